@@ -1,10 +1,19 @@
+#ifdef TEENSYDUINO
+#include <Arduino.h>
+#include "teensy-println.h"
+#endif
+
 #include "applekeyboard.h"
 #include "physicalkeyboard.h" // for LA/RA constants
 
 #include "applemmu.h"
 
+#include "serialize.h"
 #include "globals.h"
 
+// Serializing token for keyboard data
+#define KBDMAGIC 'K'
+
 // How many CPU cycles before we begin repeating a key?
 #define STARTREPEAT 700000
 // How many CPU cycles between repeats of a key?
@@ -28,6 +37,42 @@ AppleKeyboard::~AppleKeyboard()
 {
 }
 
+bool AppleKeyboard::Serialize(int8_t fd)
+{
+  serializeMagic(KBDMAGIC);
+  serialize8(capsLockEnabled ? 1 : 0);
+  serialize8(anyKeyIsDown ? 1 : 0);
+  for (uint16_t i=0; i<sizeof(keysDown); i++) {
+    serialize8(keysDown[i] ? 1 : 0);
+  }
+  serialize64(startRepeatTimer);
+  serialize8(keyThatIsRepeating);
+  serialize64(repeatTimer);
+  serializeMagic(KBDMAGIC);
+  return true;
+
+ err:
+  return false;
+}
+
+bool AppleKeyboard::Deserialize(int8_t fd)
+{
+  deserializeMagic(KBDMAGIC);
+  deserialize8(capsLockEnabled);
+  deserialize8(anyKeyIsDown);
+  for (uint16_t i=0; i<sizeof(keysDown); i++) {
+    deserialize8(keysDown[i]);
+  }
+  deserialize64(startRepeatTimer);
+  deserialize8(keyThatIsRepeating);
+  deserialize64(repeatTimer);
+  deserializeMagic(KBDMAGIC);
+  return true;
+
+ err:
+  return false;
+}
+
 bool AppleKeyboard::isVirtualKey(uint8_t kc)
 {
   if (kc >= 0x81 && kc <= 0x86) {
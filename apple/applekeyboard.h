@@ -11,6 +11,9 @@ class AppleKeyboard : public VMKeyboard {
   AppleKeyboard(AppleMMU *m);
   virtual ~AppleKeyboard();
 
+  bool Serialize(int8_t fd);
+  bool Deserialize(int8_t fd);
+
   virtual void keyDepressed(uint8_t k);
   virtual void keyReleased(uint8_t k);
   virtual void maintainKeyboard(int64_t cycleCount);
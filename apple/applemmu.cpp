@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <assert.h>
+#include <string.h>
 #endif
 
 #include "applemmu.h"
@@ -146,6 +147,7 @@ static uint16_t _pageNumberForRam(uint8_t highByte, uint8_t variant)
 AppleMMU::AppleMMU(AppleDisplay *display)
 {
   anyKeyDown = false;
+  lastSpeakerToggle = 0;
 
   for (int8_t i=0; i<=7; i++) {
     slots[i] = NULL;
@@ -181,6 +183,8 @@ bool AppleMMU::Serialize(int8_t fd)
   serialize8(slot3rom ? 1 : 0);
   serialize8(slotLatch);
   serialize8(preWriteFlag ? 1 : 0);
+  serialize8(anyKeyDown ? 1 : 0);
+  serialize64(lastSpeakerToggle);
   
   if (!g_ram.Serialize(fd)) {
     printf("Failed to serialize RAM\n");
@@ -215,6 +219,8 @@ bool AppleMMU::Deserialize(int8_t fd)
   deserialize8(slot3rom);
   deserialize8(slotLatch);
   deserialize8(preWriteFlag);
+  deserialize8(anyKeyDown);
+  deserialize64(lastSpeakerToggle);
 
   if (!g_ram.Deserialize(fd)) {
     goto err;
@@ -344,6 +350,68 @@ void AppleMMU::write(uint16_t address, uint8_t v)
   }
 }
 
+// $C000-$CFFF is soft switches, slot ROM and the no-slot clock, so
+// it goes through read() a byte at a time; everything else is RAM (or
+// ROM) that a CPU read would simply fetch through readPages.
+void AppleMMU::readBlock(uint16_t address, uint8_t *dest, uint16_t len)
+{
+  while (len) {
+    uint8_t page = address >> 8;
+    uint16_t count = 0x100 - (address & 0xFF);
+    if (count > len) count = len;
+
+    if (page >= 0xC0 && page <= 0xCF) {
+      for (uint16_t i=0; i<count; i++)
+        dest[i] = read(address + i);
+    } else {
+      memcpy(dest, g_ram.memPtr((readPages[page] << 8) | (address & 0xFF)), count);
+    }
+
+    address += count;
+    dest += count;
+    len -= count;
+  }
+}
+
+void AppleMMU::writeBlock(uint16_t address, const uint8_t *src, uint16_t len)
+{
+  bool touchedText = false;
+  bool touchedHires = false;
+
+  while (len) {
+    uint8_t page = address >> 8;
+    uint16_t count = 0x100 - (address & 0xFF);
+    if (count > len) count = len;
+
+    if (page >= 0xC0 && page <= 0xCF) {
+      // write() does its own display updates, but none apply here
+      for (uint16_t i=0; i<count; i++)
+        write(address + i, src[i]);
+    } else if (page < 0xD0 || writebsr) {
+      uint32_t ramAddr = (writePages[page] << 8) | (address & 0xFF);
+      memcpy(g_ram.memPtr(ramAddr), src, count);
+#ifndef TEENSYDUINO
+      g_ram.markDirty(ramAddr, count);
+#endif
+      if (page >= 0x04 && page <= 0x07)
+        touchedText = true;
+      else if (page >= 0x20 && page <= 0x5F)
+        touchedHires = true;
+    }
+    // else it's bank-switched ROM, which ignores writes
+
+    address += count;
+    src += count;
+    len -= count;
+  }
+
+  // The same checks write() makes, once for the whole transfer
+  if ((touchedText && ((switches & S_TEXT) || (switches & S_MIXED) || (!(switches & S_HIRES)))) ||
+      (touchedHires && (switches & S_HIRES))) {
+    display->modeChange();
+  }
+}
+
 bool AppleMMU::handleNoSlotClock(uint16_t address, uint8_t *rv)
 {
   uint8_t ah = address >> 8;
@@ -603,6 +671,7 @@ uint8_t AppleMMU::readSwitches(uint16_t address)
   case 0xC03E:
   case 0xC03F:
     g_speaker->toggle(g_cpu->cycles);
+    lastSpeakerToggle = g_cpu->cycles;
 #ifndef SUPPRESSREALTIME
     g_cpu->realtime(); // cause the CPU to stop processing its outer
 		       // loop b/c the speaker might need attention
@@ -777,6 +846,7 @@ void AppleMMU::writeSwitches(uint16_t address, uint8_t v)
   case 0xC03E:
   case 0xC03F:
     g_speaker->toggle(g_cpu->cycles);
+    lastSpeakerToggle = g_cpu->cycles;
 #ifndef SUPPRESSREALTIME
     g_cpu->realtime(); // cause the CPU to stop processing its outer
 		       // loop b/c the speaker might need attention
@@ -1039,6 +1109,9 @@ void AppleMMU::resetRAM()
 	  if (slotPage) {
 	    uint8_t *p = g_ram.memPtr(slotPage << 8);
 	    slots[slotnum]->loadExtendedRom(p, j * 256);
+#ifndef TEENSYDUINO
+	    g_ram.markDirty(slotPage << 8, 256);
+#endif
 	  }
 	}
       }
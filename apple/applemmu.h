@@ -43,6 +43,12 @@ class AppleMMU : public MMU {
   virtual uint8_t readDirect(uint16_t address, uint8_t fromPage);
   virtual void write(uint16_t address, uint8_t v);
 
+  // Bulk transfers for block devices: the same as a run of read() or
+  // write() calls at consecutive addresses, but RAM is copied a page
+  // at a time and the display is told about the change once.
+  void readBlock(uint16_t address, uint8_t *dest, uint16_t len);
+  void writeBlock(uint16_t address, const uint8_t *src, uint16_t len);
+
   virtual void Reset();
 
   void keyboardInput(uint8_t v);
@@ -89,6 +95,9 @@ class AppleMMU : public MMU {
   uint16_t writePages[0x100];
 
   bool anyKeyDown;
+
+  // CPU cycle of the last $C030 access
+  int64_t lastSpeakerToggle;
   
   NoSlotClock *clock;
 };
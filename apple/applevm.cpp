@@ -7,6 +7,7 @@
 #include "physicalkeyboard.h"
 
 #include "serialize.h"
+#include "snapshot.h"
 
 #include "globals.h"
 
@@ -16,7 +17,30 @@
 #endif
 
 #include <errno.h>
-const char *suspendHdr = "Sus2";
+const char *suspendHdr = "Sus3";
+
+// Suspend file chunks; see snapshot.h. Everything this build writes
+// is CHUNKVERSION, and it won't read any other version of them.
+#define CHUNKVERSION 1
+#define CHUNK_CPU      SNAPTAG('C','P','U',' ') // CPU, MMU and RAM
+#define CHUNK_VM       SNAPTAG('V','M',' ',' ') // paddle timers
+#define CHUNK_KEYBOARD SNAPTAG('K','B','D',' ')
+#define CHUNK_CLOCK    SNAPTAG('N','S','C',' ')
+#define CHUNK_DISKII   SNAPTAG('D','S','K','6')
+#define CHUNK_HD32     SNAPTAG('H','D','3','2')
+#define CHUNK_MOUSE    SNAPTAG('M','O','U','S')
+#define CHUNK_MOCKINGBOARD SNAPTAG('M','O','C','K')
+#define CHUNK_MEDIA    SNAPTAG('M','E','D','I') // rewind only: what's inserted
+
+#define saveChunk(tag, what) { \
+  uint32_t lengthPos; \
+  if (!beginChunk(fd, tag, CHUNKVERSION, &lengthPos) || \
+      !(what) || \
+      !endChunk(fd, lengthPos)) { \
+    printf("Failed to serialize '%s'\n", chunkName(tag)); \
+    goto err; \
+  } \
+}
 
 AppleVM::AppleVM()
 {
@@ -33,6 +57,8 @@ AppleVM::AppleVM()
   mouse = new Mouse();
   mockingboard = new Mockingboard();
 
+  paddleCycleTrigger[0] = paddleCycleTrigger[1] = 0;
+
   if (g_slotDiskII) ((AppleMMU *)mmu)->setSlot(g_slotDiskII, disk6);
   if (g_slotParallel) ((AppleMMU *)mmu)->setSlot(g_slotParallel, parallel);
   if (g_slotHD32) ((AppleMMU *)mmu)->setSlot(g_slotHD32, hd32);
@@ -64,10 +90,11 @@ AppleVM::~AppleVM()
 
 bool AppleVM::Suspend(const char *fn)
 {
-  /* Open a new suspend file via the file manager; tell all our
-     objects to serialize in to it; close the file */
+  /* Serialize all our objects into a new suspend file, which the
+     file manager builds in memory and writes out in one go when it's
+     committed; a failed suspend leaves the old file alone */
 
-  int8_t fd = g_filemanager->openFile(fn);
+  int8_t fd = g_filemanager->openSnapshot(fn, true);
   if (fd == -1) {
     // Unable to open; skip suspend
     printf("failed to open suspend file\n");
@@ -77,14 +104,11 @@ bool AppleVM::Suspend(const char *fn)
   /* Header */
   serializeString(suspendHdr);
 
-  /* Tell all of the peripherals to suspend */
-  if (g_cpu->Serialize(fd) &&
-      disk6->Serialize(fd) &&
-      hd32->Serialize(fd)
-      ) {
-    printf("All serialized successfully\n");
-  }
+  /* Then a chunk for everything with state */
+  if (!SaveState(fd) || !g_filemanager->commitSnapshot(fd))
+    goto err;
 
+  printf("All serialized successfully\n");
   g_filemanager->closeFile(fd);
   return true;
   
@@ -95,10 +119,11 @@ bool AppleVM::Suspend(const char *fn)
 
 bool AppleVM::Resume(const char *fn)
 {
-  /* Open the given suspend file via the file manager; tell all our
-     objects to deserialize from it; close the file */
+  /* Open the given suspend file via the file manager (which reads it
+     whole); tell each of our objects to deserialize its chunk; close
+     the file */
 
-  int8_t fd = g_filemanager->openFile(fn);
+  int8_t fd = g_filemanager->openSnapshot(fn, false);
   if (fd == -1) {
     // Unable to open; skip resume
     printf("Unable to open resume file '%s'\n", fn);
@@ -112,29 +137,204 @@ bool AppleVM::Resume(const char *fn)
     goto err;
   }
 
-  /* Tell all of the peripherals to resume */
-  if (g_cpu->Deserialize(fd) &&
-      disk6->Deserialize(fd) &&
-      hd32->Deserialize(fd)
-      ) {
-    printf("All deserialized successfully\n");
-  } else {
-    printf("Deserialization failed\n");
+  if (!LoadState(fd))
+    goto failed;
+
+  printf("All deserialized successfully\n");
+  g_filemanager->closeFile(fd);
+  return true;
+
+ failed:
+  printf("Deserialization failed\n");
 #ifndef TEENSYDUINO
-    exit(1);
+  exit(1);
 #endif
-    goto err;
+ err:
+  g_filemanager->closeFile(fd);
+  return false;
+}
+
+// The chunks that follow a suspend file's header
+bool AppleVM::SaveState(int8_t fd)
+{
+  return saveState(fd, false);
+}
+
+bool AppleVM::LoadState(int8_t fd)
+{
+  return loadState(fd, false);
+}
+
+// A rewind point is the same chunks, but the disk images are left as
+// they are: nothing is flushed when it's saved, or reloaded (or
+// remapped) when it's loaded. So it can only go back onto the disks
+// it came from, which a CHUNK_MEDIA up front records.
+bool AppleVM::SaveRewindState(int8_t fd)
+{
+  return saveState(fd, true);
+}
+
+bool AppleVM::LoadRewindState(int8_t fd)
+{
+  return loadState(fd, true);
+}
+
+// Reads through a rewind point without changing anything, to see
+// whether LoadRewindState() would take it.
+bool AppleVM::CheckRewindState(int8_t fd)
+{
+  while (1) {
+    uint32_t tag, length, start;
+    uint8_t version;
+    if (!readChunkHeader(fd, &tag, &version, &length, &start))
+      return false;
+    if (tag == SNAP_END)
+      return true;
+    if (tag == CHUNK_MEDIA) {
+      if (version != CHUNKVERSION || !checkMedia(fd) ||
+          !finishChunk(fd, tag, length, start))
+        return false;
+    } else if (!skipChunk(fd, length, start)) {
+      return false;
+    }
   }
+}
 
-  g_filemanager->closeFile(fd);
+bool AppleVM::serializeMedia(int8_t fd)
+{
+  for (int i=0; i<2; i++) {
+    const char *fn = DiskName(i);
+    serializeString(fn);
+  }
+  for (int i=0; i<2; i++) {
+    const char *fn = HDName(i);
+    serializeString(fn);
+  }
   return true;
+
+ err:
+  return false;
+}
+
+bool AppleVM::checkMedia(int8_t fd)
+{
+  char fn[MAXPATH];
+  for (int i=0; i<4; i++) {
+    deserializeString(fn);
+    if (strcmp(fn, i < 2 ? DiskName(i) : HDName(i - 2))) {
+      printf("The disks have changed since then\n");
+      return false;
+    }
+  }
+  return true;
+
  err:
-  g_filemanager->closeFile(fd);
   return false;
 }
 
-// fixme: make member vars
-unsigned long paddleCycleTrigger[2] = {0, 0};
+bool AppleVM::saveState(int8_t fd, bool rewind)
+{
+  if (rewind)
+    saveChunk(CHUNK_MEDIA, serializeMedia(fd));
+  saveChunk(CHUNK_CPU, g_cpu->Serialize(fd));
+  saveChunk(CHUNK_VM, serializeState(fd));
+  saveChunk(CHUNK_KEYBOARD, ((AppleKeyboard *)keyboard)->Serialize(fd));
+  saveChunk(CHUNK_CLOCK, ((AppleMMU *)mmu)->clock->Serialize(fd));
+  saveChunk(CHUNK_DISKII, rewind ? disk6->SerializeDrives(fd) : disk6->Serialize(fd));
+  saveChunk(CHUNK_HD32, hd32->Serialize(fd));
+  saveChunk(CHUNK_MOUSE, mouse->Serialize(fd));
+  saveChunk(CHUNK_MOCKINGBOARD, mockingboard->Serialize(fd));
+  saveChunk(SNAP_END, true);
+  return true;
+
+ err:
+  return false;
+}
+
+bool AppleVM::loadState(int8_t fd, bool rewind)
+{
+  bool sawCpu = false;
+
+  /* Chunks, until the end marker. Ones from newer builds that we
+     don't know about are skipped. */
+  while (1) {
+    uint32_t tag, length, start;
+    uint8_t version;
+    if (!readChunkHeader(fd, &tag, &version, &length, &start))
+      return false;
+    if (tag == SNAP_END)
+      break;
+
+    bool ok = (version == CHUNKVERSION);
+    switch (tag) {
+    case CHUNK_CPU:
+      ok = ok && g_cpu->Deserialize(fd);
+      sawCpu = ok;
+      break;
+    case CHUNK_VM:
+      ok = ok && deserializeState(fd);
+      break;
+    case CHUNK_KEYBOARD:
+      ok = ok && ((AppleKeyboard *)keyboard)->Deserialize(fd);
+      break;
+    case CHUNK_CLOCK:
+      ok = ok && ((AppleMMU *)mmu)->clock->Deserialize(fd);
+      break;
+    case CHUNK_MEDIA:
+      ok = ok && rewind && checkMedia(fd);
+      break;
+    case CHUNK_DISKII:
+      ok = ok && (rewind ? disk6->DeserializeDrives(fd) : disk6->Deserialize(fd));
+      break;
+    case CHUNK_HD32:
+      ok = ok && (rewind ? hd32->DeserializeDrives(fd) : hd32->Deserialize(fd));
+      break;
+    case CHUNK_MOUSE:
+      ok = ok && mouse->Deserialize(fd);
+      break;
+    case CHUNK_MOCKINGBOARD:
+      ok = ok && mockingboard->Deserialize(fd);
+      break;
+    default:
+      printf("Skipping unknown chunk '%s'\n", chunkName(tag));
+      if (!skipChunk(fd, length, start))
+        return false;
+      continue;
+    }
+    if (!ok || !finishChunk(fd, tag, length, start)) {
+      printf("Failed to deserialize '%s' (version %d)\n",
+             chunkName(tag), version);
+      return false;
+    }
+  }
+
+  if (!sawCpu) {
+    printf("Suspend file has no CPU state\n");
+    return false;
+  }
+  return true;
+}
+
+// The VM's own state: the paddle timers that are still counting
+bool AppleVM::serializeState(int8_t fd)
+{
+  serialize64(paddleCycleTrigger[0]);
+  serialize64(paddleCycleTrigger[1]);
+  return true;
+
+ err:
+  return false;
+}
+
+bool AppleVM::deserializeState(int8_t fd)
+{
+  deserialize64(paddleCycleTrigger[0]);
+  deserialize64(paddleCycleTrigger[1]);
+  return true;
+
+ err:
+  return false;
+}
 
 void AppleVM::triggerPaddleInCycles(uint8_t paddleNum,uint16_t cycleCount)
 {
@@ -152,11 +352,30 @@ void AppleVM::cpuMaintenance(int64_t cycles)
 
   keyboard->maintainKeyboard(cycles);
   disk6->maintenance(cycles);
+  hd32->maintenance();
   if (mouse) mouse->maintainMouse(cycles);
   if (mockingboard) mockingboard->update(cycles);
   g_speaker->maintainSpeaker(cycles, 0);
 }
 
+// How long the speaker has to have been quiet (in CPU cycles, about
+// a tenth of a second) before a disk access counts as quiet.
+#define SPEAKERQUIETCYCLES (1023000/10)
+
+bool AppleVM::isQuietDiskAccess()
+{
+  if (!disk6->isMotorOn())
+    return false;
+  // (The BIOS resets the cycle counter, which can leave the last
+  // toggle in the "future"; that's long enough ago.)
+  int64_t sinceToggle = g_cpu->cycles - ((AppleMMU *)mmu)->lastSpeakerToggle;
+  if (sinceToggle >= 0 && sinceToggle < SPEAKERQUIETCYCLES)
+    return false;
+  if (mockingboard && !mockingboard->isSilent())
+    return false;
+  return true;
+}
+
 void AppleVM::Reset()
 {
   disk6->Reset();
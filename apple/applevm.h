@@ -18,9 +18,20 @@ class AppleVM : public VM {
 
   bool Suspend(const char *fn);
   bool Resume(const char *fn);
+  // Just the machine state, without the suspend file around it
+  bool SaveState(int8_t fd);
+  bool LoadState(int8_t fd);
+  // The same, for rewinding: the disk images aren't touched
+  bool SaveRewindState(int8_t fd);
+  bool LoadRewindState(int8_t fd);
+  bool CheckRewindState(int8_t fd);
 
   void cpuMaintenance(int64_t cycles);
 
+  // True while a Disk II motor is on and nothing is making a sound,
+  // i.e. when it's safe to run unthrottled without anyone hearing it.
+  bool isQuietDiskAccess();
+
   virtual void Reset();
   void Monitor();
 
@@ -44,9 +55,20 @@ class AppleVM : public VM {
   HD32 *hd32;
   Mockingboard *mockingboard;
  protected:
+  bool serializeState(int8_t fd);
+  bool deserializeState(int8_t fd);
+  bool saveState(int8_t fd, bool rewind);
+  bool loadState(int8_t fd, bool rewind);
+  bool serializeMedia(int8_t fd);
+  bool checkMedia(int8_t fd);
+
   VMKeyboard *keyboard;
   ParallelCard *parallel;
   Mouse *mouse;
+
+  // CPU cycle at which each paddle's timer runs out (0 if it isn't
+  // running)
+  int64_t paddleCycleTrigger[2];
 };
 
 
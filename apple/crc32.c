@@ -89,3 +89,77 @@ uint32_t compute_crc_32(unsigned char *buffer, unsigned long length)
   
   return ret ^ ~0U;
 }
+
+// CRC32 is linear over GF(2): the CRC of the patched buffer is the old
+// CRC xor the raw (zero-init, no final xor) CRC of the xor of old and
+// new data, carried through the trailing bytes as if they were zero.
+// Carrying a CRC through N zero bytes is multiplying by a 32x32 bit
+// matrix raised to the Nth power, which we do by repeated squaring.
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+  uint32_t sum = 0;
+  while (vec) {
+    if (vec & 1)
+      sum ^= *mat;
+    vec >>= 1;
+    mat++;
+  }
+  return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+  int n;
+  for (n=0; n<32; n++)
+    square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+static uint32_t crc_32_zeros(uint32_t crc, unsigned long count)
+{
+  uint32_t even[32];
+  uint32_t odd[32];
+  uint32_t row = 1;
+  int n;
+
+  if (!count)
+    return crc;
+
+  // Operator for one zero bit
+  odd[0] = 0xEDB88320;
+  for (n=1; n<32; n++) {
+    odd[n] = row;
+    row <<= 1;
+  }
+  gf2_matrix_square(even, odd); // two zero bits
+  gf2_matrix_square(odd, even); // four zero bits
+
+  // Each pass squares up to the next power-of-two count of bytes
+  do {
+    gf2_matrix_square(even, odd);
+    if (count & 1)
+      crc = gf2_matrix_times(even, crc);
+    count >>= 1;
+    if (!count)
+      break;
+    gf2_matrix_square(odd, even);
+    if (count & 1)
+      crc = gf2_matrix_times(odd, crc);
+    count >>= 1;
+  } while (count);
+
+  return crc;
+}
+
+uint32_t patch_crc_32(uint32_t crc, const unsigned char *oldData,
+                      const unsigned char *newData, unsigned long length,
+                      unsigned long trailing)
+{
+  uint32_t delta = 0;
+
+  unsigned long i;
+  for (i=0; i<length; i++)
+    delta = (delta>>8) ^ preload32[(delta ^ oldData[i] ^ newData[i])&0xFF];
+
+  return crc ^ crc_32_zeros(delta, trailing);
+}
@@ -6,6 +6,12 @@ extern "C" {
 
 void preload_crc();
 uint32_t compute_crc_32(unsigned char *buffer, unsigned long length);
+// Given `crc` for some buffer, return the CRC after `length` bytes in
+// it changed from oldData to newData, with `trailing` more bytes
+// following the changed run. Doesn't need the rest of the buffer.
+uint32_t patch_crc_32(uint32_t crc, const unsigned char *oldData,
+                      const unsigned char *newData, unsigned long length,
+                      unsigned long trailing);
 
 #ifdef __cplusplus
 };
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "disk-writer.h"
+#include "woz-serializer.h"
+
+DiskWriter g_diskWriter;
+
+// Push the image's writes out to the device. Any descriptor for the
+// file will do, and the filemanager doesn't keep one open.
+static void syncFile(const char *path)
+{
+  if (!path)
+    return;
+  int fd = ::open(path, O_RDONLY);
+  if (fd == -1)
+    return;
+  fsync(fd);
+  ::close(fd);
+}
+
+DiskWriter::DiskWriter()
+{
+  head = tail = 0;
+  busy = false;
+  running = false;
+  stopping = false;
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&workReady, NULL);
+  pthread_cond_init(&spaceReady, NULL);
+  pthread_cond_init(&idle, NULL);
+}
+
+DiskWriter::~DiskWriter()
+{
+  // The mutex and conditions aren't destroyed: g_diskWriter goes away
+  // at exit, and another thread may yet come along and queue().
+  stop();
+}
+
+void DiskWriter::stop()
+{
+  pthread_mutex_lock(&mutex);
+  bool wasRunning = running && !stopping;
+  stopping = true;
+  pthread_cond_signal(&workReady);
+  pthread_mutex_unlock(&mutex);
+  if (wasRunning)
+    pthread_join(thread, NULL);
+}
+
+void DiskWriter::queue(WozSerializer *snapshot)
+{
+  pthread_mutex_lock(&mutex);
+  // The thread starts on the first flush; most sessions never write.
+  if (!running && !stopping) {
+    if (pthread_create(&thread, NULL, &DiskWriter::writerThread, this) == 0) {
+      running = true;
+    } else {
+      printf("Unable to start disk writer thread; writing synchronously\n");
+    }
+  }
+  if (!running) {
+    pthread_mutex_unlock(&mutex);
+    snapshot->writeSnapshot();
+    syncFile(snapshot->imageFile());
+    delete snapshot;
+    return;
+  }
+
+  while (tail - head == DISKWRITER_QUEUE)
+    pthread_cond_wait(&spaceReady, &mutex);
+  jobs[tail % DISKWRITER_QUEUE] = snapshot;
+  tail++;
+  pthread_cond_signal(&workReady);
+  pthread_mutex_unlock(&mutex);
+}
+
+void DiskWriter::drain()
+{
+  pthread_mutex_lock(&mutex);
+  while (head != tail || busy)
+    pthread_cond_wait(&idle, &mutex);
+  pthread_mutex_unlock(&mutex);
+}
+
+void *DiskWriter::writerThread(void *arg)
+{
+  DiskWriter *self = (DiskWriter *)arg;
+
+  pthread_mutex_lock(&self->mutex);
+  while (1) {
+    while (self->head == self->tail && !self->stopping)
+      pthread_cond_wait(&self->workReady, &self->mutex);
+    if (self->head == self->tail)
+      break; // stopping, and nothing left to write
+
+    WozSerializer *job = self->jobs[self->head % DISKWRITER_QUEUE];
+    self->head++;
+    self->busy = true;
+    pthread_cond_broadcast(&self->spaceReady);
+    pthread_mutex_unlock(&self->mutex);
+
+    // If it fails, the image it came from has the tracks dirty again
+    if (!job->writeSnapshot()) {
+      printf("Failed to write back disk image %s; will retry\n",
+             job->imageFile() ? job->imageFile() : "");
+    }
+    syncFile(job->imageFile());
+    delete job;
+
+    pthread_mutex_lock(&self->mutex);
+    self->busy = false;
+    pthread_cond_broadcast(&self->idle);
+  }
+  self->running = false;
+  pthread_cond_broadcast(&self->idle);
+  pthread_mutex_unlock(&self->mutex);
+
+  return NULL;
+}
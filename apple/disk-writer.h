@@ -0,0 +1,52 @@
+#ifndef __DISKWRITER_H
+#define __DISKWRITER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+class WozSerializer;
+
+// Writes disk images back to their files on a background thread, so a
+// flush doesn't stall the CPU thread. WozSerializer::flush() copies
+// the dirty tracks into a snapshot and queues it; this thread encodes
+// it, writes it and fsyncs the file. There's one thread and the queue
+// is FIFO, so the writes to any one image land in the order they were
+// queued. When the queue is full, queue() waits for room.
+
+#define DISKWRITER_QUEUE 8
+
+class DiskWriter {
+ public:
+  DiskWriter();
+  // Stops it, if nobody has yet.
+  ~DiskWriter();
+
+  // Takes ownership of the snapshot.
+  void queue(WozSerializer *snapshot);
+  // Waits until everything queued so far is on disk.
+  void drain();
+  // Finishes everything queued, then stops the thread. Anything
+  // queued after that is written before queue() returns.
+  void stop();
+
+ private:
+  static void *writerThread(void *arg);
+
+  WozSerializer *jobs[DISKWRITER_QUEUE];
+  uint32_t head, tail;
+  bool busy;
+  bool running;
+  bool stopping;
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t workReady;
+  pthread_cond_t spaceReady;
+  pthread_cond_t idle;
+};
+
+// The frontends stop() it on the way out (from an atexit handler), so
+// pending writes finish before we go.
+extern DiskWriter g_diskWriter;
+
+#endif
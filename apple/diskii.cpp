@@ -32,6 +32,14 @@
 #define SPINFOREVER -2
 #define NOTSPINNING -1
 
+// The nibble fast path waits for the head to sit on a track this long
+// (about 16ms) before building that track's state table, so a seek
+// doesn't analyze every track it passes over.
+#define SETTLEBITS 4096
+// Below this many bits the step tables are cheaper than checking
+// whether the fast path applies.
+#define FASTFORWARDMINBITS 16
+
 DiskII::DiskII(AppleMMU *mmu)
 {
   this->mmu = mmu;
@@ -54,13 +62,51 @@ DiskII::DiskII(AppleMMU *mmu)
   diskIsSpinningUntil[0] = diskIsSpinningUntil[1] = -1;
   flushAt[0] = flushAt[1] = 0;
   selectedDisk = 0;
+
+  nibbleFastPath = false;
+  for (int i=0; i<2; i++) {
+    trackStates[i] = NULL;
+    trackStatesSize[i] = 0;
+    trackStatesBits[i] = 0;
+    trackStatesFor[i] = 0xFF;
+    bitsOnTrack[i] = 0;
+  }
 }
 
 DiskII::~DiskII()
 {
+  for (int i=0; i<2; i++) {
+    if (trackStates[i]) {
+      free(trackStates[i]);
+      trackStates[i] = NULL;
+    }
+  }
 }
 
 bool DiskII::Serialize(int8_t fd)
+{
+  return serializeDrives(fd, true);
+}
+
+bool DiskII::Deserialize(int8_t fd)
+{
+  return deserializeDrives(fd, true);
+}
+
+// For rewinding, which keeps the disks as they are: the drives and
+// heads, without flushing or reloading the images. Loading it fails
+// unless the same disks are still inserted.
+bool DiskII::SerializeDrives(int8_t fd)
+{
+  return serializeDrives(fd, false);
+}
+
+bool DiskII::DeserializeDrives(int8_t fd)
+{
+  return deserializeDrives(fd, false);
+}
+
+bool DiskII::serializeDrives(int8_t fd, bool withImages)
 {
   serializeMagic(DISKIIMAGIC);
   serialize8(readWriteLatch);
@@ -81,9 +127,11 @@ bool DiskII::Serialize(int8_t fd)
     serialize64(diskIsSpinningUntil[i]);
     
     if (disk[i]) {
-      // Make sure we have flushed the disk images
-      disk[i]->flush();
-      flushAt[i] = 0; // and there's no need to re-flush them now
+      if (withImages) {
+	// Make sure we have flushed the disk images
+	disk[i]->flush();
+	flushAt[i] = 0; // and there's no need to re-flush them now
+      }
 
       serialize8(1);
 
@@ -91,7 +139,7 @@ bool DiskII::Serialize(int8_t fd)
       // the disk image, so it's broken until we port Woz to do that!
       const char *fn = disk[i]->diskName();
       serializeString(fn);
-      if (!disk[i]->Serialize(fd))
+      if (!disk[i]->SerializeHead(fd))
 	goto err;
     } else {
       serialize8(0);
@@ -105,10 +153,13 @@ bool DiskII::Serialize(int8_t fd)
   return false;
 }
 
-bool DiskII::Deserialize(int8_t fd)
+bool DiskII::deserializeDrives(int8_t fd, bool withImages)
 {
   deserializeMagic(DISKIIMAGIC);
 
+  dropTrackStates(0);
+  dropTrackStates(1);
+
   deserialize8(readWriteLatch);
   deserialize8(sequencer);
   deserialize8(dataRegister);
@@ -129,7 +180,19 @@ bool DiskII::Deserialize(int8_t fd)
 
     uint8_t hasDisk;
     deserialize8(hasDisk);
-    
+
+    if (!withImages) {
+      char fn[MAXPATH];
+      if (hasDisk != (disk[i] != NULL))
+	goto err;
+      if (hasDisk) {
+	deserializeString(fn);
+	if (strcmp(fn, disk[i]->diskName()) || !disk[i]->Deserialize(fd))
+	  goto err;
+      }
+      continue;
+    }
+
     if (disk[i]) delete disk[i];
     if (hasDisk) {
       disk[i] = new WozSerializer();
@@ -163,6 +226,16 @@ bool DiskII::Deserialize(int8_t fd)
   return false;
 }
 
+void DiskII::flushDisks()
+{
+  for (int i=0; i<2; i++) {
+    if (disk[i]) {
+      disk[i]->flush();
+      flushAt[i] = 0;
+    }
+  }
+}
+
 void DiskII::Reset()
 {
   curPhase[0] = curPhase[1] = 0;
@@ -409,6 +482,7 @@ void DiskII::setPhase(uint8_t phase)
   }
 
   if (curHalfTrack[selectedDisk] != prevHalfTrack) {
+    bitsOnTrack[selectedDisk] = 0;
     if (disk[selectedDisk]) {
       curWozTrack[selectedDisk] = disk[selectedDisk]->dataTrackNumberForQuarterTrack(curHalfTrack[selectedDisk]*2);
     } else {
@@ -459,6 +533,71 @@ static const uint8_t lssReadRom[16][8] = {
   {0xDD, 0x4D, 0xE0, 0xE0, 0x0A, 0x0A, 0x0A, 0x0A}  // State F
 };
 
+// Run the eight LSS clocks of one disk bit from (state, sequencer).
+// Used to build the step tables below; the emulation itself never
+// comes through here. Only the SHIFT quadrant is tabled, and it has
+// no SR or LD commands, so write-protect and the latch can't affect
+// the result.
+static uint16_t lssClockOneBit(uint8_t state, uint8_t seq, uint8_t bit)
+{
+  for (uint8_t sub = 0; sub < 8; sub++) {
+    uint8_t rp = (sub == 0 && bit) ? 1 : 0;
+    uint8_t qa = (seq & 0x80) ? 1 : 0;
+    uint8_t col = (qa << 1) | (rp ? 0 : 1);
+    uint8_t rom = lssReadRom[state][col];
+    state = rom >> 4;
+    uint8_t cmd = rom & 0x0F;
+    if (!(cmd & 0x08)) {
+      seq = 0;                                      // CLR
+    } else {
+      switch (cmd & 0x07) {
+      case 0: case 4: break;                        // NOP (8, C)
+      case 1: seq <<= 1; break;                     // SL0 (9)
+      case 5: seq = (seq << 1) | 1; break;          // SL1 (D)
+      }
+    }
+  }
+  return (state << 8) | seq;
+}
+
+// Precomputed SHIFT-mode transitions. Each entry is the (state << 8) |
+// sequencer that results from feeding some disk bits into the LSS
+// from a given (state, sequencer). lssStep1 takes one bit and
+// lssStepN takes LSS_STEP_BITS bits at once (oldest bit in the MSB of
+// the index). The N-bit table is 128k on the host; the Teensy only
+// gets the one-bit table.
+#ifdef TEENSYDUINO
+#define LSS_STEP_BITS 1
+#else
+#define LSS_STEP_BITS 4
+#endif
+
+static uint16_t lssStep1[16 * 256 * 2];
+#if LSS_STEP_BITS > 1
+static uint16_t lssStepN[16 * 256 << LSS_STEP_BITS];
+#endif
+static bool lssTablesBuilt = false;
+
+static void buildLSSTables()
+{
+  for (uint16_t ss = 0; ss < 16 * 256; ss++) {
+    lssStep1[(ss << 1) | 0] = lssClockOneBit(ss >> 8, ss & 0xFF, 0);
+    lssStep1[(ss << 1) | 1] = lssClockOneBit(ss >> 8, ss & 0xFF, 1);
+  }
+#if LSS_STEP_BITS > 1
+  for (uint16_t ss = 0; ss < 16 * 256; ss++) {
+    for (uint16_t bits = 0; bits < (1 << LSS_STEP_BITS); bits++) {
+      uint16_t cur = ss;
+      for (int8_t i = LSS_STEP_BITS - 1; i >= 0; i--) {
+	cur = lssStep1[(cur << 1) | ((bits >> i) & 1)];
+      }
+      lssStepN[(ss << LSS_STEP_BITS) | bits] = cur;
+    }
+  }
+#endif
+  lssTablesBuilt = true;
+}
+
 void DiskII::tickLSS()
 {
   // Full LSS simulation per UTA2E Chapter 9. The sequencer ROM is
@@ -469,6 +608,9 @@ void DiskII::tickLSS()
   // ROM and runs the returned command, which naturally produces the
   // MSB "byte flag" hold-and-auto-clear behavior described in UTA2E
   // p.9-26/9-29.
+  //
+  // Those eight clocks are folded into the step tables above, so
+  // here it's one lookup per LSS_STEP_BITS disk bits.
   if (!disk[selectedDisk]) return;
   if (writeMode) return;
   if (diskIsSpinningUntil[selectedDisk] == NOTSPINNING) return;
@@ -487,38 +629,166 @@ void DiskII::tickLSS()
   if (curWozTrack[selectedDisk] == 0xFF) return;
 
   int64_t bitsToDeliver = calcExpectedBits();
+  if (bitsToDeliver <= 0) return;
+  deliveredDiskBits[selectedDisk] += bitsToDeliver;
+  bitsOnTrack[selectedDisk] += bitsToDeliver;
+
+  WozSerializer *d = disk[selectedDisk];
+  uint8_t trk = curWozTrack[selectedDisk];
+
+  if (q6) {
+    // Every LOAD-column entry is 0A-SR: the state drops to 0 and the
+    // write-protect bit is shifted in on every clock, so after one
+    // whole bit the register is eight copies of it. The disk still
+    // turns underneath (and the MC3470 still draws fake bits).
+    while (bitsToDeliver > 0) {
+      uint8_t n = bitsToDeliver > 8 ? 8 : bitsToDeliver;
+      d->nextDiskBits(trk, n);
+      bitsToDeliver -= n;
+    }
+    lssState = 0;
+    sequencer = isWriteProtected() ? 0xFF : 0x00;
+    return;
+  }
+
+  if (!lssTablesBuilt)
+    buildLSSTables();
+
+  uint16_t cur = (lssState << 8) | sequencer;
+  if (nibbleFastPath && bitsToDeliver >= FASTFORWARDMINBITS &&
+      fastForwardLSS(trk, bitsToDeliver, &cur)) {
+    lssState = cur >> 8;
+    sequencer = cur & 0xFF;
+    return;
+  }
+
+#if LSS_STEP_BITS > 1
+  // Pull a byte at a time off the disk and feed it through in
+  // LSS_STEP_BITS-sized pieces.
+  while (bitsToDeliver >= 8) {
+    uint8_t bits = d->nextDiskBits(trk, 8);
+    for (int8_t i = 8 - LSS_STEP_BITS; i >= 0; i -= LSS_STEP_BITS) {
+      cur = lssStepN[(cur << LSS_STEP_BITS) |
+		     ((bits >> i) & ((1 << LSS_STEP_BITS) - 1))];
+    }
+    bitsToDeliver -= 8;
+  }
+  if (bitsToDeliver >= LSS_STEP_BITS) {
+    cur = lssStepN[(cur << LSS_STEP_BITS) | d->nextDiskBits(trk, LSS_STEP_BITS)];
+    bitsToDeliver -= LSS_STEP_BITS;
+  }
+#endif
   while (bitsToDeliver > 0) {
-    uint8_t bit = disk[selectedDisk]->nextDiskBit(curWozTrack[selectedDisk]);
-    for (uint8_t sub = 0; sub < 8; sub++) {
-      uint8_t rp = (sub == 0 && bit) ? 1 : 0;
-      uint8_t qa = (sequencer & 0x80) ? 1 : 0;
-      uint8_t col = (q6 ? 4 : 0) | (qa << 1) | (rp ? 0 : 1);
-      uint8_t rom = lssReadRom[lssState][col];
-      lssState = rom >> 4;
-      uint8_t cmd = rom & 0x0F;
-      if (!(cmd & 0x08)) {
-	sequencer = 0;                                // CLR
-      } else {
-	switch (cmd & 0x07) {
-	case 0: case 4: break;                        // NOP (8, C)
-	case 1: sequencer <<= 1; break;               // SL0 (9)
-	case 5: sequencer = (sequencer << 1) | 1;     // SL1 (D)
-	  break;
-	case 2: case 6:                               // SR (A, E)
-	  sequencer = (sequencer >> 1) |
-	              (isWriteProtected() ? 0x80 : 0x00);
-	  break;
-	case 3: case 7:                               // LD (B, F)
-	  sequencer = readWriteLatch;
-	  break;
-	}
+    cur = lssStep1[(cur << 1) | d->nextDiskBits(trk, 1)];
+    bitsToDeliver--;
+  }
+  lssState = cur >> 8;
+  sequencer = cur & 0xFF;
+}
+
+// Nibble fast path. On a clean track - one where the MC3470 never
+// sees four 0s in a row, so it never makes up bits - the LSS falls
+// into the same cycle every revolution, and its state after each bit
+// is just a function of where the head is. A standard DOS 3.3 or
+// ProDOS track is like that. buildTrackStates runs the LSS around
+// the track once to settle and once more to record that cycle. After
+// that, while the live LSS agrees with the table, the head can be
+// moved straight to where calcExpectedBits says it is and the state
+// read off the table. Anything the table doesn't model - Q6 loads,
+// writes, another track, fake bits - runs the real simulation until
+// the LSS falls back into step with the table (if it ever does).
+void DiskII::setNibbleFastPath(bool enable)
+{
+  nibbleFastPath = enable;
+  if (!enable) {
+    for (int i=0; i<2; i++) {
+      dropTrackStates(i);
+      if (trackStates[i]) {
+	free(trackStates[i]);
+	trackStates[i] = NULL;
+	trackStatesSize[i] = 0;
       }
     }
-    bitsToDeliver--;
-    deliveredDiskBits[selectedDisk]++;
   }
 }
 
+void DiskII::dropTrackStates(int8_t drive)
+{
+  trackStatesFor[drive] = 0xFF;
+  trackStatesBits[drive] = 0;
+}
+
+bool DiskII::buildTrackStates(int8_t drive, uint8_t datatrack)
+{
+  trackStatesFor[drive] = datatrack;
+  trackStatesBits[drive] = 0;
+
+  uint32_t bc;
+  const uint8_t *bits = disk[drive]->trackBits(datatrack, &bc);
+  if (!bits || bc < 8)
+    return false;
+
+  if (bc > trackStatesSize[drive]) {
+    uint16_t *p = (uint16_t *)realloc(trackStates[drive], bc * sizeof(uint16_t));
+    if (!p)
+      return false;
+    trackStates[drive] = p;
+    trackStatesSize[drive] = bc;
+  }
+  uint16_t *states = trackStates[drive];
+
+#define BITAT(i) ((bits[(i) >> 3] >> (7 - ((i) & 7))) & 1)
+  uint8_t window = 0;
+  for (uint32_t i = bc - 4; i < bc; i++)
+    window = (window << 1) | BITAT(i);
+
+  uint16_t cur = 0, firstLap = 0;
+  for (uint8_t lap = 0; lap < 2; lap++) {
+    for (uint32_t i = 0; i < bc; i++) {
+      window = ((window << 1) | BITAT(i)) & 0x0F;
+      if (!window)
+	return false; // the MC3470 would start making up bits
+      cur = lssStep1[(cur << 1) | ((window >> 1) & 1)];
+      if (lap)
+	states[i] = cur;
+    }
+    if (!lap)
+      firstLap = cur;
+  }
+#undef BITAT
+
+  // Same state at the same spot on both laps, so from here on it's
+  // periodic.
+  if (cur != firstLap)
+    return false;
+
+  trackStatesBits[drive] = bc;
+  return true;
+}
+
+bool DiskII::fastForwardLSS(uint8_t datatrack, int64_t bits, uint16_t *lss)
+{
+  int8_t drive = selectedDisk;
+  if (bitsOnTrack[drive] < SETTLEBITS)
+    return false;
+
+  if (trackStatesFor[drive] != datatrack)
+    buildTrackStates(drive, datatrack);
+  uint32_t bc = trackStatesBits[drive];
+  if (!bc)
+    return false;
+
+  uint32_t pos;
+  if (!disk[drive]->headBitPosition(datatrack, &pos))
+    return false;
+  if (trackStates[drive][(pos + bc - 1) % bc] != *lss)
+    return false;
+
+  disk[drive]->skipBits(datatrack, bits);
+  *lss = trackStates[drive][(pos + (bits - 1) % bc) % bc];
+  return true;
+}
+
 int64_t DiskII::calcExpectedBits()
 {
   // If the disk isn't spinning, then it can't be expected to deliver data
@@ -592,8 +862,10 @@ static bool _endsWithI(const char *s1, const char *s2)
 void DiskII::insertDisk(int8_t driveNum, const char *filename, bool drawIt)
 {
   ejectDisk(driveNum);
+  dropTrackStates(driveNum);
 
   disk[driveNum] = new WozSerializer();
+  disk[driveNum]->setFakeBitSeed(WOZ_FAKEBIT_SEED + driveNum);
   if (!disk[driveNum]->readFile(filename, true, T_AUTO)) {
     delete disk[driveNum];
     disk[driveNum] = NULL;
@@ -619,6 +891,7 @@ void DiskII::ejectDisk(int8_t driveNum)
     flushAt[driveNum] = 0;
     delete disk[driveNum];
     disk[driveNum] = NULL;
+    dropTrackStates(driveNum);
     g_ui->drawOnOffUIElement(UIeDisk1_state + driveNum, true);
   }
 }
@@ -696,13 +969,12 @@ uint8_t DiskII::readOrWriteByte(bool allowOvershoot)
       fprintf(stderr, "WR cyc=%lld zeros=%lld data=%02X\n",
               (long long)g_cpu->cycles, (long long)expectedBits, readWriteLatch);
 #endif
-      while (expectedBits > 0) {
-	disk[selectedDisk]->writeNextWozBit(curWozTrack[selectedDisk], 0);
-	expectedBits--;
-	deliveredDiskBits[selectedDisk]++;
-      }
-      disk[selectedDisk]->writeNextWozByte(curWozTrack[selectedDisk], readWriteLatch);
-      deliveredDiskBits[selectedDisk] += 8;
+      if (expectedBits < 0)
+        expectedBits = 0;
+      disk[selectedDisk]->writeZerosThenByte(curWozTrack[selectedDisk],
+                                             expectedBits, readWriteLatch);
+      deliveredDiskBits[selectedDisk] += expectedBits + 8;
+      dropTrackStates(selectedDisk);
     }
     // Write-protected writes do nothing (real hardware sees the write
     // but the media rejects it); either way, don't fall through to the
@@ -766,6 +1038,12 @@ void DiskII::maintenance(int64_t cycle)
   }
 }
 
+bool DiskII::isMotorOn()
+{
+  return (diskIsSpinningUntil[0] != NOTSPINNING ||
+	  diskIsSpinningUntil[1] != NOTSPINNING);
+}
+
 uint8_t DiskII::selectedDrive()
 {
   return selectedDisk;
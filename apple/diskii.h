@@ -24,6 +24,8 @@ class DiskII : public Slot {
 
   virtual bool Serialize(int8_t fd);
   virtual bool Deserialize(int8_t fd);
+  bool SerializeDrives(int8_t fd);
+  bool DeserializeDrives(int8_t fd);
 
   virtual void Reset(); // used by BIOS cold-boot
   virtual uint8_t readSwitches(uint8_t s);
@@ -36,9 +38,17 @@ class DiskII : public Slot {
   const char *DiskName(int8_t num);
 
   void maintenance(int64_t cycles);
+  // Write back any changes now, instead of waiting for the drive to
+  // have been off for a while
+  void flushDisks();
 
   uint8_t selectedDrive();
   uint8_t headPosition(uint8_t drive);
+  bool isMotorOn();
+
+  // Opt-in: on tracks where it's exact, look the LSS state up from a
+  // per-track table instead of simulating every bit (see tickLSS).
+  void setNibbleFastPath(bool enable);
   
  private:
   void setPhase(uint8_t phase);
@@ -63,6 +73,13 @@ class DiskII : public Slot {
   // ticks on C08C reads.
   void tickLSS();
 
+  bool serializeDrives(int8_t fd, bool withImages);
+  bool deserializeDrives(int8_t fd, bool withImages);
+
+  bool fastForwardLSS(uint8_t datatrack, int64_t bits, uint16_t *lss);
+  bool buildTrackStates(int8_t drive, uint8_t datatrack);
+  void dropTrackStates(int8_t drive);
+
  public:
   // debugging
   WozSerializer *disk[2];
@@ -86,6 +103,16 @@ private:
   volatile int8_t selectedDisk;
 
   volatile int64_t flushAt[2];
+
+  // Nibble fast path. trackStates[d] holds the LSS (state << 8 |
+  // sequencer) after each bit of data track trackStatesFor[d];
+  // trackStatesBits[d] is 0 if that track isn't eligible.
+  bool nibbleFastPath;
+  uint16_t *trackStates[2];
+  uint32_t trackStatesSize[2];
+  uint32_t trackStatesBits[2];
+  uint8_t trackStatesFor[2];
+  int64_t bitsOnTrack[2];
 };
 
 #endif
@@ -20,6 +20,9 @@
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#include "image-map.h"
+#include "compressed-image.h"
+#include "disk-overlay.h"
 #endif
 
 #include "serialize.h"
@@ -58,11 +61,42 @@
 HD32::HD32(AppleMMU *mmu)
 {
   this->mmu = mmu;
+  cacheBlocks = 0;
+  cacheEntry[0] = cacheEntry[1] = NULL;
+  cacheData[0] = cacheData[1] = NULL;
+  cacheClock = 0;
+  cacheHits = cacheMisses = 0;
+#ifndef TEENSYDUINO
+  mapBase[0] = mapBase[1] = NULL;
+  mapSize[0] = mapSize[1] = 0;
+  overlay[0] = overlay[1] = NULL;
+  mapDecoded[0] = mapDecoded[1] = false;
+#endif
+  setCacheBlocks(HD32_CACHEBLOCKS);
   Reset();
 }
 
 HD32::~HD32()
 {
+  // Hands the filemanager its files back, too
+  ejectDisk(0);
+  ejectDisk(1);
+  for (int i=0; i<2; i++) {
+    free(cacheEntry[i]);
+    free(cacheData[i]);
+  }
+}
+
+bool HD32::Deserialize(int8_t fd)
+{
+  return deserializeDrives(fd, true);
+}
+
+// For rewinding: what Serialize() wrote, but leaving the images mapped
+// as they are; it fails unless the same ones are still inserted.
+bool HD32::DeserializeDrives(int8_t fd)
+{
+  return deserializeDrives(fd, false);
 }
 
 bool HD32::Serialize(int8_t fd)
@@ -90,7 +124,7 @@ bool HD32::Serialize(int8_t fd)
   return false;
 }
 
-bool HD32::Deserialize(int8_t fd)
+bool HD32::deserializeDrives(int8_t fd, bool withImages)
 {
   deserializeMagic(HD32MAGIC);
 
@@ -105,11 +139,14 @@ bool HD32::Deserialize(int8_t fd)
   deserialize32(cursor[0]);
   deserialize32(cursor[1]);
   
-  cachedBlockNum = -1; // just invalidate the cache; it will reload...
-
   for (int i=0; i<2; i++) {
     char buf[MAXPATH];
     deserializeString(buf);
+    if (!withImages) {
+      if (strcmp(buf, diskName(i)))
+	goto err;
+      continue;
+    }
     // FIXME: this tromps on error and some other vars ... that we just restored
     insertDisk(i, (char *)buf);
   }
@@ -132,7 +169,12 @@ void HD32::Reset()
   driveSelected = 0;
   command = CMD_STATUS;
 
-  cachedBlockNum = -1;
+  invalidateCache(0);
+  invalidateCache(1);
+#ifndef TEENSYDUINO
+  releaseMapping(0);
+  releaseMapping(1);
+#endif
 }
 
 uint8_t HD32::readSwitches(uint8_t s)
@@ -287,26 +329,21 @@ uint8_t HD32::readNextByteFromSelectedDrive()
   }
 
   int32_t blockToRead = cursor[driveSelected] >> 9; // 512-byte block number
-  if (blockToRead != cachedBlockNum) {
-    if (g_filemanager->lseek(fd[driveSelected], blockToRead*512, SEEK_SET) != blockToRead*512) {
-      goto err;
-    }
-    ssize_t nread = g_filemanager->read(fd[driveSelected], cachedBlock, 512);
-    if (nread != 512) {
-      goto err;
-    }
-    cachedBlockNum = blockToRead;
-
+  const uint8_t *block;
+  uint16_t slot = lastSlot[driveSelected];
+  if (blockToRead == lastBlockRead[driveSelected] &&
+      cacheEntry[driveSelected][slot].blockNum == blockToRead) {
+    // Still streaming out of the block we looked up last
+    block = &cacheData[driveSelected][slot * HD32_BLOCKSIZE];
+  } else {
+    block = cachedBlock(driveSelected, blockToRead);
+    if (!block)
+      return false;
   }
 
-  ret = cachedBlock[cursor[driveSelected] & 0x1FF];
+  ret = block[cursor[driveSelected] & 0x1FF];
   cursor[driveSelected]++;
   return ret;
-
- err:
-  //  memset(cachedBlock, 0, sizeof(cachedBlock));
-  //  cachedBlockNum = -1;
-  return false;
 }
 
 // Based on diskBlock[driveSelected]; updates cursor[driveSelected].
@@ -318,51 +355,327 @@ bool HD32::readBlockFromSelectedDrive()
 
   cursor[driveSelected] = diskBlock[driveSelected] * HD32_BLOCKSIZE;
   int32_t blockToRead = cursor[driveSelected] >> 9; // 512-byte block number
-  if (blockToRead != cachedBlockNum) {
-    if (g_filemanager->lseek(fd[driveSelected], blockToRead*512, SEEK_SET) != blockToRead*512) {
-      goto err;
-    }
-    ssize_t nread = g_filemanager->read(fd[driveSelected], cachedBlock, 512);
-    if (nread != 512) {
-      goto err;
-    }
-    cachedBlockNum = blockToRead;
-  }
+  const uint8_t *block = cachedBlock(driveSelected, blockToRead);
+  if (!block)
+    return false;
   
-  for (uint16_t i=0; i<HD32_BLOCKSIZE; i++) {
-    mmu->write(memBlock[driveSelected] + i, cachedBlock[i]);
-  }
+  mmu->writeBlock(memBlock[driveSelected], block, HD32_BLOCKSIZE);
   
   return true;
-  
- err:
-  //  memset(cachedBlock, 0, sizeof(cachedBlock));
-  //  cachedBlockNum = -1;
-  return false;
 }
 
 bool HD32::writeBlockToSelectedDrive()
 {
-  cachedBlockNum = -1; // just invalidate any cache we have
-
   if (fd[driveSelected]==-1)
     return false;
   
-  for (uint16_t i=0; i<HD32_BLOCKSIZE; i++) {
-    cachedBlock[i] = mmu->read(memBlock[driveSelected] + i);
+#ifndef TEENSYDUINO
+  if (mapBase[driveSelected]) {
+    uint32_t offset = diskBlock[driveSelected] * HD32_BLOCKSIZE;
+    if (offset + HD32_BLOCKSIZE > mapSize[driveSelected])
+      return false;
+    mmu->readBlock(memBlock[driveSelected], &mapBase[driveSelected][offset], HD32_BLOCKSIZE);
+    if (overlay[driveSelected] &&
+        !overlay[driveSelected]->writeUnit(diskBlock[driveSelected], &mapBase[driveSelected][offset], HD32_BLOCKSIZE)) {
+      printf("ERROR: failed to write block %u to the overlay\n", diskBlock[driveSelected]);
+      return false;
+    }
+    if (dirtyHigh[driveSelected] == 0 || offset < dirtyLow[driveSelected])
+      dirtyLow[driveSelected] = offset;
+    if (offset + HD32_BLOCKSIZE > dirtyHigh[driveSelected])
+      dirtyHigh[driveSelected] = offset + HD32_BLOCKSIZE;
+    // maintenance() pushes it out
+    return true;
   }
+#endif
+
+  uint8_t buf[HD32_BLOCKSIZE];
+  mmu->readBlock(memBlock[driveSelected], buf, HD32_BLOCKSIZE);
+
+  // Write-through: a cached copy of this block gets the same bytes, or
+  // is dropped if the write didn't make it to the image.
+  int32_t blockNum = diskBlock[driveSelected];
+  hd32CacheEntry *e = cacheEntry[driveSelected];
+  uint16_t slot;
+  for (slot=0; slot<cacheBlocks; slot++) {
+    if (e[slot].blockNum == blockNum)
+      break;
+  }
+
   if (g_filemanager->lseek(fd[driveSelected], diskBlock[driveSelected]*HD32_BLOCKSIZE, SEEK_SET) != diskBlock[driveSelected]*HD32_BLOCKSIZE ||
-      g_filemanager->write(fd[driveSelected], cachedBlock, HD32_BLOCKSIZE) != HD32_BLOCKSIZE) {
+      g_filemanager->write(fd[driveSelected], buf, HD32_BLOCKSIZE) != HD32_BLOCKSIZE) {
     // FIXME
 #ifndef TEENSYDUINO
     printf("ERROR: failed to write to hd file? errno %d\n", errno);
 #endif
+    if (slot < cacheBlocks)
+      e[slot].blockNum = -1;
     return false;
   }
+  if (slot < cacheBlocks)
+    memcpy(&cacheData[driveSelected][slot * HD32_BLOCKSIZE], buf, HD32_BLOCKSIZE);
+
+  // The same image in both drives: the other drive's copy is stale now
+  int8_t other = driveSelected ^ 1;
+  if (fd[other] != -1 && !strcmp(diskName(other), diskName(driveSelected))) {
+    for (slot=0; slot<cacheBlocks; slot++) {
+      if (cacheEntry[other][slot].blockNum == blockNum)
+	cacheEntry[other][slot].blockNum = -1;
+    }
+  }
   
   return true;
 }
 
+// Returns the cached copy of blockNum, reading it in (and maybe some
+// readahead) on a miss. NULL if the image couldn't be read.
+const uint8_t *HD32::cachedBlock(int8_t driveNum, int32_t blockNum)
+{
+#ifndef TEENSYDUINO
+  if (mapBase[driveNum]) {
+    if ((uint32_t)(blockNum + 1) * HD32_BLOCKSIZE > mapSize[driveNum])
+      return NULL;
+    return &mapBase[driveNum][blockNum * HD32_BLOCKSIZE];
+  }
+#endif
+
+  hd32CacheEntry *e = cacheEntry[driveNum];
+  uint16_t slot = lastSlot[driveNum];
+  if (e[slot].blockNum != blockNum) {
+    for (slot=0; slot<cacheBlocks; slot++) {
+      if (e[slot].blockNum == blockNum)
+	break;
+    }
+  }
+
+  bool sequential = (blockNum == lastBlockRead[driveNum] + 1);
+  lastBlockRead[driveNum] = blockNum;
+
+  if (slot < cacheBlocks) {
+    cacheHits++;
+    e[slot].lastUse = ++cacheClock;
+    lastSlot[driveNum] = slot;
+    return &cacheData[driveNum][slot * HD32_BLOCKSIZE];
+  }
+  cacheMisses++;
+
+#if HD32_READAHEAD == 1
+  // Straight into the slot it'll live in
+  (void)sequential;
+  slot = cacheSlotFor(driveNum);
+  uint8_t *dest = &cacheData[driveNum][slot * HD32_BLOCKSIZE];
+  e[slot].blockNum = -1;
+  if (g_filemanager->lseek(fd[driveNum], blockNum*HD32_BLOCKSIZE, SEEK_SET) != blockNum*HD32_BLOCKSIZE ||
+      g_filemanager->read(fd[driveNum], dest, HD32_BLOCKSIZE) != HD32_BLOCKSIZE)
+    return NULL;
+  e[slot].blockNum = blockNum;
+  e[slot].lastUse = ++cacheClock;
+  lastSlot[driveNum] = slot;
+  return dest;
+#else
+  // On a sequential run, read ahead in the same request. Never fill
+  // more than half the cache with it.
+  static uint8_t buf[HD32_READAHEAD * HD32_BLOCKSIZE];
+  uint16_t count = 1;
+  if (sequential) {
+    count = cacheBlocks / 2;
+    if (count > HD32_READAHEAD) count = HD32_READAHEAD;
+    if (count < 1) count = 1;
+  }
+
+  ssize_t nread;
+  while (1) {
+    nread = -1;
+    if (g_filemanager->lseek(fd[driveNum], blockNum*HD32_BLOCKSIZE, SEEK_SET) == blockNum*HD32_BLOCKSIZE)
+      nread = g_filemanager->read(fd[driveNum], buf, count * HD32_BLOCKSIZE);
+    if (nread >= HD32_BLOCKSIZE || count == 1)
+      break;
+    // Probably ran off the end of the image; just get the one block
+    count = 1;
+  }
+  if (nread < HD32_BLOCKSIZE)
+    return NULL;
+  count = nread / HD32_BLOCKSIZE;
+
+  const uint8_t *ret = NULL;
+  for (uint16_t i=0; i<count; i++) {
+    if (i) {
+      // Don't duplicate readahead blocks we already have
+      uint16_t j;
+      for (j=0; j<cacheBlocks; j++) {
+	if (e[j].blockNum == blockNum + i)
+	  break;
+      }
+      if (j < cacheBlocks)
+	continue;
+    }
+    slot = cacheSlotFor(driveNum);
+    e[slot].blockNum = blockNum + i;
+    e[slot].lastUse = ++cacheClock;
+    memcpy(&cacheData[driveNum][slot * HD32_BLOCKSIZE], &buf[i * HD32_BLOCKSIZE], HD32_BLOCKSIZE);
+    if (!i) {
+      lastSlot[driveNum] = slot;
+      ret = &cacheData[driveNum][slot * HD32_BLOCKSIZE];
+    }
+  }
+  return ret;
+#endif
+}
+
+// An empty slot, or else the least recently used one
+uint16_t HD32::cacheSlotFor(int8_t driveNum)
+{
+  hd32CacheEntry *e = cacheEntry[driveNum];
+  uint16_t lru = 0;
+  for (uint16_t i=0; i<cacheBlocks; i++) {
+    if (e[i].blockNum == -1)
+      return i;
+    if (e[i].lastUse < e[lru].lastUse)
+      lru = i;
+  }
+  return lru;
+}
+
+void HD32::invalidateCache(int8_t driveNum)
+{
+  for (uint16_t i=0; i<cacheBlocks; i++) {
+    cacheEntry[driveNum][i].blockNum = -1;
+    cacheEntry[driveNum][i].lastUse = 0;
+  }
+  lastSlot[driveNum] = 0;
+  lastBlockRead[driveNum] = -1;
+}
+
+void HD32::maintenance()
+{
+#ifndef TEENSYDUINO
+  for (int8_t i=0; i<2; i++) {
+    if (dirtyHigh[i] && time(NULL) - lastSync[i] >= HD32_SYNCSECONDS)
+      syncMapping(i, false);
+  }
+#endif
+}
+
+#ifndef TEENSYDUINO
+// Writes go straight into the shared mapping; this asks the kernel to
+// write them back (and with `wait`, waits for it).
+void HD32::syncMapping(int8_t driveNum, bool wait)
+{
+  if (overlay[driveNum]) {
+    if (dirtyHigh[driveNum])
+      overlay[driveNum]->sync();
+  } else if (dirtyHigh[driveNum]) {
+    syncImageFile(mapBase[driveNum], dirtyLow[driveNum],
+                  dirtyHigh[driveNum] - dirtyLow[driveNum], wait);
+  }
+  dirtyLow[driveNum] = dirtyHigh[driveNum] = 0;
+  lastSync[driveNum] = time(NULL);
+}
+
+// An image with an overlay is never written. Decode it (if it's
+// compressed) or map it privately, apply the blocks already in the
+// overlay, and run it like a shared mapping from there - except that
+// writes also go to the overlay.
+bool HD32::openOverlayImage(int8_t driveNum, const char *filename,
+                            bool compressed, const char *ovlpath)
+{
+  char name[256];
+  uint32_t size;
+  uint8_t *image;
+  if (compressed)
+    image = readCompressedImage(filename, &size, name, sizeof(name));
+  else
+    image = mapImageFileWritable(filename, &size, false);
+  if (!image) {
+    printf("Unable to load %s\n", filename);
+    g_filemanager->closeFile(fd[driveNum]);
+    fd[driveNum] = -1;
+    return false;
+  }
+
+  DiskOverlay *o = new DiskOverlay();
+  uint32_t blocks = size / HD32_BLOCKSIZE;
+  if (!o->load(ovlpath, blocks)) {
+    delete o;
+    if (compressed)
+      free(image);
+    else
+      unmapImageFile(image, size);
+    g_filemanager->closeFile(fd[driveNum]);
+    fd[driveNum] = -1;
+    return false;
+  }
+  for (uint32_t i=0; i<blocks; i++) {
+    if (o->length(i) == HD32_BLOCKSIZE)
+      o->readUnit(i, &image[i * HD32_BLOCKSIZE], HD32_BLOCKSIZE);
+  }
+
+  mapBase[driveNum] = image;
+  mapSize[driveNum] = size;
+  mapDecoded[driveNum] = compressed;
+  overlay[driveNum] = o;
+  return true;
+}
+
+void HD32::releaseMapping(int8_t driveNum)
+{
+  if (!mapBase[driveNum])
+    return;
+  syncMapping(driveNum, true);
+  delete overlay[driveNum];
+  overlay[driveNum] = NULL;
+  if (mapDecoded[driveNum])
+    free(mapBase[driveNum]);
+  else
+    unmapImageFile(mapBase[driveNum], mapSize[driveNum]);
+  mapDecoded[driveNum] = false;
+  mapBase[driveNum] = NULL;
+  mapSize[driveNum] = 0;
+}
+#endif
+
+bool HD32::setCacheBlocks(uint16_t blocks)
+{
+  if (blocks < 1)
+    blocks = 1;
+
+  hd32CacheEntry *entries[2];
+  uint8_t *data[2];
+  for (int i=0; i<2; i++) {
+    entries[i] = (hd32CacheEntry *)malloc(blocks * sizeof(hd32CacheEntry));
+    data[i] = (uint8_t *)malloc(blocks * HD32_BLOCKSIZE);
+  }
+  if (!entries[0] || !entries[1] || !data[0] || !data[1]) {
+    for (int i=0; i<2; i++) {
+      free(entries[i]);
+      free(data[i]);
+    }
+    return false;
+  }
+
+  for (int i=0; i<2; i++) {
+    free(cacheEntry[i]);
+    free(cacheData[i]);
+    cacheEntry[i] = entries[i];
+    cacheData[i] = data[i];
+  }
+  cacheBlocks = blocks;
+  invalidateCache(0);
+  invalidateCache(1);
+  return true;
+}
+
+void HD32::cacheStats(uint32_t *hits, uint32_t *misses)
+{
+  *hits = cacheHits;
+  *misses = cacheMisses;
+}
+
+void HD32::resetCacheStats()
+{
+  cacheHits = cacheMisses = 0;
+}
+
 void HD32::setEnabled(uint8_t e)
 {
   enabled = e;
@@ -379,7 +692,23 @@ const char *HD32::diskName(int8_t num)
 void HD32::insertDisk(int8_t driveNum, const char *filename)
 {
   ejectDisk(driveNum);
+  invalidateCache(driveNum);
   fd[driveNum] = g_filemanager->openFile(filename);
+#ifndef TEENSYDUINO
+  // If the image can't be mapped, fall back to the filemanager
+  if (fd[driveNum] != -1) {
+    char ovlpath[4096];
+    bool compressed = isCompressedImage(filename);
+    if (overlayPathFor(filename, compressed, ovlpath, sizeof(ovlpath)))
+      openOverlayImage(driveNum, filename, compressed, ovlpath);
+    else
+      mapBase[driveNum] = mapImageFileWritable(filename, &mapSize[driveNum], true);
+  }
+  if (fd[driveNum] != -1) {
+    dirtyLow[driveNum] = dirtyHigh[driveNum] = 0;
+    lastSync[driveNum] = time(NULL);
+  }
+#endif
   errorState[driveNum] = 0;
   enabled = 1;
 }
@@ -390,5 +719,9 @@ void HD32::ejectDisk(int8_t driveNum)
     g_filemanager->closeFile(fd[driveNum]);
     fd[driveNum] = -1;
   }
+  invalidateCache(driveNum);
+#ifndef TEENSYDUINO
+  releaseMapping(driveNum);
+#endif
 }
 
@@ -6,6 +6,7 @@
 #else
 #include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 #endif
 
 #include "filemanager.h"
@@ -14,6 +15,33 @@
 
 #include "LRingBuffer.h"
 
+// A drive that isn't mapped (below) keeps its own LRU cache of
+// recently read blocks. When reads walk forward through the image, a
+// miss fetches the next HD32_READAHEAD blocks along with it. On the
+// host that's only an image that couldn't be mapped, so these sizes
+// are for that fallback. The Teensy can't spare the RAM: it gets one
+// block per drive and no readahead (or readahead buffer), which is
+// the card's old single-block cache.
+#ifdef TEENSYDUINO
+#define HD32_CACHEBLOCKS 1
+#define HD32_READAHEAD 1
+#else
+#define HD32_CACHEBLOCKS 64
+#define HD32_READAHEAD 8
+#endif
+
+// Host builds map the image itself (shared, so writes land in the
+// file) and skip the block cache. maintenance() pushes writes out
+// once they're this old, and eject pushes out the rest.
+#define HD32_SYNCSECONDS 2
+
+class DiskOverlay;
+
+typedef struct _hd32CacheEntry {
+  int32_t blockNum;  // -1 if the entry is empty
+  uint32_t lastUse;
+} hd32CacheEntry;
+
 class HD32 : public Slot {
  public:
   HD32(AppleMMU *mmu);
@@ -21,6 +49,7 @@ class HD32 : public Slot {
 
   virtual bool Serialize(int8_t fd);
   virtual bool Deserialize(int8_t fd);
+  bool DeserializeDrives(int8_t fd);
 
   virtual void Reset(); // used by BIOS cold-boot
   virtual uint8_t readSwitches(uint8_t s);
@@ -34,11 +63,33 @@ class HD32 : public Slot {
 
   const char *diskName(int8_t num);
 
+  // Called regularly from the CPU thread
+  void maintenance();
+
+  // Resizes (and empties) both drives' block caches; at least 1 block
+  bool setCacheBlocks(uint16_t blocks);
+  // Lookups in the block caches. Reads from a mapped drive don't go
+  // through one, so they aren't counted.
+  void cacheStats(uint32_t *hits, uint32_t *misses);
+  void resetCacheStats();
+
  protected:
   uint8_t readNextByteFromSelectedDrive();
   bool readBlockFromSelectedDrive();
   bool writeBlockToSelectedDrive();
 
+  bool deserializeDrives(int8_t fd, bool withImages);
+
+  const uint8_t *cachedBlock(int8_t driveNum, int32_t blockNum);
+  uint16_t cacheSlotFor(int8_t driveNum);
+  void invalidateCache(int8_t driveNum);
+#ifndef TEENSYDUINO
+  void syncMapping(int8_t driveNum, bool wait);
+  void releaseMapping(int8_t driveNum);
+  bool openOverlayImage(int8_t driveNum, const char *filename,
+                        bool compressed, const char *ovlpath);
+#endif
+
  private:
   AppleMMU *mmu;
 
@@ -55,8 +106,26 @@ class HD32 : public Slot {
   int8_t fd[2];
   uint32_t cursor[2]; // seek position on the given file handle
 
-  int32_t cachedBlockNum;
-  uint8_t cachedBlock[512];
+  uint16_t cacheBlocks;
+  hd32CacheEntry *cacheEntry[2];
+  uint8_t *cacheData[2];      // cacheBlocks * 512 bytes per drive
+  uint16_t lastSlot[2];       // where the last lookup found its block
+  int32_t lastBlockRead[2];   // for spotting sequential reads
+  uint32_t cacheClock;
+  uint32_t cacheHits, cacheMisses;
+
+#ifndef TEENSYDUINO
+  uint8_t *mapBase[2];        // NULL if the drive isn't mapped
+  uint32_t mapSize[2];
+  uint32_t dirtyLow[2];       // written since the last sync
+  uint32_t dirtyHigh[2];
+  time_t lastSync[2];
+  // An image with an overlay is mapped privately, or decoded into a
+  // buffer if it's compressed (mapDecoded); blocks written to it also
+  // go to the overlay file.
+  DiskOverlay *overlay[2];
+  bool mapDecoded[2];
+#endif
 };
 
 #endif
@@ -3,6 +3,7 @@
 
 #include "globals.h"
 #include "cpu.h"
+#include "serialize.h"
 
 #ifdef TEENSYDUINO
 #include "teensy-println.h"
@@ -27,6 +28,9 @@ static const int16_t ayAmplitudes[16] = {
 #define IFR_TIMER2 0x20
 #define IFR_IRQ    0x80
 
+// Serializing token for Mockingboard data
+#define MBMAGIC 'B'
+
 Mockingboard::Mockingboard()
 {
   lastCycleCount = 0;
@@ -54,8 +58,109 @@ void Mockingboard::Reset()
   }
 }
 
-bool Mockingboard::Serialize(int8_t fd) { return true; }
-bool Mockingboard::Deserialize(int8_t fd) { return true; }
+bool Mockingboard::Serialize(int8_t fd)
+{
+  serializeMagic(MBMAGIC);
+  for (int i = 0; i < 2; i++) {
+    Via6522 &p = via[i];
+    serialize8(p.orb);
+    serialize8(p.ora);
+    serialize8(p.ddrb);
+    serialize8(p.ddra);
+    serialize16(p.timer1latch);
+    serialize16(p.timer1counter);
+    serialize16(p.timer2latch);
+    serialize16(p.timer2counter);
+    serialize8(p.sr);
+    serialize8(p.acr);
+    serialize8(p.pcr);
+    serialize8(p.ifr);
+    serialize8(p.ier);
+    serialize8(p.timer1running ? 1 : 0);
+    serialize8(p.timer2running ? 1 : 0);
+    serialize8(p.timer1fired ? 1 : 0);
+    serialize8(p.timer2fired ? 1 : 0);
+  }
+  for (int i = 0; i < 2; i++) {
+    AY8910 &psg = ay[i];
+    for (int r = 0; r < AY_NUM_REGS; r++) {
+      serialize8(psg.regs[r]);
+    }
+    serialize8(psg.latchedReg);
+    for (int ch = 0; ch < AY_NUM_CHANNELS; ch++) {
+      serialize32(psg.tonePeriod[ch]);
+      serialize32(psg.toneCounter[ch]);
+      serialize8(psg.toneHigh[ch] ? 1 : 0);
+    }
+    serialize32(psg.noisePeriod);
+    serialize32(psg.noiseCounter);
+    serialize32(psg.noiseShift);
+    serialize32(psg.envPeriod);
+    serialize32(psg.envCounter);
+    serialize8(psg.envStep);
+    serialize8(psg.envHolding ? 1 : 0);
+    serialize8(psg.envDirection);
+    serialize8(psg.envShape);
+  }
+  serialize64(lastCycleCount);
+  serializeMagic(MBMAGIC);
+  return true;
+
+ err:
+  return false;
+}
+
+bool Mockingboard::Deserialize(int8_t fd)
+{
+  deserializeMagic(MBMAGIC);
+  for (int i = 0; i < 2; i++) {
+    Via6522 &p = via[i];
+    deserialize8(p.orb);
+    deserialize8(p.ora);
+    deserialize8(p.ddrb);
+    deserialize8(p.ddra);
+    deserialize16(p.timer1latch);
+    deserialize16(p.timer1counter);
+    deserialize16(p.timer2latch);
+    deserialize16(p.timer2counter);
+    deserialize8(p.sr);
+    deserialize8(p.acr);
+    deserialize8(p.pcr);
+    deserialize8(p.ifr);
+    deserialize8(p.ier);
+    deserialize8(p.timer1running);
+    deserialize8(p.timer2running);
+    deserialize8(p.timer1fired);
+    deserialize8(p.timer2fired);
+  }
+  for (int i = 0; i < 2; i++) {
+    AY8910 &psg = ay[i];
+    for (int r = 0; r < AY_NUM_REGS; r++) {
+      deserialize8(psg.regs[r]);
+    }
+    deserialize8(psg.latchedReg);
+    for (int ch = 0; ch < AY_NUM_CHANNELS; ch++) {
+      deserialize32(psg.tonePeriod[ch]);
+      deserialize32(psg.toneCounter[ch]);
+      deserialize8(psg.toneHigh[ch]);
+    }
+    deserialize32(psg.noisePeriod);
+    deserialize32(psg.noiseCounter);
+    deserialize32(psg.noiseShift);
+    deserialize32(psg.envPeriod);
+    deserialize32(psg.envCounter);
+    deserialize8(psg.envStep);
+    deserialize8(psg.envHolding);
+    deserialize8(psg.envDirection);
+    deserialize8(psg.envShape);
+  }
+  deserialize64(lastCycleCount);
+  deserializeMagic(MBMAGIC);
+  return true;
+
+ err:
+  return false;
+}
 
 void Mockingboard::loadROM(uint8_t *toWhere)
 {
@@ -461,3 +566,15 @@ int16_t Mockingboard::mixSample()
 {
   return renderOneSample();
 }
+
+bool Mockingboard::isSilent()
+{
+  // A channel in envelope mode (bit 4) counts as making noise.
+  for (int a = 0; a < 2; a++) {
+    for (int ch = 0; ch < AY_NUM_CHANNELS; ch++) {
+      if (ay[a].regs[8 + ch] & 0x1F)
+	return false;
+    }
+  }
+  return true;
+}
@@ -78,6 +78,9 @@ class Mockingboard : public Slot {
   void renderToBuffer(int16_t *buf, int count);
   int16_t mixSample();
 
+  // True when every channel on both AYs is at zero volume.
+  bool isSilent();
+
  private:
   uint8_t viaRead(int whichVia, uint8_t reg);
   void viaWrite(int whichVia, uint8_t reg, uint8_t val);
@@ -1,7 +1,16 @@
+#ifdef TEENSYDUINO
+#include <Arduino.h>
+#include "teensy-println.h"
+#endif
+
 #include "mouse.h"
 #include <string.h>
+#include "serialize.h"
 #include "globals.h"
 
+// Serializing token for mouse data
+#define MOUSEMAGIC 'm'
+
 // This ROM is part of the Aiie source code, but it was compiled and
 // bundled as a binary. If you want to see what it's doing, take a
 // look at mouserom.asm.
@@ -42,20 +51,54 @@ Mouse::Mouse()
   lastXForInt = lastYForInt = 0;
   lastButton = false;
   lastButtonForInt = false;
+  curButton = false;
+  nextInterruptTime = -1;
 }
 
 Mouse::~Mouse()
 {
 }
 
+// The card's side of things. Where the host mouse is (and its
+// clamps) belongs to the host.
 bool Mouse::Serialize(int8_t fd)
 {
+  serializeMagic(MOUSEMAGIC);
+  serialize8(status);
+  serialize8(interruptsTriggered);
+  serialize16(lastX);
+  serialize16(lastY);
+  serialize8(lastButton ? 1 : 0);
+  serialize8(curButton ? 1 : 0);
+  serialize16(lastXForInt);
+  serialize16(lastYForInt);
+  serialize8(lastButtonForInt ? 1 : 0);
+  serialize64(nextInterruptTime);
+  serializeMagic(MOUSEMAGIC);
   return true;
+
+ err:
+  return false;
 }
 
 bool Mouse::Deserialize(int8_t fd)
 {
+  deserializeMagic(MOUSEMAGIC);
+  deserialize8(status);
+  deserialize8(interruptsTriggered);
+  deserialize16(lastX);
+  deserialize16(lastY);
+  deserialize8(lastButton);
+  deserialize8(curButton);
+  deserialize16(lastXForInt);
+  deserialize16(lastYForInt);
+  deserialize8(lastButtonForInt);
+  deserialize64(nextInterruptTime);
+  deserializeMagic(MOUSEMAGIC);
   return true;
+
+ err:
+  return false;
 }
 
 void Mouse::Reset()
@@ -218,7 +261,8 @@ void Mouse::loadExtendedRom(uint8_t *toWhere, uint16_t byteOffset)
 void Mouse::maintainMouse(int64_t cycleCount)
 {
   // Fake a 60Hz VBL in case we need it for our interrupts
-  static int64_t nextInterruptTime = cycleCount + 17050;
+  if (nextInterruptTime == -1)
+    nextInterruptTime = cycleCount + 17050;
   if ( (status & ST_MOUSEENABLE) &&
        (status & ST_INTVBL)  &&
        (cycleCount >= nextInterruptTime) ) {
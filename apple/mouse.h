@@ -47,6 +47,10 @@ private:
   // needs to fire based on a change
   uint16_t lastXForInt, lastYForInt;
   bool lastButtonForInt;
+
+  // CPU cycle of the next fake VBL interrupt (-1 until the first
+  // maintainMouse call)
+  int64_t nextInterruptTime;
 };
 
 #endif
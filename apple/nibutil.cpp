@@ -71,15 +71,16 @@ static const uint8_t _diskBytes53[32] = {
 
 // Inverse table: disk byte → 5-bit value, or 0xFF if invalid. Built at
 // startup from _diskBytes53 so we don't carry a second hand-maintained
-// copy that could drift.
-static uint8_t _invDiskBytes53[256];
-static bool _inv53Ready = false;
-static void _build53Inverse() {
-  if (_inv53Ready) return;
-  for (int i = 0; i < 256; i++) _invDiskBytes53[i] = 0xFF;
-  for (int i = 0; i < 32; i++) _invDiskBytes53[_diskBytes53[i]] = (uint8_t)i;
-  _inv53Ready = true;
-}
+// copy that could drift. It's a static object, rather than built on
+// first use, so it's done before any threads (diskbatch's workers)
+// can be decoding with it.
+static struct _inv53Table {
+  uint8_t v[256];
+  _inv53Table() {
+    for (int i = 0; i < 256; i++) v[i] = 0xFF;
+    for (int i = 0; i < 32; i++) v[_diskBytes53[i]] = (uint8_t)i;
+  }
+} _invDiskBytes53;
 
 // Prodos to physical sector conversion
 const uint8_t deProdosPhys[] = {
@@ -252,7 +253,9 @@ uint32_t nibblizeTrack(uint8_t outputBuffer[NIBTRACKSIZE], const uint8_t rawTrac
 // trackBuf.
 bool _decode62Data(const uint8_t trackBuffer[343], uint8_t output[256])
 {
-  static uint8_t workbuf[342];
+  // On the stack: the disk writer thread decodes tracks at the same
+  // time as the CPU thread does.
+  uint8_t workbuf[342];
 
   for (int i=0; i<342; i++) {
     uint8_t in = *(trackBuffer++) & 0x7F; // strip high bit
@@ -319,8 +322,6 @@ bool _decode62Data(const uint8_t trackBuffer[343], uint8_t output[256])
 
 void _encode53Data(uint8_t outputBuffer[411], const uint8_t input[256])
 {
-  _build53Inverse(); // harmless here; keeps both paths self-initializing
-
   uint8_t tops[256];      // high-5-bit values
   uint8_t threes[154];    // packed aux values
 
@@ -364,26 +365,24 @@ void _encode53Data(uint8_t outputBuffer[411], const uint8_t input[256])
 
 bool _decode53Data(const uint8_t trackBuffer[411], uint8_t output[256])
 {
-  _build53Inverse();
-
   uint8_t threes[154];    // aux 5-bit values, post-XOR
   uint8_t tops[256];      // primary 5-bit values, post-XOR
   uint8_t chk = 0;
 
   // Aux section first — the encoder wrote it reversed, so index 153 down.
   for (int i = 153; i >= 0; i--) {
-    uint8_t v = _invDiskBytes53[trackBuffer[153 - i]];
+    uint8_t v = _invDiskBytes53.v[trackBuffer[153 - i]];
     if (v == 0xFF) return false;
     chk ^= v;
     threes[i] = chk;
   }
   for (int i = 0; i < 256; i++) {
-    uint8_t v = _invDiskBytes53[trackBuffer[154 + i]];
+    uint8_t v = _invDiskBytes53.v[trackBuffer[154 + i]];
     if (v == 0xFF) return false;
     chk ^= v;
     tops[i] = chk;
   }
-  uint8_t trailer = _invDiskBytes53[trackBuffer[410]];
+  uint8_t trailer = _invDiskBytes53.v[trackBuffer[410]];
   if (trailer == 0xFF || trailer != chk) return false;
 
   // Rebuild the 255 five-byte groups in reverse order (matching how they
@@ -1,7 +1,17 @@
+#ifdef TEENSYDUINO
+#include <Arduino.h>
+#include "teensy-println.h"
+#endif
+
 #include "noslotclock.h"
+#include "serialize.h"
+#include "globals.h"
 
 #define initSequence 0x5CA33AC55CA33AC5LL
 
+// Serializing token for the clock
+#define NSCMAGIC 'N'
+
 /* The no-slot clock works like this...
  *
  * The NSC is installed in some bank of ROM memory. For our instance,
@@ -38,6 +48,40 @@ NoSlotClock::~NoSlotClock()
 {
 }
 
+// Where the clock is in its bit-serial handshake; the time itself
+// comes from the host again when it's next read.
+bool NoSlotClock::Serialize(int8_t fd)
+{
+  serializeMagic(NSCMAGIC);
+  serialize64(clockReg);
+  serialize64(compareReg);
+  serialize8(clockRegPtr);
+  serialize8(compareRegPtr);
+  serialize8(regEnabled ? 1 : 0);
+  serialize8(writeEnabled ? 1 : 0);
+  serializeMagic(NSCMAGIC);
+  return true;
+
+ err:
+  return false;
+}
+
+bool NoSlotClock::Deserialize(int8_t fd)
+{
+  deserializeMagic(NSCMAGIC);
+  deserialize64(clockReg);
+  deserialize64(compareReg);
+  deserialize8(clockRegPtr);
+  deserialize8(compareRegPtr);
+  deserialize8(regEnabled);
+  deserialize8(writeEnabled);
+  deserializeMagic(NSCMAGIC);
+  return true;
+
+ err:
+  return false;
+}
+
 bool NoSlotClock::read(uint8_t s, uint8_t *d)
 {
   if (s & 0x04) {
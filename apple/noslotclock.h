@@ -11,6 +11,9 @@ class NoSlotClock {
   NoSlotClock(AppleMMU *mmu);
   virtual ~NoSlotClock();
 
+  bool Serialize(int8_t fd);
+  bool Deserialize(int8_t fd);
+
   bool read(uint8_t s, uint8_t *data);
   void write(uint8_t s);
 
@@ -5,16 +5,41 @@
 
 #ifdef TEENSYDUINO
 #include "iocompat.h"
+#else
+#include <string.h>
+#include "disk-writer.h"
 #endif
 
-#define WOZMAGIC 0xAA
+// 0xAA snapshots carried rand() fake-bit state instead of the seed
+#define WOZMAGIC 0xAB
 
 WozSerializer::WozSerializer() : Woz(false,0)
 {
+#ifdef TEENSYDUINO
+  backgroundFlush = false;
+#else
+  backgroundFlush = true;
+  flushOwner = NULL;
+  pthread_mutex_init(&failedLock, NULL);
+  memset(failedTracks, 0, sizeof(failedTracks));
+  haveFailedTracks = false;
+  retryHere = false;
+#endif
 }
 
 WozSerializer::~WozSerializer()
 {
+#ifndef TEENSYDUINO
+  // Whoever loads this image next has to see our writes, and this is
+  // the last chance for any that failed.
+  if (backgroundFlush) {
+    g_diskWriter.drain();
+    takeFailedTracks();
+    if (retryHere && Woz::isDirty() && !writeBack())
+      fprintf(stderr, "Changes to %s were lost\n", imagePath ? imagePath : "");
+  }
+  pthread_mutex_destroy(&failedLock);
+#endif
 }
 
 const char *WozSerializer::diskName()
@@ -29,7 +54,11 @@ bool WozSerializer::Serialize(int8_t fd)
 {
   // If we're being asked to serialize, make sure we've flushed any data first
   flush();
-  
+  return SerializeHead(fd);
+}
+
+bool WozSerializer::SerializeHead(int8_t fd)
+{
   serializeMagic(WOZMAGIC);
   // The disk image and its cache will be reloaded completely, so no
   // need to serialize tracks[] or diskinfo or imageType or metadata
@@ -42,8 +71,11 @@ bool WozSerializer::Serialize(int8_t fd)
   serialize8(trackByteFromDataTrack);
   serialize8(trackBitIdx);
   serialize8(trackLoopCounter);
-  serialize8(randData);
-  serialize8(randPtr);
+  serialize64(fakeBitSeedValue);
+  serialize64(fakeBitState);
+  serialize64(fakeBits);
+  serialize8(fakeBitsLeft);
+  serialize8(headWindow);
   serializeMagic(WOZMAGIC);
 
   return true;
@@ -63,8 +95,12 @@ bool WozSerializer::Deserialize(int8_t fd)
   deserialize8(trackByteFromDataTrack);
   deserialize8(trackBitIdx);
   deserialize8(trackLoopCounter);
-  deserialize8(randData);
-  deserialize8(randPtr);
+  deserialize64(fakeBitSeedValue);
+  deserialize64(fakeBitState);
+  deserialize64(fakeBits);
+  deserialize8(fakeBitsLeft);
+  deserialize8(headWindow);
+  bitWindowCount = 0;
   
   deserializeMagic(WOZMAGIC);
 
@@ -74,46 +110,157 @@ bool WozSerializer::Deserialize(int8_t fd)
   return false;
 }
 
+bool WozSerializer::isDirty()
+{
+#ifndef TEENSYDUINO
+  takeFailedTracks();
+#endif
+  return Woz::isDirty();
+}
+
 bool WozSerializer::flush()
 {
-  // Flush the entire disk image if it's dirty. We could make this
-  // smarter later.
-  // FIXME hard-coded number of tracks?
-  bool trackDirty = false;
+#ifndef TEENSYDUINO
+  takeFailedTracks();
+#endif
+  if (!Woz::isDirty())
+    return true;
+
+#ifndef TEENSYDUINO
+  // Hand the dirty tracks to the writer thread - unless the flush
+  // would need the rest of the image too (a full rewrite, or clean
+  // tracks we'd have to read back in), in which case do it here.
+  if (backgroundFlush) {
+    if (!autoFlushTrackData && canFlushInPlace() && imagePath) {
+      // The last background write failed, so this one's done here
+      // where the caller can see how it goes
+      if (retryHere)
+        return writeBack();
+      WozSerializer *snapshot = snapshotForFlush();
+      if (snapshot) {
+        g_diskWriter.queue(snapshot);
+        return true;
+      }
+    }
+    // Anything already queued for this image has to land first
+    g_diskWriter.drain();
+  }
+#endif
+
+  // Only the dirty tracks are written back
+  bool ret = Woz::flush();
+  g_filemanager->flush();
+
+  return ret;
+}
+
+// A copy of everything flush() needs, holding its own copies of the
+// dirty tracks, which are then clean here. We carry on using (and
+// writing) our tracks while the writer thread encodes the copy.
+WozSerializer *WozSerializer::snapshotForFlush()
+{
+  WozSerializer *s = new WozSerializer();
+  s->backgroundFlush = false;
+  s->flushOwner = this;
+  s->imageType = imageType;
+  s->autoFlushTrackData = false;
+  s->di = di;
+  memcpy(s->quarterTrackMap, quarterTrackMap, sizeof(quarterTrackMap));
+  s->trksDataPos = trksDataPos;
+  s->wozImageEnd = wozImageEnd;
+  s->imagePath = (char *)malloc(strlen(imagePath)+1);
+  if (!s->imagePath) {
+    delete s;
+    return NULL;
+  }
+  strcpy(s->imagePath, imagePath);
+
   for (int i=0; i<160; i++) {
-    if (tracks[i].dirty)
-      trackDirty = true;
+    s->tracks[i] = tracks[i];
+    s->tracks[i].trackData = NULL;
+    s->tracks[i].dirty = false;
+    s->tracks[i].mapped = false;
+    if (!tracks[i].dirty || !tracks[i].trackData)
+      continue;
+    uint32_t size = tracks[i].blockCount * 512;
+    s->tracks[i].trackData = (uint8_t *)malloc(size);
+    if (!s->tracks[i].trackData) {
+      delete s;
+      return NULL;
+    }
+    memcpy(s->tracks[i].trackData, tracks[i].trackData, size);
+    s->tracks[i].dirty = true;
   }
-  if (!trackDirty) {
-    return true;
+
+  for (int i=0; i<160; i++) {
+    tracks[i].dirty = false;
   }
+  return s;
+}
 
-  // The fd should still be open. If it's not, then we can't flush.
-  if (fd == -1)
+bool WozSerializer::writeSnapshot()
+{
+  bool ok = reopenImage();
+  if (!ok)
+    fprintf(stderr, "Error: unable to reopen %s to flush it\n", imagePath);
+  else
+    ok = Woz::flush();
+#ifndef TEENSYDUINO
+  if (!ok && flushOwner)
+    flushOwner->noteFailedTracks(this);
+#endif
+  return ok;
+}
+
+#ifndef TEENSYDUINO
+// What the writer thread would do, here and now
+bool WozSerializer::writeBack()
+{
+  WozSerializer *snapshot = snapshotForFlush();
+  if (!snapshot)
     return false;
+  g_diskWriter.drain();
+  bool ok = snapshot->writeSnapshot();
+  delete snapshot;
+  if (ok)
+    retryHere = false;
+  takeFailedTracks();
+  return ok;
+}
 
-  bool ret = true;
-
-  switch (imageType) {
-  case T_WOZ:
-    ret = writeWozFile(fd, imageType);
-    break;
-  case T_DSK:
-  case T_PO:
-    ret = writeDskFile(fd, imageType);
-    break;
-  case T_NIB:
-    ret = writeNibFile(fd);
-    break;
-    default:
-      fprintf(stderr, "Error: unknown imageType; can't flush\n");
-      ret = false;
-      break;
+// On the writer thread: what the snapshot was to write is dirty again
+// (Woz::flush() leaves them marked if it fails part way)
+void WozSerializer::noteFailedTracks(const WozSerializer *snapshot)
+{
+  pthread_mutex_lock(&failedLock);
+  for (int i=0; i<160; i++) {
+    if (snapshot->tracks[i].trackData && snapshot->tracks[i].dirty) {
+      failedTracks[i] = true;
+      haveFailedTracks = true;
+    }
   }
-  g_filemanager->flush();
+  pthread_mutex_unlock(&failedLock);
+}
 
-  return ret;
+// Mark the tracks whose background write failed dirty again, and
+// write them from here next time. True if there were any.
+bool WozSerializer::takeFailedTracks()
+{
+  pthread_mutex_lock(&failedLock);
+  bool any = haveFailedTracks;
+  if (any) {
+    for (int i=0; i<160; i++) {
+      if (failedTracks[i])
+        tracks[i].dirty = true;
+    }
+    memset(failedTracks, 0, sizeof(failedTracks));
+    haveFailedTracks = false;
+    retryHere = true;
+  }
+  pthread_mutex_unlock(&failedLock);
+  return any;
 }
+#endif
 
 bool WozSerializer::writeNextWozBit(uint8_t datatrack, uint8_t bit)
 {
@@ -125,11 +272,21 @@ bool WozSerializer::writeNextWozByte(uint8_t datatrack, uint8_t b)
   return Woz::writeNextWozByte(datatrack, b);
 }
 
+bool WozSerializer::writeZerosThenByte(uint8_t datatrack, uint64_t zeros, uint8_t b)
+{
+  return Woz::writeZerosThenByte(datatrack, zeros, b);
+}
+
 uint8_t WozSerializer::nextDiskBit(uint8_t datatrack)
 {
   return Woz::nextDiskBit(datatrack);
 }
 
+uint8_t WozSerializer::nextDiskBits(uint8_t datatrack, uint8_t count)
+{
+  return Woz::nextDiskBits(datatrack, count);
+}
+
 uint8_t WozSerializer::nextDiskByte(uint8_t datatrack)
 {
   return Woz::nextDiskByte(datatrack);
@@ -2,6 +2,10 @@
 #define __WOZ_SERIALIZER_H
 
 #include "woz.h"
+#ifndef TEENSYDUINO
+#include <pthread.h>
+#endif
+
 class WozSerializer: public virtual Woz {
 public:
   WozSerializer();
@@ -12,13 +16,52 @@ public:
  public:
   bool Serialize(int8_t fd);
   bool Deserialize(int8_t fd);
+  // Just the head's position and state, without flushing the image
+  // first; Deserialize() reads it back.
+  bool SerializeHead(int8_t fd);
 
   virtual bool flush();
+  // Includes tracks whose background write failed; the next flush()
+  // writes those itself.
+  bool isDirty();
+
+  // Host builds hand flushes to the background disk writer
+  // (disk-writer.h) by default; this turns that on or off.
+  void setBackgroundFlush(bool enabled) { backgroundFlush = enabled; }
+  // Called on the writer thread for a snapshot from flush(). If it
+  // fails, the image the snapshot came from gets its tracks back as
+  // dirty.
+  bool writeSnapshot();
+  const char *imageFile() { return imagePath; }
 
   virtual bool writeNextWozBit(uint8_t datatrack, uint8_t bit);
   virtual bool writeNextWozByte(uint8_t datatrack, uint8_t b);
+  virtual bool writeZerosThenByte(uint8_t datatrack, uint64_t zeros, uint8_t b);
   virtual uint8_t nextDiskBit(uint8_t datatrack);
+  virtual uint8_t nextDiskBits(uint8_t datatrack, uint8_t count);
   virtual uint8_t nextDiskByte(uint8_t datatrack);
+
+ protected:
+  WozSerializer *snapshotForFlush();
+#ifndef TEENSYDUINO
+  bool writeBack();
+  void noteFailedTracks(const WozSerializer *snapshot);
+  bool takeFailedTracks();
+#endif
+
+  bool backgroundFlush;
+#ifndef TEENSYDUINO
+  // A snapshot's source image, which gets told if it fails
+  WozSerializer *flushOwner;
+  // Tracks that were handed to the writer thread clean and then
+  // failed to write, until flush() marks them dirty again
+  pthread_mutex_t failedLock;
+  bool failedTracks[160];
+  bool haveFailedTracks;
+  // Set once a background write has failed: flush() works here, not
+  // on the writer thread, until one succeeds
+  bool retryHere;
+#endif
 };
 
 
@@ -5,6 +5,13 @@
 #include "nibutil.h"
 #include "version.h"
 
+#ifndef TEENSYDUINO
+#include "image-map.h"
+#include "nib-cache.h"
+#include "compressed-image.h"
+#include "disk-overlay.h"
+#endif
+
 // Block number we start packing data bits after (Woz 2.0 images)
 #define STARTBLOCK 3
 
@@ -23,67 +30,117 @@
 #define realloc extmem_realloc
 #endif
 
-#define PREP_SECTION(fd, t) {      \
-  uint32_t type = t;               \
-  if (!write32(fd, type))           \
+#define PREP_SECTION(out, t) {     \
+  if (!out.put32(t))               \
     return false;                  \
-  if (!write32(fd, 0))              \
+  if (!out.put32(0))               \
     return false;                  \
-  curpos = lseek(fd, 0, SEEK_CUR); \
+  curpos = out.tell();             \
  }
 
-#define END_SECTION(fd) {                   \
-  long endpos = lseek(fd, 0, SEEK_CUR);	    \
-  lseek(fd, curpos-4, SEEK_SET);            \
-  uint32_t chunksize = endpos - curpos;                                 \
-  if (!write32(fd, chunksize))               \
+#define END_SECTION(out) {                  \
+  uint32_t endpos = out.tell();             \
+  out.seek(curpos-4);                       \
+  if (!out.put32(endpos - curpos))          \
     return false;                           \
-  lseek(fd, endpos, SEEK_SET);                   \
+  out.seek(endpos);                         \
   }
 
+// Chunks are built in memory; start at this size and double as needed
+#define WOZBUFFER_INITIAL (64*1024)
+
+Woz *Woz::trackCacheImages = NULL;
+uint32_t Woz::trackCacheBudget = TRACKCACHE_BUDGET;
+uint32_t Woz::trackCacheClock = 0;
+uint32_t Woz::trackCacheHits = 0;
+uint32_t Woz::trackCacheMisses = 0;
+
 Woz::Woz(bool verbose, uint8_t dumpflags)
 {
   fd = -1;
+#ifndef TEENSYDUINO
+  ownFd = false;
+#endif
   trackPointer = 0;
   trackBitIdx = 0x80;
   trackBitCounter = 0;
   trackByteFromDataTrack = 255;
   trackLoopCounter = 0;
+  bitWindow = 0;
+  bitWindowCount = 0;
+  bitWindowPos = 0;
   imageType = T_AUTO;
   metaData = NULL;
   this->verbose = verbose;
   this->dumpflags = dumpflags;
 
   memset(&quarterTrackMap, 255, sizeof(quarterTrackMap));
+  trksDataPos = wozImageEnd = 0;
+  imagePath = NULL;
+  mapBase = NULL;
+  mapSize = parsePos = 0;
+  parseBufPos = parseBufLen = 0;
   memset(&di, 0, sizeof(diskInfo));
   memset(&tracks, 0, sizeof(tracks));
-  randPtr = 0;
+  setFakeBitSeed(WOZ_FAKEBIT_SEED);
   headWindow = 0;
   hdvData = NULL;
   hdvByteSize = 0;
+  hdvMapped = false;
+  decodedImage = NULL;
+  decodedSize = 0;
+  overlay = NULL;
+  readOnlyImage = false;
+  autoFlushTrackData = false;
+  inTrackCache = false;
+  nextInTrackCache = NULL;
 }
 
 Woz::~Woz()
 {
+  releaseImage();
+  if (imagePath) {
+    free(imagePath);
+    imagePath = NULL;
+  }
+}
+
+// Let go of everything the current image holds, so another one can be
+// read into this Woz.
+void Woz::releaseImage()
+{
+  leaveTrackCache();
   if (fd != -1) {
-    close(fd);
+#ifndef TEENSYDUINO
+    if (ownFd)
+      (::close)(fd);
+    else
+#endif
+      close(fd);
     fd = -1;
   }
+#ifndef TEENSYDUINO
+  ownFd = false;
+#endif
 
+  releaseMapping();
   for (int i=0; i<160; i++) {
     if (tracks[i].trackData) {
       free(tracks[i].trackData);
       tracks[i].trackData = NULL;
     }
   }
+  releaseDecodedImage();
+#ifndef TEENSYDUINO
+  delete overlay;
+  overlay = NULL;
+#endif
   if (metaData) {
     free(metaData);
     metaData = NULL;
   }
-  if (hdvData) {
-    free(hdvData);
-    hdvData = NULL;
-  }
+  releaseHdvData();
+  bitWindowCount = 0;
 }
 
 // external interface for a disk subsystem to write a bit
@@ -94,10 +151,15 @@ bool Woz::writeNextWozBit(uint8_t datatrack, uint8_t bit)
     return true;
   }
 
+  if (autoFlushTrackData &&
+      (!tracks[datatrack].trackData || trackByteFromDataTrack != datatrack))
+    useTrack(datatrack);
   if (!tracks[datatrack].trackData) {
     fprintf(stderr, "ERROR: tried to writeNextWozBit to a data track that's not loaded, and we can't possibly tell which QT that should be\n");
     return false;
   }
+  if (tracks[datatrack].mapped && !ownTrackData(datatrack))
+    return false;
 
   if (trackByteFromDataTrack != datatrack) {
     // FIXME what if trackpointer is out of bounds for this track
@@ -111,6 +173,7 @@ bool Woz::writeNextWozBit(uint8_t datatrack, uint8_t bit)
     trackByte &= ~trackBitIdx;
   
   tracks[datatrack].trackData[trackPointer] = trackByte;
+  bitWindowCount = 0;
 
   advanceBitStream(datatrack);
   tracks[datatrack].dirty = true;
@@ -133,28 +196,139 @@ bool Woz::writeNextWozByte(uint8_t datatrack, uint8_t b)
     return false;
   }
   
-  // We could be byte-aligned, but it's not guaranteed, so this
-  // handles it bitwise.
-  for (uint8_t i=0; i<8; i++) {
-    writeNextWozBit(datatrack, b & (1 << (7-i)) ? 1 : 0);
+  return writeZerosThenByte(datatrack, 0, b);
+}
+
+// Put the top `count` (1-8) bits of `bits` under the head, as far as
+// the end of the current byte or of the track, and move past them.
+// Returns how many were written.
+uint8_t Woz::putBits(uint8_t datatrack, uint8_t bits, uint8_t count)
+{
+  trackInfo &t = tracks[datatrack];
+  // Bits left in this byte (trackBitIdx is the next one) and track
+  uint8_t room = __builtin_ctz(trackBitIdx) + 1;
+  if (count > room)
+    count = room;
+  if (count > t.bitCount - trackBitCounter)
+    count = t.bitCount - trackBitCounter;
+
+  uint8_t shift = room - count;
+  uint8_t mask = ((1 << count) - 1) << shift;
+  uint8_t *p = &t.trackData[trackPointer];
+  *p = (*p & ~mask) | ((bits >> (8 - count)) << shift & mask);
+
+  trackBitCounter += count;
+  if (count == room) {
+    trackPointer++;
+    trackBitIdx = 0x80;
+  } else {
+    trackBitIdx >>= count;
+  }
+  if (trackBitCounter >= t.bitCount) {
+    trackPointer = 0;
+    trackBitIdx = 0x80;
+    trackBitCounter = 0;
+    trackLoopCounter++;
+  }
+  return count;
+}
+
+// Write `zeros` 0-bits and then `b`, MSB first. The track ends up
+// exactly as it would after that many writeNextWozBit() calls, but
+// whole bytes are written at once wherever the head is byte aligned.
+bool Woz::writeZerosThenByte(uint8_t datatrack, uint64_t zeros, uint8_t b)
+{
+  if (datatrack == 0xFF) {
+    printf("ERROR: tried to write bit on half-track; not implemented\n");
+    return true;
   }
+
+  if (autoFlushTrackData &&
+      (!tracks[datatrack].trackData || trackByteFromDataTrack != datatrack))
+    useTrack(datatrack);
+  trackInfo &t = tracks[datatrack];
+  if (!t.trackData) {
+    fprintf(stderr, "ERROR: tried to write to a data track that's not loaded, and we can't possibly tell which QT that should be\n");
+    return false;
+  }
+  if (t.mapped && !ownTrackData(datatrack))
+    return false;
+  if (!t.bitCount)
+    return false;
+
+  while (zeros) {
+    if (trackBitIdx == 0x80 && zeros >= 8) {
+      // Aligned: clear whole bytes, up to the end of the track
+      uint32_t n = (t.bitCount - trackBitCounter) / 8;
+      if (n > zeros / 8)
+        n = zeros / 8;
+      if (n) {
+        memset(&t.trackData[trackPointer], 0, n);
+        trackPointer += n;
+        trackBitCounter += n * 8;
+        zeros -= n * 8;
+        if (trackBitCounter >= t.bitCount) {
+          trackPointer = 0;
+          trackBitCounter = 0;
+          trackLoopCounter++;
+        }
+        continue;
+      }
+    }
+    zeros -= putBits(datatrack, 0, zeros > 8 ? 8 : zeros);
+  }
+
+  if (trackBitIdx == 0x80 && t.bitCount - trackBitCounter >= 8) {
+    // Aligned, with room for the whole byte
+    t.trackData[trackPointer] = b;
+    trackPointer++;
+    trackBitCounter += 8;
+    if (trackBitCounter >= t.bitCount) {
+      trackPointer = 0;
+      trackBitCounter = 0;
+      trackLoopCounter++;
+    }
+  } else {
+    // Masked into the byte(s) it straddles
+    uint8_t left = 8;
+    while (left) {
+      uint8_t n = putBits(datatrack, b, left);
+      b <<= n;
+      left -= n;
+    }
+  }
+
+  trackByte = t.trackData[trackPointer];
+  trackByteFromDataTrack = datatrack;
+  bitWindowCount = 0;
+  t.dirty = true;
   return true;
 }
 
-uint8_t Woz::getNextWozBit(uint8_t datatrack)
+// Point the bitstream cursor at `datatrack`. When the head has moved
+// to a different track, this does the cross-track rescale and throws
+// away the bit window. Returns false if there's nothing to read.
+bool Woz::seekBitWindow(uint8_t datatrack)
 {
   if (datatrack >= 160) {
     if (datatrack != 255) {
       fprintf(stderr, "datatrack %d out of range\n", datatrack);
       exit(1);
     }
-    return 0;
+    return false;
   }
   
+  // Lazily loaded images fetch (or just touch) the track in the cache
+  // when the head arrives on it
+  if (autoFlushTrackData &&
+      (!tracks[datatrack].trackData || trackByteFromDataTrack != datatrack))
+    useTrack(datatrack);
   if (!tracks[datatrack].trackData) {
-    fprintf(stderr, "ERROR: getNextWozBit was called without the track being cached, and it can't possibly know which QT to load it from\n");
-    return 0;
+    fprintf(stderr, "ERROR: tried to read a bit from a data track that's not cached, and it can't possibly know which QT to load it from\n");
+    return false;
   }
+  if (!tracks[datatrack].bitCount)
+    return false;
 
   if (trackByteFromDataTrack != datatrack) {
     // Cross-track sync per WOZ 2.0 reference: when moving to a new
@@ -165,7 +339,6 @@ uint8_t Woz::getNextWozBit(uint8_t datatrack)
     // 8-bit alignment and fail their protection checks.
     if (trackByteFromDataTrack < 160 &&
         tracks[trackByteFromDataTrack].bitCount > 0 &&
-        tracks[datatrack].bitCount > 0 &&
         trackBitCounter < tracks[trackByteFromDataTrack].bitCount) {
       uint64_t scaled =
         (uint64_t)trackBitCounter * tracks[datatrack].bitCount /
@@ -176,14 +349,149 @@ uint8_t Woz::getNextWozBit(uint8_t datatrack)
     }
     trackByte = tracks[datatrack].trackData[trackPointer];
     trackByteFromDataTrack = datatrack;
+    bitWindowCount = 0;
   }
 
-  // It's assumed that trackByte is set properly when we get here. It
-  // should be set when we load image or change tracks, and it's
-  // changed again when we advanceBitStream.
+  // Someone else (a write, a deserialize, a dump) moved the cursor.
+  if (bitWindowPos != trackBitCounter)
+    bitWindowCount = 0;
+  if (!bitWindowCount) {
+    bitWindow = 0;
+    bitWindowPos = trackBitCounter;
+  }
+  return true;
+}
 
-  uint8_t ret = (trackByte & trackBitIdx) ? 1 : 0;
-  advanceBitStream(datatrack);
+// Top the window up to at least 57 bits. Away from the end of the
+// track this is one unaligned 64-bit load; the last few bytes before
+// bitCount go in a byte at a time, and then we carry on from bit 0.
+void Woz::fillBitWindow(uint8_t datatrack)
+{
+  trackInfo *t = &tracks[datatrack];
+  uint32_t p = (bitWindowPos + bitWindowCount) % t->bitCount;
+
+  while (bitWindowCount <= 56) {
+    uint64_t w;
+    uint8_t take;
+    if (p + 64 <= t->bitCount) {
+      const uint8_t *b = &t->trackData[p >> 3];
+      w = 0;
+      for (uint8_t i=0; i<8; i++) {
+	w = (w << 8) | b[i];
+      }
+      w <<= (p & 7);
+      take = 64 - (p & 7);
+    } else {
+      w = (uint64_t)(uint8_t)(t->trackData[p >> 3] << (p & 7)) << 56;
+      take = 8 - (p & 7);
+      if (take > t->bitCount - p)
+	take = t->bitCount - p;
+    }
+    if (take > 64 - bitWindowCount)
+      take = 64 - bitWindowCount;
+
+    w &= ~0ULL << (64 - take);
+    bitWindow |= w >> bitWindowCount;
+    bitWindowCount += take;
+    p += take;
+    if (p >= t->bitCount)
+      p = 0;
+  }
+}
+
+// The next `count` (1-32) raw bits of the track, first bit in the
+// MSB, without moving the head.
+uint32_t Woz::peekBits(uint8_t datatrack, uint8_t count)
+{
+  if (!seekBitWindow(datatrack))
+    return 0;
+  if (bitWindowCount < count)
+    fillBitWindow(datatrack);
+  return bitWindow >> (64 - count);
+}
+
+// Move the head past `count` (1-32) bits, wrapping at bitCount.
+void Woz::consumeBits(uint8_t datatrack, uint8_t count)
+{
+  if (!seekBitWindow(datatrack))
+    return;
+  if (bitWindowCount < count)
+    fillBitWindow(datatrack);
+
+  bitWindow <<= count;
+  bitWindowCount -= count;
+
+  trackBitCounter += count;
+  while (trackBitCounter >= tracks[datatrack].bitCount) {
+    trackBitCounter -= tracks[datatrack].bitCount;
+    trackLoopCounter++;
+  }
+  trackPointer = trackBitCounter / 8;
+  trackBitIdx = 0x80 >> (trackBitCounter & 7);
+  trackByte = tracks[datatrack].trackData[trackPointer];
+  bitWindowPos = trackBitCounter;
+}
+
+// Raw bit `pos` of a data track (no MC3470 processing).
+static inline uint8_t trackBitAt(const uint8_t *data, uint32_t pos)
+{
+  return (data[pos >> 3] >> (7 - (pos & 7))) & 1;
+}
+
+const uint8_t *Woz::trackBits(uint8_t datatrack, uint32_t *bitCount)
+{
+  if (datatrack >= 160 || !tracks[datatrack].trackData)
+    return NULL;
+  *bitCount = tracks[datatrack].bitCount;
+  return tracks[datatrack].trackData;
+}
+
+bool Woz::headBitPosition(uint8_t datatrack, uint32_t *pos)
+{
+  if (datatrack >= 160 || trackByteFromDataTrack != datatrack ||
+      !tracks[datatrack].trackData || tracks[datatrack].bitCount < 4)
+    return false;
+
+  // The MC3470 window has to hold this track's own last four bits;
+  // right after a track switch it still has the old track's.
+  uint32_t bc = tracks[datatrack].bitCount;
+  uint8_t expect = 0;
+  for (uint32_t i = 4; i > 0; i--) {
+    expect = (expect << 1) |
+      trackBitAt(tracks[datatrack].trackData, (trackBitCounter + bc - i) % bc);
+  }
+  if ((headWindow & 0x0f) != expect)
+    return false;
+
+  *pos = trackBitCounter;
+  return true;
+}
+
+void Woz::skipBits(uint8_t datatrack, uint64_t count)
+{
+  if (!seekBitWindow(datatrack) || !count)
+    return;
+
+  uint32_t bc = tracks[datatrack].bitCount;
+  trackLoopCounter += (trackBitCounter + count) / bc;
+  trackBitCounter = (trackBitCounter + count) % bc;
+  trackPointer = trackBitCounter / 8;
+  trackBitIdx = 0x80 >> (trackBitCounter & 7);
+  trackByte = tracks[datatrack].trackData[trackPointer];
+  bitWindowCount = 0;
+
+  // Leave the MC3470 window as if we'd read our way here.
+  uint8_t n = count < 8 ? count : 8;
+  for (uint32_t i = n; i > 0; i--) {
+    headWindow = (headWindow << 1) |
+      trackBitAt(tracks[datatrack].trackData, (trackBitCounter + bc - i) % bc);
+  }
+}
+
+uint8_t Woz::getNextWozBit(uint8_t datatrack)
+{
+  uint8_t ret = peekBits(datatrack, 1);
+  consumeBits(datatrack, 1);
   return ret;
 }
 
@@ -220,29 +528,43 @@ void Woz::advanceBitStream(uint8_t datatrack)
   }
 }
 
+void Woz::setFakeBitSeed(uint64_t seed)
+{
+  fakeBitSeedValue = seed;
+  // One splitmix64 step, so nearby seeds (drive 0 and 1) start far
+  // apart; xorshift just has to avoid an all-zero state.
+  uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+  fakeBitState = z ? z : WOZ_FAKEBIT_SEED;
+  fakeBits = 0;
+  fakeBitsLeft = 0;
+}
+
+uint64_t Woz::nextFakeBitWord()
+{
+  // xorshift64*
+  fakeBitState ^= fakeBitState >> 12;
+  fakeBitState ^= fakeBitState << 25;
+  fakeBitState ^= fakeBitState >> 27;
+  return fakeBitState * 0x2545F4914F6CDD1DULL;
+}
+
 uint8_t Woz::fakeBit()
 {
-  // WOZ reference recommends roughly 30% ones. AND three independent
-  // 50/50 samples to get ~12.5% ones? That's too sparse. AND two
-  // gives 25%; OR of (AND of 2) with a 1/8 extra gets close to 30%
-  // without needing floating point. Simpler approach: keep the
-  // random buffer approach, but only count a bit as 1 if it and a
-  // second independent bit are both set — that gives 25%. Close
-  // enough; Print Shop just needs "long runs of fake bits don't
-  // consistently produce nibbles".
-  if (randPtr == 0) {
-    randPtr = 0x80;
-    randData = (uint8_t) ((float)256 * rand() / (RAND_MAX + 1.0));
-  }
-  uint8_t a = (randData & randPtr) ? 1 : 0;
-  randPtr >>= 1;
-  if (randPtr == 0) {
-    randPtr = 0x80;
-    randData = (uint8_t) ((float)256 * rand() / (RAND_MAX + 1.0));
-  }
-  uint8_t b = (randData & randPtr) ? 1 : 0;
-  randPtr >>= 1;
-  return a & b;
+  // WOZ reference recommends roughly 30% ones. The AND of two
+  // independent words gives 25%, which is close enough; Print Shop
+  // just needs "long runs of fake bits don't consistently produce
+  // nibbles". Drawn 64 at a time.
+  if (fakeBitsLeft == 0) {
+    fakeBits = nextFakeBitWord() & nextFakeBitWord();
+    fakeBitsLeft = 64;
+  }
+  uint8_t ret = fakeBits & 1;
+  fakeBits >>= 1;
+  fakeBitsLeft--;
+  return ret;
 }
 
 void Woz::dumpTrackState(uint8_t datatrack)
@@ -289,6 +611,31 @@ uint8_t Woz::nextDiskBit(uint8_t datatrack)
   return fakeBit();
 }
 
+// Same MC3470 model as nextDiskBit, for `count` (1-8) bits at a
+// time. The raw bits come out of the bit window in one go; only the
+// 4-bit window check runs per bit.
+uint8_t Woz::nextDiskBits(uint8_t datatrack, uint8_t count)
+{
+  if (!tracks[datatrack].trackData) {
+    fprintf(stderr, "ERROR: nextDiskBits was called without the track being cached, and it can't possibly know which QT to load it from\n");
+    return 0;
+  }
+
+  uint8_t raw = peekBits(datatrack, count);
+  consumeBits(datatrack, count);
+  uint8_t ret = 0;
+  for (int8_t i=count-1; i>=0; i--) {
+    headWindow = (headWindow << 1) | ((raw >> i) & 1);
+    ret <<= 1;
+    if ((headWindow & 0x0f) != 0x00) {
+      ret |= (headWindow & 0x02) >> 1;
+    } else {
+      ret |= fakeBit();
+    }
+  }
+  return ret;
+}
+
 uint8_t Woz::nextDiskByte(uint8_t datatrack)
 {
   if (!tracks[datatrack].trackData) {
@@ -296,83 +643,96 @@ uint8_t Woz::nextDiskByte(uint8_t datatrack)
     return 0;
   }
 
+  // nextDiskBit's MC3470 model, but with the raw bits peeked 32 at a
+  // time and only the ones that made it into the byte consumed.
   uint8_t d = 0;
   while ((d & 0x80) == 0) {
-    d <<= 1;
-    d |= nextDiskBit(datatrack);
+    uint32_t raw = peekBits(datatrack, 32);
+    uint8_t used = 0;
+    while (used < 32 && (d & 0x80) == 0) {
+      headWindow = (headWindow << 1) | (raw >> 31);
+      raw <<= 1;
+      used++;
+      d <<= 1;
+      if ((headWindow & 0x0f) != 0x00) {
+	d |= (headWindow & 0x02) >> 1;
+      } else {
+	d |= fakeBit();
+      }
+    }
+    consumeBits(datatrack, used);
   }
   return d;
 }
 
-static bool write8(int fd, uint8_t v)
+WozBuffer::WozBuffer()
 {
-  if (write(fd, &v, 1) != 1)
-    return false;
-  return true;
+  data = NULL;
+  size = len = pos = 0;
 }
 
-static bool write16(int fd, uint16_t v)
+WozBuffer::~WozBuffer()
 {
-  if (!write8(fd, v & 0xFF))
-    return false;
-  v >>= 8;
-  if (!write8(fd, v & 0xFF))
+  if (data)
+    free(data);
+}
+
+bool WozBuffer::reserve(uint32_t end)
+{
+  if (end <= size)
+    return true;
+  uint32_t newSize = size ? size : WOZBUFFER_INITIAL;
+  while (newSize < end)
+    newSize *= 2;
+  uint8_t *p = (uint8_t *)realloc(data, newSize);
+  if (!p) {
+    fprintf(stderr, "ERROR: failed to grow WOZ output buffer\n");
     return false;
+  }
+  data = p;
+  size = newSize;
   return true;
 }
 
-static bool write32(int fd, uint32_t v)
+bool WozBuffer::seek(uint32_t newPos)
 {
-  for (int i=0; i<4; i++) {
-    if (!write8(fd, v&0xFF))
+  if (newPos > len) {
+    if (!reserve(newPos))
       return false;
-    v >>= 8;
+    memset(&data[len], 0, newPos - len);
+    len = newPos;
   }
+  pos = newPos;
   return true;
 }
 
-static bool read8(int fd, uint8_t *toWhere)
+bool WozBuffer::putBytes(const void *buf, uint32_t count)
 {
-  uint8_t r;
-  if (read(fd, &r, 1) != 1)
+  if (!reserve(pos + count))
     return false;
-  *toWhere = r;
-
+  memcpy(&data[pos], buf, count);
+  pos += count;
+  if (pos > len)
+    len = pos;
   return true;
 }
 
-static bool read16(int fd, uint16_t *toWhere)
+bool WozBuffer::put8(uint8_t v)
 {
-  uint16_t ret = 0;
-  for (int i=0; i<2; i++) {
-    uint8_t r;
-    if (!read8(fd, &r)) {
-      return false;
-    }
-    ret >>= 8;
-    ret |= (r<<8);
-  }
-
-  *toWhere = ret;
-
-  return true;
+  return putBytes(&v, 1);
 }
 
-static bool read32(int fd, uint32_t *toWhere)
+bool WozBuffer::put16(uint16_t v)
 {
-  uint32_t ret = 0;
-  for (int i=0; i<4; i++) {
-    uint8_t r;
-    if (!read8(fd, &r)) {
-      return false;
-    }
-    ret >>= 8;
-    ret |= (r<<24);
-  }
-
-  *toWhere = ret;
+  uint8_t b[2] = { (uint8_t)v, (uint8_t)(v >> 8) };
+  return putBytes(b, 2);
+}
 
-  return true;
+bool WozBuffer::put32(uint32_t v)
+{
+  uint8_t b[4] = { (uint8_t)v, (uint8_t)(v >> 8),
+                   (uint8_t)(v >> 16), (uint8_t)(v >> 24) };
+  return putBytes(b, 4);
 }
 
 bool Woz::writeFile(const char *filename, uint8_t forceType)
@@ -445,74 +805,51 @@ bool Woz::writeWozFile(const char *filename, uint8_t subtype)
 bool Woz::writeWozFile(int fdout, uint8_t subtype)
 {
   int version = 2; // FIXME figure out from subtype
-  bool retval = false;
-  uint32_t tmp32; // scratch 32-bit value
-  off_t curpos; // used in macros to dynamically tell what size the chunks are
-  off_t crcPos = 0, endPos = 0;
-  uint32_t crcDataSize = 0;
-  uint8_t *crcData = NULL;
-  (void)crcPos; (void)endPos; (void)crcDataSize; (void)crcData;
-
+  uint32_t curpos; // used in macros to dynamically tell what size the chunks are
+  WozBuffer out;
 
   if (version > 2 || !version) {
     fprintf(stderr, "ERROR: version must be 1 or 2\n");
-    goto done;
-  }
-  lseek(fdout, 0, SEEK_SET);
-  
-  // header
-  if (version == 1) {
-    tmp32 = 0x315A4F57;
-  } else {
-    tmp32 = 0x325A4F57;
-  }
-  if (!write32(fdout, tmp32)) {
-    fprintf(stderr, "ERROR: failed to write\n");
-    goto done;
-  }
-  tmp32 = 0x0A0D0AFF;
-  if (!write32(fdout, tmp32)) {
-    fprintf(stderr, "ERROR: failed to write\n");
-    goto done;
+    return false;
   }
 
-  // We'll come back and write the checksum later
-  crcPos = lseek(fdout, 0, SEEK_CUR);
-  tmp32 = 0;
-  if (!write32(fdout, tmp32)) {
-    fprintf(stderr, "ERROR: failed to write\n");
-    goto done;
+  // header
+  if (!out.put32(version == 1 ? 0x315A4F57 : 0x325A4F57) ||
+      !out.put32(0x0A0D0AFF) ||
+      !out.put32(0)) { // We'll come back and write the checksum later
+    return false;
   }
 
-  PREP_SECTION(fdout, 0x4F464E49); // 'INFO'
-  if (!writeInfoChunk(version, fdout)) {
+  PREP_SECTION(out, 0x4F464E49); // 'INFO'
+  if (!writeInfoChunk(version, out)) {
     fprintf(stderr, "ERROR: failed to write INFO chunk\n");
-    goto done;
+    return false;
   }
-  END_SECTION(fdout);
+  END_SECTION(out);
 
-  PREP_SECTION(fdout, 0x50414D54); // 'TMAP'
-  if (!writeTMAPChunk(version, fdout)) {
+  PREP_SECTION(out, 0x50414D54); // 'TMAP'
+  if (!writeTMAPChunk(version, out)) {
     fprintf(stderr, "ERROR: failed to write TMAP chunk\n");
-    goto done;
+    return false;
   }
-  END_SECTION(fdout);
+  END_SECTION(out);
 
-  PREP_SECTION(fdout, 0x534B5254); // 'TRKS'
-  if (!writeTRKSChunk(version, fdout)) {
+  PREP_SECTION(out, 0x534B5254); // 'TRKS'
+  uint32_t trksPos = curpos;
+  if (!writeTRKSChunk(version, out)) {
     fprintf(stderr, "ERROR: failed to write TRKS chunk\n");
-    goto done;
+    return false;
   }
-  END_SECTION(fdout);
+  END_SECTION(out);
 
   // Write the metadata if we have any
   if (metaData) {
-    PREP_SECTION(fdout, 0x4154454D); // 'META'
-    if ((size_t)write(fdout, metaData, strlen(metaData)) != strlen(metaData)) {
+    PREP_SECTION(out, 0x4154454D); // 'META'
+    if (!out.putBytes(metaData, strlen(metaData))) {
       fprintf(stderr, "ERROR: failed to write META chunk\n");
-      goto done;
+      return false;
     }
-    END_SECTION(fdout);
+    END_SECTION(out);
   }
 
   // FIXME: missing the WRIT chunk, if it exists
@@ -520,47 +857,27 @@ bool Woz::writeWozFile(int fdout, uint8_t subtype)
   // Fix up the checksum. Optional; the spec says it can be 0 meaning
   // "don't verify"
 #ifndef SKIPCHECKSUM
-  endPos = lseek(fdout, 0, SEEK_CUR);
-  crcDataSize = endPos-crcPos-4;
-  crcData = (uint8_t *)malloc(crcDataSize);
-  if (!crcData) {
-    fprintf(stderr, "ERROR: failed to malloc crc data chunk\n");
-    goto done;
-  }
-    
-  // Read the data in for checksumming
-  if (lseek(fdout, crcPos+4, SEEK_SET) == -1) {
-    fprintf(stderr, "ERROR: failed to fseek to crcPos+4 (0x%llX)\n", crcPos+4);
-    goto done;
-  }
+  out.seek(8);
+  out.put32(compute_crc_32(out.bytes() + 12, out.length() - 12));
+#endif
 
-  tmp32 = read(fdout, crcData, crcDataSize);
-  if (tmp32 != crcDataSize) {
-    fprintf(stderr, "ERROR: failed to read in data for checksum [read %lu, wanted %lu]\n", (unsigned long)tmp32, (unsigned long)crcDataSize);
-    goto done;
+  // (The filemanager can't seek in an empty file, and doesn't need to)
+  lseek(fdout, 0, SEEK_SET);
+  if ((uint32_t)write(fdout, out.bytes(), out.length()) != out.length()) {
+    fprintf(stderr, "ERROR: failed to write WOZ image\n");
+    return false;
   }
-    
-  tmp32 = compute_crc_32(crcData, crcDataSize);
-  // Write it back out
-  lseek(fdout, crcPos, SEEK_SET);
-  if (!write32(fdout, tmp32)) {
-    fprintf(stderr, "ERROR: failed to write CRC\n");
-    goto done;
+
+  if (fdout == fd) {
+    trksDataPos = trksPos;
+    wozImageEnd = out.length();
   }
-#endif
-  
+
   for (int i=0; i<160; i++) {
     tracks[i].dirty = false;
   }
 
-  
-  retval = true;
-
- done:
-  if (crcData)
-    free(crcData);
-
-  return retval;
+  return true;
 }
 
 bool Woz::writeDskFile(const char *filename, uint8_t subtype)
@@ -671,23 +988,42 @@ void Woz::_initInfo()
   }
 }
 
+// nibblizeTrack(), through the host's nibble cache if there is one
+static uint32_t nibblizeDskTrack(uint8_t *out, const uint8_t sectorData[256*16],
+                                 uint8_t subtype, uint8_t phystrack)
+{
+  uint32_t sizeInBits;
+#ifndef TEENSYDUINO
+  if (nibCacheLoad(sectorData, subtype, phystrack, out, &sizeInBits))
+    return sizeInBits;
+#endif
+  sizeInBits = nibblizeTrack(out, sectorData, subtype, phystrack);
+#ifndef TEENSYDUINO
+  nibCacheStore(sectorData, subtype, phystrack, out, sizeInBits);
+#endif
+  return sizeInBits;
+}
+
 // Only used if we didn't preload a data track; the load we perform
 // differs based on the image type we originally read from
 bool Woz::loadMissingTrackFromImage(uint8_t datatrack)
 {
-  // If we're going to malloc a new one, then find all the other ones
-  // that might be malloc'd and purge them if we're
-  // autoFlushTrackData==true (trying to limit memory use)
+  // Track buffers may be about to be freed or replaced.
+  bitWindowCount = 0;
+
+  // If we're going to malloc a new one, make room for it in the
+  // track cache first (trying to limit memory use)
   if (autoFlushTrackData == true) {
-    for (int i=0; i<160; i++) {
-      // Don't flush any tracks that are dirty
-      if (tracks[i].trackData && !tracks[i].dirty) {
-        free(tracks[i].trackData);
-        tracks[i].trackData = NULL;
-      }
-    }
+    trackCacheMisses++;
+    evictTracksFor(trackBufferSize(datatrack));
   }
 
+#ifndef TEENSYDUINO
+  // A track that's been written lives in the overlay, not the image
+  if (overlay && overlay->has(datatrack))
+    return loadOverlayTrack(datatrack);
+#endif
+
   // Based on the source image type, load the data track we're looking for
   if (imageType == T_WOZ) {
     // If the source was WOZ, just load the datatrack directly
@@ -706,9 +1042,7 @@ bool Woz::loadMissingTrackFromImage(uint8_t datatrack)
     
     static uint8_t sectorData[256*16];
 
-    lseek(fd, 256*16*phystrack, SEEK_SET);
-
-    if (read(fd, sectorData, 256*16) != 256*16) {
+    if (!readImage(256*16*phystrack, sectorData, 256*16)) {
       fprintf(stderr, "Failed to read sector\n");
       return false;
     }
@@ -720,7 +1054,7 @@ bool Woz::loadMissingTrackFromImage(uint8_t datatrack)
     }
     tracks[datatrack].startingBlock = STARTBLOCK + 13*phystrack;
     tracks[datatrack].blockCount = 13;
-    uint32_t sizeInBits = nibblizeTrack(tracks[datatrack].trackData, sectorData, imageType, phystrack);
+    uint32_t sizeInBits = nibblizeDskTrack(tracks[datatrack].trackData, sectorData, imageType, phystrack);
     tracks[datatrack].bitCount = sizeInBits; // ... reality.
 
     return true;
@@ -740,8 +1074,7 @@ bool Woz::loadMissingTrackFromImage(uint8_t datatrack)
       return false;
     }
 
-    lseek(fd, NIBTRACKSIZE * phystrack, SEEK_SET);
-    read(fd, tracks[datatrack].trackData, NIBTRACKSIZE);
+    readImage(NIBTRACKSIZE * phystrack, tracks[datatrack].trackData, NIBTRACKSIZE);
       // FIXME: no error checking
     
     tracks[datatrack].startingBlock = STARTBLOCK + 13*phystrack;
@@ -761,18 +1094,118 @@ bool Woz::loadMissingTrackFromImage(uint8_t datatrack)
   return false;
 }
 
+bool Woz::useTrack(uint8_t datatrack)
+{
+  if (!tracks[datatrack].trackData) {
+    if (!loadMissingTrackFromImage(datatrack))
+      return false;
+  } else if (autoFlushTrackData) {
+    trackCacheHits++;
+  }
+  // Only cached (lazily loaded) tracks need the shared clock; leaving
+  // it alone otherwise means preloaded images share nothing between
+  // threads.
+  if (autoFlushTrackData)
+    tracks[datatrack].lastUse = ++trackCacheClock;
+  return true;
+}
+
+// What loading datatrack costs the track cache, in bytes
+uint32_t Woz::trackBufferSize(uint8_t datatrack)
+{
+  if (imageType == T_DSK || imageType == T_PO || imageType == T_NIB)
+    return NIBTRACKSIZE;
+  if (di.version == 1)
+    return (tracks[datatrack].bitCount + 7) / 8;
+  return tracks[datatrack].blockCount * 512;
+}
+
+void Woz::joinTrackCache()
+{
+  if (inTrackCache)
+    return;
+  nextInTrackCache = trackCacheImages;
+  trackCacheImages = this;
+  inTrackCache = true;
+}
+
+void Woz::leaveTrackCache()
+{
+  if (!inTrackCache)
+    return;
+  for (Woz **p = &trackCacheImages; *p; p = &(*p)->nextInTrackCache) {
+    if (*p == this) {
+      *p = nextInTrackCache;
+      break;
+    }
+  }
+  inTrackCache = false;
+}
+
+// Free the least recently used tracks, from any lazily loaded image,
+// until another `bytes` fits in the budget or nothing else can go.
+void Woz::evictTracksFor(uint32_t bytes)
+{
+  while (trackCacheBytes() + bytes > trackCacheBudget) {
+    Woz *victim = NULL;
+    uint8_t victimTrack = 0;
+    for (Woz *w = trackCacheImages; w; w = w->nextInTrackCache) {
+      for (int i=0; i<160; i++) {
+        const trackInfo &t = w->tracks[i];
+        if (!t.trackData || t.dirty || t.mapped ||
+            i == w->trackByteFromDataTrack)
+          continue;
+        if (!victim || t.lastUse < victim->tracks[victimTrack].lastUse) {
+          victim = w;
+          victimTrack = i;
+        }
+      }
+    }
+    if (!victim)
+      return;
+    free(victim->tracks[victimTrack].trackData);
+    victim->tracks[victimTrack].trackData = NULL;
+    victim->bitWindowCount = 0;
+  }
+}
+
+void Woz::setTrackCacheBudget(uint32_t bytes)
+{
+  trackCacheBudget = bytes;
+  evictTracksFor(0);
+}
+
+uint32_t Woz::trackCacheBytes()
+{
+  uint32_t total = 0;
+  for (Woz *w = trackCacheImages; w; w = w->nextInTrackCache) {
+    for (int i=0; i<160; i++) {
+      if (w->tracks[i].trackData && !w->tracks[i].mapped)
+        total += w->trackBufferSize(i);
+    }
+  }
+  return total;
+}
+
+void Woz::trackCacheStats(uint32_t *hits, uint32_t *misses)
+{
+  *hits = trackCacheHits;
+  *misses = trackCacheMisses;
+}
+
+void Woz::resetTrackCacheStats()
+{
+  trackCacheHits = trackCacheMisses = 0;
+}
+
 bool Woz::readDskFile(const char *filename, bool preloadTracks, uint8_t subtype)
 {
   bool retval = false;
   autoFlushTrackData = !preloadTracks;
   imageType = subtype;
 
-  if (fd != -1) close(fd);
-  fd = open(filename, O_RDWR, S_IRUSR|S_IWUSR);
-  if (fd == -1) {
-    perror("Unable to open input file");
+  if (!openImage(filename))
     goto done;
-  }
 
   _initInfo();
 
@@ -780,9 +1213,8 @@ bool Woz::readDskFile(const char *filename, bool preloadTracks, uint8_t subtype)
   if (preloadTracks) {
     uint8_t sectorData[256*16];
     for (int phystrack=0; phystrack<35; phystrack++) {
-      uint32_t bytesRead = read(fd, sectorData, 256*16);
-      if (bytesRead != 256*16) {
-	fprintf(stderr, "Failed to read DSK data; got %lu bytes, wanted %d\n", (unsigned long)bytesRead, 256);
+      if (!readImage(256*16*phystrack, sectorData, 256*16)) {
+	fprintf(stderr, "Failed to read DSK data for track %d\n", phystrack);
 	goto done;
       }
       uint8_t datatrack = quarterTrackMap[phystrack*4];
@@ -793,7 +1225,7 @@ bool Woz::readDskFile(const char *filename, bool preloadTracks, uint8_t subtype)
       }
       tracks[datatrack].startingBlock = STARTBLOCK + 13*datatrack;
       tracks[datatrack].blockCount = 13;
-      uint32_t sizeInBits = nibblizeTrack(tracks[datatrack].trackData, sectorData, subtype, phystrack);
+      uint32_t sizeInBits = nibblizeDskTrack(tracks[datatrack].trackData, sectorData, subtype, phystrack);
       tracks[datatrack].bitCount = sizeInBits; // ... reality.
     }
   }
@@ -817,6 +1249,40 @@ bool Woz::readHdvFile(const char *filename)
   // that higher layers (ProdosSpector) read blocks out of directly.
   imageType = T_HDV;
   autoFlushTrackData = false;
+  releaseHdvData();
+
+  if (decodedImage) {
+    if (decodedSize == 0 || (decodedSize % 512) != 0) {
+      fprintf(stderr, "HDV image '%s' has a bad size (%u bytes)\n",
+              filename, decodedSize);
+      return false;
+    }
+    // The decoded buffer becomes the HDV buffer
+    hdvData = decodedImage;
+    hdvByteSize = decodedSize;
+    decodedImage = NULL;
+    decodedSize = 0;
+    _initInfo();
+    di.diskType = 1;
+    return true;
+  }
+
+#ifndef TEENSYDUINO
+  // ... or on the host, map it copy-on-write and let the kernel page
+  // in whatever gets used.
+  uint32_t mappedSize;
+  uint8_t *mapped = mapImageFileWritable(filename, &mappedSize, false);
+  if (mapped && (mappedSize % 512) == 0) {
+    hdvData = mapped;
+    hdvByteSize = mappedSize;
+    hdvMapped = true;
+    _initInfo();
+    di.diskType = 1;
+    return true;
+  }
+  if (mapped)
+    unmapImageFile(mapped, mappedSize);
+#endif
 
   if (fd != -1) close(fd);
   fd = open(filename, O_RDONLY, S_IRUSR);
@@ -837,7 +1303,6 @@ bool Woz::readHdvFile(const char *filename)
     return false;
   }
 
-  if (hdvData) { free(hdvData); hdvData = NULL; }
   hdvByteSize = (uint32_t)st.st_size;
   hdvData = (uint8_t *)malloc(hdvByteSize);
   if (!hdvData) {
@@ -866,7 +1331,18 @@ bool Woz::writeHdvFile(const char *filename)
     fprintf(stderr, "No HDV buffer to write\n");
     return false;
   }
-  int fdout = open(filename, O_TRUNC|O_CREAT|O_WRONLY, S_IRUSR|S_IWUSR);
+  // A mapped image may be the file we're about to replace, and
+  // truncating it would pull the pages out from under us. Write a new
+  // file next to it and rename that into place instead.
+  const char *outname = filename;
+#ifndef TEENSYDUINO
+  char tmpname[4096];
+  if (hdvMapped) {
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+    outname = tmpname;
+  }
+#endif
+  int fdout = open(outname, O_TRUNC|O_CREAT|O_WRONLY, S_IRUSR|S_IWUSR);
   if (fdout == -1) {
     perror("Unable to open output HDV file");
     return false;
@@ -878,20 +1354,37 @@ bool Woz::writeHdvFile(const char *filename)
             wrote, hdvByteSize);
     return false;
   }
+#ifndef TEENSYDUINO
+  if (hdvMapped && rename(outname, filename) != 0) {
+    perror("Unable to replace HDV file");
+    return false;
+  }
+#endif
   return true;
 }
 
+void Woz::releaseHdvData()
+{
+  if (!hdvData)
+    return;
+#ifndef TEENSYDUINO
+  if (hdvMapped)
+    unmapImageFile(hdvData, hdvByteSize);
+  else
+#endif
+    free(hdvData);
+  hdvData = NULL;
+  hdvByteSize = 0;
+  hdvMapped = false;
+}
+
 bool Woz::readNibFile(const char *filename, bool preloadTracks)
 {
   autoFlushTrackData = !preloadTracks;
   imageType = T_NIB;
 
-  if (fd != -1) close(fd);
-  fd = open(filename, O_RDWR, S_IRUSR|S_IWUSR);
-  if (fd == -1) {
-    perror("Unable to open input file");
+  if (!openImage(filename))
     return false;
-  }
   
   _initInfo();
 
@@ -899,9 +1392,8 @@ bool Woz::readNibFile(const char *filename, bool preloadTracks)
   if (preloadTracks) {
     nibSector nibData[16];
     for (int phystrack=0; phystrack<35; phystrack++) {
-      uint32_t bytesRead = read(fd, nibData, NIBTRACKSIZE);
-      if (bytesRead != NIBTRACKSIZE) {
-	printf("Failed to read NIB data; got %lu bytes, wanted %d\n", (unsigned long)bytesRead, NIBTRACKSIZE);
+      if (!readImage(NIBTRACKSIZE*phystrack, nibData, NIBTRACKSIZE)) {
+	printf("Failed to read NIB data for track %d\n", phystrack);
 	return false;
       }
       uint8_t datatrack = quarterTrackMap[phystrack * 4];
@@ -930,17 +1422,29 @@ bool Woz::readWozFile(const char *filename, bool preloadTracks)
 {
   imageType = T_WOZ;
   autoFlushTrackData = !preloadTracks;
+  trksDataPos = wozImageEnd = 0;
 
-  if (fd != -1) close(fd);
-  fd = open(filename, O_RDWR, S_IRUSR|S_IWUSR);
-  if (fd == -1) {
-    perror("Unable to open input file");
+  if (!openImage(filename))
     return false;
+
+  releaseMapping();
+  if (decodedImage) {
+    // A decoded image is parsed (and its tracks used) the same way
+    // as a mapped one
+    mapBase = decodedImage;
+    mapSize = decodedSize;
   }
+#ifndef TEENSYDUINO
+  else {
+    mapBase = mapImageFile(filename, &mapSize);
+  }
+#endif
+  parsePos = 0;
+  parseBufPos = parseBufLen = 0;
 
   // Header
   uint32_t h;
-  read32(fd, &h);
+  parse32(&h);
   if (h == 0x325A4F57 || h == 0x315A4F57) {
     if (verbose) {
       printf("WOZ%c disk image\n", (int)((h & 0xFF000000)>>24));
@@ -953,7 +1457,7 @@ bool Woz::readWozFile(const char *filename, bool preloadTracks)
   }
 
   uint32_t tmp;
-  if (!read32(fd, &tmp)) {
+  if (!parse32(&tmp)) {
     printf("Read failure\n");
     if (preloadTracks && fd != -1)
       close(fd);
@@ -966,7 +1470,7 @@ bool Woz::readWozFile(const char *filename, bool preloadTracks)
     return false;
   }
   uint32_t crc32;
-  read32(fd, &crc32);
+  parse32(&crc32);
   // If CRC is set, then check it
   if (crc32) {
     // FIXME: check CRC
@@ -983,16 +1487,16 @@ bool Woz::readWozFile(const char *filename, bool preloadTracks)
 #define cTRKS 4
 
   while (1) {
-    if (lseek(fd, fpos, SEEK_SET) == -1) {
+    if (!parseSeek(fpos)) {
       break;
     }
 
     uint32_t chunkType;
-    if (!read32(fd, &chunkType)) {
+    if (!parse32(&chunkType)) {
       break;
     }
     uint32_t chunkDataSize;
-    read32(fd, &chunkDataSize);
+    parse32(&chunkDataSize);
     if ((int32_t)chunkDataSize < 0) {
       printf("ERROR: data size < 0?\n");
       exit(1);
@@ -1004,7 +1508,7 @@ bool Woz::readWozFile(const char *filename, bool preloadTracks)
     case 0x4F464E49: // 'INFO'
       if (verbose) {
 	printf("Reading INFO chunk starting at byte 0x%llX\n",
-	       (unsigned long long)lseek(fd, 0, SEEK_CUR));
+	       (unsigned long long)(fpos + 8));
       }
       isOk = parseInfoChunk(chunkDataSize);
       haveData |= cINFO;
@@ -1012,7 +1516,7 @@ bool Woz::readWozFile(const char *filename, bool preloadTracks)
     case 0x50414D54: // 'TMAP'
       if (verbose) {
 	printf("Reading TMAP chunk starting at byte 0x%llX\n",
-	       (unsigned long long)lseek(fd, 0, SEEK_CUR));
+	       (unsigned long long)(fpos + 8));
       }
       isOk = parseTMAPChunk(chunkDataSize);
       haveData |= cTMAP;
@@ -1020,15 +1524,16 @@ bool Woz::readWozFile(const char *filename, bool preloadTracks)
     case 0x534B5254: // 'TRKS'
       if (verbose) {
 	printf("Reading TRKS chunk starting at byte 0x%llX\n",
-	       (unsigned long long) lseek(fd, 0, SEEK_CUR));
+	       (unsigned long long)(fpos + 8));
       }
+      trksDataPos = fpos + 8;
       isOk = parseTRKSChunk(chunkDataSize);
       haveData |= cTRKS;
       break;
     case 0x4154454D: // 'META'
       if (verbose) {
 	printf("Reading META chunk starting at byte 0x%llX\n",
-	       (unsigned long long) lseek(fd, 0, SEEK_CUR));
+	       (unsigned long long)(fpos + 8));
       }	  
       isOk = parseMetaChunk(chunkDataSize);
       break;
@@ -1052,6 +1557,7 @@ bool Woz::readWozFile(const char *filename, bool preloadTracks)
     }
     fpos += chunkDataSize + 8; // 8 bytes for the ChunkID and the ChunkSize
   }
+  wozImageEnd = fpos;
 
   if (haveData != 0x07) {
     printf("ERROR: missing one or more critical sections\n");
@@ -1061,8 +1567,9 @@ bool Woz::readWozFile(const char *filename, bool preloadTracks)
   // For a Woz file, we need to read *every* quarter-track; and if we've
   // already got the target track's data, we don't need to re-read it.
   // And if we're not preloading the tracks, then we'll wind up loading
-  // them on demand later.
-  if (preloadTracks) {
+  // them on demand later. Tracks in a mapped image cost nothing to
+  // "load", so they're always all there.
+  if (preloadTracks || mapBase) {
     for (int i=0; i<160; i++) {
       if (!readWozDataTrack(i)) {
 	printf("Failed to read Woz datatrack %d\n", i);
@@ -1086,11 +1593,38 @@ bool Woz::readWozFile(const char *filename, bool preloadTracks)
 
 bool Woz::readFile(const char *filename, bool preloadTracks, uint8_t forceType)
 {
+  if (imagePath)
+    free(imagePath);
+  imagePath = (char *)malloc(strlen(filename)+1);
+  if (imagePath)
+    strcpy(imagePath, filename);
+
+  // The type comes from the name of the image; for a compressed
+  // image, that's the name of the image inside it.
+  const char *typeName = filename;
+  releaseImage();
+  readOnlyImage = false;
+  setFakeBitSeed(fakeBitSeedValue);
+#ifndef TEENSYDUINO
+  char innerName[256];
+  if (isCompressedImage(filename)) {
+    decodedImage = readCompressedImage(filename, &decodedSize, innerName, sizeof(innerName));
+    if (!decodedImage)
+      return false;
+    typeName = innerName;
+  }
+  // Images with an overlay are only ever read
+  char ovlName[4096];
+  bool useOverlay = overlayPathFor(filename, decodedImage != NULL,
+                                   ovlName, sizeof(ovlName));
+  readOnlyImage = useOverlay;
+#endif
+
   if (forceType == T_AUTO) {
     // Try to determine type from the file extension
-    const char *p = strrchr(filename, '.');
+    const char *p = strrchr(typeName, '.');
     if (!p) {
-      printf("Unable to determine file type of '%s'\n", filename);
+      printf("Unable to determine file type of '%s'\n", typeName);
       return false;
     }
     if (strcasecmp(p, ".woz") == 0) {
@@ -1107,7 +1641,7 @@ bool Woz::readFile(const char *filename, bool preloadTracks, uint8_t forceType)
                strcasecmp(p, ".img") == 0) {
       forceType = T_HDV;
     } else {
-      printf("Unable to determine file type of '%s'\n", filename);
+      printf("Unable to determine file type of '%s'\n", typeName);
       return false;
     }
   }
@@ -1117,7 +1651,12 @@ bool Woz::readFile(const char *filename, bool preloadTracks, uint8_t forceType)
   // raw-block path is used instead.
   if (forceType == T_PO || forceType == T_DSK) {
     struct stat st;
-    if (stat(filename, &st) == 0 && st.st_size > 35 * 16 * 256) {
+    if (decodedImage) {
+      st.st_size = decodedSize;
+    } else if (stat(filename, &st) != 0) {
+      st.st_size = 0;
+    }
+    if (st.st_size > 35 * 16 * 256) {
       if (verbose) {
         printf("Input file is larger than a floppy (%lld bytes); "
                "treating as ProDOS hard-disk image.\n",
@@ -1127,20 +1666,140 @@ bool Woz::readFile(const char *filename, bool preloadTracks, uint8_t forceType)
     }
   }
 
+  bool ret;
   switch (forceType) {
   case T_WOZ:
-    return readWozFile(filename, preloadTracks);
+    ret = readWozFile(filename, preloadTracks);
+    break;
   case T_DSK:
   case T_PO:
-    return readDskFile(filename, preloadTracks, forceType);
+    ret = readDskFile(filename, preloadTracks, forceType);
+    break;
   case T_NIB:
-    return readNibFile(filename, preloadTracks);
+    ret = readNibFile(filename, preloadTracks);
+    break;
   case T_HDV:
-    return readHdvFile(filename);
+    ret = readHdvFile(filename);
+    break;
   default:
     printf("Unknown disk type; unable to read\n");
     return false;
   }
+
+  if (ret && autoFlushTrackData)
+    joinTrackCache();
+  else
+    leaveTrackCache();
+
+#ifndef TEENSYDUINO
+  // Changed tracks go to the overlay instead of the image, and come
+  // back from it here.
+  if (ret && useOverlay && forceType != T_HDV)
+    ret = openOverlay(ovlName);
+#endif
+  return ret;
+}
+
+// Chunk parsing reads through these: from the mapped image if we
+// have one, otherwise from fd.
+bool Woz::parse8(uint8_t *v)
+{
+  if (mapBase) {
+    if (parsePos >= mapSize)
+      return false;
+    *v = mapBase[parsePos++];
+    return true;
+  }
+
+  if (parsePos < parseBufPos || parsePos >= parseBufPos + parseBufLen) {
+    if (lseek(fd, parsePos, SEEK_SET) == -1)
+      return false;
+    int n = read(fd, parseBuf, sizeof(parseBuf));
+    if (n <= 0) {
+      // The filemanager won't do a short read at the end of the file
+      if (lseek(fd, parsePos, SEEK_SET) == -1 || read(fd, parseBuf, 1) != 1)
+        return false;
+      n = 1;
+    }
+    parseBufPos = parsePos;
+    parseBufLen = n;
+  }
+  *v = parseBuf[parsePos++ - parseBufPos];
+  return true;
+}
+
+bool Woz::parse16(uint16_t *v)
+{
+  uint8_t lo, hi;
+  if (!parse8(&lo) || !parse8(&hi))
+    return false;
+  *v = lo | (hi << 8);
+  return true;
+}
+
+bool Woz::parse32(uint32_t *v)
+{
+  uint16_t lo, hi;
+  if (!parse16(&lo) || !parse16(&hi))
+    return false;
+  *v = lo | ((uint32_t)hi << 16);
+  return true;
+}
+
+bool Woz::parseBytes(void *buf, uint32_t len)
+{
+  if (!mapBase) {
+    if (lseek(fd, parsePos, SEEK_SET) == -1 ||
+        (uint32_t)read(fd, buf, len) != len)
+      return false;
+    parsePos += len;
+    return true;
+  }
+  if (len > mapSize - parsePos)
+    return false;
+  memcpy(buf, mapBase + parsePos, len);
+  parsePos += len;
+  return true;
+}
+
+bool Woz::parseSeek(uint32_t pos)
+{
+  // Reads past the end fail, which is how the chunk loop finishes
+  if (mapBase && pos >= mapSize)
+    return false;
+  parsePos = pos;
+  return true;
+}
+
+void Woz::releaseMapping()
+{
+  for (int i=0; i<160; i++) {
+    if (tracks[i].mapped) {
+      tracks[i].trackData = NULL;
+      tracks[i].mapped = false;
+    }
+  }
+#ifndef TEENSYDUINO
+  if (mapBase != decodedImage)
+    unmapImageFile(mapBase, mapSize);
+#endif
+  mapBase = NULL;
+  mapSize = 0;
+}
+
+// Copy a mapped track into a buffer of its own so it can be written
+bool Woz::ownTrackData(uint8_t datatrack)
+{
+  uint32_t size = tracks[datatrack].blockCount * 512;
+  uint8_t *copy = (uint8_t *)malloc(size);
+  if (!copy) {
+    perror("Failed to alloc buf for track data");
+    return false;
+  }
+  memcpy(copy, tracks[datatrack].trackData, size);
+  tracks[datatrack].trackData = copy;
+  tracks[datatrack].mapped = false;
+  return true;
 }
 
 bool Woz::parseTRKSChunk(uint32_t chunkSize)
@@ -1149,11 +1808,11 @@ bool Woz::parseTRKSChunk(uint32_t chunkSize)
   // WOZ 1 uses the older packed-6656-byte format.
   if (di.version >= 2) {
     for (int i=0; i<160; i++) {
-      if (!read16(fd, &tracks[i].startingBlock))
+      if (!parse16(&tracks[i].startingBlock))
 	return false;
-      if (!read16(fd, &tracks[i].blockCount))
+      if (!parse16(&tracks[i].blockCount))
 	return false;
-      if (!read32(fd, &tracks[i].bitCount))
+      if (!parse32(&tracks[i].bitCount))
 	return false;
       tracks[i].startingByte = 0; // v1-specific
     }
@@ -1167,9 +1826,9 @@ bool Woz::parseTRKSChunk(uint32_t chunkSize)
     tracks[trackNumber].startingByte = trackNumber * 6656 + 256;
     tracks[trackNumber].startingBlock = 0; // v2-specific
     tracks[trackNumber].blockCount = 13;
-    lseek(fd, (trackNumber * 6656 + 256) + 6648, SEEK_SET);
+    parseSeek((trackNumber * 6656 + 256) + 6648);
     uint16_t numBits;
-    if (!read16(fd, &numBits)) {
+    if (!parse16(&numBits)) {
       return false;
     }
     if (verbose) {
@@ -1194,7 +1853,7 @@ bool Woz::parseTMAPChunk(uint32_t chunkSize)
   }
 
   for (int i=0; i<40*4; i++) {
-    if (!read8(fd, (uint8_t *)&quarterTrackMap[i]))
+    if (!parse8((uint8_t *)&quarterTrackMap[i]))
       return false;
     chunkSize--;
   }
@@ -1221,7 +1880,7 @@ bool Woz::parseInfoChunk(uint32_t chunkSize)
     return false;
   }
 
-  if (!read8(fd, &di.version))
+  if (!parse8(&di.version))
     return false;
   // Per the spec: "use >= when checking the INFO Version field. The INFO
   // chunk will always be upgraded in a safe way for older consumers."
@@ -1233,40 +1892,40 @@ bool Woz::parseInfoChunk(uint32_t chunkSize)
     return false;
   }
 
-  if (!read8(fd, &di.diskType))
+  if (!parse8(&di.diskType))
     return false;
   if (di.diskType != 1) {
     fprintf(stderr, "Not a 5.25\" disk image; aborting\n");
     return false;
   }
 
-  if (!read8(fd, &di.writeProtected))
+  if (!parse8(&di.writeProtected))
     return false;
 
-  if (!read8(fd, &di.synchronized))
+  if (!parse8(&di.synchronized))
     return false;
 
-  if (!read8(fd, &di.cleaned))
+  if (!parse8(&di.cleaned))
     return false;
 
   di.creator[32] = 0;
   for (int i=0; i<32; i++) {
-    if (!read8(fd, (uint8_t *)&di.creator[i]))
+    if (!parse8((uint8_t *)&di.creator[i]))
       return false;
   }
 
   if (di.version >= 2) {
-    if (!read8(fd, &di.diskSides))
+    if (!parse8(&di.diskSides))
       return false;
-    if (!read8(fd, &di.bootSectorFormat))
+    if (!parse8(&di.bootSectorFormat))
       return false;
-    if (!read8(fd, &di.optimalBitTiming))
+    if (!parse8(&di.optimalBitTiming))
       return false;
-    if (!read16(fd, &di.compatHardware))
+    if (!parse16(&di.compatHardware))
       return false;
-    if (!read16(fd, &di.requiredRam))
+    if (!parse16(&di.requiredRam))
       return false;
-    if (!read16(fd, &di.largestTrack))
+    if (!parse16(&di.largestTrack))
       return false;
   } else {
     di.diskSides = 0;
@@ -1284,9 +1943,9 @@ bool Woz::parseInfoChunk(uint32_t chunkSize)
   // this WOZ carries flux-timing data for some tracks (we don't decode
   // those yet, but we at least know not to trip on the chunk itself).
   if (di.version >= 3) {
-    if (!read16(fd, &di.fluxBlock))
+    if (!parse16(&di.fluxBlock))
       return false;
-    if (!read16(fd, &di.largestFluxTrack))
+    if (!parse16(&di.largestFluxTrack))
       return false;
   } else {
     di.fluxBlock = 0;
@@ -1302,7 +1961,7 @@ bool Woz::parseMetaChunk(uint32_t chunkSize)
   if (!metaData)
     return false;
 
-  if ((uint32_t)read(fd, metaData, chunkSize) != chunkSize)
+  if (!parseBytes(metaData, chunkSize))
     return false;
 
   metaData[chunkSize] = 0;
@@ -1316,9 +1975,19 @@ bool Woz::readWozDataTrack(uint8_t datatrack)
   if (tracks[datatrack].trackData)
     return true;
 
-  // If we have no open FD, then assume anything missing is supposed
-  // to be missing
-  if (fd == -1) {
+  // WOZ2 tracks are whole blocks, so a mapped image can be used as-is
+  uint32_t mapStart = tracks[datatrack].startingBlock * 512;
+  uint32_t mapCount = tracks[datatrack].blockCount * 512;
+  if (mapBase && di.version >= 2 && mapStart && mapCount &&
+      mapStart + mapCount <= mapSize) {
+    tracks[datatrack].trackData = (uint8_t *)(mapBase + mapStart);
+    tracks[datatrack].mapped = true;
+    return true;
+  }
+
+  // If we have no open FD (or decoded image), then assume anything
+  // missing is supposed to be missing
+  if (fd == -1 && !decodedImage) {
     return true;
   }
 
@@ -1340,30 +2009,14 @@ bool Woz::readWozDataTrack(uint8_t datatrack)
     return false;
   }
 
-  if (di.version == 1) {
-    if (verbose) {
-      printf("Reading datatrack %d starting at byte 0x%lX\n",
-	     datatrack,
-	     (unsigned long)tracks[datatrack].startingByte);
-    }
-    if (lseek(fd, tracks[datatrack].startingByte, SEEK_SET) == -1) {
-      perror("Failed to seek to start of block");
-      return false;
-    }
-  } else {
-    if (verbose) {
-      printf("Reading datatrack %d starting at byte 0x%lX\n",
-	     datatrack,
-	     (unsigned long)(bitsStartBlock*512));
-    }
-    if (lseek(fd, bitsStartBlock*512, SEEK_SET) == -1) {
-      perror("Failed to seek to start of block");
-      return false;
-    }
+  uint32_t startingByte = (di.version == 1) ? tracks[datatrack].startingByte : bitsStartBlock*512;
+  if (verbose) {
+    printf("Reading datatrack %d starting at byte 0x%lX\n",
+	   datatrack,
+	   (unsigned long)startingByte);
   }
-  uint32_t didRead = read(fd, tracks[datatrack].trackData, count);
-  if (didRead != count) {
-    printf("Failed to read all track data for track [read %lu, wanted %lu]\n", (unsigned long)didRead, (unsigned long)count);
+  if (!readImage(startingByte, tracks[datatrack].trackData, count)) {
+    printf("Failed to read all track data for track %d\n", datatrack);
     return false;
   }
 
@@ -1420,12 +2073,10 @@ static void dumpNibSector(nibSector *ns)
 bool Woz::writeNibSectorDataToDataTrack(uint8_t dataTrack, uint8_t sector, uint8_t nibData[343])
 {
   // Find the spot on the track that has the right sector
-  if (!tracks[dataTrack].trackData) {
-    // Load the cached track for this phys Nib track.
-    if (!loadMissingTrackFromImage(dataTrack)) {
-      fprintf(stderr, "Failed to read track %d\n", dataTrack);
-      return false;
-    }
+  // Load the cached track for this phys Nib track, if it isn't already
+  if (!useTrack(dataTrack)) {
+    fprintf(stderr, "Failed to read track %d\n", dataTrack);
+    return false;
   }
   
   // find the data header
@@ -1505,12 +2156,10 @@ bool Woz::readNibSectorDataFromDataTrack(uint8_t dataTrack, uint8_t sector, nibS
   // Find the sector header for this sector and return the nibblized data
   uint32_t ptr = 0;
 
-  if (!tracks[dataTrack].trackData) {
-    // Load the cached track for this phys Nib track.
-    if (!loadMissingTrackFromImage(dataTrack)) {
-      fprintf(stderr, "Failed to read track %d\n", dataTrack);
-      return false;
-    }
+  // Load the cached track for this phys Nib track, if it isn't already
+  if (!useTrack(dataTrack)) {
+    fprintf(stderr, "Failed to read track %d\n", dataTrack);
+    return false;
   }
 
   memset(sectorData->gap1, 0xFF, sizeof(sectorData->gap1));
@@ -1584,17 +2233,17 @@ bool Woz::readNibSectorDataFromDataTrack(uint8_t dataTrack, uint8_t sector, nibS
   return false;
 }
 
-bool Woz::writeInfoChunk(uint8_t version, int fdout)
+bool Woz::writeInfoChunk(uint8_t version, WozBuffer &out)
 {
-  if (!write8(fdout, version) ||
-      !write8(fdout, di.diskType) ||
-      !write8(fdout, di.writeProtected) ||
-      !write8(fdout, di.synchronized) ||
-      !write8(fdout, di.cleaned))
+  if (!out.put8(version) ||
+      !out.put8(di.diskType) ||
+      !out.put8(di.writeProtected) ||
+      !out.put8(di.synchronized) ||
+      !out.put8(di.cleaned))
     return false;
 
   for (int i=0; i<32; i++) {
-    if (!write8(fdout, di.creator[i]))
+    if (!out.put8(di.creator[i]))
       return false;
   }
   
@@ -1603,34 +2252,34 @@ bool Woz::writeInfoChunk(uint8_t version, int fdout)
     if (di.diskSides == 0)
       di.diskSides = 1;
 
-    if ( !write8(fdout, di.diskSides) ||
-	 !write8(fdout, di.bootSectorFormat) ||
-	 !write8(fdout, di.optimalBitTiming) ||
-	 !write16(fdout, di.compatHardware) ||
-	 !write16(fdout, di.requiredRam) ||
-	 !write16(fdout, di.largestTrack))
+    if ( !out.put8(di.diskSides) ||
+	 !out.put8(di.bootSectorFormat) ||
+	 !out.put8(di.optimalBitTiming) ||
+	 !out.put16(di.compatHardware) ||
+	 !out.put16(di.requiredRam) ||
+	 !out.put16(di.largestTrack))
       return false;
   }
 
   // Padding
   for (int i=0; i<((version==1)?23:14); i++) {
-    if (!write8(fdout, 0))
+    if (!out.put8(0))
       return false;
   }
   return true;
 }
 
-bool Woz::writeTMAPChunk(uint8_t version, int fdout)
+bool Woz::writeTMAPChunk(uint8_t version, WozBuffer &out)
 {
   for (int i=0; i<40*4; i++) {
-    if (!write8(fdout, quarterTrackMap[i]))
+    if (!out.put8(quarterTrackMap[i]))
       return false;
   }
 
   return true;
 }
 
-bool Woz::writeTRKSChunk(uint8_t version, int fdout)
+bool Woz::writeTRKSChunk(uint8_t version, WozBuffer &out)
 {
   if (version == 1) {
     fprintf(stderr, "V1 write is not implemented\n");
@@ -1658,11 +2307,11 @@ bool Woz::writeTRKSChunk(uint8_t version, int fdout)
       tracks[i].blockCount = 0;
       tracks[i].bitCount = 0;
     } 
-    if (!write16(fdout, tracks[i].startingBlock))
+    if (!out.put16(tracks[i].startingBlock))
       return false;
-    if (!write16(fdout, tracks[i].blockCount))
+    if (!out.put16(tracks[i].blockCount))
       return false;
-    if (!write32(fdout, tracks[i].bitCount))
+    if (!out.put32(tracks[i].bitCount))
       return false;
   }
 
@@ -1675,7 +2324,7 @@ bool Woz::writeTRKSChunk(uint8_t version, int fdout)
     
     if (tracks[i].startingBlock &&
 	tracks[i].blockCount) {
-      if (lseek(fdout, tracks[i].startingBlock * 512, SEEK_SET) == -1) {
+      if (!out.seek(tracks[i].startingBlock * 512)) {
 	fprintf(stderr, "Failed to seek before writing track\n");
 	return false;
       }
@@ -1684,10 +2333,8 @@ bool Woz::writeTRKSChunk(uint8_t version, int fdout)
       // ... but in practice, the tracks are all padded to NIBTRACKSIZE bytes;
       // and we alloc'd a buffer of that size, too; so write the whole thing,
       // since it would have been calloc'd initially.
-      ssize_t numWritten = write(fdout, tracks[i].trackData, NIBTRACKSIZE);
-      if (numWritten != NIBTRACKSIZE) {
-	fprintf(stderr, "Failed to write track [%d]\n", (int)numWritten);
-	perror("error writing");
+      if (!out.putBytes(tracks[i].trackData, NIBTRACKSIZE)) {
+	fprintf(stderr, "Failed to write track %d\n", i);
 	return false;
       }
       tracks[i].dirty = false;
@@ -1774,12 +2421,10 @@ bool Woz::isThirteenSectorDisk()
 bool Woz::readRawNibStream(uint8_t phystrack, uint8_t out[])
 {
   uint8_t dataTrack = quarterTrackMap[phystrack*4];
-  // Only fall through to loadMissingTrackFromImage if the track isn't
-  // already resident — otherwise on a preload-loaded DSK the fd has
-  // been closed and the re-read would fail.
-  if (!tracks[dataTrack].trackData) {
-    if (!loadMissingTrackFromImage(dataTrack)) return false;
-  }
+  // useTrack only falls through to loadMissingTrackFromImage if the
+  // track isn't already resident — otherwise on a preload-loaded DSK
+  // the fd has been closed and the re-read would fail.
+  if (!useTrack(dataTrack)) return false;
   for (uint32_t i = 0; i < NIBTRACKSIZE; i++) {
     out[i] = nextDiskByte(dataTrack);
   }
@@ -2071,7 +2716,336 @@ uint8_t Woz::dataTrackNumberForQuarterTrack(uint16_t qt)
 
 bool Woz::flush()
 {
-  // *** FIXME - should flush() write the image out if it's dirty?
+  if (!isDirty())
+    return true;
+
+#ifndef TEENSYDUINO
+  if (overlay)
+    return flushOverlayTracks();
+#endif
+
+  // The fd should still be open. If it's not, then we can't flush.
+  if (fd == -1)
+    return false;
+
+  switch (imageType) {
+  case T_WOZ:
+    return flushWozTracks();
+  case T_DSK:
+  case T_PO:
+    return flushDskTracks();
+  case T_NIB:
+    return flushNibTracks();
+  default:
+    fprintf(stderr, "Error: unknown imageType; can't flush\n");
+    return false;
+  }
+}
+
+// Writing never changes a track's bitCount or blockCount, so each
+// dirty track still fits exactly where it was read from: rewrite its
+// blocks and its TRKS entry, and patch the CRC for just those bytes.
+// If the layout isn't one we can patch (WOZ1, or a track that has no
+// blocks in the file) then fall back to rewriting the whole image.
+bool Woz::flushWozTracks()
+{
+  if (!canFlushInPlace()) {
+    // A rewrite can move any track, so stop using the old file in place
+    for (int i=0; i<160; i++) {
+      if (tracks[i].mapped && !ownTrackData(i))
+        return false;
+    }
+    releaseMapping();
+    return writeWozFile(fd, T_WOZ);
+  }
+
+  uint8_t b[4];
+  if (!readImageFd(8, b, 4)) {
+    fprintf(stderr, "ERROR: failed to read image CRC\n");
+    return false;
+  }
+  uint32_t crc = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+
+  for (int i=0; i<160; i++) {
+    if (!tracks[i].dirty)
+      continue;
+    if (!patchWozImage(tracks[i].startingBlock * 512, tracks[i].trackData,
+                       tracks[i].blockCount * 512, &crc))
+      return false;
+
+    uint8_t entry[8] = { (uint8_t)tracks[i].startingBlock,
+                         (uint8_t)(tracks[i].startingBlock >> 8),
+                         (uint8_t)tracks[i].blockCount,
+                         (uint8_t)(tracks[i].blockCount >> 8),
+                         (uint8_t)tracks[i].bitCount,
+                         (uint8_t)(tracks[i].bitCount >> 8),
+                         (uint8_t)(tracks[i].bitCount >> 16),
+                         (uint8_t)(tracks[i].bitCount >> 24) };
+    if (!patchWozImage(trksDataPos + 8*i, entry, sizeof(entry), &crc))
+      return false;
+    tracks[i].dirty = false;
+  }
+
+#ifdef SKIPCHECKSUM
+  // Same as a full write: 0 means "don't verify"
+  crc = 0;
+#endif
+  b[0] = crc; b[1] = crc >> 8; b[2] = crc >> 16; b[3] = crc >> 24;
+  if (!writeImageFd(8, b, 4)) {
+    fprintf(stderr, "ERROR: failed to write CRC\n");
+    return false;
+  }
+
+  return true;
+}
+
+bool Woz::canFlushInPlace()
+{
+  // Overlay writes are cheap, and the image itself isn't touched
+  if (overlay)
+    return false;
+  if (imageType == T_DSK || imageType == T_PO || imageType == T_NIB)
+    return true;
+  if (imageType != T_WOZ || di.version < 2 || !trksDataPos || !wozImageEnd)
+    return false;
+
+  for (int i=0; i<160; i++) {
+    if (!tracks[i].dirty)
+      continue;
+    if (!tracks[i].trackData || !tracks[i].startingBlock ||
+        !tracks[i].blockCount ||
+        (tracks[i].startingBlock + tracks[i].blockCount) * 512 > wozImageEnd)
+      return false;
+  }
+  return true;
+}
+
+// The readers get their bytes through these, so a decoded (compressed)
+// image can stand in for the file.
+bool Woz::openImage(const char *filename)
+{
+  if (fd != -1) close(fd);
+  fd = -1;
+  if (decodedImage)
+    return true;
+
+  fd = open(filename, readOnlyImage ? O_RDONLY : O_RDWR, S_IRUSR|S_IWUSR);
+  if (fd == -1) {
+    perror("Unable to open input file");
+    return false;
+  }
+  return true;
+}
+
+bool Woz::readImage(uint32_t offset, void *buf, uint32_t len)
+{
+  if (decodedImage) {
+    if (offset > decodedSize || len > decodedSize - offset)
+      return false;
+    memcpy(buf, decodedImage + offset, len);
+    return true;
+  }
+  return (lseek(fd, offset, SEEK_SET) != -1 &&
+          (uint32_t)read(fd, buf, len) == len);
+}
+
+void Woz::releaseDecodedImage()
+{
+  if (!decodedImage)
+    return;
+  if (mapBase == decodedImage)
+    releaseMapping();
+  free(decodedImage);
+  decodedImage = NULL;
+  decodedSize = 0;
+}
+
+#ifndef TEENSYDUINO
+// Overlay records are a track's bitCount and blockCount (4 and 2
+// bytes, then 2 spare) followed by its data.
+#define OVERLAYTRACKHEADER 8
+
+bool Woz::openOverlay(const char *path)
+{
+  delete overlay;
+  overlay = new DiskOverlay();
+  if (!overlay->load(path, 160)) {
+    delete overlay;
+    overlay = NULL;
+    return false;
+  }
+
+  // Lazily loaded tracks that aren't in memory yet will come from the
+  // overlay when they're loaded
+  for (int i=0; i<160; i++) {
+    if (!overlay->has(i) || (autoFlushTrackData && !tracks[i].trackData))
+      continue;
+    if (!loadOverlayTrack(i))
+      return false;
+  }
+  return true;
+}
+
+// Replace datatrack with its copy from the overlay
+bool Woz::loadOverlayTrack(uint8_t datatrack)
+{
+  uint32_t len = overlay->length(datatrack);
+  if (len <= OVERLAYTRACKHEADER)
+    return false;
+  uint8_t *record = (uint8_t *)malloc(len);
+  if (!record || !overlay->readUnit(datatrack, record, len)) {
+    free(record);
+    fprintf(stderr, "Failed to read track %d from the overlay\n", datatrack);
+    return false;
+  }
+  trackInfo &t = tracks[datatrack];
+  if (t.trackData && !t.mapped)
+    free(t.trackData);
+  t.bitCount = record[0] | (record[1] << 8) | (record[2] << 16) | ((uint32_t)record[3] << 24);
+  t.blockCount = record[4] | (record[5] << 8);
+  t.mapped = false;
+  // The record becomes the track buffer, once the header's out of the way
+  memmove(record, record + OVERLAYTRACKHEADER, len - OVERLAYTRACKHEADER);
+  t.trackData = record;
+  return true;
+}
+
+bool Woz::flushOverlayTracks()
+{
+  for (int i=0; i<160; i++) {
+    if (!tracks[i].dirty || !tracks[i].trackData)
+      continue;
+    uint32_t size = trackBufferSize(i);
+    uint8_t *record = (uint8_t *)malloc(OVERLAYTRACKHEADER + size);
+    if (!record) {
+      fprintf(stderr, "ERROR: failed to malloc track buffer\n");
+      return false;
+    }
+    uint32_t bits = tracks[i].bitCount;
+    record[0] = bits; record[1] = bits >> 8; record[2] = bits >> 16; record[3] = bits >> 24;
+    record[4] = tracks[i].blockCount; record[5] = tracks[i].blockCount >> 8;
+    record[6] = record[7] = 0;
+    memcpy(record + OVERLAYTRACKHEADER, tracks[i].trackData, size);
+    bool ok = overlay->writeUnit(i, record, OVERLAYTRACKHEADER + size);
+    free(record);
+    if (!ok) {
+      fprintf(stderr, "Failed to write track %d to the overlay\n", i);
+      return false;
+    }
+    tracks[i].dirty = false;
+  }
+  return overlay->sync();
+}
+#endif
+
+bool Woz::readImageFd(uint32_t offset, void *buf, uint32_t len)
+{
+#ifndef TEENSYDUINO
+  if (ownFd)
+    return ::pread(fd, buf, len, offset) == (ssize_t)len;
+#endif
+  return (lseek(fd, offset, SEEK_SET) != -1 &&
+          (uint32_t)read(fd, buf, len) == len);
+}
+
+bool Woz::writeImageFd(uint32_t offset, const void *buf, uint32_t len)
+{
+#ifndef TEENSYDUINO
+  if (ownFd)
+    return ::pwrite(fd, buf, len, offset) == (ssize_t)len;
+#endif
+  return (lseek(fd, offset, SEEK_SET) != -1 &&
+          (uint32_t)write(fd, buf, len) == len);
+}
+
+bool Woz::reopenImage()
+{
+  if (!imagePath || fd != -1)
+    return false;
+#ifdef TEENSYDUINO
+  fd = open(imagePath, O_RDWR, S_IRUSR|S_IWUSR);
+#else
+  // Straight from the OS: this runs on the disk writer's thread, and
+  // the filemanager's few descriptors are for the emulator's files.
+  // (The parentheses keep fscompat.h's macros off it.)
+  fd = (::open)(imagePath, O_RDWR);
+  ownFd = (fd != -1);
+#endif
+  return fd != -1;
+}
+
+// Overwrite `len` bytes of the image at `offset`, updating *crc (if
+// it's set - 0 means "don't verify") from the bytes being replaced.
+bool Woz::patchWozImage(uint32_t offset, const uint8_t *data, uint32_t len, uint32_t *crc)
+{
+  if (*crc) {
+    uint8_t *old = (uint8_t *)malloc(len);
+    if (!old) {
+      fprintf(stderr, "ERROR: failed to malloc track buffer\n");
+      return false;
+    }
+    if (!readImageFd(offset, old, len)) {
+      fprintf(stderr, "ERROR: failed to read image at 0x%lX\n", (unsigned long)offset);
+      free(old);
+      return false;
+    }
+    *crc = patch_crc_32(*crc, old, data, len, wozImageEnd - (offset + len));
+    free(old);
+  }
+
+  if (!writeImageFd(offset, data, len)) {
+    fprintf(stderr, "ERROR: failed to write image at 0x%lX\n", (unsigned long)offset);
+    return false;
+  }
+  return true;
+}
+
+// DSK and PO images hold each physical track at a fixed offset, so a
+// dirty track is denibblized and written back over its own 4k.
+bool Woz::flushDskTracks()
+{
+  uint8_t sectorData[256*16];
+  for (int phystrack=0; phystrack<35; phystrack++) {
+    uint8_t datatrack = quarterTrackMap[phystrack*4];
+    if (datatrack == 0xFF || !tracks[datatrack].dirty)
+      continue;
+    if (!decodeWozTrackToDsk(phystrack, imageType, sectorData)) {
+      fprintf(stderr, "Failed to decode track %d; not flushed\n", phystrack);
+      return false;
+    }
+    if (!writeImageFd(256*16*phystrack, sectorData, 256*16)) {
+      fprintf(stderr, "Failed to write track %d\n", phystrack);
+      return false;
+    }
+  }
+
+  // Anything else that's dirty (quarter tracks) can't be represented
+  for (int i=0; i<160; i++) {
+    tracks[i].dirty = false;
+  }
+  return true;
+}
+
+bool Woz::flushNibTracks()
+{
+  nibSector nibData[16];
+  for (int phystrack=0; phystrack<35; phystrack++) {
+    uint8_t datatrack = quarterTrackMap[phystrack*4];
+    if (datatrack == 0xFF || !tracks[datatrack].dirty)
+      continue;
+    if (!decodeWozTrackToNibFromDataTrack(datatrack, nibData)) {
+      fprintf(stderr, "Failed to decode track %d; not flushed\n", phystrack);
+      return false;
+    }
+    if (!writeImageFd(NIBTRACKSIZE*phystrack, nibData, NIBTRACKSIZE)) {
+      fprintf(stderr, "Failed to write track %d\n", phystrack);
+      return false;
+    }
+  }
+
+  for (int i=0; i<160; i++) {
+    tracks[i].dirty = false;
+  }
   return true;
 }
 
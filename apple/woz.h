@@ -42,19 +42,81 @@ typedef struct _trackInfo {
   uint32_t bitCount;
   uint8_t *trackData;
   bool dirty;
+  bool mapped;            // trackData points into the mapped image
+  uint32_t lastUse;       // track cache clock when it was last used
 } trackInfo;
 
+// Images read without preloading share one LRU cache of loaded
+// tracks, across both drives. This is its default size; it can be
+// changed with Woz::setTrackCacheBudget().
+#ifdef TEENSYDUINO
+#define TRACKCACHE_BUDGET (4*NIBTRACKSIZE)
+#else
+#define TRACKCACHE_BUDGET (512*1024)
+#endif
+
+// Where the MC3470 fake-bit stream starts unless it's given a seed
+#define WOZ_FAKEBIT_SEED 0x9E3779B97F4A7C15ULL
+
+// Where writeWozFile assembles an image: chunks are serialized into
+// memory, their sizes (and the CRC) are patched in place, and the
+// whole thing goes out in one write instead of a syscall per byte.
+class WozBuffer {
+ public:
+  WozBuffer();
+  ~WozBuffer();
+
+  bool put8(uint8_t v);
+  bool put16(uint16_t v);
+  bool put32(uint32_t v);
+  bool putBytes(const void *buf, uint32_t len);
+  // Seeking past the end leaves a zero-filled gap.
+  bool seek(uint32_t pos);
+  uint32_t tell() { return pos; }
+
+  uint8_t *bytes() { return data; }
+  uint32_t length() { return len; }
+
+ private:
+  bool reserve(uint32_t end);
+
+  uint8_t *data;
+  uint32_t size;
+  uint32_t len;
+  uint32_t pos;
+};
+
+class DiskOverlay;
+
 class Woz {
  public:
   Woz(bool verbose, uint8_t dumpflags);
   ~Woz();
 
+  // Reading another image into the same Woz releases the last one.
   bool readFile(const char *filename, bool preloadTracks, uint8_t forceType = T_AUTO);
   bool writeFile(const char *filename, uint8_t forceType = T_AUTO);
 
   void advanceBitStream(uint8_t datatrack);
   uint8_t getNextWozBit(uint8_t datatrack);
 
+  // Bitstream cursor over the current track. peekBits returns the
+  // next `count` (1-32) bits, first bit in the MSB; consumeBits moves
+  // the head past them. Both wrap at the track's bitCount.
+  uint32_t peekBits(uint8_t datatrack, uint8_t count);
+  void consumeBits(uint8_t datatrack, uint8_t count);
+
+  // Whole-track access for callers that precompute something per
+  // track (DiskII's nibble fast path). trackBits returns the cached
+  // data (NULL if it isn't loaded). headBitPosition gives the index of
+  // the next bit the head will read, but only when the cursor and the
+  // MC3470 window are both settled on `datatrack`. skipBits moves the
+  // head `count` bits along without looking at them; it doesn't draw
+  // fake bits, so it's only exact on tracks with no run of four 0s.
+  const uint8_t *trackBits(uint8_t datatrack, uint32_t *bitCount);
+  bool headBitPosition(uint8_t datatrack, uint32_t *pos);
+  void skipBits(uint8_t datatrack, uint64_t count);
+
   void dumpInfo();
 
   bool isSynchronized();
@@ -66,8 +128,13 @@ class Woz {
 
   uint8_t dataTrackNumberForQuarterTrack(uint16_t qt);
   
+  // Write any dirty tracks back into the image we were read from, in
+  // place; clean tracks aren't touched.
   bool flush();
   bool isDirty();
+  // True if flush() only has to write the dirty tracks, rather than
+  // rewrite the whole image.
+  bool canFlushInPlace();
 
   bool decodeWozTrackToDsk(uint8_t phystrack, uint8_t subtype, uint8_t sectorData[256*16]);
   bool decodeWozTrackSector(uint8_t phystrack, uint8_t sector, uint8_t dataOut[256]);
@@ -96,9 +163,26 @@ class Woz {
   // read freely and may also write in place (writeFile will flush the
   // modified buffer back to disk).
   bool isHdv() const { return imageType == T_HDV; }
+  // T_WOZ, T_DSK etc: what the image was read from
+  uint8_t imageFormat() const { return imageType; }
   uint32_t hdvByteCount() const { return hdvByteSize; }
   uint8_t *hdvBuffer() { return hdvData; }
 
+  // The lazily loaded track cache. Tracks that are dirty, mapped or
+  // under a head are never evicted, so it can run over budget. A hit
+  // is a lazily loaded track that was still there when it was needed;
+  // a miss had to be read back from the image.
+  static void setTrackCacheBudget(uint32_t bytes);
+  static uint32_t trackCacheBytes();
+  static void trackCacheStats(uint32_t *hits, uint32_t *misses);
+  static void resetTrackCacheStats();
+
+  // The MC3470's fake bits come from a per-drive xorshift stream. It
+  // restarts from the seed whenever an image is read, so reading a
+  // protected disk comes out the same every run.
+  void setFakeBitSeed(uint64_t seed);
+  uint64_t fakeBitSeed() const { return fakeBitSeedValue; }
+
  protected:
   bool writeWozFile(const char *filename, uint8_t subtype);
   bool writeWozFile(int fdout, uint8_t subtype);
@@ -106,8 +190,20 @@ class Woz {
   bool writeDskFile(int fdout, uint8_t subtype);
   bool writeNibFile(const char *filename);
   bool writeNibFile(int fdout);
+
+  bool flushWozTracks();
+  bool flushDskTracks();
+  bool flushNibTracks();
+  bool patchWozImage(uint32_t offset, const uint8_t *data, uint32_t len, uint32_t *crc);
+  // The flushes reach fd through these
+  bool readImageFd(uint32_t offset, void *buf, uint32_t len);
+  bool writeImageFd(uint32_t offset, const void *buf, uint32_t len);
+  // Open imagePath again, for a copy of this Woz that writes into it
+  bool reopenImage();
   
   uint8_t nextDiskBit(uint8_t datatrack);
+  // The next `count` (1-8) bits, oldest in the MSB.
+  uint8_t nextDiskBits(uint8_t datatrack, uint8_t count);
   uint8_t nextDiskByte(uint8_t datatrack);
 
   void writeDiskByte(uint8_t datatrack, uint8_t b);
@@ -118,28 +214,59 @@ class Woz {
   bool readNibFile(const char *filename, bool preloadTracks);
   bool readHdvFile(const char *filename);
   bool writeHdvFile(const char *filename);
+  void releaseHdvData();
+  void releaseImage();
+
+  bool openImage(const char *filename);
+  bool readImage(uint32_t offset, void *buf, uint32_t len);
+  void releaseDecodedImage();
+  bool openOverlay(const char *path);
+  bool flushOverlayTracks();
+  bool loadOverlayTrack(uint8_t datatrack);
 
   bool decodeWozTrackToNibFromDataTrack(uint8_t dataTrack, nibSector sectorData[16]);
 
   uint8_t fakeBit();
+  uint64_t nextFakeBitWord();
+
+  bool seekBitWindow(uint8_t datatrack);
+  void fillBitWindow(uint8_t datatrack);
 
   bool writeNextWozBit(uint8_t datatrack, uint8_t bit);
   bool writeNextWozByte(uint8_t datatrack, uint8_t b);
+  // `zeros` 0-bits and then b, as fast as they can be written
+  bool writeZerosThenByte(uint8_t datatrack, uint64_t zeros, uint8_t b);
+  uint8_t putBits(uint8_t datatrack, uint8_t bits, uint8_t count);
   
+  bool parse8(uint8_t *v);
+  bool parse16(uint16_t *v);
+  bool parse32(uint32_t *v);
+  bool parseBytes(void *buf, uint32_t len);
+  bool parseSeek(uint32_t pos);
+
+  void releaseMapping();
+  bool ownTrackData(uint8_t datatrack);
+
   bool parseTRKSChunk(uint32_t chunkSize);
   bool parseTMAPChunk(uint32_t chunkSize);
   bool parseInfoChunk(uint32_t chunkSize);
   bool parseMetaChunk(uint32_t chunkSize);
 
-  bool writeInfoChunk(uint8_t version, int fdout);
-  bool writeTMAPChunk(uint8_t version, int fdout);
-  bool writeTRKSChunk(uint8_t version, int fdout);
+  bool writeInfoChunk(uint8_t version, WozBuffer &out);
+  bool writeTMAPChunk(uint8_t version, WozBuffer &out);
+  bool writeTRKSChunk(uint8_t version, WozBuffer &out);
 
   bool readWozDataTrack(uint8_t datatrack);
   bool writeNibSectorDataToDataTrack(uint8_t dataTrack, uint8_t sector, uint8_t nibData[343]);
   bool readNibSectorDataFromDataTrack(uint8_t dataTrack, uint8_t sector, nibSector *sectorData);
 
   bool loadMissingTrackFromImage(uint8_t datatrack);
+  // Make sure datatrack is loaded, and mark it as recently used
+  bool useTrack(uint8_t datatrack);
+  uint32_t trackBufferSize(uint8_t datatrack);
+  void joinTrackCache();
+  void leaveTrackCache();
+  static void evictTracksFor(uint32_t bytes);
   
   bool checksumWozDataTrack(uint8_t datatrack, uint32_t *retCRC);
 
@@ -147,6 +274,10 @@ class Woz {
 
  protected:
   int fd;
+#ifndef TEENSYDUINO
+  // fd came straight from the OS (reopenImage), not the filemanager
+  bool ownFd;
+#endif
   
  protected:
   uint8_t imageType;
@@ -155,8 +286,34 @@ class Woz {
   uint8_t dumpflags;
 
   bool autoFlushTrackData;
+  // Lazily loaded images are linked together for the track cache
+  bool inTrackCache;
+  Woz *nextInTrackCache;
+  static Woz *trackCacheImages;
+  static uint32_t trackCacheBudget;
+  static uint32_t trackCacheClock;
+  static uint32_t trackCacheHits;
+  static uint32_t trackCacheMisses;
   
   uint8_t quarterTrackMap[40*4];
+  // Where the image file (fd) keeps its WOZ2 TRKS entries, and where
+  // its last chunk ends (the CRC covers bytes 12 up to there). Both
+  // are 0 when we don't know the layout and have to rewrite it all.
+  uint32_t trksDataPos;
+  uint32_t wozImageEnd;
+  // The file readFile() loaded us from (NULL until then)
+  char *imagePath;
+
+  // Host builds map WOZ images read-only and point clean tracks
+  // straight at their blocks; the first write to a track copies it
+  // (ownTrackData). parsePos is the chunk parser's cursor into it.
+  const uint8_t *mapBase;
+  uint32_t mapSize;
+  uint32_t parsePos;
+  // Without a mapping, the parser reads the file a window at a time
+  uint8_t parseBuf[512];
+  uint32_t parseBufPos;
+  uint32_t parseBufLen;
   diskInfo di;
   trackInfo tracks[160];
 
@@ -167,8 +324,21 @@ class Woz {
   uint8_t trackByteFromDataTrack;
   uint8_t trackBitIdx;
   uint8_t trackLoopCounter;
+
+  // Up to 64 upcoming bits of trackByteFromDataTrack, starting at
+  // bitWindowPos, next bit in the MSB. It's only a cache: the
+  // cursor above is the real head position, and anything that moves
+  // it or changes the track data drops the window.
+  uint64_t bitWindow;
+  uint8_t bitWindowCount;
+  uint32_t bitWindowPos;
   char *metaData;
-  uint8_t randData, randPtr;
+  // xorshift64* state for fakeBit(), and the bits it has drawn but
+  // not handed out yet (next one in the LSB)
+  uint64_t fakeBitSeedValue;
+  uint64_t fakeBitState;
+  uint64_t fakeBits;
+  uint8_t fakeBitsLeft;
 
   // MC3470 fake-bit emulation: 4-bit sliding window over the last
   // four bits read. When it goes to zero (i.e. we've seen four 0s in
@@ -179,9 +349,19 @@ class Woz {
 
   // HDV-backed state. Only populated when imageType == T_HDV.
   // hdvData owns a heap buffer the size of the loaded image; the
-  // destructor frees it.
+  // destructor frees it. On the host it's a private mapping of the
+  // image instead (hdvMapped), so only the blocks used are read in.
   uint8_t *hdvData;
   uint32_t hdvByteSize;
+  bool hdvMapped;
+
+  // A compressed image is decoded whole into decodedImage and read
+  // from there instead of fd. Those, and every image in overlay mode,
+  // are never rewritten: changed tracks go to overlay instead.
+  uint8_t *decodedImage;
+  uint32_t decodedSize;
+  DiskOverlay *overlay;
+  bool readOnlyImage;
 };
 
 #endif
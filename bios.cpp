@@ -30,7 +30,16 @@ EXTMEM struct _cacheEntry biosCache[BIOSCACHESIZE];
 uint16_t numCacheEntries = 0;
 
 // When selecting files...
-char fileFilter[16]; // FIXME length & Strcpy -> strncpy
+char fileFilter[24]; // FIXME length & Strcpy -> strncpy
+
+// Host builds can also open compressed images (.gz and .zip)
+#ifdef TEENSYDUINO
+#define DISKFILTER "dsk,.po,nib,woz"
+#define HDFILTER "img,hdv"
+#else
+#define DISKFILTER "dsk,.po,nib,woz,.gz,zip"
+#define HDFILTER "img,hdv,.gz,zip"
+#endif
 uint16_t fileSelectionFor; // define what the returned name is for
 
 #define LINEHEIGHT 10
@@ -408,7 +417,7 @@ uint16_t BIOS::VmMenuHandler(bool needsRedraw, bool performAction)
 	return BIOS_DONE;
       case ACT_DEBUG:
 	g_debugMode++;
-	g_debugMode %= 9; // FIXME: abstract max #
+	g_debugMode %= 10; // FIXME: abstract max #
 	localRedraw = true;
 	return BIOS_VM;
       case ACT_SUSPEND:
@@ -690,7 +699,7 @@ uint16_t BIOS::DisksMenuHandler(bool needsRedraw, bool performAction)
 	localRedraw = true;
 	break;
       } else {
-	strcpy(fileFilter, "dsk,.po,nib,woz");
+	strcpy(fileFilter, DISKFILTER);
 	fileSelectionFor = ACT_DISK1;
 	return BIOS_SELECTFILE;
       }
@@ -701,7 +710,7 @@ uint16_t BIOS::DisksMenuHandler(bool needsRedraw, bool performAction)
 	localRedraw = true;
 	break;
       } else {
-	strcpy(fileFilter, "dsk,.po,nib,woz");
+	strcpy(fileFilter, DISKFILTER);
 	fileSelectionFor = ACT_DISK2;
 	return BIOS_SELECTFILE;
       }
@@ -712,7 +721,7 @@ uint16_t BIOS::DisksMenuHandler(bool needsRedraw, bool performAction)
 	localRedraw = true;
 	break;
       } else {
-	strcpy(fileFilter, "img,hdv");
+	strcpy(fileFilter, HDFILTER);
 	fileSelectionFor = ACT_HD1;
 	return BIOS_SELECTFILE;
       }
@@ -723,7 +732,7 @@ uint16_t BIOS::DisksMenuHandler(bool needsRedraw, bool performAction)
 	localRedraw = true;
 	break;
       } else {
-	strcpy(fileFilter, "img,hdv");
+	strcpy(fileFilter, HDFILTER);
 	fileSelectionFor = ACT_HD2;
 	return BIOS_SELECTFILE;
       }
@@ -1126,6 +1135,9 @@ void BIOS::DrawVMMenu()
 	case D_SHOWDSK:
 	  snprintf(buf, sizeof(buf), templateString, "Show Disk");
 	  break;
+	case D_SHOWAUDIO:
+	  snprintf(buf, sizeof(buf), templateString, "Show audio");
+	  break;
 	}
       }
       break;
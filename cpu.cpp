@@ -332,7 +332,7 @@ bool Cpu::Serialize(int8_t fd)
   serialize8(x);
   serialize8(y);
   serialize8(flags);
-  serialize32(cycles);
+  serialize64(cycles);
   serialize8(irqPending ? 1 : 0);
 
   if (!mmu->Serialize(fd)) {
@@ -356,7 +356,7 @@ bool Cpu::Deserialize(int8_t fd)
   deserialize8(x);
   deserialize8(y);
   deserialize8(flags);
-  deserialize32(cycles);
+  deserialize64(cycles);
   deserialize8(irqPending);
   
   if (!mmu->Deserialize(fd)) {
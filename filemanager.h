@@ -2,6 +2,7 @@
 #define __FILEMANAGER_H
 
 #include <stdint.h>
+#include <stddef.h> // for NULL
 
 #define MAXFILES 4    // how many results we can simultaneously manage
 #define DIRPAGESIZE 10 // how many results in one readDir
@@ -144,6 +145,25 @@ class FileManager {
 
   virtual void flush() = 0;
 
+  // Suspend files are written and read whole. Between openSnapshot()
+  // and closeFile(), write() and read() on the fd work on a copy in
+  // memory; commitSnapshot() replaces the file with what was written,
+  // all at once. The defaults just use the file directly.
+  virtual int8_t openSnapshot(const char *name, bool forWriting) {
+    return openFile(name);
+  }
+  virtual bool commitSnapshot(int8_t fd) { return true; }
+  // What's been written to a snapshot so far, without committing it
+  // (NULL if it isn't being built in memory)...
+  virtual const uint8_t *snapshotData(int8_t fd, uint32_t *len) {
+    return NULL;
+  }
+  // ... and a snapshot fd that reads from the caller's buffer, which
+  // has to stay put until the fd is closed.
+  virtual int8_t openSnapshotData(const uint8_t *data, uint32_t len) {
+    return -1;
+  }
+
  protected:
   volatile unsigned long fileSeekPositions[MAXFILES];
   char cachedNames[MAXFILES][MAXPATH];
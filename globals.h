@@ -38,7 +38,8 @@ enum {
   D_SHOWCYCLES  = 5,
   D_SHOWBATTERY = 6,
   D_SHOWTIME    = 7,
-  D_SHOWDSK     = 8
+  D_SHOWDSK     = 8,
+  D_SHOWAUDIO   = 9
 };
 
 extern FileManager *g_filemanager;
@@ -10,12 +10,16 @@
 #include "fb-display.h"
 #include "linux-keyboard.h"
 #include "linux-speaker.h"
+#include "wav-speaker.h"
 #include "fb-paddles.h"
 #include "nix-filemanager.h"
 #include "linux-printer.h"
 #include "appleui.h"
 #include "bios.h"
 #include "nix-prefs.h"
+#include "nib-cache.h"
+#include "disk-overlay.h"
+#include "disk-writer.h"
 
 #include "globals.h"
 
@@ -29,6 +33,11 @@
 BIOS bios;
 
 static struct timespec nextInstructionTime, startTime;
+// g_cpu->cycles at startTime
+static int64_t startCycles = 0;
+
+// "-d": run unthrottled while a disk is loading quietly.
+static bool diskWarp = false;
 
 #define NB_ENABLE 1
 #define NB_DISABLE 0
@@ -47,6 +56,12 @@ void doDebugging();
 void readPrefs();
 void writePrefs();
 
+// Let the queued disk writes finish before the statics go away
+void stopDiskWriter()
+{
+  g_diskWriter.stop();
+}
+
 void sigint_handler(int n)
 {
   send_rst = 1;
@@ -91,6 +106,7 @@ static void *cpu_thread(void *dummyptr) {
   struct timespec currentTime;
   struct timespec nextCycleTime;
   int64_t nextSpeakerCycle = 0;
+  bool warping = false;
 
 #if 0
   int policy;
@@ -171,9 +187,23 @@ static void *cpu_thread(void *dummyptr) {
 #else
       executed = g_cpu->Run(24);
 #endif
+      // Disk warp: while the drive is loading and nothing's making a
+      // sound, don't pace the CPU. Re-anchor the clock on every change
+      // so there's no catch-up (or sleeping off) afterwards.
+      bool warpNow = diskWarp && ((AppleVM *)g_vm)->isQuietDiskAccess();
+      if (warpNow != warping) {
+	warping = warpNow;
+	startTime = currentTime;
+	startCycles = g_cpu->cycles;
+      }
+
       // calculate the real time that we should be at now, and schedule
       // that as our next instruction time
-      timespec_add_cycles(&startTime, g_cpu->cycles, &nextInstructionTime);
+      if (warping) {
+	nextInstructionTime = currentTime;
+      } else {
+	timespec_add_cycles(&startTime, g_cpu->cycles - startCycles, &nextInstructionTime);
+      }
 
       // The paddles need to be triggered in real-time on the CPU
       // clock. That happens from the VM's CPU maintenance poller.
@@ -268,6 +298,44 @@ int main(int argc, char *argv[])
   struct vt_stat vts;
   int newVT;
   int initialVT;
+  const char *wavFile = NULL;
+  bool nibbleFastPath = false;
+
+  while (argc > 1 && argv[1][0] == '-') {
+    // "-w file.wav": there's no audio device here, but we can record the
+    // speaker and Mockingboard by emulated time.
+    if (argc > 2 && !strcmp(argv[1], "-w")) {
+      wavFile = argv[2];
+      argc -= 2;
+      argv += 2;
+    }
+    // "-n": use the Disk II nibble fast path on clean tracks.
+    else if (!strcmp(argv[1], "-n")) {
+      nibbleFastPath = true;
+      argc--;
+      argv++;
+    }
+    else if (!strcmp(argv[1], "-d")) {
+      diskWarp = true;
+      argc--;
+      argv++;
+    }
+    // "-c dir": keep nibblized DSK/PO tracks in dir between runs.
+    else if (argc > 2 && !strcmp(argv[1], "-c")) {
+      setNibCacheDir(argv[2]);
+      argc -= 2;
+      argv += 2;
+    }
+    // "-o dir": never write to disk images; keep changes in dir.
+    else if (argc > 2 && !strcmp(argv[1], "-o")) {
+      setOverlayDir(argv[2]);
+      argc -= 2;
+      argv += 2;
+    }
+    else {
+      break;
+    }
+  }
   
   if ((fd=open("/dev/console", O_WRONLY)) < 0) {
     perror("opening /dev/console");
@@ -323,7 +391,11 @@ int main(int argc, char *argv[])
   exit(1);
 #endif
 
-  g_speaker = new LinuxSpeaker();
+  if (wavFile) {
+    g_speaker = new WavSpeaker(wavFile);
+  } else {
+    g_speaker = new LinuxSpeaker();
+  }
   g_printer = new LinuxPrinter();
 
   // create the filemanager - the interface to the host file system.
@@ -344,6 +416,7 @@ int main(int argc, char *argv[])
   // (The actual Apple VM we've built has them compiled in, though.) It will create its virutal 
   // hardware (MMU, video driver, floppy, paddles, whatever).
   g_vm = new AppleVM();
+  ((AppleVM *)g_vm)->disk6->setNibbleFastPath(nibbleFastPath);
 
   g_keyboard = new LinuxKeyboard(g_vm->getKeyboard());
 
@@ -379,6 +452,10 @@ int main(int argc, char *argv[])
 
   signal(SIGINT, sigint_handler);
 
+  atexit(stopDiskWriter);
+
+  g_speaker->begin();
+
   printf("creating CPU thread\n");
   if (!pthread_create(&cpuThreadID, NULL, &cpu_thread, (void *)NULL)) {
     printf("thread created\n");
@@ -404,6 +481,7 @@ int main(int argc, char *argv[])
 
       // clear the CPU next-step counters
       g_cpu->cycles = 0;
+      startCycles = 0;
       do_gettime(&startTime);
       do_gettime(&nextInstructionTime);
 
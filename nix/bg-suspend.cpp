@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#include "bg-suspend.h"
+#include "nix-filemanager.h"
+#include "globals.h"
+
+BackgroundSuspend::BackgroundSuspend()
+{
+  pid = -1;
+  pipeFd = -1;
+}
+
+BackgroundSuspend::~BackgroundSuspend()
+{
+  poll(true);
+}
+
+bool BackgroundSuspend::start(const char *fn, saveFn save)
+{
+  if (busy()) {
+    printf("A background suspend is still running\n");
+    return false;
+  }
+
+  int fds[2];
+  if (pipe(fds)) {
+    printf("Unable to create suspend pipe: %s\n", strerror(errno));
+    return false;
+  }
+
+  // Anything still buffered would be written twice, once by each of
+  // us. And the file manager's lock can't be left held by some other
+  // thread (the disk writer) that the child won't have.
+  fflush(stdout);
+  fflush(stderr);
+  NixFileManager *fm = (NixFileManager *)g_filemanager;
+  fm->lockForFork();
+  pid_t child = fork();
+  fm->unlockAfterFork(child == 0);
+
+  if (child == 0) {
+    close(fds[0]);
+    uint8_t ok = save(fn) ? 1 : 0;
+    fflush(stdout);
+    ssize_t rv = write(fds[1], &ok, 1);
+    (void)rv;
+    // No exit(): the atexit handlers and static destructors belong to
+    // the parent (the disk writer would wait forever for its thread).
+    _exit(ok ? 0 : 1);
+  }
+
+  close(fds[1]);
+  if (child == -1) {
+    printf("Unable to fork for suspend: %s\n", strerror(errno));
+    close(fds[0]);
+    return false;
+  }
+
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  pid = child;
+  pipeFd = fds[0];
+  return true;
+}
+
+int BackgroundSuspend::poll(bool wait)
+{
+  if (!busy())
+    return BGSUSPEND_IDLE;
+
+  if (wait)
+    fcntl(pipeFd, F_SETFL, 0);
+
+  uint8_t ok = 0;
+  ssize_t rv;
+  do {
+    rv = read(pipeFd, &ok, 1);
+  } while (rv == -1 && errno == EINTR);
+  if (rv == -1 && errno == EAGAIN)
+    return BGSUSPEND_RUNNING;
+
+  // Either it told us how it went, or it died before it could (and
+  // the pipe closed). Either way it's gone, or about to be.
+  int status = 0;
+  while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+    ;
+  close(pipeFd);
+  pid = -1;
+  pipeFd = -1;
+
+  if (rv == 1 && ok && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    return BGSUSPEND_DONE;
+  return BGSUSPEND_FAILED;
+}
@@ -0,0 +1,44 @@
+#ifndef __BGSUSPEND_H
+#define __BGSUSPEND_H
+
+#include <sys/types.h>
+
+// Writes a suspend file without stopping the emulator. start() forks;
+// the child saves from its copy-on-write image of the machine and
+// exits, and the parent carries straight on. The child reports back
+// through a pipe, which poll() checks. Only one runs at a time.
+//
+// The child can't flush disk images (the disk writer thread isn't
+// there, and the parent is still writing them), so the caller flushes
+// them before start(), which leaves them clean in the child.
+
+enum {
+  BGSUSPEND_IDLE,
+  BGSUSPEND_RUNNING,
+  BGSUSPEND_DONE,
+  BGSUSPEND_FAILED
+};
+
+class BackgroundSuspend {
+ public:
+  // Runs in the child, with the file manager usable
+  typedef bool (*saveFn)(const char *fn);
+
+  BackgroundSuspend();
+  // Waits for a running one to finish
+  ~BackgroundSuspend();
+
+  // False if one is still running or the fork fails
+  bool start(const char *fn, saveFn save);
+  bool busy() { return pid != -1; }
+
+  // How the last one went. DONE and FAILED are reported once, after
+  // which it's IDLE again.
+  int poll(bool wait = false);
+
+ private:
+  pid_t pid;
+  int pipeFd;
+};
+
+#endif
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "compressed-image.h"
+#include "image-map.h"
+#include "inflate.h"
+
+// gzip flag bits (RFC 1952)
+#define GZ_FHCRC    0x02
+#define GZ_FEXTRA   0x04
+#define GZ_FNAME    0x08
+#define GZ_FCOMMENT 0x10
+
+static uint16_t le16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static uint32_t le32(const uint8_t *p) { return le16(p) | ((uint32_t)le16(p+2) << 16); }
+
+static bool isGzip(const uint8_t *p, uint32_t len)
+{
+  return len >= 18 && p[0] == 0x1F && p[1] == 0x8B && p[2] == 8;
+}
+
+static bool isZip(const uint8_t *p, uint32_t len)
+{
+  return len >= 22 && p[0] == 'P' && p[1] == 'K' && p[2] == 3 && p[3] == 4;
+}
+
+bool isCompressedImage(const char *path)
+{
+  uint8_t magic[4];
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return false;
+  bool ret = (read(fd, magic, 4) == 4 &&
+              (isGzip(magic, 18) || isZip(magic, 22)));
+  close(fd);
+  return ret;
+}
+
+static bool isDiskImageName(const char *name, size_t len)
+{
+  static const char *exts[] = { ".dsk", ".do", ".po", ".nib", ".woz",
+                                ".hdv", ".2mg", ".img" };
+  for (size_t i = 0; i < sizeof(exts)/sizeof(exts[0]); i++) {
+    size_t el = strlen(exts[i]);
+    if (len > el && !strncasecmp(name + len - el, exts[i], el))
+      return true;
+  }
+  return false;
+}
+
+static void copyName(char *dest, size_t destLen, const char *src, size_t srcLen)
+{
+  if (!destLen)
+    return;
+  if (srcLen >= destLen)
+    srcLen = destLen - 1;
+  memcpy(dest, src, srcLen);
+  dest[srcLen] = 0;
+}
+
+// Decode `method` data (stored or deflated) into a new buffer
+static uint8_t *decodeMember(const uint8_t *data, uint32_t dataLen,
+                             uint8_t method, uint32_t size)
+{
+  if (!size)
+    return NULL;
+  uint8_t *out = (uint8_t *)malloc(size);
+  if (!out)
+    return NULL;
+
+  if (method == 0 && dataLen >= size) {
+    memcpy(out, data, size);
+    return out;
+  }
+  if (method == 8 && inflateRaw(data, dataLen, out, size, NULL) == (int32_t)size)
+    return out;
+
+  free(out);
+  return NULL;
+}
+
+static uint8_t *readGzip(const uint8_t *p, uint32_t len, const char *path,
+                         uint32_t *size, char *innerName, size_t nameLen)
+{
+  uint8_t flags = p[3];
+  uint32_t pos = 10;
+  if (flags & GZ_FEXTRA) {
+    if (pos + 2 > len)
+      return NULL;
+    pos += 2 + le16(&p[pos]);
+  }
+
+  // The original name, if it was stored; otherwise ours without ".gz"
+  const char *base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+  size_t baseLen = strlen(base);
+  if (baseLen > 3 && !strcasecmp(base + baseLen - 3, ".gz"))
+    baseLen -= 3;
+  copyName(innerName, nameLen, base, baseLen);
+  if (flags & GZ_FNAME) {
+    uint32_t start = pos;
+    while (pos < len && p[pos])
+      pos++;
+    copyName(innerName, nameLen, (const char *)&p[start], pos - start);
+    pos++;
+  }
+  if (flags & GZ_FCOMMENT) {
+    while (pos < len && p[pos])
+      pos++;
+    pos++;
+  }
+  if (flags & GZ_FHCRC)
+    pos += 2;
+  if (pos + 8 > len)
+    return NULL;
+
+  // The trailer's ISIZE is the decoded size (mod 4GB, which is fine
+  // for disk images)
+  *size = le32(&p[len - 4]);
+  return decodeMember(&p[pos], len - 8 - pos, 8, *size);
+}
+
+static uint8_t *readZip(const uint8_t *p, uint32_t len,
+                        uint32_t *size, char *innerName, size_t nameLen)
+{
+  // The central directory has the real sizes even when the local
+  // headers defer them to a data descriptor. Find its end record by
+  // scanning back over a possible comment.
+  int64_t eocd = -1;
+  for (int64_t i = (int64_t)len - 22; i >= 0 && i >= (int64_t)len - 22 - 0xFFFF; i--) {
+    if (p[i] == 'P' && p[i+1] == 'K' && p[i+2] == 5 && p[i+3] == 6) {
+      eocd = i;
+      break;
+    }
+  }
+  if (eocd < 0)
+    return NULL;
+
+  uint16_t entries = le16(&p[eocd + 10]);
+  uint32_t pos = le32(&p[eocd + 16]);
+  for (uint16_t e = 0; e < entries; e++) {
+    if (pos + 46 > len || le32(&p[pos]) != 0x02014B50)
+      return NULL;
+    uint16_t method = le16(&p[pos + 10]);
+    uint32_t csize = le32(&p[pos + 20]);
+    uint32_t usize = le32(&p[pos + 24]);
+    uint16_t nlen = le16(&p[pos + 28]);
+    uint16_t xlen = le16(&p[pos + 30]);
+    uint16_t clen = le16(&p[pos + 32]);
+    uint32_t local = le32(&p[pos + 42]);
+    const char *name = (const char *)&p[pos + 46];
+    pos += 46 + nlen + xlen + clen;
+
+    if ((method != 0 && method != 8) || !isDiskImageName(name, nlen))
+      continue;
+    if (local + 30 > len || le32(&p[local]) != 0x04034B50)
+      return NULL;
+    uint32_t data = local + 30 + le16(&p[local + 26]) + le16(&p[local + 28]);
+    if (data > len || csize > len - data)
+      return NULL;
+
+    copyName(innerName, nameLen, name, nlen);
+    *size = usize;
+    return decodeMember(&p[data], csize, method, usize);
+  }
+  return NULL;
+}
+
+uint8_t *readCompressedImage(const char *path, uint32_t *size,
+                             char *innerName, size_t nameLen)
+{
+  uint32_t len;
+  const uint8_t *p = mapImageFile(path, &len);
+  if (!p)
+    return NULL;
+
+  uint8_t *ret = NULL;
+  *size = 0;
+  if (isGzip(p, len))
+    ret = readGzip(p, len, path, size, innerName, nameLen);
+  else if (isZip(p, len))
+    ret = readZip(p, len, size, innerName, nameLen);
+
+  unmapImageFile(p, len);
+  if (!ret)
+    printf("Unable to decode compressed image '%s'\n", path);
+  return ret;
+}
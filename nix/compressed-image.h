@@ -0,0 +1,19 @@
+#ifndef __COMPRESSEDIMAGE_H
+#define __COMPRESSEDIMAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Disk images stored as .gz, or as the first disk image inside a
+// .zip. Containers are recognized by their magic numbers, not their
+// names.
+bool isCompressedImage(const char *path);
+
+// Decodes the image in `path` into a new malloc()'d buffer, and puts
+// the name of the image inside (e.g. "game.woz" for "game.woz.gz") in
+// innerName, so the caller can pick a loader from its extension.
+// Returns NULL if it isn't a container we understand or is corrupt.
+uint8_t *readCompressedImage(const char *path, uint32_t *size,
+                             char *innerName, size_t nameLen);
+
+#endif
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "disk-overlay.h"
+
+#define HEADERSIZE 12
+
+static char *s_overlayDir = NULL;
+
+void setOverlayDir(const char *dir)
+{
+  free(s_overlayDir);
+  s_overlayDir = NULL;
+  if (!dir)
+    return;
+
+  if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+    printf("Unable to create overlay directory '%s': %s\n", dir, strerror(errno));
+    return;
+  }
+  s_overlayDir = strdup(dir);
+}
+
+bool overlayPathFor(const char *image, bool compressed, char *out, size_t len)
+{
+  if (s_overlayDir) {
+    // Named after the image, plus a hash of its full path so that
+    // images with the same name in different places don't collide
+    char full[PATH_MAX];
+    const char *p = realpath(image, full) ? full : image;
+    uint32_t h = 0x811c9dc5;
+    while (*p)
+      h = (h ^ (uint8_t)*p++) * 0x01000193;
+    const char *base = strrchr(image, '/');
+    snprintf(out, len, "%s/%s-%08x.ovl", s_overlayDir,
+             base ? base + 1 : image, h);
+    return true;
+  }
+  if (compressed) {
+    snprintf(out, len, "%s.ovl", image);
+    return true;
+  }
+  return false;
+}
+
+DiskOverlay::DiskOverlay()
+{
+  path = NULL;
+  fd = -1;
+  unitCount = 0;
+  index = NULL;
+  fileEnd = 0;
+}
+
+DiskOverlay::~DiskOverlay()
+{
+  release();
+}
+
+bool DiskOverlay::load(const char *path, uint32_t unitCount)
+{
+  release();
+  this->path = strdup(path);
+  this->unitCount = unitCount;
+  index = (uint32_t *)calloc(unitCount * 2, sizeof(uint32_t));
+  if (!this->path || !index) {
+    release();
+    return false;
+  }
+  fileEnd = HEADERSIZE + unitCount * 8;
+
+  fd = ::open(path, O_RDWR);
+  if (fd == -1) {
+    if (errno == ENOENT)
+      return true; // created when something is written
+    printf("Unable to open overlay '%s': %s\n", path, strerror(errno));
+    release();
+    return false;
+  }
+
+  uint8_t header[HEADERSIZE];
+  struct stat st;
+  if (pread(fd, header, HEADERSIZE, 0) != HEADERSIZE ||
+      memcmp(header, DISKOVERLAY_MAGIC, 8) ||
+      (uint32_t)(header[8] | (header[9] << 8) | (header[10] << 16) | (header[11] << 24)) != unitCount ||
+      pread(fd, index, unitCount * 8, HEADERSIZE) != (ssize_t)(unitCount * 8) ||
+      fstat(fd, &st) == -1) {
+    printf("'%s' isn't an overlay for this image\n", path);
+    release();
+    return false;
+  }
+  // The index is stored little-endian, like everything else on disk
+  for (uint32_t i = 0; i < unitCount * 2; i++) {
+    uint8_t *b = (uint8_t *)&index[i];
+    index[i] = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+  }
+  fileEnd = st.st_size;
+  return true;
+}
+
+void DiskOverlay::release()
+{
+  if (fd != -1) {
+    ::close(fd);
+    fd = -1;
+  }
+  free(path);
+  path = NULL;
+  free(index);
+  index = NULL;
+  unitCount = 0;
+}
+
+bool DiskOverlay::readUnit(uint32_t unit, void *buf, uint32_t len)
+{
+  if (!has(unit) || fd == -1 || len > index[unit*2+1])
+    return false;
+  return pread(fd, buf, len, index[unit*2]) == (ssize_t)len;
+}
+
+bool DiskOverlay::writeUnit(uint32_t unit, const void *buf, uint32_t len)
+{
+  if (unit >= unitCount || !len)
+    return false;
+  if (fd == -1 && !create())
+    return false;
+
+  // Reuse the unit's space if it still fits; otherwise append
+  uint32_t offset = index[unit*2];
+  if (!offset || len > index[unit*2+1]) {
+    offset = fileEnd;
+    fileEnd += len;
+  }
+  // The data lands before the index points at it
+  if (pwrite(fd, buf, len, offset) != (ssize_t)len)
+    return false;
+  index[unit*2] = offset;
+  index[unit*2+1] = len;
+  return writeIndexEntry(unit);
+}
+
+bool DiskOverlay::sync()
+{
+  return fd == -1 || fsync(fd) == 0;
+}
+
+bool DiskOverlay::create()
+{
+  fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    printf("Unable to create overlay '%s': %s\n", path, strerror(errno));
+    return false;
+  }
+  uint8_t header[HEADERSIZE];
+  memcpy(header, DISKOVERLAY_MAGIC, 8);
+  header[8] = unitCount;
+  header[9] = unitCount >> 8;
+  header[10] = unitCount >> 16;
+  header[11] = unitCount >> 24;
+  if (pwrite(fd, header, HEADERSIZE, 0) != HEADERSIZE ||
+      ftruncate(fd, HEADERSIZE + unitCount * 8) == -1) {
+    ::close(fd);
+    fd = -1;
+    return false;
+  }
+  fileEnd = HEADERSIZE + unitCount * 8;
+  return true;
+}
+
+bool DiskOverlay::writeIndexEntry(uint32_t unit)
+{
+  uint8_t b[8];
+  for (int i = 0; i < 2; i++) {
+    uint32_t v = index[unit*2+i];
+    b[i*4] = v;
+    b[i*4+1] = v >> 8;
+    b[i*4+2] = v >> 16;
+    b[i*4+3] = v >> 24;
+  }
+  return pwrite(fd, b, 8, HEADERSIZE + unit * 8) == 8;
+}
@@ -0,0 +1,57 @@
+#ifndef __DISKOVERLAY_H
+#define __DISKOVERLAY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A sidecar file holding rewritten pieces of a disk image (tracks for
+// the Disk II, blocks for HD32), so the image itself never changes.
+// Units are numbered by the caller and can be any length; a unit
+// that's rewritten at the same size or smaller reuses its space.
+//
+// The file is an 8-byte magic, a unit count, an index of
+// (offset, length) pairs - offset 0 for units that aren't present -
+// and the unit data. It's only created on the first write.
+
+#define DISKOVERLAY_MAGIC "AIIEOVL1"
+
+// Overlay mode: with a directory set, images are opened read-only and
+// everything written to them goes to an overlay in that directory, so
+// any number of emulators can share one master image. Each one just
+// needs its own directory.
+void setOverlayDir(const char *dir);
+
+// Where the overlay for `image` is kept, if it gets one: always in
+// overlay mode, and otherwise only for compressed images (which can't
+// be written back), as "<image>.ovl".
+bool overlayPathFor(const char *image, bool compressed, char *out, size_t len);
+
+class DiskOverlay {
+ public:
+  DiskOverlay();
+  ~DiskOverlay();
+
+  // Reads the index if `path` exists. Fails if it exists but isn't an
+  // overlay for `unitCount` units.
+  bool load(const char *path, uint32_t unitCount);
+  void release();
+
+  uint32_t units() { return unitCount; }
+  bool has(uint32_t unit) { return unit < unitCount && index[unit*2]; }
+  uint32_t length(uint32_t unit) { return has(unit) ? index[unit*2+1] : 0; }
+  bool readUnit(uint32_t unit, void *buf, uint32_t len);
+  bool writeUnit(uint32_t unit, const void *buf, uint32_t len);
+  bool sync();
+
+ private:
+  bool create();
+  bool writeIndexEntry(uint32_t unit);
+
+  char *path;
+  int fd;
+  uint32_t unitCount;
+  uint32_t *index;   // offset, length for each unit
+  uint32_t fileEnd;
+};
+
+#endif
@@ -0,0 +1,106 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "image-map.h"
+
+// Images up to this size (every floppy) are read into anonymous memory
+// instead of being mapped; see mapPrivate().
+#define IMAGEMAP_COPYSIZE (2 * 1024 * 1024)
+
+// A private mapping isn't a snapshot. Pages we haven't touched (or,
+// for a writable one, haven't written) still show whatever anyone
+// else writes to the file afterwards, and if the file is truncated
+// under us, touching the pages past its new end raises SIGBUS. For
+// floppy-sized images a copy costs next to nothing and avoids both;
+// the big ones (hard drive images) are still mapped, and the user
+// shouldn't be rewriting those while they're in use anyway.
+static void *mapPrivate(int fd, uint32_t size, int prot)
+{
+  if (size > IMAGEMAP_COPYSIZE)
+    return mmap(NULL, size, prot, MAP_PRIVATE, fd, 0);
+
+  // Anonymous, so unmapImageFile() can munmap it like the rest
+  uint8_t *p = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return MAP_FAILED;
+  uint32_t pos = 0;
+  while (pos < size) {
+    ssize_t got = pread(fd, p + pos, size - pos, pos);
+    if (got <= 0) {
+      munmap(p, size);
+      return MAP_FAILED;
+    }
+    pos += got;
+  }
+  if (!(prot & PROT_WRITE))
+    mprotect(p, size, prot);
+  return p;
+}
+
+const uint8_t *mapImageFile(const char *path, uint32_t *size)
+{
+  *size = 0;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0 || st.st_size > 0x7FFFFFFF) {
+    close(fd);
+    return NULL;
+  }
+
+  // Either way, it outlives the descriptor
+  void *p = mapPrivate(fd, st.st_size, PROT_READ);
+  close(fd);
+  if (p == MAP_FAILED)
+    return NULL;
+
+  *size = st.st_size;
+  return (const uint8_t *)p;
+}
+
+uint8_t *mapImageFileWritable(const char *path, uint32_t *size, bool shared)
+{
+  *size = 0;
+  int fd = open(path, shared ? O_RDWR : O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0 || st.st_size > 0x7FFFFFFF) {
+    close(fd);
+    return NULL;
+  }
+
+  void *p = shared ?
+    mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) :
+    mapPrivate(fd, st.st_size, PROT_READ | PROT_WRITE);
+  close(fd);
+  if (p == MAP_FAILED)
+    return NULL;
+
+  *size = st.st_size;
+  return (uint8_t *)p;
+}
+
+bool syncImageFile(uint8_t *base, uint32_t offset, uint32_t len, bool wait)
+{
+  if (!base || !len)
+    return true;
+
+  // msync wants a page-aligned start
+  uint32_t pageMask = sysconf(_SC_PAGESIZE) - 1;
+  uint32_t start = offset & ~pageMask;
+  return msync(base + start, len + (offset - start),
+               wait ? MS_SYNC : MS_ASYNC) == 0;
+}
+
+void unmapImageFile(const uint8_t *base, uint32_t size)
+{
+  if (base)
+    munmap((void *)base, size);
+}
@@ -0,0 +1,24 @@
+#ifndef __IMAGEMAP_H
+#define __IMAGEMAP_H
+
+#include <stdint.h>
+
+// A read-only view of a whole file, for loaders that can use the
+// bytes where they sit instead of reading them into buffers. Returns
+// NULL (and a size of 0) if the file can't be mapped; the caller
+// falls back to reading it. Floppy-sized files are copied rather
+// than mapped, so later changes to the file don't show through; big
+// ones are mapped, and must not be truncated while they're in use.
+const uint8_t *mapImageFile(const char *path, uint32_t *size);
+void unmapImageFile(const uint8_t *base, uint32_t size);
+
+// A writable view. With `shared`, stores land in the file itself
+// (syncImageFile pushes them out); without it they stay private to
+// this process and the file never changes (but, as above, it may
+// still change under a big one).
+uint8_t *mapImageFileWritable(const char *path, uint32_t *size, bool shared);
+// Write back dirty pages in [offset, offset+len). With `wait` false
+// this only starts the writeback.
+bool syncImageFile(uint8_t *base, uint32_t offset, uint32_t len, bool wait);
+
+#endif
@@ -0,0 +1,311 @@
+#include <string.h>
+#include <pthread.h>
+
+#include "inflate.h"
+
+// Canonical Huffman decoding in the style of zlib's "puff": for each
+// code length, how many codes there are, and the symbols in code
+// order. Decoding walks the lengths one bit at a time.
+
+#define MAXBITS 15
+#define MAXLCODES 286
+#define MAXDCODES 30
+#define FIXLCODES 288
+
+typedef struct _huffman {
+  uint16_t count[MAXBITS+1];
+  uint16_t symbol[FIXLCODES];
+} huffman;
+
+typedef struct _inflateState {
+  const uint8_t *src;
+  uint32_t srcLen;
+  uint32_t srcPos;
+  uint32_t bitBuf;
+  uint8_t bitCount;
+
+  uint8_t *dest;
+  uint32_t destLen;
+  uint32_t destPos;
+} inflateState;
+
+static const uint16_t lengthBase[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t lengthExtra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t distBase[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+  8193, 12289, 16385, 24577 };
+static const uint8_t distExtra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// Returns -1 (as an int32) if we run out of input
+static int32_t bits(inflateState *s, uint8_t need)
+{
+  uint32_t val = s->bitBuf;
+  while (s->bitCount < need) {
+    if (s->srcPos >= s->srcLen)
+      return -1;
+    val |= (uint32_t)s->src[s->srcPos++] << s->bitCount;
+    s->bitCount += 8;
+  }
+  s->bitBuf = val >> need;
+  s->bitCount -= need;
+  return val & ((1UL << need) - 1);
+}
+
+static int32_t decodeSymbol(inflateState *s, const huffman *h)
+{
+  int32_t code = 0, first = 0, index = 0;
+  for (int len = 1; len <= MAXBITS; len++) {
+    int32_t b = bits(s, 1);
+    if (b < 0)
+      return -1;
+    code |= b;
+    int32_t count = h->count[len];
+    if (code - count < first)
+      return h->symbol[index + (code - first)];
+    index += count;
+    first += count;
+    first <<= 1;
+    code <<= 1;
+  }
+  return -1;
+}
+
+// Returns false for an over-subscribed or otherwise bad set of lengths.
+// Incomplete codes are allowed (a single distance code is legal).
+static bool buildHuffman(huffman *h, const uint8_t *length, int n)
+{
+  uint16_t offs[MAXBITS+1];
+
+  memset(h->count, 0, sizeof(h->count));
+  for (int sym = 0; sym < n; sym++)
+    h->count[length[sym]]++;
+  if (h->count[0] == n)
+    return true;
+
+  int32_t left = 1;
+  for (int len = 1; len <= MAXBITS; len++) {
+    left <<= 1;
+    left -= h->count[len];
+    if (left < 0)
+      return false;
+  }
+
+  offs[1] = 0;
+  for (int len = 1; len < MAXBITS; len++)
+    offs[len + 1] = offs[len] + h->count[len];
+  for (int sym = 0; sym < n; sym++) {
+    if (length[sym])
+      h->symbol[offs[length[sym]]++] = sym;
+  }
+  return true;
+}
+
+static bool stored(inflateState *s)
+{
+  // Stored blocks start on a byte boundary
+  s->bitBuf = 0;
+  s->bitCount = 0;
+  if (s->srcPos + 4 > s->srcLen)
+    return false;
+  uint16_t len = s->src[s->srcPos] | (s->src[s->srcPos+1] << 8);
+  uint16_t nlen = s->src[s->srcPos+2] | (s->src[s->srcPos+3] << 8);
+  s->srcPos += 4;
+  if (len != (uint16_t)~nlen)
+    return false;
+  if (s->srcPos + len > s->srcLen || s->destPos + len > s->destLen)
+    return false;
+  memcpy(&s->dest[s->destPos], &s->src[s->srcPos], len);
+  s->srcPos += len;
+  s->destPos += len;
+  return true;
+}
+
+static bool codes(inflateState *s, const huffman *lencode, const huffman *distcode)
+{
+  while (1) {
+    int32_t sym = decodeSymbol(s, lencode);
+    if (sym < 0)
+      return false;
+    if (sym < 256) {
+      if (s->destPos >= s->destLen)
+        return false;
+      s->dest[s->destPos++] = sym;
+      continue;
+    }
+    if (sym == 256)
+      return true;
+
+    sym -= 257;
+    if (sym >= 29)
+      return false;
+    int32_t extra = bits(s, lengthExtra[sym]);
+    if (extra < 0)
+      return false;
+    uint32_t len = lengthBase[sym] + extra;
+
+    sym = decodeSymbol(s, distcode);
+    if (sym < 0 || sym >= 30)
+      return false;
+    extra = bits(s, distExtra[sym]);
+    if (extra < 0)
+      return false;
+    uint32_t dist = distBase[sym] + extra;
+
+    if (dist > s->destPos || s->destPos + len > s->destLen)
+      return false;
+    // May overlap itself (dist < len), so this has to go forwards
+    uint8_t *out = &s->dest[s->destPos];
+    const uint8_t *from = out - dist;
+    for (uint32_t i = 0; i < len; i++)
+      out[i] = from[i];
+    s->destPos += len;
+  }
+}
+
+// The fixed codes are built once, by whichever thread gets there
+// first (diskbatch inflates images on several at once).
+static huffman fixedLencode, fixedDistcode;
+static pthread_once_t fixedOnce = PTHREAD_ONCE_INIT;
+
+static void buildFixed()
+{
+  uint8_t lengths[FIXLCODES];
+  int sym;
+  for (sym = 0; sym < 144; sym++) lengths[sym] = 8;
+  for (; sym < 256; sym++) lengths[sym] = 9;
+  for (; sym < 280; sym++) lengths[sym] = 7;
+  for (; sym < FIXLCODES; sym++) lengths[sym] = 8;
+  buildHuffman(&fixedLencode, lengths, FIXLCODES);
+  for (sym = 0; sym < MAXDCODES; sym++) lengths[sym] = 5;
+  buildHuffman(&fixedDistcode, lengths, MAXDCODES);
+}
+
+static bool fixed(inflateState *s)
+{
+  pthread_once(&fixedOnce, buildFixed);
+  return codes(s, &fixedLencode, &fixedDistcode);
+}
+
+static bool dynamic(inflateState *s)
+{
+  static const uint8_t order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+  uint8_t lengths[MAXLCODES + MAXDCODES];
+  huffman lencode, distcode;
+
+  int32_t nlen = bits(s, 5);
+  int32_t ndist = bits(s, 5);
+  int32_t ncode = bits(s, 4);
+  if (nlen < 0 || ndist < 0 || ncode < 0)
+    return false;
+  nlen += 257;
+  ndist += 1;
+  ncode += 4;
+  if (nlen > MAXLCODES || ndist > MAXDCODES)
+    return false;
+
+  int index;
+  for (index = 0; index < ncode; index++) {
+    int32_t b = bits(s, 3);
+    if (b < 0)
+      return false;
+    lengths[order[index]] = b;
+  }
+  for (; index < 19; index++)
+    lengths[order[index]] = 0;
+  if (!buildHuffman(&lencode, lengths, 19))
+    return false;
+
+  index = 0;
+  while (index < nlen + ndist) {
+    int32_t sym = decodeSymbol(s, &lencode);
+    if (sym < 0)
+      return false;
+    if (sym < 16) {
+      lengths[index++] = sym;
+      continue;
+    }
+    uint8_t len = 0;
+    int32_t repeat;
+    if (sym == 16) {
+      if (index == 0)
+        return false;
+      len = lengths[index - 1];
+      repeat = bits(s, 2);
+      if (repeat < 0) return false;
+      repeat += 3;
+    } else if (sym == 17) {
+      repeat = bits(s, 3);
+      if (repeat < 0) return false;
+      repeat += 3;
+    } else {
+      repeat = bits(s, 7);
+      if (repeat < 0) return false;
+      repeat += 11;
+    }
+    if (index + repeat > nlen + ndist)
+      return false;
+    while (repeat--)
+      lengths[index++] = len;
+  }
+
+  // There has to be an end-of-block code
+  if (lengths[256] == 0)
+    return false;
+  if (!buildHuffman(&lencode, lengths, nlen) ||
+      !buildHuffman(&distcode, lengths + nlen, ndist))
+    return false;
+
+  return codes(s, &lencode, &distcode);
+}
+
+int32_t inflateRaw(const uint8_t *src, uint32_t srcLen,
+                   uint8_t *dest, uint32_t destLen, uint32_t *srcUsed)
+{
+  inflateState s;
+  s.src = src;
+  s.srcLen = srcLen;
+  s.srcPos = 0;
+  s.bitBuf = 0;
+  s.bitCount = 0;
+  s.dest = dest;
+  s.destLen = destLen;
+  s.destPos = 0;
+
+  int32_t last;
+  do {
+    last = bits(&s, 1);
+    int32_t type = bits(&s, 2);
+    if (last < 0 || type < 0)
+      return -1;
+
+    bool ok;
+    switch (type) {
+    case 0:
+      ok = stored(&s);
+      break;
+    case 1:
+      ok = fixed(&s);
+      break;
+    case 2:
+      ok = dynamic(&s);
+      break;
+    default:
+      ok = false;
+      break;
+    }
+    if (!ok)
+      return -1;
+  } while (!last);
+
+  if (srcUsed)
+    *srcUsed = s.srcPos;
+  return s.destPos;
+}
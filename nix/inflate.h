@@ -0,0 +1,16 @@
+#ifndef __INFLATE_H
+#define __INFLATE_H
+
+#include <stdint.h>
+
+// A small, self-contained raw DEFLATE (RFC 1951) decoder, for reading
+// compressed disk images without zlib. It decodes straight into the
+// caller's buffer, which doubles as the 32K history window.
+//
+// Returns the number of bytes written to dest, or -1 if the stream is
+// malformed or wouldn't fit. *srcUsed (if not NULL) gets the number of
+// input bytes consumed, so a caller can find what follows the stream.
+int32_t inflateRaw(const uint8_t *src, uint32_t srcLen,
+                   uint8_t *dest, uint32_t destLen, uint32_t *srcUsed);
+
+#endif
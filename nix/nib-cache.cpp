@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "nib-cache.h"
+#include "image-map.h"
+#include "nibutil.h"
+
+// Bump the last character whenever nibblizeTrack()'s output (or the
+// entry layout) changes, so old entries are ignored.
+#define NIBCACHE_MAGIC "AIIENIB2"
+
+// An entry is the header, the sector data it was made from, and the
+// nibblized track. The name is only a hash; the sector data is what
+// says an entry is the one we want.
+#define NIBCACHE_SECTORDATA (256*16)
+
+typedef struct _nibCacheHeader {
+  char magic[8];
+  uint8_t subtype;
+  uint8_t phystrack;
+  uint8_t reserved[2];
+  uint32_t bitCount;
+} nibCacheHeader;
+
+static char *s_dir = NULL;
+static mode_t s_mode = 0644; // what the entries get; see setNibCacheDir()
+static uint32_t s_hits = 0, s_misses = 0;
+
+void setNibCacheDir(const char *dir)
+{
+  free(s_dir);
+  s_dir = NULL;
+  if (!dir)
+    return;
+
+  if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+    printf("Unable to create nibble cache '%s': %s\n", dir, strerror(errno));
+    return;
+  }
+  s_dir = strdup(dir);
+
+  // mkstemp() makes its files 0600, which nobody else sharing the
+  // directory could read. Entries get what a plain creat() would have
+  // given them; the umask is read here, before there are threads,
+  // since reading it means setting it.
+  mode_t mask = umask(0);
+  umask(mask);
+  s_mode = 0666 & ~mask;
+}
+
+// FNV-1a over everything nibblizeTrack() looks at
+static uint64_t hashTrack(const uint8_t *sectorData, uint8_t subtype,
+                          uint8_t phystrack)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  uint8_t prefix[2] = { subtype, phystrack };
+  for (int i = 0; i < 2; i++)
+    h = (h ^ prefix[i]) * 0x100000001b3ULL;
+  for (int i = 0; i < 256*16; i++)
+    h = (h ^ sectorData[i]) * 0x100000001b3ULL;
+  return h;
+}
+
+static void entryPath(char *path, size_t len, const uint8_t *sectorData,
+                      uint8_t subtype, uint8_t phystrack)
+{
+  snprintf(path, len, "%s/%016llx.nib", s_dir,
+           (unsigned long long)hashTrack(sectorData, subtype, phystrack));
+}
+
+bool nibCacheLoad(const uint8_t sectorData[256*16], uint8_t subtype,
+                  uint8_t phystrack, uint8_t *out, uint32_t *bitCount)
+{
+  if (!s_dir)
+    return false;
+
+  char path[4096];
+  entryPath(path, sizeof(path), sectorData, subtype, phystrack);
+  uint32_t size;
+  const uint8_t *p = mapImageFile(path, &size);
+  if (!p) {
+    s_misses++;
+    return false;
+  }
+
+  const nibCacheHeader *h = (const nibCacheHeader *)p;
+  const uint8_t *source = p + sizeof(nibCacheHeader);
+  bool ok = (size == sizeof(nibCacheHeader) + NIBCACHE_SECTORDATA + NIBTRACKSIZE &&
+             !memcmp(h->magic, NIBCACHE_MAGIC, sizeof(h->magic)) &&
+             h->subtype == subtype && h->phystrack == phystrack &&
+             h->bitCount <= NIBTRACKSIZE*8 &&
+             !memcmp(source, sectorData, NIBCACHE_SECTORDATA));
+  if (ok) {
+    memcpy(out, source + NIBCACHE_SECTORDATA, NIBTRACKSIZE);
+    *bitCount = h->bitCount;
+    s_hits++;
+  } else {
+    s_misses++;
+  }
+  unmapImageFile(p, size);
+  return ok;
+}
+
+void nibCacheStore(const uint8_t sectorData[256*16], uint8_t subtype,
+                   uint8_t phystrack, const uint8_t *nib, uint32_t bitCount)
+{
+  if (!s_dir)
+    return;
+
+  char path[4096], tmp[4096+8];
+  entryPath(path, sizeof(path), sectorData, subtype, phystrack);
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+
+  nibCacheHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, NIBCACHE_MAGIC, sizeof(h.magic));
+  h.subtype = subtype;
+  h.phystrack = phystrack;
+  h.bitCount = bitCount;
+
+  // Written to a temporary name and renamed into place, so another
+  // emulator sharing the directory never maps a half-written entry.
+  int fd = mkstemp(tmp);
+  if (fd == -1)
+    return;
+  bool ok = (fchmod(fd, s_mode) == 0 &&
+             write(fd, &h, sizeof(h)) == sizeof(h) &&
+             write(fd, sectorData, NIBCACHE_SECTORDATA) == NIBCACHE_SECTORDATA &&
+             write(fd, nib, NIBTRACKSIZE) == NIBTRACKSIZE);
+  close(fd);
+  if (!ok || rename(tmp, path) == -1)
+    unlink(tmp);
+}
+
+void nibCacheStats(uint32_t *hits, uint32_t *misses)
+{
+  *hits = s_hits;
+  *misses = s_misses;
+}
@@ -0,0 +1,26 @@
+#ifndef __NIBCACHE_H
+#define __NIBCACHE_H
+
+#include <stdint.h>
+
+// An optional directory of already-nibblized DSK/PO tracks, so
+// inserting an image doesn't have to run nibblizeTrack() on every
+// track again. Entries are named after a hash of the track's sector
+// data (plus its sector order and track number), so when an image
+// changes its tracks just stop matching their old entries; nothing
+// ever has to be invalidated by hand. Each entry also keeps the sector
+// data it was made from, and a lookup only hits if that matches, so
+// two tracks whose hashes collide can't be mixed up.
+//
+// With no directory set, lookups miss and stores do nothing.
+void setNibCacheDir(const char *dir);
+
+// On a hit, fills out (NIBTRACKSIZE bytes) and *bitCount.
+bool nibCacheLoad(const uint8_t sectorData[256*16], uint8_t subtype,
+                  uint8_t phystrack, uint8_t *out, uint32_t *bitCount);
+void nibCacheStore(const uint8_t sectorData[256*16], uint8_t subtype,
+                   uint8_t phystrack, const uint8_t *nib, uint32_t bitCount);
+
+void nibCacheStats(uint32_t *hits, uint32_t *misses);
+
+#endif
@@ -7,22 +7,65 @@
 #include <errno.h>
 #include <dirent.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 #include "nix-filemanager.h"
+#include "image-map.h"
 
 #define ROOTDIR "./disks/"
 
+// Held for the duration of any call that touches the file tables
+class FMLock {
+ public:
+  FMLock(pthread_mutex_t *m) : m(m) { pthread_mutex_lock(m); }
+  ~FMLock() { pthread_mutex_unlock(m); }
+ private:
+  pthread_mutex_t *m;
+};
+
 NixFileManager::NixFileManager()
 {
   numCached = 0;
+  memset(snap, 0, sizeof(snap));
+  initMutex();
+}
+
+void NixFileManager::initMutex()
+{
+  // lseek() calls setSeekPosition()
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+void NixFileManager::lockForFork()
+{
+  pthread_mutex_lock(&mutex);
+}
+
+void NixFileManager::unlockAfterFork(bool inChild)
+{
+  // The child's thread has a new id, so it doesn't own the lock it
+  // inherited; it just starts over with a fresh one.
+  if (inChild)
+    initMutex();
+  else
+    pthread_mutex_unlock(&mutex);
 }
 
 NixFileManager::~NixFileManager()
 {
+  for (int i=0; i<MAXFILES; i++)
+    releaseSnapshot(i);
+  pthread_mutex_destroy(&mutex);
 }
 
 int8_t NixFileManager::openFile(const char *name)
 {
+  FMLock lock(&mutex);
+
   // See if there's a hole to re-use...
   for (int i=0; i<numCached; i++) {
     if (cachedNames[i][0] == '\0') {
@@ -49,16 +92,22 @@ int8_t NixFileManager::openFile(const char *name)
 
 void NixFileManager::closeFile(int8_t fd)
 {
+  FMLock lock(&mutex);
+
   // invalid fd provided?
   if (fd < 0 || fd >= numCached)
     return;
 
+  releaseSnapshot(fd);
+
   // clear the name
   cachedNames[fd][0] = '\0';
 }
 
 const char *NixFileManager::fileName(int8_t fd)
 {
+  FMLock lock(&mutex);
+
   if (fd < 0 || fd >= numCached)
     return NULL;
 
@@ -163,6 +212,17 @@ void NixFileManager::getRootPath(char *toWhere, int8_t maxLen)
 
 bool NixFileManager::setSeekPosition(int8_t fd, uint32_t pos)
 {
+  FMLock lock(&mutex);
+
+  if (snap[fd].data) {
+    if (pos < snap[fd].len) {
+      fileSeekPositions[fd] = pos;
+      return true;
+    }
+    fileSeekPositions[fd] = snap[fd].len;
+    return false;
+  }
+
   // This could be a whole lot simpler.
   bool ret = false;
   FILE *f = fopen(cachedNames[fd], "r");
@@ -183,6 +243,13 @@ bool NixFileManager::setSeekPosition(int8_t fd, uint32_t pos)
 
 void NixFileManager::seekToEnd(int8_t fd)
 {
+  FMLock lock(&mutex);
+
+  if (snap[fd].data) {
+    fileSeekPositions[fd] = snap[fd].len;
+    return;
+  }
+
   // This could just be a stat call...
   FILE *f = fopen(cachedNames[fd], "r");
   if (f) {
@@ -194,6 +261,8 @@ void NixFileManager::seekToEnd(int8_t fd)
 
 int NixFileManager::write(int8_t fd, const void *buf, int nbyte)
 {
+  FMLock lock(&mutex);
+
   if (fd < 0 || fd >= numCached) {
     printf("invalid fd (out of range)\n");
     return -1;
@@ -205,6 +274,28 @@ int NixFileManager::write(int8_t fd, const void *buf, int nbyte)
   }
 
   uint32_t pos = fileSeekPositions[fd];
+  snapshotBuffer *sb = &snap[fd];
+  if (sb->data) {
+    if (!sb->writing || nbyte < 0)
+      return -1;
+    if (pos + nbyte > sb->size) {
+      uint32_t newSize = sb->size * 2;
+      while (newSize < pos + nbyte)
+        newSize *= 2;
+      uint8_t *p = (uint8_t *)realloc(sb->data, newSize);
+      if (!p)
+        return -1;
+      sb->data = p;
+      sb->size = newSize;
+    }
+    if (pos > sb->len)
+      memset(&sb->data[sb->len], 0, pos - sb->len);
+    memcpy(&sb->data[pos], buf, nbyte);
+    if (pos + nbyte > sb->len)
+      sb->len = pos + nbyte;
+    fileSeekPositions[fd] += nbyte;
+    return nbyte;
+  }
   // open, seek, write, close.
   ssize_t rv = 0;
   int ffd = ::open(cachedNames[fd], O_WRONLY|O_CREAT, 0644);
@@ -234,6 +325,8 @@ int NixFileManager::write(int8_t fd, const void *buf, int nbyte)
 
 int NixFileManager::read(int8_t fd, void *buf, int nbyte)
 {
+  FMLock lock(&mutex);
+
   if (fd < 0 || fd >= numCached) {
     printf("no fd when reading? fd=%d\n", fd);
     return -1; // FIXME: error handling?
@@ -245,6 +338,14 @@ int NixFileManager::read(int8_t fd, void *buf, int nbyte)
 
   off_t pos = fileSeekPositions[fd];
 
+  if (snap[fd].data) {
+    if (nbyte < 0 || pos + nbyte > snap[fd].len)
+      return -1;
+    memcpy(buf, &snap[fd].data[pos], nbyte);
+    fileSeekPositions[fd] += nbyte;
+    return nbyte;
+  }
+
   // open, seek, read, close.
   int ffd = ::open(cachedNames[fd], O_RDONLY);
   if (ffd == -1) {
@@ -270,6 +371,8 @@ int NixFileManager::read(int8_t fd, void *buf, int nbyte)
 
 int NixFileManager::lseek(int8_t fd, int offset, int whence)
 {
+  FMLock lock(&mutex);
+
   if (whence == SEEK_CUR && offset == 0) {
     return fileSeekPositions[fd];
   }
@@ -295,3 +398,131 @@ void NixFileManager::flush()
 {
   // No files are kept open, so there's nothing to flush
 }
+
+int8_t NixFileManager::openSnapshot(const char *name, bool forWriting)
+{
+  FMLock lock(&mutex);
+
+  int8_t fd = openFile(name);
+  if (fd == -1)
+    return -1;
+
+  snapshotBuffer *sb = &snap[fd];
+  if (forWriting) {
+    // Big enough for the RAM and everything else in one go
+    sb->size = 256 * 1024;
+    sb->data = (uint8_t *)malloc(sb->size);
+    sb->writing = true;
+  } else {
+    sb->data = (uint8_t *)mapImageFile(name, &sb->len);
+    sb->mapped = (sb->data != NULL);
+    if (!sb->data) {
+      // Can't be mapped (or it's empty), so read it in one go
+      int ffd = ::open(name, O_RDONLY);
+      struct stat st;
+      if (ffd != -1 && fstat(ffd, &st) == 0) {
+        sb->data = (uint8_t *)malloc(st.st_size + 1);
+        ssize_t got = 0;
+        while (sb->data && got < st.st_size) {
+          ssize_t rv = ::read(ffd, &sb->data[got], st.st_size - got);
+          if (rv <= 0)
+            break;
+          got += rv;
+        }
+        if (sb->data && got != st.st_size) {
+          free(sb->data);
+          sb->data = NULL;
+        }
+        sb->len = got;
+      }
+      if (ffd != -1)
+        close(ffd);
+    }
+  }
+
+  if (!sb->data) {
+    printf("Unable to %s snapshot '%s': %s\n",
+           forWriting ? "create" : "read", name, strerror(errno));
+    closeFile(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool NixFileManager::commitSnapshot(int8_t fd)
+{
+  FMLock lock(&mutex);
+
+  if (fd < 0 || fd >= numCached || !snap[fd].data || !snap[fd].writing)
+    return false;
+
+  // Write it all beside the old one and rename it into place, so a
+  // crash part way through leaves the last good snapshot. (No fsync:
+  // this runs on the CPU thread, and the rename is what matters.)
+  char tmp[MAXPATH + 8];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", cachedNames[fd]);
+  int ffd = ::open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (ffd == -1) {
+    printf("Failed to open '%s' for writing: %s\n", tmp, strerror(errno));
+    return false;
+  }
+  uint32_t done = 0;
+  while (done < snap[fd].len) {
+    ssize_t rv = ::write(ffd, &snap[fd].data[done], snap[fd].len - done);
+    if (rv < 0 && errno == EINTR)
+      continue;
+    if (rv <= 0)
+      break;
+    done += rv;
+  }
+  close(ffd);
+
+  if (done != snap[fd].len || rename(tmp, cachedNames[fd])) {
+    printf("Failed to write snapshot '%s': %s\n", cachedNames[fd], strerror(errno));
+    unlink(tmp);
+    return false;
+  }
+  return true;
+}
+
+const uint8_t *NixFileManager::snapshotData(int8_t fd, uint32_t *len)
+{
+  FMLock lock(&mutex);
+
+  if (fd < 0 || fd >= numCached || !snap[fd].data || !snap[fd].writing)
+    return NULL;
+  *len = snap[fd].len;
+  return snap[fd].data;
+}
+
+int8_t NixFileManager::openSnapshotData(const uint8_t *data, uint32_t len)
+{
+  FMLock lock(&mutex);
+
+  if (!data)
+    return -1;
+
+  // The name is only there to mark the slot as in use; nothing is
+  // ever read from or written to it.
+  int8_t fd = openFile("(memory)");
+  if (fd == -1)
+    return -1;
+
+  snapshotBuffer *sb = &snap[fd];
+  sb->data = (uint8_t *)data;
+  sb->len = len;
+  sb->borrowed = true;
+  return fd;
+}
+
+void NixFileManager::releaseSnapshot(int8_t fd)
+{
+  snapshotBuffer *sb = &snap[fd];
+  if (sb->data && !sb->borrowed) {
+    if (sb->mapped)
+      unmapImageFile(sb->data, sb->len);
+    else
+      free(sb->data);
+  }
+  memset(sb, 0, sizeof(*sb));
+}
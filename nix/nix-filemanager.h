@@ -3,6 +3,7 @@
 
 #include "filemanager.h"
 #include <stdint.h>
+#include <pthread.h>
 
 class NixFileManager : public FileManager {
  public:
@@ -27,8 +28,38 @@ class NixFileManager : public FileManager {
   virtual int lseek(int8_t fd, int offset, int whence);
 
   virtual void flush();
+
+  virtual int8_t openSnapshot(const char *name, bool forWriting);
+  virtual bool commitSnapshot(int8_t fd);
+  virtual const uint8_t *snapshotData(int8_t fd, uint32_t *len);
+  virtual int8_t openSnapshotData(const uint8_t *data, uint32_t len);
+
+  // Held across a fork(), so the child doesn't start out with the
+  // lock taken by a thread it doesn't have
+  void lockForFork();
+  void unlockAfterFork(bool inChild);
+
  private:
+  void releaseSnapshot(int8_t fd);
+  void initMutex();
+
   int8_t numCached;
+
+  // The in-memory copy of an open snapshot; data is NULL for ordinary
+  // files. A snapshot being read is mapped when it can be, and one
+  // opened with openSnapshotData() borrows the caller's buffer.
+  struct snapshotBuffer {
+    uint8_t *data;
+    uint32_t len;
+    uint32_t size;
+    bool writing;
+    bool mapped;
+    bool borrowed;
+  } snap[MAXFILES];
+
+  // The disk writer thread reads and writes images through us too,
+  // and each fd's seek position is shared state.
+  pthread_mutex_t mutex;
   
 };
 
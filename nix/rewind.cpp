@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rewind.h"
+#include "globals.h"
+
+#define RAMSIZE (VMRAM_PAGES * 256)
+
+RewindBuffer::RewindBuffer(uint32_t budgetBytes, stateFn save, stateFn load,
+                           stateFn check)
+{
+  budget = budgetBytes;
+  this->save = save;
+  this->load = load;
+  this->check = check;
+  shadow = (uint8_t *)malloc(RAMSIZE);
+  memset(entries, 0, sizeof(entries));
+  first = numEntries = 0;
+  used = RAMSIZE;
+}
+
+RewindBuffer::~RewindBuffer()
+{
+  clear();
+  free(shadow);
+}
+
+void RewindBuffer::clear()
+{
+  while (numEntries)
+    dropOldest();
+  first = 0;
+}
+
+int64_t RewindBuffer::oldestCycle()
+{
+  return numEntries ? at(0)->cycle : -1;
+}
+
+int64_t RewindBuffer::newestCycle()
+{
+  return numEntries ? at(numEntries - 1)->cycle : -1;
+}
+
+uint32_t RewindBuffer::entrySize(entry *e)
+{
+  return e->stateLen + e->pageCount * (256 + sizeof(uint16_t));
+}
+
+void RewindBuffer::dropUndo(entry *e)
+{
+  used -= e->pageCount * (256 + sizeof(uint16_t));
+  free(e->pageNums);
+  free(e->pages);
+  e->pageNums = NULL;
+  e->pages = NULL;
+  e->pageCount = 0;
+}
+
+void RewindBuffer::dropOldest()
+{
+  entry *e = at(0);
+  used -= entrySize(e);
+  free(e->state);
+  free(e->pageNums);
+  free(e->pages);
+  memset(e, 0, sizeof(*e));
+  first = (first + 1) % REWIND_MAXENTRIES;
+  numEntries--;
+
+  // Nothing goes back past the oldest capture, so the new oldest one
+  // no longer needs its undo pages.
+  if (numEntries)
+    dropUndo(at(0));
+}
+
+bool RewindBuffer::capture(int64_t cycle)
+{
+  if (!shadow)
+    return false;
+
+  // The device state first; if that fails, the dirty pages are left
+  // for next time.
+  int8_t fd = g_filemanager->openSnapshot("(rewind)", true);
+  if (fd == -1)
+    return false;
+  g_ram.setSerializeContents(false);
+  bool ok = save(fd);
+  g_ram.setSerializeContents(true);
+  uint32_t stateLen = 0;
+  const uint8_t *data = ok ? g_filemanager->snapshotData(fd, &stateLen) : NULL;
+  uint8_t *state = data ? (uint8_t *)malloc(stateLen) : NULL;
+  if (state)
+    memcpy(state, data, stateLen);
+  g_filemanager->closeFile(fd);
+  if (!state) {
+    printf("Unable to capture rewind state\n");
+    return false;
+  }
+
+  if (numEntries == REWIND_MAXENTRIES)
+    dropOldest();
+
+  entry *e = at(numEntries);
+  e->cycle = cycle;
+  e->state = state;
+  e->stateLen = stateLen;
+
+  uint32_t dirty[VMRAM_DIRTYWORDS];
+  g_ram.takeDirtyPages(dirty);
+  uint8_t *ram = g_ram.memPtr(0);
+  if (numEntries == 0) {
+    // Nothing to undo back to yet; just start the shadow copy
+    memcpy(shadow, ram, RAMSIZE);
+  } else {
+    uint16_t count = 0;
+    for (int i=0; i<VMRAM_DIRTYWORDS; i++)
+      count += __builtin_popcount(dirty[i]);
+    if (count) {
+      e->pageNums = (uint16_t *)malloc(count * sizeof(uint16_t));
+      e->pages = (uint8_t *)malloc(count * 256);
+      if (!e->pageNums || !e->pages) {
+        // Put the pages back for the next try
+        for (uint16_t page = 0; page < VMRAM_PAGES; page++) {
+          if (dirty[page >> 5] & (1 << (page & 31)))
+            g_ram.markDirty(page << 8, 256);
+        }
+        free(e->pageNums);
+        free(e->pages);
+        free(e->state);
+        memset(e, 0, sizeof(*e));
+        printf("Unable to capture rewind state\n");
+        return false;
+      }
+      uint16_t n = 0;
+      for (uint16_t page = 0; page < VMRAM_PAGES; page++) {
+        if (!(dirty[page >> 5] & (1 << (page & 31))))
+          continue;
+        e->pageNums[n] = page;
+        memcpy(&e->pages[n * 256], &shadow[page << 8], 256);
+        memcpy(&shadow[page << 8], &ram[page << 8], 256);
+        n++;
+      }
+      e->pageCount = n;
+    }
+  }
+  used += entrySize(e);
+  numEntries++;
+
+  while (used > budget && numEntries > 1)
+    dropOldest();
+
+  return true;
+}
+
+int64_t RewindBuffer::restore(int64_t cycle)
+{
+  if (!numEntries)
+    return -1;
+
+  int target = 0;
+  for (int i=numEntries-1; i>0; i--) {
+    if (at(i)->cycle <= cycle) {
+      target = i;
+      break;
+    }
+  }
+
+  // Make sure the device state will load before anything is changed
+  entry *e = at(target);
+  int8_t fd = g_filemanager->openSnapshotData(e->state, e->stateLen);
+  if (fd == -1)
+    return -1;
+  bool ok = check(fd);
+  g_filemanager->closeFile(fd);
+  if (!ok) {
+    printf("Unable to restore rewind state\n");
+    return -1;
+  }
+
+  // Walk the shadow copy back from the newest capture to the target
+  // one, and that's the RAM.
+  for (int i=numEntries-1; i>target; i--) {
+    entry *e = at(i);
+    for (uint16_t n=0; n<e->pageCount; n++)
+      memcpy(&shadow[e->pageNums[n] << 8], &e->pages[n * 256], 256);
+  }
+  memcpy(g_ram.memPtr(0), shadow, RAMSIZE);
+
+  // The device state has to come after the RAM; the MMU redraws the
+  // display from it.
+  fd = g_filemanager->openSnapshotData(e->state, e->stateLen);
+  ok = false;
+  if (fd != -1) {
+    g_ram.setSerializeContents(false);
+    ok = load(fd);
+    g_ram.setSerializeContents(true);
+    g_filemanager->closeFile(fd);
+  }
+
+  uint32_t dirty[VMRAM_DIRTYWORDS];
+  g_ram.takeDirtyPages(dirty);
+
+  // Everything after it is in the future now
+  int64_t rv = e->cycle;
+  while (numEntries > target + 1) {
+    entry *last = at(numEntries - 1);
+    used -= entrySize(last);
+    free(last->state);
+    free(last->pageNums);
+    free(last->pages);
+    memset(last, 0, sizeof(*last));
+    numEntries--;
+  }
+
+  if (!ok) {
+    printf("Failed to restore rewind state\n");
+    return -1;
+  }
+  return rv;
+}
@@ -0,0 +1,81 @@
+#ifndef __REWIND_H
+#define __REWIND_H
+
+#include <stdint.h>
+
+#include "vmram.h"
+
+// An in-memory history of the machine for stepping back in time.
+//
+// Each capture keeps the device state (whatever the save callback
+// writes, with the RAM contents left out) and, instead of the RAM
+// itself, the previous contents of the pages that have been written
+// since the capture before it. A shadow copy of RAM as of the newest
+// capture is what those get undone against. An idle machine only
+// touches a handful of pages between captures, so a minute of history
+// is a few hundred KB (mostly the shadow copy).
+//
+// Disk images aren't part of it, and neither capturing nor restoring
+// flushes or reloads them: the drives go back to their position and
+// state from back then, over the images as they are now. A capture
+// made with other disks inserted won't restore.
+
+#define REWIND_MAXENTRIES 128
+
+class RewindBuffer {
+ public:
+  // save and load do the device state through the file manager fd
+  // they're given (AppleVM::SaveRewindState and LoadRewindState, in
+  // practice); check reads it without changing anything, and says
+  // whether load would work.
+  typedef bool (*stateFn)(int8_t fd);
+
+  RewindBuffer(uint32_t budgetBytes, stateFn save, stateFn load,
+               stateFn check);
+  ~RewindBuffer();
+
+  // Record the machine as it is now, at emulated cycle `cycle`. The
+  // oldest captures are dropped to stay within the budget.
+  bool capture(int64_t cycle);
+
+  // Put the machine back the way it was at the newest capture at or
+  // before `cycle` (or the oldest one, if they're all later), and
+  // forget everything after it. Returns that capture's cycle, or -1
+  // if there's nothing to go back to (or that capture can't be
+  // restored, in which case nothing has changed).
+  int64_t restore(int64_t cycle);
+
+  void clear();
+
+  int count() { return numEntries; }
+  int64_t oldestCycle();
+  int64_t newestCycle();
+  uint32_t bytesUsed() { return used; }
+
+ private:
+  struct entry {
+    int64_t cycle;
+    uint8_t *state;
+    uint32_t stateLen;
+    // Pages as they were at the previous capture
+    uint16_t pageCount;
+    uint16_t *pageNums;
+    uint8_t *pages;
+  };
+
+  entry *at(int i) { return &entries[(first + i) % REWIND_MAXENTRIES]; }
+  void dropUndo(entry *e);
+  void dropOldest();
+  uint32_t entrySize(entry *e);
+
+  uint32_t budget;
+  uint32_t used;
+  stateFn save, load, check;
+
+  uint8_t *shadow;
+  entry entries[REWIND_MAXENTRIES];
+  int first;
+  int numEntries;
+};
+
+#endif
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "wav-sink.h"
+
+#define SAMPLEBYTES sizeof(int16_t)
+
+WavSink::WavSink()
+{
+  fd = -1;
+  ring = NULL;
+  writeIdx = readIdx = 0;
+  stopping = false;
+  written = dropped = 0;
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&dataReady, NULL);
+  pthread_cond_init(&spaceReady, NULL);
+}
+
+WavSink::~WavSink()
+{
+  close();
+  pthread_mutex_destroy(&mutex);
+  pthread_cond_destroy(&dataReady);
+  pthread_cond_destroy(&spaceReady);
+}
+
+bool WavSink::open(const char *path)
+{
+  if (fd != -1)
+    close();
+
+  fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    printf("Unable to open audio output file '%s': %s\n", path, strerror(errno));
+    return false;
+  }
+
+  // Signed 16-bit mono @ 44100 Hz. The two sizes are placeholders
+  // until updateHeader() fills them in.
+  unsigned char buf[44] = { 'R','I','F','F',
+                            0xff,0xff,0xff,0x7f,
+                            'W','A','V','E',
+                            'f','m','t',' ',
+                            16,0,0,0,
+                            1,0,
+                            1,0,
+                            0x44,0xAC,0,0,
+                            0x88,0x58,1,0,
+                            2,0,
+                            16,0,
+                            'd','a','t','a',
+                            0xff,0xff,0xff,0x7f };
+  if (::write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+    printf("Unable to write WAV header: %s\n", strerror(errno));
+    ::close(fd);
+    fd = -1;
+    return false;
+  }
+
+  ring = (int16_t *)malloc(WAVSINK_RING_SAMPLES * SAMPLEBYTES);
+  writeIdx = readIdx = 0;
+  written = dropped = 0;
+  stopping = false;
+  updateHeader();
+
+  if (!ring || pthread_create(&thread, NULL, &WavSink::writerThread, this)) {
+    printf("Unable to start audio writer thread\n");
+    free(ring);
+    ring = NULL;
+    ::close(fd);
+    fd = -1;
+    return false;
+  }
+
+  printf("Recording audio to %s\n", path);
+  return true;
+}
+
+void WavSink::close()
+{
+  if (fd == -1)
+    return;
+
+  pthread_mutex_lock(&mutex);
+  stopping = true;
+  pthread_cond_signal(&dataReady);
+  pthread_mutex_unlock(&mutex);
+  pthread_join(thread, NULL);
+
+  updateHeader();
+  ::close(fd);
+  fd = -1;
+  free(ring);
+  ring = NULL;
+
+  printf("Audio recording closed: %llu samples written, %llu dropped\n",
+         (unsigned long long)written, (unsigned long long)dropped);
+}
+
+void WavSink::write(const int16_t *samples, int count, bool blockWhenFull)
+{
+  if (fd == -1 || count <= 0)
+    return;
+
+  pthread_mutex_lock(&mutex);
+  while (count) {
+    uint64_t space = WAVSINK_RING_SAMPLES - (writeIdx - readIdx);
+    if (space == 0) {
+      if (!blockWhenFull) {
+        dropped += count;
+        break;
+      }
+      pthread_cond_signal(&dataReady);
+      pthread_cond_wait(&spaceReady, &mutex);
+      continue;
+    }
+
+    // Copy up to the end of the ring, then wrap around for the rest.
+    uint32_t pos = writeIdx & WAVSINK_RING_MASK;
+    uint32_t n = count;
+    if (n > space) n = space;
+    if (n > WAVSINK_RING_SAMPLES - pos) n = WAVSINK_RING_SAMPLES - pos;
+    memcpy(&ring[pos], samples, n * SAMPLEBYTES);
+    writeIdx += n;
+    samples += n;
+    count -= n;
+  }
+  pthread_cond_signal(&dataReady);
+  pthread_mutex_unlock(&mutex);
+}
+
+void *WavSink::writerThread(void *arg)
+{
+  WavSink *self = (WavSink *)arg;
+
+  while (1) {
+    pthread_mutex_lock(&self->mutex);
+    while (self->writeIdx == self->readIdx && !self->stopping)
+      pthread_cond_wait(&self->dataReady, &self->mutex);
+    uint64_t r = self->readIdx;
+    uint64_t w = self->writeIdx;
+    bool stop = self->stopping;
+    pthread_mutex_unlock(&self->mutex);
+
+    if (w == r && stop)
+      break;
+
+    // [r, w) belongs to us until we advance readIdx, so the file I/O
+    // happens without holding the lock.
+    while (r != w) {
+      uint32_t pos = r & WAVSINK_RING_MASK;
+      uint32_t n = w - r;
+      if (n > WAVSINK_RING_SAMPLES - pos) n = WAVSINK_RING_SAMPLES - pos;
+      ssize_t ret = ::write(self->fd, &self->ring[pos], n * SAMPLEBYTES);
+      if (ret < 0) {
+        if (errno == EINTR) continue;
+        printf("Audio recording write failed: %s\n", strerror(errno));
+        // Keep draining so the producer doesn't block forever.
+        self->dropped += w - r;
+        r = w;
+        break;
+      }
+      r += ret / SAMPLEBYTES;
+      self->written += ret / SAMPLEBYTES;
+    }
+    self->updateHeader();
+
+    pthread_mutex_lock(&self->mutex);
+    self->readIdx = r;
+    pthread_cond_broadcast(&self->spaceReady);
+    pthread_mutex_unlock(&self->mutex);
+  }
+
+  return NULL;
+}
+
+void WavSink::updateHeader()
+{
+  uint32_t dataBytes = written * SAMPLEBYTES;
+  uint32_t riffBytes = dataBytes + 36;
+  unsigned char b[4];
+
+  b[0] = riffBytes; b[1] = riffBytes >> 8; b[2] = riffBytes >> 16; b[3] = riffBytes >> 24;
+  pwrite(fd, b, 4, 4);
+  b[0] = dataBytes; b[1] = dataBytes >> 8; b[2] = dataBytes >> 16; b[3] = dataBytes >> 24;
+  pwrite(fd, b, 4, 40);
+}
@@ -0,0 +1,56 @@
+#ifndef __WAVSINK_H
+#define __WAVSINK_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+// Records signed 16-bit mono 44.1 kHz audio to a WAV file. Samples
+// are pushed into a large ring buffer and a background thread does
+// the file I/O, so the producer (the real-time audio callback, or the
+// CPU thread when clocked by emulated time) never waits on the disk.
+// The header's sizes are patched after every batch, so the file is
+// playable even if we never get to close() it cleanly.
+
+// 2^20 samples is about 24 seconds of audio (2 MB).
+#define WAVSINK_RING_SAMPLES (1 << 20)
+#define WAVSINK_RING_MASK    (WAVSINK_RING_SAMPLES - 1)
+
+class WavSink {
+ public:
+  WavSink();
+  ~WavSink();
+
+  bool open(const char *path);
+  // Drains everything queued, finalizes the header and stops the
+  // writer thread.
+  void close();
+  bool isOpen() { return fd != -1; }
+
+  // Queue `count` samples. With `blockWhenFull` false, whatever
+  // doesn't fit is dropped (and counted) - use that from real-time
+  // threads. With it true, waits for the writer to make room.
+  void write(const int16_t *samples, int count, bool blockWhenFull);
+
+  uint64_t samplesWritten() { return written; }
+  uint64_t samplesDropped() { return dropped; }
+
+ private:
+  static void *writerThread(void *arg);
+  void updateHeader();
+
+  int fd;
+  int16_t *ring;
+  volatile uint64_t writeIdx;
+  volatile uint64_t readIdx;
+  volatile bool stopping;
+
+  volatile uint64_t written;
+  volatile uint64_t dropped;
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t dataReady;
+  pthread_cond_t spaceReady;
+};
+
+#endif
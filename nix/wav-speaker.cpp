@@ -0,0 +1,123 @@
+#include <string.h>
+
+#include "wav-speaker.h"
+
+#include "globals.h"
+#include "wsola-speaker.h"
+#include "applevm.h"
+
+#define HIGHVAL ((int16_t)((0x4FFF) >> (15-g_volume)))
+#define LOWVAL  ((int16_t)(-((0x4FFF) >> (15-g_volume))))
+
+#define AUDIO_SAMPLE_RATE_EXACT 44100
+
+// wsola only emits a sample once the cycle after it has been seen, so
+// stay this many samples behind emulated time to avoid padding
+// samples that are about to arrive.
+#define WAVSPEAKER_LAG 2
+
+static uint64_t sampleForCycle(int64_t c)
+{
+  return (uint64_t)c * AUDIO_SAMPLE_RATE_EXACT / 1023000;
+}
+
+WavSpeaker::WavSpeaker(const char *path)
+{
+  strncpy(this->path, path, sizeof(this->path)-1);
+  this->path[sizeof(this->path)-1] = '\0';
+  lastCycles = 0;
+  samplesProduced = 0;
+  holdLevel = 0;
+  batchFill = 0;
+}
+
+WavSpeaker::~WavSpeaker()
+{
+  close();
+}
+
+void WavSpeaker::begin()
+{
+  wsola_reset();
+  sink.open(path);
+}
+
+void WavSpeaker::reset()
+{
+  // The cycle counter keeps running across a VM reset, so our sample
+  // clock does too; only the speaker's own state starts over.
+  wsola_reset();
+}
+
+void WavSpeaker::close()
+{
+  flushBatch();
+  sink.close();
+}
+
+void WavSpeaker::toggle(int64_t c)
+{
+  wsola_toggle(c, HIGHVAL, LOWVAL);
+}
+
+void WavSpeaker::maintainSpeaker(int64_t c, uint64_t microseconds)
+{
+  if (c < 0)
+    return;
+
+  // The CPU's cycle counter is zeroed after the BIOS runs; pick up
+  // from wherever it restarts rather than waiting for it to catch up.
+  if (c < lastCycles) {
+    wsola_reset();
+    samplesProduced = sampleForCycle(c);
+  }
+  lastCycles = c;
+
+  wsola_flush(c);
+
+  uint64_t due = sampleForCycle(c);
+  if (due < samplesProduced + WAVSPEAKER_LAG)
+    return;
+  uint64_t want = due - WAVSPEAKER_LAG - samplesProduced;
+
+  while (want) {
+    int n = sizeof(batch)/sizeof(batch[0]) - batchFill;
+    if ((uint64_t)n > want) n = want;
+    int16_t *out = &batch[batchFill];
+
+    // Before the first toggle (and right after a reset) the speaker
+    // hasn't produced anything; hold the last level as silence.
+    int got = wsola_drain(out, n);
+    if (got) holdLevel = out[got-1];
+    for (int i = got; i < n; i++) out[i] = holdLevel;
+
+    Mockingboard *mb = ((AppleVM *)g_vm)->mockingboard;
+    if (mb) {
+      int16_t mbBuf[sizeof(batch)/sizeof(batch[0])];
+      mb->renderToBuffer(mbBuf, n);
+      for (int i = 0; i < n; i++) {
+        int32_t mixed = (int32_t)out[i] + (int32_t)mbBuf[i];
+        if (mixed > 0x7FFF) mixed = 0x7FFF;
+        if (mixed < -0x7FFF) mixed = -0x7FFF;
+        out[i] = (int16_t)mixed;
+      }
+    }
+
+    batchFill += n;
+    samplesProduced += n;
+    want -= n;
+    if (batchFill == sizeof(batch)/sizeof(batch[0]))
+      flushBatch();
+  }
+}
+
+void WavSpeaker::flushBatch()
+{
+  // Not a real-time thread, so wait for the writer rather than drop
+  // samples - a recording with holes is useless for comparisons.
+  sink.write(batch, batchFill, true);
+  batchFill = 0;
+}
+
+void WavSpeaker::beginMixing() {}
+void WavSpeaker::mixOutput(uint8_t v) {}
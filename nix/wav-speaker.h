@@ -0,0 +1,46 @@
+#ifndef __WAVSPEAKER_H
+#define __WAVSPEAKER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "physicalspeaker.h"
+#include "wav-sink.h"
+
+// A speaker with no audio device behind it: the mixed speaker and
+// Mockingboard output is clocked by emulated CPU cycles instead of a
+// device callback and recorded to a WAV file. Output is the same no
+// matter how fast the host runs, which is what regression tests and
+// offline benchmarks of the audio pipeline want.
+
+class WavSpeaker : public PhysicalSpeaker {
+ public:
+  WavSpeaker(const char *path);
+  virtual ~WavSpeaker();
+
+  virtual void begin();
+  virtual void reset();
+
+  virtual void toggle(int64_t c);
+  virtual void maintainSpeaker(int64_t c, uint64_t microseconds);
+  virtual void beginMixing();
+  virtual void mixOutput(uint8_t v);
+
+  void close();
+  // False if begin() couldn't open the file
+  bool isRecording() { return sink.isOpen(); }
+
+ private:
+  void flushBatch();
+
+  WavSink sink;
+  char path[256];
+
+  int64_t lastCycles;
+  uint64_t samplesProduced;
+  int16_t holdLevel;
+
+  int16_t batch[1024];
+  int batchFill;
+};
+
+#endif
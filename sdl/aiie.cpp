@@ -11,13 +11,19 @@
 #include "sdl-keyboard.h"
 #include "sdl-mouse.h"
 #include "sdl-speaker.h"
+#include "wav-speaker.h"
 #include "sdl-paddles.h"
 #include "nix-filemanager.h"
 #include "sdl-printer.h"
 #include "appleui.h"
 #include "bios.h"
 #include "nix-prefs.h"
+#include "nib-cache.h"
+#include "disk-overlay.h"
+#include "disk-writer.h"
 #include "debugger.h"
+#include "rewind.h"
+#include "bg-suspend.h"
 
 #include "globals.h"
 
@@ -36,14 +42,50 @@ char disk2name[256] = "\0";
 
 volatile bool wantSuspend = false;
 volatile bool wantResume = false;
+volatile bool wantRewind = false;
 
 volatile bool cpuDebuggerRunning = false;
 
 volatile bool cpuClockInitialized = false;
 
+// Audio recording: "-w file.wav" records what goes to the audio device;
+// "-W file.wav" skips the audio device entirely and records by
+// emulated time instead.
+static const char *wavFile = NULL;
+static bool wavOnly = false;
+
+// "-l": size the audio device buffer adaptively for low latency.
+static bool adaptiveAudio = false;
+
+// "-n": use the Disk II nibble fast path on clean tracks.
+static bool nibbleFastPath = false;
+
+// "-d": run unthrottled while a disk is loading quietly.
+static bool diskWarp = false;
+
+// "-r": keep the last minute or so in memory, and step back through
+// it with F7.
+static bool rewindEnabled = false;
+static RewindBuffer *rewindBuffer = NULL;
+#define REWIND_BUDGET (16 * 1024 * 1024)
+#define REWIND_INTERVAL (1023000 / 2) // capture every half second...
+#define REWIND_STEP (5 * 1023000)     // ... and go back five at a time
+
+// "-b": F8 suspends in a forked child, so the emulator doesn't stop
+// while the suspend file is written.
+static bool backgroundSuspend = false;
+static BackgroundSuspend bgSuspend;
+
 void doDebugging();
 void readPrefs();
 void writePrefs();
+void closeAudioRecording();
+
+// Let the queued disk writes finish before the statics go away
+void stopDiskWriter()
+{
+  g_diskWriter.stop();
+}
 
 void sigint_handler(int n)
 {
@@ -125,22 +167,124 @@ static struct timespec runBIOS(struct timespec now)
   return diff;
 }
 
+static bool suspendInChild(const char *fn)
+{
+  return g_vm->Suspend(fn);
+}
+
+static void suspendVM()
+{
+  if (!backgroundSuspend) {
+    printf("CPU halted; suspending VM\n");
+    g_vm->Suspend("suspend.vm");
+    printf("... done; resuming CPU.\n");
+    return;
+  }
+
+  if (bgSuspend.busy()) {
+    printf("Still writing the last suspend file; try again shortly\n");
+    return;
+  }
+  // Whatever's on the disks goes out from here, so the child has
+  // nothing to flush
+  ((AppleVM *)g_vm)->disk6->flushDisks();
+  if (bgSuspend.start("suspend.vm", suspendInChild))
+    printf("Suspending VM in the background\n");
+}
+
+static bool rewindSave(int8_t fd)
+{
+  return ((AppleVM *)g_vm)->SaveRewindState(fd);
+}
+
+static bool rewindLoad(int8_t fd)
+{
+  return ((AppleVM *)g_vm)->LoadRewindState(fd);
+}
+
+static bool rewindCheck(int8_t fd)
+{
+  return ((AppleVM *)g_vm)->CheckRewindState(fd);
+}
+
+// Returns true if it took the machine back in time
+static bool maintainRewind()
+{
+  static int64_t nextCapture = 0;
+
+  if (!rewindBuffer)
+    rewindBuffer = new RewindBuffer(REWIND_BUDGET, rewindSave, rewindLoad,
+                                    rewindCheck);
+
+  if (wantRewind) {
+    wantRewind = false;
+    struct timespec t0, t1;
+    int64_t from = g_cpu->cycles;
+    do_gettime(&t0);
+    int64_t at = rewindBuffer->restore(g_cpu->cycles - REWIND_STEP);
+    do_gettime(&t1);
+    if (at >= 0) {
+      struct timespec took = tsSubtract(t1, t0);
+      printf("Rewound %.1f seconds in %.2f ms (%d left, %u KB)\n",
+             (from - at) / 1023000.0,
+             took.tv_sec * 1000.0 + took.tv_nsec / 1000000.0,
+             rewindBuffer->count(), rewindBuffer->bytesUsed() / 1024);
+      if (!wavOnly)
+        g_speaker->reset();
+      nextCapture = g_cpu->cycles + REWIND_INTERVAL;
+      return true;
+    }
+    return false;
+  }
+
+  // The BIOS and the debugger both restart the cycle counter, and
+  // none of what we have lines up with it after that.
+  if (g_cpu->cycles < rewindBuffer->newestCycle()) {
+    rewindBuffer->clear();
+    nextCapture = 0;
+  }
+
+  if (g_cpu->cycles >= nextCapture) {
+    rewindBuffer->capture(g_cpu->cycles);
+    nextCapture = g_cpu->cycles + REWIND_INTERVAL;
+  }
+  return false;
+}
+
 static struct timespec runCPU(struct timespec now)
 {
   static struct timespec startTime;
   static struct timespec nextInstructionTime;
+  static int64_t startCycles = 0;
+  static bool warping = false;
   
   if (!cpuClockInitialized) {
     do_gettime(&startTime);
     do_gettime(&nextInstructionTime);
+    startCycles = g_cpu->cycles;
     cpuClockInitialized = true;
   }
 
+  // Disk warp: while the drive is loading and nothing's making a
+  // sound, don't pace the CPU at all. Re-anchor the clock on every
+  // change, so coming out of warp doesn't sleep off the cycles we ran
+  // ahead, and going in doesn't count time that already went by.
+  bool warpNow = diskWarp && ((AppleVM *)g_vm)->isQuietDiskAccess();
+  if (warpNow != warping) {
+    warping = warpNow;
+    startTime = now;
+    startCycles = g_cpu->cycles;
+    if (!warping && !wavOnly) {
+      // Whatever the speaker buffered while we were racing is silence
+      // at the wrong rate; start clean. (Recording by emulated time
+      // doesn't care how fast we ran.)
+      g_speaker->reset();
+    }
+  }
+
   // Check for interrupt-like actions before running the CPU
   if (wantSuspend) {
-    printf("CPU halted; suspending VM\n");
-    g_vm->Suspend("suspend.vm");
-    printf("... done; resuming CPU.\n");
+    suspendVM();
     wantSuspend = false;
   }
   if (wantResume) {
@@ -149,16 +293,24 @@ static struct timespec runCPU(struct timespec now)
     printf("... done. resuming CPU.\n");
     wantResume = false;
   }
+  if (rewindEnabled && maintainRewind()) {
+    // Pace from the restored cycle count
+    startTime = now;
+    startCycles = g_cpu->cycles;
+  }
 
   // Determine correct time for next CPU cycle
-  timespec_add_cycles(&startTime, g_cpu->cycles, &nextInstructionTime);
+  timespec_add_cycles(&startTime, g_cpu->cycles - startCycles, &nextInstructionTime);
 
   // Check if it's time to run - and if not, return how long it will be until we need to run
   struct timespec diff = tsSubtract(nextInstructionTime, now);
-  if (diff.tv_sec > 0 || diff.tv_nsec > 0) {
+  if (!warping && (diff.tv_sec > 0 || diff.tv_nsec > 0)) {
     // The caller can decide to nanosleep(&diff, NULL)
     return diff;
   }
+  if (warping) {
+    diff.tv_sec = diff.tv_nsec = 0;
+  }
 
   // Run the CPU
   bool debuggerWasActive = false;
@@ -277,6 +429,14 @@ void doDebugging()
     snprintf(buf, sizeof(buf), "%llX", g_cpu->cycles);
     g_display->debugMsg(buf);
     break;
+  case D_SHOWAUDIO:
+    if (!wavOnly) {
+      SDLSpeaker *spk = (SDLSpeaker *)g_speaker;
+      snprintf(buf, sizeof(buf), "%ums %u/%u", spk->latencyMs(),
+               spk->deviceBufferSamples(), spk->underruns());
+      g_display->debugMsg(buf);
+    }
+    break;
     /*
   case D_SHOWBATTERY:
     //    sprintf(buf, "BAT %d", analogRead(BATTERYPIN));
@@ -319,6 +479,15 @@ struct timespec runMaintenance(struct timespec now)
     g_mouse->maintainMouse();
   }
 
+  switch (bgSuspend.poll()) {
+  case BGSUSPEND_DONE:
+    printf("Background suspend finished\n");
+    break;
+  case BGSUSPEND_FAILED:
+    printf("Background suspend failed\n");
+    break;
+  }
+
   doDebugging();
   g_ui->drawPercentageUIElement(UIePowerPercentage, 100);
 
@@ -380,20 +549,72 @@ int main(int argc, char *argv[])
 
   /* Look for flags first and strip them out of argv/argc if present, leaving
    * just filenames for disks to have been inserted */
-  if (argc > 1 && !strcmp(argv[1], "-9")) {
-    argc--;
-    argv++;
-    use8875 = false;
-  }
-  else if (argc > 1 && !strcmp(argv[1], "-8")) {
-    argc--;
-    argv++;
-    use8875 = true;
+  while (argc > 1 && argv[1][0] == '-') {
+    if (!strcmp(argv[1], "-9")) {
+      argc--;
+      argv++;
+      use8875 = false;
+    }
+    else if (!strcmp(argv[1], "-8")) {
+      argc--;
+      argv++;
+      use8875 = true;
+    }
+    else if (!strcmp(argv[1], "-l")) {
+      argc--;
+      argv++;
+      adaptiveAudio = true;
+    }
+    else if (!strcmp(argv[1], "-n")) {
+      argc--;
+      argv++;
+      nibbleFastPath = true;
+    }
+    else if (!strcmp(argv[1], "-d")) {
+      argc--;
+      argv++;
+      diskWarp = true;
+    }
+    else if (!strcmp(argv[1], "-r")) {
+      argc--;
+      argv++;
+      rewindEnabled = true;
+    }
+    else if (!strcmp(argv[1], "-b")) {
+      argc--;
+      argv++;
+      backgroundSuspend = true;
+    }
+    // "-c dir": keep nibblized DSK/PO tracks in dir between runs.
+    else if (argc > 2 && !strcmp(argv[1], "-c")) {
+      setNibCacheDir(argv[2]);
+      argc -= 2;
+      argv += 2;
+    }
+    else if (argc > 2 && !strcmp(argv[1], "-o")) {
+      setOverlayDir(argv[2]);
+      argc -= 2;
+      argv += 2;
+    }
+    else if (argc > 2 && (!strcmp(argv[1], "-w") || !strcmp(argv[1], "-W"))) {
+      wavOnly = (argv[1][1] == 'W');
+      wavFile = argv[2];
+      argc -= 2;
+      argv += 2;
+    }
+    else {
+      break;
+    }
   }
   
-  SDL_Init(SDL_INIT_EVERYTHING);
+  SDL_Init(wavOnly ? (SDL_INIT_EVERYTHING & ~SDL_INIT_AUDIO) : SDL_INIT_EVERYTHING);
 
-  g_speaker = new SDLSpeaker();
+  if (wavOnly) {
+    g_speaker = new WavSpeaker(wavFile);
+  } else {
+    g_speaker = new SDLSpeaker();
+    ((SDLSpeaker *)g_speaker)->setAdaptiveLatency(adaptiveAudio);
+  }
   g_printer = new SDLPrinter();
 
   // create the filemanager - the interface to the host file system.
@@ -437,6 +658,7 @@ int main(int argc, char *argv[])
   // (The actual Apple VM we've built has them compiled in, though.) It will create its virutal
   // hardware (MMU, video driver, floppy, paddles, whatever).
   g_vm = new AppleVM();
+  ((AppleVM *)g_vm)->disk6->setNibbleFastPath(nibbleFastPath);
 
   g_keyboard = new SDLKeyboard(g_vm->getKeyboard());
   g_mouse = new SDLMouse();
@@ -474,8 +696,19 @@ int main(int argc, char *argv[])
   signal(SIGPIPE, SIG_IGN); // debugger might have a SIGPIPE happen if the remote end drops
 
   atexit(writePrefs);
+  atexit(stopDiskWriter);
 
   g_speaker->begin();
+  if (wavFile) {
+    bool recording = wavOnly ?
+      ((WavSpeaker *)g_speaker)->isRecording() :
+      ((SDLSpeaker *)g_speaker)->recordTo(wavFile);
+    if (!recording) {
+      printf("Unable to record audio to %s\n", wavFile);
+      exit(1);
+    }
+    atexit(closeAudioRecording);
+  }
 
   printf("Starting loop\n");
   while (1) {
@@ -483,6 +716,14 @@ int main(int argc, char *argv[])
   }
 }
 
+void closeAudioRecording()
+{
+  if (wavOnly)
+    ((WavSpeaker *)g_speaker)->close();
+  else
+    ((SDLSpeaker *)g_speaker)->stopRecording();
+}
+
 void readPrefs()
 {
   NixPrefs np;
@@ -6,6 +6,9 @@
 #include "globals.h"
 #include "sdl-display.h"
 
+extern volatile bool wantRewind;
+extern volatile bool wantSuspend;
+
 SDLKeyboard::SDLKeyboard(VMKeyboard *k) : PhysicalKeyboard(k)
 {
 }
@@ -30,6 +33,20 @@ void SDLKeyboard::handleKeypress(SDL_KeyboardEvent *key)
     return;
   }
 
+  if (key->type == SDL_KEYDOWN &&
+      key->keysym.sym == SDLK_F7) {
+    // Step back in time (only does anything with "-r")
+    wantRewind = true;
+    return;
+  }
+
+  if (key->type == SDL_KEYDOWN &&
+      key->keysym.sym == SDLK_F8) {
+    // Suspend to suspend.vm
+    wantSuspend = true;
+    return;
+  }
+
   if (key->type == SDL_KEYDOWN &&
       key->keysym.sym == SDLK_F9) {
     // Save printer output
@@ -12,6 +12,7 @@ extern "C"
 
 #include "globals.h"
 #include "wsola-speaker.h"
+#include "wav-sink.h"
 #include "applevm.h"
 
 #define HIGHVAL ((int16_t)((0x4FFF) >> (15-g_volume)))
@@ -21,16 +22,25 @@ extern "C"
 #define AUDIO_SAMPLE_RATE_EXACT 44100
 #define SAMPLEBYTES sizeof(int16_t)
 
+// Adaptive latency: start with a small device buffer and double it
+// (and the WSOLA target lag with it) whenever a one-second window sees
+// an underrun; halve it again after ADAPT_STABLE_SECS clean seconds.
+// A size that underran isn't retried for ADAPT_RETRY_SECS, so a host
+// that's marginal at some size doesn't flap between the two.
+#define ADAPT_MIN_SAMPLES 256
+#define ADAPT_STABLE_SECS 10
+#define ADAPT_RETRY_SECS  60
+
 static pthread_mutex_t togmutex = PTHREAD_MUTEX_INITIALIZER;
 volatile uint8_t audioRunning = 0;
 
-// Debug: dump wall-clock output to /tmp/out.wav. Compare with the
-// pre-WSOLA reference capture to see what the WSOLA pipeline is
-// doing to the signal.
-//#define DEBUG_OUT_WAV
-#ifdef DEBUG_OUT_WAV
-static int outputFD = -1;
-#endif
+static volatile int deviceSamples = SDLSIZE;
+static volatile uint64_t samplesPlayed = 0;
+
+// Optional recording of the mixed wall-clock output (see recordTo).
+// The callback only copies into the sink's ring; the file I/O happens
+// on the sink's own thread.
+static WavSink *recorder = NULL;
 
 static void audioCallback(void *unused, Uint8 *stream, int len)
 {
@@ -49,9 +59,10 @@ static void audioCallback(void *unused, Uint8 *stream, int len)
   // Speaker: wait for priming before producing, otherwise zero-fill.
   if (audioRunning) {
     wsola_produce(out, outputCount);
+    samplesPlayed += outputCount;
   } else {
     memset(stream, 0, len);
-    if (wsola_has_primed_fill(SDLSIZE))
+    if (wsola_has_primed_fill(deviceSamples))
       audioRunning = 1;
   }
 
@@ -68,27 +79,8 @@ static void audioCallback(void *unused, Uint8 *stream, int len)
     }
   }
 
-#ifdef DEBUG_OUT_WAV
-  if (outputFD == -1) {
-    outputFD = open("/tmp/out.wav", O_RDWR | O_CREAT | O_TRUNC, 0600);
-    // Signed 16-bit mono @ 44100 Hz.
-    unsigned char buf[44] = { 'R','I','F','F',
-                              0xff,0xff,0xff,0x7f,
-                              'W','A','V','E',
-                              'f','m','t',' ',
-                              16,0,0,0,
-                              1,0,
-                              1,0,
-                              0x44,0xAC,0,0,
-                              0x88,0x58,1,0,
-                              2,0,
-                              16,0,
-                              'd','a','t','a',
-                              0xff,0xff,0xff,0x7f };
-    write(outputFD, buf, sizeof(buf));
-  }
-  write(outputFD, (void *)out, outputCount * SAMPLEBYTES);
-#endif
+  if (recorder)
+    recorder->write(out, outputCount, false);
 
   pthread_mutex_unlock(&togmutex);
 }
@@ -97,6 +89,12 @@ SDLSpeaker::SDLSpeaker()
 {
   toggleState = false;
   mixerValue = 0x80;
+  adaptive = false;
+  windowStart = 0;
+  windowUnderruns = 0;
+  stableSecs = 0;
+  failedSize = 0;
+  failedSecsAgo = 0;
   pthread_mutex_init(&togmutex, NULL);
 }
 
@@ -109,26 +107,97 @@ void SDLSpeaker::reset()
   pthread_mutex_unlock(&togmutex);
 }
 
+void SDLSpeaker::setAdaptiveLatency(bool on)
+{
+  adaptive = on;
+}
+
 void SDLSpeaker::begin()
+{
+  wsola_reset();
+  openDevice(adaptive ? ADAPT_MIN_SAMPLES : SDLSIZE);
+}
+
+void SDLSpeaker::openDevice(int samples)
 {
   SDL_AudioSpec audioDevice, audioActual;
   SDL_memset(&audioDevice, 0, sizeof(audioDevice));
   audioDevice.freq     = AUDIO_SAMPLE_RATE_EXACT;
   audioDevice.format   = AUDIO_S16;
   audioDevice.channels = 1;
-  audioDevice.samples  = SDLSIZE;
+  audioDevice.samples  = samples;
   audioDevice.callback = audioCallback;
   audioDevice.userdata = NULL;
 
-  wsola_reset();
   audioRunning = 0;
 
   SDL_OpenAudio(&audioDevice, &audioActual);
   printf("Actual: freq %d channels %d samples %d\n",
          audioActual.freq, audioActual.channels, audioActual.samples);
+
+  // The mixing buffers are sized for SDLSIZE, so never go above it.
+  deviceSamples = audioActual.samples;
+  if (deviceSamples > SDLSIZE || deviceSamples <= 0) deviceSamples = SDLSIZE;
+  wsola_set_target_lag(deviceSamples);
+  windowStart = samplesPlayed;
+  windowUnderruns = wsola_underruns();
+  stableSecs = 0;
+
   SDL_PauseAudio(0);
 }
 
+void SDLSpeaker::adaptLatency()
+{
+  if (samplesPlayed - windowStart < AUDIO_SAMPLE_RATE_EXACT)
+    return;
+
+  // One second of audio has been played since the last look.
+  uint32_t now = wsola_underruns();
+  bool underran = (now != windowUnderruns);
+  windowStart = samplesPlayed;
+  windowUnderruns = now;
+  if (failedSize) failedSecsAgo++;
+  if (failedSecsAgo >= ADAPT_RETRY_SECS) failedSize = 0;
+
+  int newSize = deviceSamples;
+  if (underran) {
+    stableSecs = 0;
+    if (deviceSamples < SDLSIZE) {
+      failedSize = deviceSamples;
+      failedSecsAgo = 0;
+      newSize = deviceSamples * 2;
+    }
+  } else if (++stableSecs >= ADAPT_STABLE_SECS) {
+    stableSecs = 0;
+    if (deviceSamples > ADAPT_MIN_SAMPLES && deviceSamples / 2 > failedSize)
+      newSize = deviceSamples / 2;
+  }
+
+  if (newSize != deviceSamples) {
+    SDL_CloseAudio();
+    openDevice(newSize);
+    printf("Audio latency now %u ms (%u underruns so far)\n",
+           latencyMs(), underruns());
+  }
+}
+
+uint32_t SDLSpeaker::latencyMs()
+{
+  // What's queued in the device plus what WSOLA keeps buffered.
+  return (uint32_t)((deviceSamples + wsola_buffered()) * 1000 /
+                    AUDIO_SAMPLE_RATE_EXACT);
+}
+
+uint32_t SDLSpeaker::underruns()
+{
+  return wsola_underruns();
+}
+
+uint16_t SDLSpeaker::deviceBufferSamples()
+{
+  return deviceSamples;
+}
+
 void SDLSpeaker::toggle(int64_t c)
 {
   pthread_mutex_lock(&togmutex);
@@ -141,6 +210,33 @@ void SDLSpeaker::maintainSpeaker(int64_t c, uint64_t microseconds)
   pthread_mutex_lock(&togmutex);
   wsola_flush(c);
   pthread_mutex_unlock(&togmutex);
+
+  if (adaptive)
+    adaptLatency();
 }
+bool SDLSpeaker::recordTo(const char *path)
+{
+  WavSink *sink = new WavSink();
+  if (!sink->open(path)) {
+    delete sink;
+    return false;
+  }
+  pthread_mutex_lock(&togmutex);
+  WavSink *old = recorder;
+  recorder = sink;
+  pthread_mutex_unlock(&togmutex);
+  delete old;
+  return true;
+}
+
+void SDLSpeaker::stopRecording()
+{
+  pthread_mutex_lock(&togmutex);
+  WavSink *old = recorder;
+  recorder = NULL;
+  pthread_mutex_unlock(&togmutex);
+  delete old;
+}
+
 void SDLSpeaker::beginMixing() {}
 void SDLSpeaker::mixOutput(uint8_t v) {}
@@ -18,9 +18,31 @@ class SDLSpeaker : public PhysicalSpeaker {
   virtual void beginMixing();
   virtual void mixOutput(uint8_t v);
 
+  // Also record everything sent to the audio device to a WAV file.
+  bool recordTo(const char *path);
+  void stopRecording();
+
+  // Start with a small device buffer and size it (and WSOLA's target
+  // lag) to the smallest that doesn't underrun. Call before begin().
+  void setAdaptiveLatency(bool on);
+
+  uint32_t latencyMs();
+  uint32_t underruns();
+  uint16_t deviceBufferSamples();
+
  private:
+  void openDevice(int samples);
+  void adaptLatency();
+
   uint8_t mixerValue;
   bool toggleState;
+
+  bool adaptive;
+  uint64_t windowStart;
+  uint32_t windowUnderruns;
+  int stableSecs;
+  int failedSize;
+  int failedSecsAgo;
 };
 
 #endif
@@ -9,7 +9,6 @@
 }
 
 #define serializeMagic(var) { \
-  printf("Serializing magic '%d'\n", var); \
   uint8_t buf = var; \
   if (g_filemanager->write(fd, &buf, 1) != 1) { \
     printf("Failed to write 1 byte of magic\n"); \
@@ -77,7 +76,6 @@
 
 #define deserializeMagic(expect) {		\
   uint8_t buf; \
-  printf("Deserializing magic, expecting 0x%X\n", expect); \
   if (g_filemanager->read(fd, &buf, 1) != 1) { \
     printf("Failed to deserialize 1 byte of magic\n"); \
     goto err; \
@@ -134,7 +132,6 @@
       printf("Failed to read string byte\n"); \
       goto err; \
     } \
-      printf(". "); \
     *(ptr++) = c; \
     if (c == 0) { break; } \
   } \
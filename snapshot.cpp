@@ -0,0 +1,80 @@
+#ifdef TEENSYDUINO
+#include <Arduino.h>
+#include "teensy-println.h"
+#else
+#include <stdio.h>
+#endif
+
+#include "snapshot.h"
+#include "serialize.h"
+#include "globals.h"
+
+bool beginChunk(int8_t fd, uint32_t tag, uint8_t version, uint32_t *lengthPos)
+{
+  uint32_t placeholder = 0;
+  serialize32(tag);
+  serialize8(version);
+  *lengthPos = g_filemanager->getSeekPosition(fd);
+  serialize32(placeholder);
+  return true;
+
+ err:
+  return false;
+}
+
+bool endChunk(int8_t fd, uint32_t lengthPos)
+{
+  uint32_t end = g_filemanager->getSeekPosition(fd);
+  uint32_t length = end - lengthPos - 4;
+  if (!g_filemanager->setSeekPosition(fd, lengthPos))
+    return false;
+  serialize32(length);
+  g_filemanager->seekToEnd(fd);
+  return g_filemanager->getSeekPosition(fd) == end;
+
+ err:
+  return false;
+}
+
+bool readChunkHeader(int8_t fd, uint32_t *tag, uint8_t *version,
+                     uint32_t *length, uint32_t *start)
+{
+  deserialize32(*tag);
+  deserialize8(*version);
+  deserialize32(*length);
+  *start = g_filemanager->getSeekPosition(fd);
+  return true;
+
+ err:
+  return false;
+}
+
+bool finishChunk(int8_t fd, uint32_t tag, uint32_t length, uint32_t start)
+{
+  uint32_t used = g_filemanager->getSeekPosition(fd) - start;
+  if (used != length) {
+    printf("Chunk '%s' is %u bytes, but %u were read\n", chunkName(tag),
+           (unsigned)length, (unsigned)used);
+    return false;
+  }
+  return true;
+}
+
+bool skipChunk(int8_t fd, uint32_t length, uint32_t start)
+{
+  // Seeking to the very end of the file reports failure but still
+  // gets there, so check where we ended up
+  g_filemanager->setSeekPosition(fd, start + length);
+  return g_filemanager->getSeekPosition(fd) == start + length;
+}
+
+const char *chunkName(uint32_t tag)
+{
+  static char buf[5];
+  for (int i=0; i<4; i++) {
+    char c = (tag >> (24 - 8*i)) & 0xFF;
+    buf[i] = (c >= 0x20 && c < 0x7F) ? c : '?';
+  }
+  buf[4] = '\0';
+  return buf;
+}
@@ -0,0 +1,32 @@
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include <stdint.h>
+
+// Suspend files are a header string followed by chunks. Each chunk is
+// a four-character tag, a version byte and the length of what
+// follows, so a reader can skip the chunks it doesn't know about (and
+// refuse the versions it doesn't understand). The last chunk is an
+// empty SNAP_END.
+
+#define SNAPTAG(a,b,c,d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | \
+                          ((uint32_t)(c) << 8) | (uint32_t)(d))
+#define SNAP_END SNAPTAG('E','N','D',' ')
+
+// Writes the chunk header with a placeholder length; endChunk() goes
+// back and fills it in.
+bool beginChunk(int8_t fd, uint32_t tag, uint8_t version, uint32_t *lengthPos);
+bool endChunk(int8_t fd, uint32_t lengthPos);
+
+// Reads the next chunk header. *start is where the chunk's data
+// begins; finishChunk() checks a chunk was read exactly, and
+// skipChunk() steps over one without reading it.
+bool readChunkHeader(int8_t fd, uint32_t *tag, uint8_t *version,
+                     uint32_t *length, uint32_t *start);
+bool finishChunk(int8_t fd, uint32_t tag, uint32_t length, uint32_t start);
+bool skipChunk(int8_t fd, uint32_t length, uint32_t start);
+
+// "CPU " and the like, for messages
+const char *chunkName(uint32_t tag);
+
+#endif
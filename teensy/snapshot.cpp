@@ -0,0 +1 @@
+../snapshot.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../snapshot.h
\ No newline at end of file
@@ -13,6 +13,9 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <dirent.h>
 
 #include "cpu.h"
 #include "vmui.h"
@@ -22,6 +25,14 @@
 #include "apple/diskii.h"
 #include "apple/woz.h"
 #include "apple/nibutil.h"
+#include "apple/crc32.h"
+#include "apple/woz-serializer.h"
+#include "apple/disk-writer.h"
+#include "nix/nib-cache.h"
+#include "nix/inflate.h"
+#include "nix/compressed-image.h"
+#include "nix/disk-overlay.h"
+#include "nix/nix-filemanager.h"
 
 // ---------------------------------------------------------------------
 // Stubs for the globals DiskII reads (g_cpu->cycles, g_ui->drawOnOff...)
@@ -294,6 +305,144 @@ static void testReadMinerTrack1A5(const char *diskPath) {
         "isn't stable", topByte, topCount, N);
 }
 
+// The LSS consumes disk bits in table-driven multi-bit steps when
+// the CPU has been away for a while. Leave long, uneven idle gaps
+// between bursts of polling (the way a program does when it goes off
+// to decode a sector) and check we still land on well-formed headers.
+static void testReadAcrossIdleGaps(const char *diskPath) {
+  TEST("read: sector headers found across idle gaps");
+  DiskII d(NULL);
+  d.insertDisk(0, diskPath, false);
+
+  g_cpu->cycles = 0;
+  primeForRead(d);
+
+  int headers = 0;
+  for (int round = 0; round < 16; round++) {
+    // 250..3250 bits go by with nobody looking.
+    cpuRead(d, 0x0C, 1000 + round * 811 % 12000);
+    uint8_t p2 = 0, p1 = 0, c = 0;
+    for (int i = 0; i < 8000; i++) {
+      p2 = p1; p1 = c;
+      c = pollForByte(d);
+      if (p2 == 0xD5 && p1 == 0xAA && c == 0x96)
+	break;
+    }
+    if (!(p2 == 0xD5 && p1 == 0xAA && c == 0x96))
+      continue;
+    uint8_t v1 = pollForByte(d), v2 = pollForByte(d);
+    uint8_t t1 = pollForByte(d), t2 = pollForByte(d);
+    uint8_t s1 = pollForByte(d), s2 = pollForByte(d);
+    uint8_t c1 = pollForByte(d), c2 = pollForByte(d);
+    uint8_t vol = ((v1 << 1) | 1) & v2;
+    uint8_t trk = ((t1 << 1) | 1) & t2;
+    uint8_t sec = ((s1 << 1) | 1) & s2;
+    uint8_t chk = ((c1 << 1) | 1) & c2;
+    if (vol == 0xFE && trk == 0 && sec < 16 && chk == (vol ^ trk ^ sec))
+      headers++;
+  }
+  CHECK(headers == 16, "only %d of 16 sector headers decoded", headers);
+}
+
+// The nibble fast path has to be invisible: run one drive with it and
+// one without, side by side on the same clean disk, through polling
+// loops, idle gaps, WP sensing and a seek, and compare every read.
+static void testNibbleFastPathMatchesLSS(const char *diskPath) {
+  TEST("read: nibble fast path matches the bit-level LSS");
+  DiskII slow(NULL), fast(NULL);
+  fast.setNibbleFastPath(true);
+  slow.insertDisk(0, diskPath, false);
+  fast.insertDisk(0, diskPath, false);
+
+  g_cpu->cycles = 0;
+  int reads = 0, mismatches = 0;
+  auto both = [&](uint8_t reg, int cycles) {
+    g_cpu->cycles += cycles;
+    uint8_t a = slow.readSwitches(reg);
+    uint8_t b = fast.readSwitches(reg);
+    reads++;
+    if (a != b) mismatches++;
+  };
+
+  both(0x09, 4); both(0x0A, 4); both(0x0E, 4);
+  uint32_t lcg = 7;
+  for (int round = 0; round < 300; round++) {
+    lcg = lcg * 1103515245 + 12345;
+    switch ((lcg >> 16) % 12) {
+    case 0: // a tight read loop
+      for (int i = 0; i < 500; i++) both(0x0C, 7);
+      break;
+    case 1: case 4: case 5: case 6: // off decoding something
+      both(0x0C, 100 + (lcg >> 8) % 5000);
+      break;
+    case 2: // sense write-protect
+      both(0x0D, 4); both(0x0E, 8); both(0x0C, 4);
+      break;
+    case 3: // step the head a half-track in or out
+      both(0x01 + 2 * ((round / 3) & 3), 4); both(0x00 + 2 * ((round / 3) & 3), 4);
+      break;
+    default: // uneven polling
+      for (int i = 0; i < 200; i++) both(0x0C, 3 + (i * 13) % 40);
+      break;
+    }
+  }
+  fprintf(stderr, "  %d reads compared\n", reads);
+  CHECK(mismatches == 0, "%d of %d reads differed", mismatches, reads);
+}
+
+// With Q6 on, the LSS shifts the write-protect state in on every
+// clock; after a bit time the register reads back as all WP bits.
+static void testLoadSensesWriteProtect(const char *diskPath) {
+  TEST("read: Q6 load senses write-protect");
+  DiskII d(NULL);
+  d.insertDisk(0, diskPath, false);
+
+  g_cpu->cycles = 0;
+  primeForRead(d);
+  cpuRead(d, 0x0D);
+  CHECK_EQ_U8(cpuRead(d, 0x0E, 40), 0x00, "WP sense on a writable disk");
+  cpuRead(d, 0x0C);
+}
+
+// Woz's bitstream cursor hands out bits from a 64-bit window. Read a
+// track in uneven chunks, across several wraps and with a bitCount
+// that isn't a whole number of bytes, and compare against the track
+// data read one bit at a time by hand.
+class CursorWoz : public Woz {
+ public:
+  CursorWoz() : Woz(false, 0) {}
+  trackInfo *track(uint8_t t) { return &tracks[t]; }
+  uint32_t bitPos() { return trackBitCounter; }
+};
+
+static void testWozBitCursor(const char *diskPath) {
+  TEST("woz: bit cursor matches the track bit for bit");
+  CursorWoz w;
+  if (!w.readFile(diskPath, true, T_AUTO)) {
+    CHECK(false, "couldn't load %s", diskPath);
+    return;
+  }
+  trackInfo *t = w.track(0);
+  t->bitCount -= 5;
+
+  uint32_t ref = 0;
+  int mismatches = 0;
+  for (int i = 0; i < 40000; i++) {
+    uint8_t n = 1 + (i * 7) % 32;
+    uint32_t got = w.peekBits(0, n);
+    uint32_t want = 0;
+    for (uint8_t b = 0; b < n; b++) {
+      uint32_t pos = (ref + b) % t->bitCount;
+      want = (want << 1) | ((t->trackData[pos / 8] >> (7 - (pos & 7))) & 1);
+    }
+    if (got != want) mismatches++;
+    w.consumeBits(0, n);
+    ref = (ref + n) % t->bitCount;
+    if (w.bitPos() != ref) mismatches++;
+  }
+  CHECK(mismatches == 0, "%d mismatched reads", mismatches);
+}
+
 // ---------------------------------------------------------------------
 // Write tests (round-trip through the LSS read path)
 // ---------------------------------------------------------------------
@@ -426,9 +575,904 @@ static void testWriteSectorHeaderRoundTrip(const char *diskPath) {
   }
 }
 
+// ---------------------------------------------------------------------
+// Flush tests (dirty tracks go back into the image in place)
+// ---------------------------------------------------------------------
+static uint8_t *slurp(const char *path, uint32_t *len) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+  off_t size = lseek(fd, 0, SEEK_END);
+  lseek(fd, 0, SEEK_SET);
+  uint8_t *buf = (uint8_t *)malloc(size);
+  if (read(fd, buf, size) != size) { free(buf); buf = NULL; }
+  close(fd);
+  *len = size;
+  return buf;
+}
+
+// Returns the number of differing bytes; *first/*last span them.
+static uint32_t diffRange(const uint8_t *a, const uint8_t *b, uint32_t len,
+                          uint32_t *first, uint32_t *last) {
+  uint32_t n = 0;
+  *first = *last = 0;
+  for (uint32_t i = 0; i < len; i++) {
+    if (a[i] == b[i]) continue;
+    if (!n) *first = i;
+    *last = i;
+    n++;
+  }
+  return n;
+}
+
+// Fills in a "/tmp/...-XXXXXX.dsk" path template with a new 35-track
+// DSK whose track t has t*k + i*m at byte i.
+static void makeScratchDsk(char *path, uint8_t k, uint8_t m) {
+  int fd = mkstemps(path, 4);
+  if (fd < 0) { perror("mkstemps"); exit(1); }
+  uint8_t buf[256*16];
+  for (int t = 0; t < 35; t++) {
+    for (int i = 0; i < 256*16; i++) buf[i] = t*k + i*m;
+    write(fd, buf, sizeof(buf));
+  }
+  close(fd);
+}
+
+static void testFlushDskWritesOnlyDirtyTrack() {
+  TEST("flush: DSK writes back only the dirty track");
+  char path[] = "/tmp/diskii-flush-XXXXXX.dsk";
+  makeScratchDsk(path, 31, 7);
+
+  uint32_t len, newLen;
+  uint8_t *before = slurp(path, &len);
+  uint8_t sector[256];
+  memset(sector, 0xA5, sizeof(sector));
+  {
+    Woz w(false, 0);
+    // Not preloaded, so the image's fd stays open for the flush
+    CHECK(w.readFile(path, false, T_AUTO), "couldn't load %s", path);
+    CHECK(w.encodeWozTrackSector(7, 3, sector), "couldn't write a sector");
+    CHECK(w.isDirty(), "image isn't dirty after a write");
+    CHECK(w.flush(), "flush failed");
+    CHECK(!w.isDirty(), "image still dirty after flush");
+  }
+  uint8_t *after = slurp(path, &newLen);
+  uint32_t first, last;
+  uint32_t n = diffRange(before, after, len, &first, &last);
+  CHECK(newLen == len, "image changed size (%u -> %u)", len, newLen);
+  CHECK(n > 0 && n <= 256, "%u bytes changed", n);
+  CHECK(first >= 7*4096 && last < 8*4096,
+        "changes span $%X-$%X, outside track 7", first, last);
+
+  free(before);
+  free(after);
+  unlink(path);
+}
+
+static void testFlushWozPatchesTrackAndCRC(const char *diskPath) {
+  TEST("flush: WOZ patches one track and the CRC in place");
+  char path[] = "/tmp/diskii-flush-XXXXXX.woz";
+  int fd = mkstemps(path, 4);
+  close(fd);
+  {
+    Woz w(false, 0);
+    CHECK(w.readFile(diskPath, true, T_AUTO), "couldn't load %s", diskPath);
+    CHECK(w.writeFile(path, T_WOZ), "couldn't write %s", path);
+  }
+
+  uint32_t len, newLen;
+  uint8_t *before = slurp(path, &len);
+  uint8_t sector[256];
+  for (int i = 0; i < 256; i++) sector[i] = i ^ 0x5A;
+  uint8_t datatrack;
+  uint8_t *written = NULL;
+  uint32_t writtenSize = 0;
+  {
+    CursorWoz w;
+    CHECK(w.readFile(path, false, T_AUTO), "couldn't load %s", path);
+    datatrack = w.dataTrackNumberForQuarterTrack(9*4);
+    CHECK(w.encodeWozTrackSector(9, 5, sector), "couldn't write a sector");
+    trackInfo *t = w.track(datatrack);
+    writtenSize = t->blockCount * 512;
+    written = (uint8_t *)malloc(writtenSize);
+    memcpy(written, t->trackData, writtenSize);
+    CHECK(w.flush(), "flush failed");
+  }
+  uint8_t *after = slurp(path, &newLen);
+  CHECK(newLen == len, "image changed size (%u -> %u)", len, newLen);
+
+  // TRKS entries start at byte 256 in a WOZ2 file
+  const uint8_t *entry = &after[256 + 8*datatrack];
+  uint32_t start = (entry[0] | (entry[1] << 8)) * 512;
+  uint32_t size = (entry[2] | (entry[3] << 8)) * 512;
+  uint32_t first, last;
+  uint32_t n = diffRange(before + 12, after + 12, len - 12, &first, &last);
+  CHECK(n > 0, "nothing changed");
+  CHECK(first + 12 >= start && last + 12 < start + size,
+        "changes span $%X-$%X, outside track $%X-$%X",
+        first + 12, last + 12, start, start + size);
+  CHECK(size == writtenSize && start + size <= newLen &&
+        !memcmp(&after[start], written, size),
+        "track data on disk doesn't match what was written");
+
+  uint32_t crc = after[8] | (after[9] << 8) | (after[10] << 16) |
+                 ((uint32_t)after[11] << 24);
+  CHECK(crc == compute_crc_32(after + 12, newLen - 12),
+        "stored CRC $%08X doesn't match the image", crc);
+
+  free(written);
+  free(before);
+  free(after);
+  unlink(path);
+}
+
+static void testWozMappedLoad(const char *diskPath) {
+  TEST("woz: mapped image is used in place and copied on write");
+  char path[] = "/tmp/diskii-map-XXXXXX.woz";
+  int fd = mkstemps(path, 4);
+  close(fd);
+  {
+    Woz w(false, 0);
+    CHECK(w.readFile(diskPath, true, T_AUTO), "couldn't load %s", diskPath);
+    CHECK(w.writeFile(path, T_WOZ), "couldn't write %s", path);
+  }
+
+  uint32_t len, newLen;
+  uint8_t *image = slurp(path, &len);
+  CursorWoz w;
+  CHECK(w.readFile(path, false, T_AUTO), "couldn't load %s", path);
+  int inPlace = 0, wrong = 0;
+  for (int i = 0; i < 160; i++) {
+    trackInfo *t = w.track(i);
+    if (!t->startingBlock) continue;
+    if (t->mapped) inPlace++;
+    if (!t->trackData ||
+        memcmp(t->trackData, &image[t->startingBlock * 512], t->blockCount * 512))
+      wrong++;
+  }
+  CHECK(inPlace == 35, "%d of 35 tracks used in place", inPlace);
+  CHECK(wrong == 0, "%d tracks don't match the file", wrong);
+
+  uint8_t sector[256];
+  memset(sector, 0x5A, sizeof(sector));
+  uint8_t datatrack = w.dataTrackNumberForQuarterTrack(12*4);
+  CHECK(w.encodeWozTrackSector(12, 2, sector), "couldn't write a sector");
+  CHECK(!w.track(datatrack)->mapped, "written track is still the mapped one");
+  CHECK(w.track(w.dataTrackNumberForQuarterTrack(13*4))->mapped,
+        "writing one track copied another");
+  uint8_t *after = slurp(path, &newLen);
+  CHECK(newLen == len && !memcmp(image, after, len),
+        "image changed before it was flushed");
+
+  // Someone else rewriting (or truncating) the file doesn't reach the
+  // tracks we're using in place
+  fd = open(path, O_WRONLY | O_TRUNC);
+  uint8_t junk[512];
+  memset(junk, 0xEE, sizeof(junk));
+  CHECK(fd != -1 && write(fd, junk, sizeof(junk)) == sizeof(junk),
+        "couldn't rewrite %s", path);
+  if (fd != -1) close(fd);
+  wrong = 0;
+  for (int i = 0; i < 160; i++) {
+    trackInfo *t = w.track(i);
+    if (!t->mapped) continue;
+    if (memcmp(t->trackData, &image[t->startingBlock * 512], t->blockCount * 512))
+      wrong++;
+  }
+  CHECK(wrong == 0, "%d tracks changed with the file", wrong);
+
+  free(image);
+  free(after);
+  unlink(path);
+}
+
+static void testBackgroundFlushKeepsOrder() {
+  TEST("flush: background writer lands flushes in order");
+  char path[] = "/tmp/diskii-flush-XXXXXX.dsk";
+  makeScratchDsk(path, 13, 3);
+
+  uint32_t len, newLen;
+  uint8_t *before = slurp(path, &len);
+  uint8_t sector[256];
+  uint8_t want3[256*16], want20[256*16];
+  {
+    WozSerializer w;
+    CHECK(w.readFile(path, true, T_AUTO), "couldn't load %s", path);
+    // Three flushes queued back to back; the second rewrites the
+    // track the first one did, so it has to land after it.
+    memset(sector, 0x11, sizeof(sector));
+    w.encodeWozTrackSector(3, 1, sector);
+    CHECK(w.flush(), "first flush failed");
+    CHECK(!w.isDirty(), "flush didn't hand the tracks off");
+    memset(sector, 0x22, sizeof(sector));
+    w.encodeWozTrackSector(3, 1, sector);
+    CHECK(w.flush(), "second flush failed");
+    memset(sector, 0x33, sizeof(sector));
+    w.encodeWozTrackSector(20, 9, sector);
+    CHECK(w.flush(), "third flush failed");
+    CHECK(w.decodeWozTrackToDsk(3, T_DSK, want3), "couldn't decode track 3");
+    CHECK(w.decodeWozTrackToDsk(20, T_DSK, want20), "couldn't decode track 20");
+    // Destroying it waits for its writes
+  }
+
+  uint8_t *after = slurp(path, &newLen);
+  CHECK(newLen == len, "image changed size (%u -> %u)", len, newLen);
+  CHECK(!memcmp(&after[3*4096], want3, 4096), "track 3 isn't the last write");
+  CHECK(!memcmp(&after[20*4096], want20, 4096), "track 20 wasn't written");
+  int others = 0;
+  for (int t = 0; t < 35; t++) {
+    if (t == 3 || t == 20) continue;
+    if (memcmp(&after[t*4096], &before[t*4096], 4096)) others++;
+  }
+  CHECK(others == 0, "%d other tracks changed", others);
+
+  free(before);
+  free(after);
+  unlink(path);
+}
+
+// A background write that fails leaves its tracks dirty, and the next
+// flush writes them itself. The image is moved away so the writer
+// can't reopen it.
+static void testBackgroundFlushFailureKeepsTracks() {
+  TEST("flush: a failed background write keeps its tracks dirty");
+  char path[] = "/tmp/diskii-flush-XXXXXX.dsk";
+  makeScratchDsk(path, 17, 5);
+  char moved[sizeof(path) + 6];
+  snprintf(moved, sizeof(moved), "%s.moved", path);
+
+  uint8_t sector[256];
+  uint8_t want[256*16];
+  memset(sector, 0x6C, sizeof(sector));
+  {
+    WozSerializer w;
+    CHECK(w.readFile(path, true, T_AUTO), "couldn't load %s", path);
+    CHECK(rename(path, moved) == 0, "couldn't move %s", path);
+    w.encodeWozTrackSector(11, 4, sector);
+    CHECK(w.flush(), "the flush wasn't queued");
+    g_diskWriter.drain();
+    CHECK(w.isDirty(), "the failed write's track isn't dirty");
+
+    // Still there the next time, and written here rather than queued
+    CHECK(!w.flush(), "a flush with nowhere to write succeeded");
+    CHECK(w.isDirty(), "a failed retry cleaned the track");
+    CHECK(rename(moved, path) == 0, "couldn't move %s back", path);
+    CHECK(w.flush(), "the retry failed");
+    CHECK(!w.isDirty(), "still dirty after the retry");
+    CHECK(w.decodeWozTrackToDsk(11, T_DSK, want), "couldn't decode track 11");
+
+    uint32_t len;
+    uint8_t *after = slurp(path, &len);
+    CHECK(after && len == 35*4096 && !memcmp(&after[11*4096], want, 4096),
+          "the retried track isn't in the image");
+    free(after);
+  }
+  unlink(path);
+  unlink(moved);
+}
+
 // ---------------------------------------------------------------------
 // Driver
 // ---------------------------------------------------------------------
+// Two lazily loaded drives share the track cache. Once a track is
+// cached, reading it again mustn't touch the image: the images are
+// truncated underneath us, so only real cache hits can still succeed.
+static void testTrackCacheSharedLRU() {
+  TEST("woz: lazily loaded tracks share an LRU cache");
+  char pathA[] = "/tmp/diskii-cache-XXXXXX.dsk";
+  char pathB[] = "/tmp/diskii-cache-XXXXXX.dsk";
+  char *paths[2] = { pathA, pathB };
+  for (int d = 0; d < 2; d++)
+    makeScratchDsk(paths[d], 31 + d, 7);
+
+  Woz::setTrackCacheBudget(2*NIBTRACKSIZE);
+  Woz::resetTrackCacheStats();
+  {
+    Woz a(false, 0), b(false, 0);
+    CHECK(a.readFile(pathA, false, T_AUTO), "couldn't load %s", pathA);
+    CHECK(b.readFile(pathB, false, T_AUTO), "couldn't load %s", pathB);
+
+    uint8_t sector[256];
+    uint32_t hits, misses;
+    CHECK(a.decodeWozTrackSector(3, 0, sector), "couldn't read A:3");
+    CHECK(a.decodeWozTrackSector(17, 0, sector), "couldn't read A:17");
+    CHECK(b.decodeWozTrackSector(5, 0, sector), "couldn't read B:5");
+    Woz::trackCacheStats(&hits, &misses);
+    CHECK(misses == 3, "%u misses loading three tracks", misses);
+    CHECK(Woz::trackCacheBytes() <= 2*NIBTRACKSIZE,
+          "cache holds %u bytes, over its budget", Woz::trackCacheBytes());
+
+    // A:3 was the least recently used, so it's the one that went
+    truncate(pathA, 0);
+    truncate(pathB, 0);
+    Woz::resetTrackCacheStats();
+    for (int i = 0; i < 10; i++) {
+      CHECK(a.decodeWozTrackSector(17, i, sector), "A:17 wasn't cached");
+      CHECK(sector[0] == (uint8_t)(17*31 + i*256*7), "A:17 sector %d is wrong", i);
+      CHECK(b.decodeWozTrackSector(5, i, sector), "B:5 wasn't cached");
+      CHECK(sector[0] == (uint8_t)(5*32 + i*256*7), "B:5 sector %d is wrong", i);
+    }
+    Woz::trackCacheStats(&hits, &misses);
+    CHECK(misses == 0 && hits >= 20, "%u hits, %u misses alternating drives",
+          hits, misses);
+    CHECK(!a.decodeWozTrackSector(3, 0, sector), "A:3 was still cached");
+  }
+  CHECK(Woz::trackCacheBytes() == 0, "closed images left %u bytes cached",
+        Woz::trackCacheBytes());
+  Woz::setTrackCacheBudget(TRACKCACHE_BUDGET);
+
+  unlink(pathA);
+  unlink(pathB);
+}
+
+// A second insert of the same image loads every track from the nibble
+// cache, byte for byte what nibblizeTrack made; changing one track of
+// the image misses only that track.
+static void testNibCacheHitsAndInvalidates() {
+  TEST("woz: nibble cache reuses tracks and notices changes");
+  char dir[] = "/tmp/diskii-nibcache-XXXXXX";
+  char path[] = "/tmp/diskii-nibcache-XXXXXX.dsk";
+  CHECK(mkdtemp(dir) != NULL, "couldn't make a cache directory");
+  makeScratchDsk(path, 13, 3);
+  int fd;
+  uint8_t buf[256*16];
+
+  // The reference load doesn't use the cache
+  static uint8_t ref[35][NIBTRACKSIZE];
+  uint32_t refBits[35];
+  {
+    Woz w(false, 0);
+    CHECK(w.readFile(path, true, T_AUTO), "couldn't load %s", path);
+    for (int t = 0; t < 35; t++)
+      memcpy(ref[t], w.trackBits(t, &refBits[t]), NIBTRACKSIZE);
+  }
+
+  setNibCacheDir(dir);
+  uint32_t hits0, misses0, hits, misses;
+  nibCacheStats(&hits0, &misses0);
+  for (int pass = 0; pass < 2; pass++) {
+    Woz w(false, 0);
+    CHECK(w.readFile(path, true, T_AUTO), "couldn't load %s", path);
+    int same = 0;
+    for (int t = 0; t < 35; t++) {
+      uint32_t bits;
+      const uint8_t *data = w.trackBits(t, &bits);
+      if (data && bits == refBits[t] && !memcmp(data, ref[t], NIBTRACKSIZE))
+        same++;
+    }
+    CHECK(same == 35, "pass %d: only %d tracks match nibblizeTrack", pass, same);
+  }
+  nibCacheStats(&hits, &misses);
+  CHECK(misses - misses0 == 35 && hits - hits0 == 35,
+        "%u hits, %u misses over two inserts", hits - hits0, misses - misses0);
+
+  // Entries are as readable as any other new file, so the directory
+  // can be shared
+  mode_t mask = umask(0);
+  umask(mask);
+  int entries = 0, wrongMode = 0;
+  DIR *d = opendir(dir);
+  struct dirent *de;
+  while (d && (de = readdir(d)) != NULL) {
+    if (de->d_name[0] == '.') continue;
+    char entry[sizeof(dir) + sizeof(de->d_name)];
+    struct stat st;
+    snprintf(entry, sizeof(entry), "%s/%s", dir, de->d_name);
+    entries++;
+    if (stat(entry, &st) || (st.st_mode & 0777) != (0666 & ~mask))
+      wrongMode++;
+  }
+  if (d) closedir(d);
+  CHECK(entries == 35 && wrongMode == 0,
+        "%d of %d cache entries have the wrong mode", wrongMode, entries);
+
+  // Change track 9 in the image
+  memset(buf, 0x5A, sizeof(buf));
+  fd = open(path, O_WRONLY);
+  pwrite(fd, buf, sizeof(buf), 9*sizeof(buf));
+  close(fd);
+  nibCacheStats(&hits0, &misses0);
+  {
+    Woz w(false, 0);
+    CHECK(w.readFile(path, true, T_AUTO), "couldn't load %s", path);
+    uint8_t sector[256];
+    CHECK(w.decodeWozTrackSector(9, 0, sector) && sector[0] == 0x5A,
+          "track 9 came from the stale cache entry");
+  }
+  nibCacheStats(&hits, &misses);
+  CHECK(misses - misses0 == 1 && hits - hits0 == 34,
+        "%u hits, %u misses after changing one track",
+        hits - hits0, misses - misses0);
+
+  // The old track 9 entry under the new one's name, as if their hashes
+  // collided, is a miss rather than the wrong track
+  uint8_t oldTrack9[256*16];
+  for (int i = 0; i < 256*16; i++) oldTrack9[i] = 9*13 + i*3;
+  char oldEntry[sizeof(dir) + 256] = "", newEntry[sizeof(dir) + 256] = "";
+  d = opendir(dir);
+  while (d && (de = readdir(d)) != NULL) {
+    if (de->d_name[0] == '.') continue;
+    char entry[sizeof(dir) + sizeof(de->d_name)];
+    snprintf(entry, sizeof(entry), "%s/%s", dir, de->d_name);
+    uint32_t len;
+    uint8_t *data = slurp(entry, &len);
+    if (data && memmem(data, len, oldTrack9, sizeof(oldTrack9)))
+      strcpy(oldEntry, entry);
+    if (data && memmem(data, len, buf, sizeof(buf)))
+      strcpy(newEntry, entry);
+    free(data);
+  }
+  if (d) closedir(d);
+  CHECK(oldEntry[0] && newEntry[0], "couldn't find both track 9 entries");
+  uint32_t oldLen;
+  uint8_t *oldData = oldEntry[0] ? slurp(oldEntry, &oldLen) : NULL;
+  fd = newEntry[0] ? open(newEntry, O_WRONLY | O_TRUNC) : -1;
+  CHECK(oldData && fd != -1 && write(fd, oldData, oldLen) == (ssize_t)oldLen,
+        "couldn't replace the new track 9 entry");
+  if (fd != -1) close(fd);
+  free(oldData);
+  nibCacheStats(&hits0, &misses0);
+  {
+    Woz w(false, 0);
+    CHECK(w.readFile(path, true, T_AUTO), "couldn't load %s", path);
+    uint8_t sector[256];
+    CHECK(w.decodeWozTrackSector(9, 0, sector) && sector[0] == 0x5A,
+          "track 9 came from a colliding entry");
+  }
+  nibCacheStats(&hits, &misses);
+  CHECK(misses - misses0 == 1 && hits - hits0 == 34,
+        "%u hits, %u misses with a colliding entry",
+        hits - hits0, misses - misses0);
+
+  setNibCacheDir(NULL);
+  char cmd[64];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+  system(cmd);
+  unlink(path);
+}
+
+// A gzip of the file at `path`, in stored (uncompressed) deflate
+// blocks, so the tests don't need a compressor
+static bool writeStoredGzip(const char *path, const char *gzPath) {
+  uint32_t len;
+  uint8_t *data = slurp(path, &len);
+  int fd = open(gzPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = data && fd != -1;
+  static const uint8_t header[10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF };
+  ok = ok && write(fd, header, sizeof(header)) == sizeof(header);
+  for (uint32_t pos = 0; ok && pos < len; pos += 0xFFFF) {
+    uint16_t n = (len - pos > 0xFFFF) ? 0xFFFF : len - pos;
+    uint8_t block[5] = { (uint8_t)(pos + n == len), (uint8_t)n, (uint8_t)(n >> 8),
+                         (uint8_t)~n, (uint8_t)(~n >> 8) };
+    ok = write(fd, block, 5) == 5 && write(fd, &data[pos], n) == n;
+  }
+  uint32_t crc = data ? compute_crc_32(data, len) : 0;
+  uint8_t trailer[8] = { (uint8_t)crc, (uint8_t)(crc >> 8), (uint8_t)(crc >> 16),
+                         (uint8_t)(crc >> 24), (uint8_t)len, (uint8_t)(len >> 8),
+                         (uint8_t)(len >> 16), (uint8_t)(len >> 24) };
+  ok = ok && write(fd, trailer, 8) == 8;
+  if (fd != -1) close(fd);
+  free(data);
+  return ok;
+}
+
+// The two block types a disk image rarely gets from a real compressor,
+// and a .zip whose disk image isn't its first member
+static void testInflateBlocksAndZip() {
+  TEST("inflate: stored and fixed-Huffman blocks, and .zip members");
+  static const char text[] =
+    "APPLE ][ FOREVER. APPLE ][ FOREVER. APPLE ][ FOREVER.\n";
+  const uint32_t textLen = sizeof(text) - 1;
+  uint8_t out[128];
+  uint32_t used;
+
+  // Two stored blocks, the second one final
+  static const uint8_t stored[] = {
+    0x00, 0x09, 0x00, 0xF6, 0xFF,
+    'A', 'P', 'P', 'L', 'E', ' ', ']', '[', ' ',
+    0x01, 0x2D, 0x00, 0xD2, 0xFF,
+    'F', 'O', 'R', 'E', 'V', 'E', 'R', '.', ' ',
+    'A', 'P', 'P', 'L', 'E', ' ', ']', '[', ' ',
+    'F', 'O', 'R', 'E', 'V', 'E', 'R', '.', ' ',
+    'A', 'P', 'P', 'L', 'E', ' ', ']', '[', ' ',
+    'F', 'O', 'R', 'E', 'V', 'E', 'R', '.', '\n',
+    0xEE // not part of the stream
+  };
+  memset(out, 0, sizeof(out));
+  int32_t n = inflateRaw(stored, sizeof(stored), out, sizeof(out), &used);
+  CHECK(n == (int32_t)textLen && !memcmp(out, text, textLen),
+        "stored blocks decoded to %d bytes", n);
+  CHECK(used == sizeof(stored) - 1, "stored blocks used %u bytes", used);
+  CHECK(inflateRaw(stored, sizeof(stored), out, textLen - 1, NULL) == -1,
+        "stored blocks overran the output");
+
+  // One fixed-Huffman block, with back references
+  static const uint8_t fixed[] = {
+    0x73, 0x0C, 0x08, 0xF0, 0x71, 0x55, 0x88, 0x8D, 0x56, 0x70, 0xF3, 0x0F,
+    0x72, 0x0D, 0x73, 0x0D, 0xD2, 0x53, 0x70, 0x24, 0x2C, 0xC2, 0x05, 0x00
+  };
+  memset(out, 0, sizeof(out));
+  n = inflateRaw(fixed, sizeof(fixed), out, sizeof(out), &used);
+  CHECK(n == (int32_t)textLen && !memcmp(out, text, textLen),
+        "the fixed-Huffman block decoded to %d bytes", n);
+  CHECK(used == sizeof(fixed), "the fixed-Huffman block used %u bytes", used);
+  CHECK(inflateRaw(fixed, sizeof(fixed) - 4, out, sizeof(out), NULL) == -1,
+        "a truncated fixed-Huffman block decoded");
+
+  // README.TXT (stored), then TINY.DSK (the fixed block above)
+  static const uint8_t zip[] = {
+    0x50, 0x4B, 0x03, 0x04, 0x14, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x21, 0x00, 0x7A, 0x7A, 0x6F, 0xED, 0x03, 0x00, 0x00, 0x00, 0x03, 0x00,
+    0x00, 0x00, 0x0A, 0x00, 0x00, 0x00, 0x52, 0x45, 0x41, 0x44, 0x4D, 0x45,
+    0x2E, 0x54, 0x58, 0x54, 0x68, 0x69, 0x0A, 0x50, 0x4B, 0x03, 0x04, 0x14,
+    0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x21, 0x00, 0xDA, 0x99, 0xED,
+    0x18, 0x18, 0x00, 0x00, 0x00, 0x36, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00,
+    0x00, 0x54, 0x49, 0x4E, 0x59, 0x2E, 0x44, 0x53, 0x4B, 0x73, 0x0C, 0x08,
+    0xF0, 0x71, 0x55, 0x88, 0x8D, 0x56, 0x70, 0xF3, 0x0F, 0x72, 0x0D, 0x73,
+    0x0D, 0xD2, 0x53, 0x70, 0x24, 0x2C, 0xC2, 0x05, 0x00, 0x50, 0x4B, 0x01,
+    0x02, 0x14, 0x03, 0x14, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x21,
+    0x00, 0x7A, 0x7A, 0x6F, 0xED, 0x03, 0x00, 0x00, 0x00, 0x03, 0x00, 0x00,
+    0x00, 0x0A, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x80, 0x01, 0x00, 0x00, 0x00, 0x00, 0x52, 0x45, 0x41, 0x44, 0x4D,
+    0x45, 0x2E, 0x54, 0x58, 0x54, 0x50, 0x4B, 0x01, 0x02, 0x14, 0x03, 0x14,
+    0x00, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x21, 0x00, 0xDA, 0x99, 0xED,
+    0x18, 0x18, 0x00, 0x00, 0x00, 0x36, 0x00, 0x00, 0x00, 0x08, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x01, 0x2B,
+    0x00, 0x00, 0x00, 0x54, 0x49, 0x4E, 0x59, 0x2E, 0x44, 0x53, 0x4B, 0x50,
+    0x4B, 0x05, 0x06, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x02, 0x00, 0x6E,
+    0x00, 0x00, 0x00, 0x69, 0x00, 0x00, 0x00, 0x00, 0x00
+  };
+  char path[] = "/tmp/diskii-zip-XXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd != -1 && write(fd, zip, sizeof(zip)) == sizeof(zip),
+        "couldn't write %s", path);
+  if (fd != -1) close(fd);
+  CHECK(isCompressedImage(path), "the .zip wasn't recognized");
+  char name[64] = "";
+  uint32_t size = 0;
+  uint8_t *data = readCompressedImage(path, &size, name, sizeof(name));
+  CHECK(data && size == textLen && !memcmp(data, text, textLen),
+        "the .zip member decoded to %u bytes", size);
+  CHECK(!strcmp(name, "TINY.DSK"), "the .zip member is called '%s'", name);
+  free(data);
+  unlink(path);
+}
+
+// A gzipped DSK reads the same as the plain one. Writes land in the
+// ".ovl" next to it and come back on the next load; the .gz itself
+// never changes.
+static void testCompressedImageOverlay() {
+  TEST("woz: gzipped images load, and writes go to an overlay");
+  char path[] = "/tmp/diskii-gz-XXXXXX.dsk";
+  makeScratchDsk(path, 7, 5);
+  uint8_t buf[256*16];
+
+  char gzPath[64], ovlPath[64];
+  snprintf(gzPath, sizeof(gzPath), "%s.gz", path);
+  snprintf(ovlPath, sizeof(ovlPath), "%s.gz.ovl", path);
+  CHECK(writeStoredGzip(path, gzPath), "couldn't write %s", gzPath);
+
+  static uint8_t want[35][256*16];
+  {
+    Woz w(false, 0);
+    CHECK(w.readFile(path, true, T_AUTO), "couldn't load %s", path);
+    for (int t = 0; t < 35; t++)
+      w.decodeWozTrackToDsk(t, T_DSK, want[t]);
+  }
+
+  uint32_t gzLen, newLen;
+  uint8_t *gzBefore = slurp(gzPath, &gzLen);
+  uint8_t sector[256], written[256*16];
+  {
+    Woz w(false, 0);
+    CHECK(w.readFile(gzPath, true, T_AUTO), "couldn't load %s", gzPath);
+    int same = 0;
+    for (int t = 0; t < 35; t++) {
+      if (w.decodeWozTrackToDsk(t, T_DSK, buf) && !memcmp(buf, want[t], sizeof(buf)))
+        same++;
+    }
+    CHECK(same == 35, "only %d tracks match the uncompressed image", same);
+
+    memset(sector, 0x6C, sizeof(sector));
+    w.encodeWozTrackSector(12, 4, sector);
+    CHECK(w.decodeWozTrackToDsk(12, T_DSK, written), "couldn't decode track 12");
+    CHECK(w.flush(), "flush failed");
+  }
+  CHECK(access(ovlPath, F_OK) == 0, "no overlay was written");
+  uint8_t *gzAfter = slurp(gzPath, &newLen);
+  CHECK(newLen == gzLen && !memcmp(gzBefore, gzAfter, gzLen),
+        "the compressed image changed");
+
+  {
+    Woz w(false, 0);
+    CHECK(w.readFile(gzPath, true, T_AUTO), "couldn't reload %s", gzPath);
+    int changed = 0;
+    CHECK(w.decodeWozTrackToDsk(12, T_DSK, buf) &&
+          !memcmp(buf, written, sizeof(buf)), "the written sector didn't come back");
+    for (int i = 0; i < 16; i++)
+      if (memcmp(&buf[i*256], &want[12][i*256], 256)) changed++;
+    CHECK(changed == 1, "%d sectors of track 12 changed", changed);
+  }
+
+  free(gzBefore);
+  free(gzAfter);
+  unlink(ovlPath);
+  unlink(gzPath);
+  unlink(path);
+}
+
+// Overlay mode: two instances share one image, each with its own
+// overlay directory. Neither one's writes reach the image or the other
+// instance, and a written track that's been evicted from the track
+// cache comes back from the overlay rather than the image.
+static void testOverlayModeSharesImage() {
+  TEST("woz: overlay mode keeps writes out of a shared image");
+  char path[] = "/tmp/diskii-master-XXXXXX.dsk";
+  char dirA[] = "/tmp/diskii-ovlA-XXXXXX";
+  char dirB[] = "/tmp/diskii-ovlB-XXXXXX";
+  CHECK(mkdtemp(dirA) && mkdtemp(dirB), "couldn't make overlay directories");
+  makeScratchDsk(path, 11, 7);
+  uint8_t buf[256*16];
+
+  uint32_t len, newLen;
+  uint8_t *before = slurp(path, &len);
+  uint8_t sector[256], written[256*16], orig[256*16];
+
+  setOverlayDir(dirA);
+  {
+    Woz w(false, 0);
+    CHECK(w.readFile(path, false, T_AUTO), "couldn't load %s", path);
+    CHECK(w.decodeWozTrackToDsk(7, T_DSK, orig), "couldn't decode track 7");
+    memset(sector, 0x3C, sizeof(sector));
+    CHECK(w.encodeWozTrackSector(7, 3, sector), "couldn't write a sector");
+    CHECK(w.decodeWozTrackToDsk(7, T_DSK, written), "couldn't decode track 7");
+    CHECK(w.flush(), "flush failed");
+
+    // Push track 7 out of the cache, then read it again
+    Woz::setTrackCacheBudget(2*NIBTRACKSIZE);
+    for (int t = 10; t < 20; t++)
+      w.decodeWozTrackToDsk(t, T_DSK, buf);
+    CHECK(w.decodeWozTrackToDsk(7, T_DSK, buf) &&
+          !memcmp(buf, written, sizeof(buf)), "track 7 was reloaded from the image");
+    Woz::setTrackCacheBudget(TRACKCACHE_BUDGET);
+  }
+
+  uint8_t *after = slurp(path, &newLen);
+  CHECK(newLen == len && !memcmp(before, after, len), "the image was written");
+  free(after);
+
+  char cmd[128];
+  snprintf(cmd, sizeof(cmd), "du -k %s | cut -f1", dirA);
+  FILE *p = popen(cmd, "r");
+  int kb = 0;
+  if (p) {
+    fscanf(p, "%d", &kb);
+    pclose(p);
+  }
+  CHECK(kb > 0 && kb < 32, "the overlay takes %d KB", kb);
+
+  setOverlayDir(dirB);
+  {
+    Woz w(false, 0);
+    CHECK(w.readFile(path, true, T_AUTO), "couldn't load %s", path);
+    CHECK(w.decodeWozTrackToDsk(7, T_DSK, buf) && !memcmp(buf, orig, sizeof(buf)),
+          "another instance sees the first one's write");
+  }
+
+  setOverlayDir(dirA);
+  {
+    Woz w(false, 0);
+    CHECK(w.readFile(path, true, T_AUTO), "couldn't reload %s", path);
+    CHECK(w.decodeWozTrackToDsk(7, T_DSK, buf) && !memcmp(buf, written, sizeof(buf)),
+          "the write didn't come back from the overlay");
+  }
+
+  setOverlayDir(NULL);
+  snprintf(cmd, sizeof(cmd), "rm -rf %s %s", dirA, dirB);
+  system(cmd);
+  free(before);
+  unlink(path);
+}
+
+// One Woz can read image after image (as util/diskbatch's workers
+// do); each load has to look exactly like a fresh Woz's, with nothing
+// left over from the last one.
+static void testReuseWozForAnotherImage() {
+  TEST("woz: one instance reads image after image");
+  char pathA[] = "/tmp/diskii-reuseA-XXXXXX.dsk";
+  char pathB[] = "/tmp/diskii-reuseB-XXXXXX.woz";
+  makeScratchDsk(pathA, 3, 13);
+  uint8_t buf[256*16], want[256*16];
+  close(mkstemps(pathB, 4));
+  {
+    // B is A with track 4 rewritten, saved as a WOZ
+    Woz w(false, 0);
+    CHECK(w.readFile(pathA, true, T_AUTO), "couldn't load %s", pathA);
+    memset(buf, 0xE1, 256);
+    w.encodeWozTrackSector(4, 0, buf);
+    CHECK(w.writeFile(pathB, T_WOZ), "couldn't write %s", pathB);
+  }
+
+  Woz reused(false, 0);
+  const char *order[] = { pathB, pathA, pathB };
+  for (int n = 0; n < 3; n++) {
+    Woz fresh(false, 0);
+    CHECK(fresh.readFile(order[n], true, T_AUTO) &&
+          reused.readFile(order[n], true, T_AUTO), "couldn't load %s", order[n]);
+    int same = 0;
+    for (int t = 0; t < 35; t++) {
+      if (fresh.decodeWozTrackToDsk(t, T_DSK, want) &&
+          reused.decodeWozTrackToDsk(t, T_DSK, buf) &&
+          !memcmp(buf, want, sizeof(buf)))
+        same++;
+    }
+    CHECK(same == 35, "load %d: only %d tracks match a fresh load", n, same);
+    CHECK(reused.imageFormat() == fresh.imageFormat(),
+          "load %d: reads as type %d, not %d", n, reused.imageFormat(),
+          fresh.imageFormat());
+  }
+
+  unlink(pathA);
+  unlink(pathB);
+}
+
+// Woz's head state, for comparing two of them exactly
+class WozPeek : public WozSerializer {
+ public:
+  WozPeek() : Woz(false, 0) {}
+  bool sameHead(const WozPeek &o) const {
+    return trackPointer == o.trackPointer && trackBitIdx == o.trackBitIdx &&
+      trackBitCounter == o.trackBitCounter &&
+      trackLoopCounter == o.trackLoopCounter && trackByte == o.trackByte;
+  }
+  uint8_t fake() { return fakeBit(); }
+};
+
+// The MC3470 fake bits have to be a pure function of the seed: the
+// same every run, restarted by reading an image, carried through a
+// snapshot, and still about a quarter ones.
+static void testFakeBitsFollowSeed(const char *diskPath) {
+  TEST("woz: fake bits are reproducible from the seed");
+  const int N = 100000;
+  WozPeek a, b, c;
+  c.setFakeBitSeed(WOZ_FAKEBIT_SEED + 1);
+
+  int ones = 0, sameAsC = 0;
+  bool same = true;
+  for (int i = 0; i < N; i++) {
+    uint8_t bit = a.fake();
+    ones += bit;
+    if (bit != b.fake()) same = false;
+    if (bit == c.fake()) sameAsC++;
+  }
+  CHECK(same, "two drives with the same seed diverged");
+  CHECK(sameAsC < N * 3 / 4 + N / 50,
+        "different seeds agree on %d of %d bits", sameAsC, N);
+  CHECK(ones > N * 23 / 100 && ones < N * 27 / 100,
+        "%d of %d fake bits are ones", ones, N);
+
+  // Reading an image starts the stream over
+  uint8_t first[64];
+  WozPeek d;
+  for (int i = 0; i < 64; i++) first[i] = d.fake();
+  CHECK(d.readFile(diskPath, true, T_AUTO), "couldn't read %s", diskPath);
+  bool restarted = true;
+  for (int i = 0; i < 64; i++) if (d.fake() != first[i]) restarted = false;
+  CHECK(restarted, "readFile didn't restart the fake-bit stream");
+
+  // A snapshot taken partway through a word carries on exactly
+  NixFileManager fm;
+  FileManager *saved = g_filemanager;
+  g_filemanager = &fm;
+  char snapPath[] = "/tmp/aiie-fakebit-XXXXXX";
+  int tfd = mkstemp(snapPath);
+  if (tfd != -1) close(tfd);
+  for (int i = 0; i < 37; i++) a.fake();
+  int8_t fd = fm.openFile(snapPath);
+  CHECK(a.Serialize(fd), "Serialize failed");
+  fm.closeFile(fd);
+  WozPeek e;
+  fd = fm.openFile(snapPath);
+  CHECK(e.Deserialize(fd), "Deserialize failed");
+  fm.closeFile(fd);
+  g_filemanager = saved;
+  unlink(snapPath);
+  CHECK(e.fakeBitSeed() == a.fakeBitSeed(), "seed didn't round-trip");
+  same = true;
+  for (int i = 0; i < 1000; i++) if (a.fake() != e.fake()) same = false;
+  CHECK(same, "restored stream diverged");
+}
+
+// Rewinding saves and restores the drives without flushing or
+// reloading the image under them, and won't restore onto another one.
+static void testDriveStateLeavesImage(const char *diskPath) {
+  TEST("diskii: drive state round-trips without touching the image");
+  DiskII d(NULL);
+  d.insertDisk(0, diskPath, false);
+  g_cpu->cycles = 0;
+  cpuRead(d, 0x09);
+  cpuRead(d, 0x0A);
+  for (int i = 0; i < 100; i++) cpuRead(d, 0x0C, 7);
+  cpuRead(d, 0x0F);
+  for (int i = 0; i < 40; i++) writeSyncByte(d, 0xFF);
+  cpuRead(d, 0x0E);
+  WozSerializer *image = d.disk[0];
+  CHECK(image->isDirty(), "the writes didn't dirty the image");
+
+  NixFileManager fm;
+  FileManager *saved = g_filemanager;
+  g_filemanager = &fm;
+  int8_t fd = fm.openSnapshot("(drives)", true);
+  CHECK(fd != -1 && d.SerializeDrives(fd), "SerializeDrives failed");
+  uint32_t len = 0;
+  const uint8_t *data = fm.snapshotData(fd, &len);
+  static uint8_t state[4096];
+  CHECK(data && len <= sizeof(state), "no drive state (%u bytes)", len);
+  if (data && len <= sizeof(state)) memcpy(state, data, len);
+  fm.closeFile(fd);
+  CHECK(image->isDirty(), "saving the drive state flushed the image");
+
+  int64_t at = g_cpu->cycles;
+  uint8_t first[50], again[50];
+  for (int i = 0; i < 50; i++) first[i] = pollForByte(d);
+
+  g_cpu->cycles = at;
+  fd = fm.openSnapshotData(state, len);
+  CHECK(fd != -1 && d.DeserializeDrives(fd), "DeserializeDrives failed");
+  fm.closeFile(fd);
+  CHECK(d.disk[0] == image && image->isDirty(),
+        "restoring the drive state reloaded the image");
+  for (int i = 0; i < 50; i++) again[i] = pollForByte(d);
+  CHECK(!memcmp(first, again, sizeof(first)),
+        "the head didn't go back to where it was");
+
+  d.ejectDisk(0);
+  fd = fm.openSnapshotData(state, len);
+  CHECK(fd != -1 && !d.DeserializeDrives(fd),
+        "restored onto a drive with no disk in it");
+  fm.closeFile(fd);
+  CHECK(d.disk[0] == NULL, "a refused restore inserted a disk");
+  g_filemanager = saved;
+}
+
+// writeZerosThenByte() has to leave the track and the head exactly
+// where the bit-at-a-time writes it replaced would: from every bit
+// alignment, across the end of the track, and for runs long enough to
+// go all the way around.
+static void testBulkWriteMatchesBitWrites(const char *diskPath) {
+  TEST("woz: bulk writes match bit-at-a-time writes");
+  WozPeek a, b;
+  CHECK(a.readFile(diskPath, true, T_AUTO) && b.readFile(diskPath, true, T_AUTO),
+        "couldn't load %s", diskPath);
+  uint8_t trk = a.dataTrackNumberForQuarterTrack(17*4);
+  uint32_t bitCount;
+  a.trackBits(trk, &bitCount);
+
+  uint32_t seed = 1234;
+  int mismatches = 0;
+  for (int i = 0; i < 3000 && !mismatches; i++) {
+    seed = seed * 1103515245 + 12345;
+    uint32_t zeros = (seed >> 8) % 48;
+    if (i % 500 == 499)
+      zeros = bitCount + (seed >> 16) % 100; // all the way around
+    uint8_t v = seed >> 20;
+    for (uint32_t z = 0; z < zeros; z++)
+      a.writeNextWozBit(trk, 0);
+    for (int bit = 7; bit >= 0; bit--)
+      a.writeNextWozBit(trk, (v >> bit) & 1);
+    b.writeZerosThenByte(trk, zeros, v);
+
+    uint32_t bitsA, bitsB;
+    const uint8_t *da = a.trackBits(trk, &bitsA);
+    const uint8_t *db = b.trackBits(trk, &bitsB);
+    if (!a.sameHead(b) || bitsA != bitsB || memcmp(da, db, (bitsA + 7) / 8)) {
+      CHECK(false, "write %d (%u zeros, then %02X) differs", i, zeros, v);
+      mismatches++;
+    }
+  }
+  CHECK(mismatches == 0, "bulk writes diverged");
+  CHECK(b.isDirty(), "bulk writes didn't dirty the track");
+}
+
 int main(int argc, char *argv[]) {
   // Allow selecting which disk images to use via argv for flexibility;
   // default to Miner for the real-world read tests and a scratch DSK
@@ -444,8 +1488,26 @@ int main(int argc, char *argv[]) {
             minerPath);
   }
 
+  testWozBitCursor(scratchPath);
+  testReadAcrossIdleGaps(scratchPath);
+  testLoadSensesWriteProtect(scratchPath);
+  testNibbleFastPathMatchesLSS(scratchPath);
   testWriteThenReadFF(scratchPath);
   testWriteSectorHeaderRoundTrip(scratchPath);
+  testFlushDskWritesOnlyDirtyTrack();
+  testFlushWozPatchesTrackAndCRC(scratchPath);
+  testBackgroundFlushKeepsOrder();
+  testBackgroundFlushFailureKeepsTracks();
+  testWozMappedLoad(scratchPath);
+  testTrackCacheSharedLRU();
+  testNibCacheHitsAndInvalidates();
+  testInflateBlocksAndZip();
+  testCompressedImageOverlay();
+  testOverlayModeSharesImage();
+  testReuseWozForAnotherImage();
+  testBulkWriteMatchesBitWrites(scratchPath);
+  testFakeBitsFollowSeed(scratchPath);
+  testDriveStateLeavesImage(scratchPath);
 
   unlink(scratchPath);
 
@@ -0,0 +1,331 @@
+// Tests for the HD32 card's block storage: a block written through the
+// card is what the next read gets (from either drive), when the block
+// cache is full the least recently used block is the one that goes,
+// and a mapped image's writes end up in the file.
+//
+// The host build maps images and only falls back to the cache when it
+// can't, so HD32Peek drops the mapping to get at it. The card is
+// driven through its switches the way the ROM driver does, and the
+// AppleMMU is stubbed down to the two block copies HD32 makes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+
+#include "cpu.h"
+#include "filemanager.h"
+#include "globals.h"
+#include "apple/hd32.h"
+#include "nix/nix-filemanager.h"
+
+// ---------------------------------------------------------------------
+// Stubs: the globals HD32 reads, and the AppleMMU block copies (over a
+// flat 64K, since the tests pass a NULL AppleMMU)
+// ---------------------------------------------------------------------
+static Cpu s_cpu;
+FileManager *g_filemanager = NULL;
+Cpu *g_cpu = &s_cpu;
+VM *g_vm = NULL;
+PhysicalDisplay *g_display = NULL;
+PhysicalKeyboard *g_keyboard = NULL;
+PhysicalMouse *g_mouse = NULL;
+PhysicalSpeaker *g_speaker = NULL;
+PhysicalPaddles *g_paddles = NULL;
+PhysicalPrinter *g_printer = NULL;
+VMui *g_ui = NULL;
+int8_t g_volume = 0;
+uint8_t g_displayType = 0;
+VMRam g_ram;
+volatile uint8_t g_debugMode = 0;
+volatile bool g_biosInterrupt = false;
+uint32_t g_speed = 1023000;
+bool g_invertPaddleX = false;
+bool g_invertPaddleY = false;
+uint8_t g_luminanceCutoff = 0;
+uint8_t g_slotDiskII = 6;
+uint8_t g_slotHD32 = 7;
+char debugBuf[255];
+
+static uint8_t s_mem[65536];
+
+void AppleMMU::readBlock(uint16_t address, uint8_t *dest, uint16_t len)
+{
+  memcpy(dest, &s_mem[address], len);
+}
+
+void AppleMMU::writeBlock(uint16_t address, const uint8_t *src, uint16_t len)
+{
+  memcpy(&s_mem[address], src, len);
+}
+
+// ---------------------------------------------------------------------
+// Test framework (tiny — just counters and an ASSERT macro)
+// ---------------------------------------------------------------------
+static int g_pass = 0, g_fail = 0;
+static const char *g_curTest = "";
+
+#define TEST(name) do { g_curTest = name; fprintf(stderr, "\n[%s]\n", name); } while (0)
+
+#define CHECK(cond, fmt, ...) do { \
+  if (!(cond)) { \
+    fprintf(stderr, "  FAIL %s: " fmt "\n", g_curTest, ##__VA_ARGS__); \
+    g_fail++; \
+  } else { \
+    g_pass++; \
+  } \
+} while (0)
+
+// ---------------------------------------------------------------------
+// Driving the card
+// ---------------------------------------------------------------------
+
+// The card's switches and commands, as in hd32.cpp
+#define HD32_EXEC_RETSTAT 0x0
+#define HD32_COMMAND 0x2
+#define HD32_UNITNUM 0x3
+#define HD32_LBBUF 0x4
+#define HD32_HBBUF 0x5
+#define HD32_LBBLOCKNUM 0x6
+#define HD32_HBBLOCKNUM 0x7
+#define CMD_READ 0x1
+#define CMD_WRITE 0x2
+
+#define BUFADDR 0x2000
+#define IMAGEBLOCKS 64
+
+class HD32Peek : public HD32 {
+ public:
+  HD32Peek() : HD32(NULL) {}
+  // Drop the host's mapping, leaving the image open through the
+  // filemanager, so blocks come from the cache
+  void useCache(int8_t drive) { releaseMapping(drive); }
+};
+
+// 0 on success, like the ROM driver sees
+static uint8_t command(HD32 &hd, uint8_t drive, uint8_t cmd, uint16_t block)
+{
+  hd.writeSwitches(HD32_UNITNUM, drive ? 0x80 : 0x00);
+  hd.writeSwitches(HD32_LBBUF, BUFADDR & 0xFF);
+  hd.writeSwitches(HD32_HBBUF, BUFADDR >> 8);
+  hd.writeSwitches(HD32_LBBLOCKNUM, block & 0xFF);
+  hd.writeSwitches(HD32_HBBLOCKNUM, block >> 8);
+  hd.writeSwitches(HD32_COMMAND, cmd);
+  return hd.readSwitches(HD32_EXEC_RETSTAT);
+}
+
+static uint8_t patternByte(uint16_t block, uint16_t i)
+{
+  return block * 7 + i * 3;
+}
+
+static bool readIs(HD32 &hd, uint8_t drive, uint16_t block, uint8_t fill)
+{
+  memset(&s_mem[BUFADDR], ~fill, 512);
+  if (command(hd, drive, CMD_READ, block))
+    return false;
+  for (int i = 0; i < 512; i++)
+    if (s_mem[BUFADDR + i] != fill) return false;
+  return true;
+}
+
+static bool readIsPattern(HD32 &hd, uint8_t drive, uint16_t block)
+{
+  memset(&s_mem[BUFADDR], 0, 512);
+  if (command(hd, drive, CMD_READ, block))
+    return false;
+  for (int i = 0; i < 512; i++)
+    if (s_mem[BUFADDR + i] != patternByte(block, i)) return false;
+  return true;
+}
+
+static char s_imagePath[64];
+
+static const char *makeImage()
+{
+  strcpy(s_imagePath, "/tmp/test-hd32-XXXXXX.hdv");
+  int fd = mkstemps(s_imagePath, 4);
+  if (fd < 0) { perror("mkstemps"); exit(1); }
+  uint8_t block[512];
+  for (int b = 0; b < IMAGEBLOCKS; b++) {
+    for (int i = 0; i < 512; i++) block[i] = patternByte(b, i);
+    write(fd, block, sizeof(block));
+  }
+  close(fd);
+  return s_imagePath;
+}
+
+static void testReadAfterWrite(const char *path)
+{
+  TEST("hd32: a written block reads back from the cache");
+  HD32Peek hd;
+  hd.insertDisk(0, path);
+  hd.insertDisk(1, path);
+  hd.useCache(0);
+  hd.useCache(1);
+
+  // Both drives have block 5 cached before it's written
+  CHECK(readIsPattern(hd, 0, 5) && readIsPattern(hd, 1, 5),
+        "couldn't read block 5");
+  memset(&s_mem[BUFADDR], 0xA5, 512);
+  CHECK(command(hd, 0, CMD_WRITE, 5) == 0, "the write failed");
+
+  uint32_t hits, misses;
+  hd.resetCacheStats();
+  CHECK(readIs(hd, 0, 5, 0xA5), "drive 0 read back its old copy");
+  hd.cacheStats(&hits, &misses);
+  CHECK(hits == 1 && misses == 0,
+        "the written block wasn't a cache hit (%u hits, %u misses)",
+        hits, misses);
+  CHECK(readIs(hd, 1, 5, 0xA5),
+        "drive 1, with the same image, read back its stale copy");
+
+  // ... and it's in the image itself
+  uint8_t onDisk[512];
+  int fd = open(path, O_RDONLY);
+  bool ok = fd != -1 && pread(fd, onDisk, 512, 5 * 512) == 512;
+  if (fd != -1) close(fd);
+  bool same = ok;
+  for (int i = 0; ok && i < 512; i++)
+    if (onDisk[i] != 0xA5) same = false;
+  CHECK(same, "the write didn't reach the image");
+
+  // Writing a block that isn't cached doesn't bring in a stale one
+  memset(&s_mem[BUFADDR], 0x3C, 512);
+  CHECK(command(hd, 0, CMD_WRITE, 40) == 0 && readIs(hd, 0, 40, 0x3C),
+        "an uncached written block read back wrong");
+}
+
+static void testEvictsLeastRecentlyUsed(const char *path)
+{
+  TEST("hd32: a full cache drops the least recently used block");
+  HD32Peek hd;
+  CHECK(hd.setCacheBlocks(4), "couldn't resize the cache");
+  hd.insertDisk(0, path);
+  hd.useCache(0);
+
+  // Far apart, so there's no readahead
+  uint16_t blocks[] = { 10, 20, 30, 40 };
+  for (int i = 0; i < 4; i++)
+    CHECK(readIsPattern(hd, 0, blocks[i]), "couldn't read block %d", blocks[i]);
+
+  uint32_t hits, misses;
+  hd.resetCacheStats();
+  CHECK(readIsPattern(hd, 0, 10), "block 10 read back wrong");
+  hd.cacheStats(&hits, &misses);
+  CHECK(hits == 1 && misses == 0, "a full cache missed a cached block");
+
+  // 20 is the oldest now; 50 takes its place
+  CHECK(readIsPattern(hd, 0, 50), "block 50 read back wrong");
+  hd.resetCacheStats();
+  CHECK(readIsPattern(hd, 0, 10) && readIsPattern(hd, 0, 30) &&
+        readIsPattern(hd, 0, 40) && readIsPattern(hd, 0, 50),
+        "a block read back wrong");
+  hd.cacheStats(&hits, &misses);
+  CHECK(hits == 4 && misses == 0,
+        "the wrong block was dropped (%u hits, %u misses)", hits, misses);
+  CHECK(readIsPattern(hd, 0, 20), "block 20 read back wrong");
+  hd.cacheStats(&hits, &misses);
+  CHECK(misses == 1, "block 20 was never dropped");
+
+  // A one-block cache (the Teensy's) still alternates correctly
+  CHECK(hd.setCacheBlocks(1), "couldn't resize the cache");
+  bool ok = true;
+  for (int i = 0; i < 8; i++)
+    if (!readIsPattern(hd, 0, (i & 1) ? 3 : 60)) ok = false;
+  CHECK(ok, "a one-block cache read back wrong");
+}
+
+// The host normally runs the drive straight out of the mapped image
+static void testMappedReadAfterWrite(const char *path)
+{
+  TEST("hd32: a mapped drive reads back what was written");
+  HD32Peek hd;
+  hd.insertDisk(0, path);
+  hd.insertDisk(1, path);
+
+  CHECK(readIsPattern(hd, 0, 12) && readIsPattern(hd, 1, 12),
+        "couldn't read block 12");
+  memset(&s_mem[BUFADDR], 0x96, 512);
+  CHECK(command(hd, 0, CMD_WRITE, 12) == 0, "the write failed");
+  CHECK(readIs(hd, 0, 12, 0x96), "drive 0 read back the old block");
+  CHECK(readIs(hd, 1, 12, 0x96),
+        "drive 1, with the same image, read back the old block");
+  CHECK(readIsPattern(hd, 0, 11) && readIsPattern(hd, 0, 13),
+        "the write spilled into the blocks around it");
+  uint32_t hits, misses;
+  hd.cacheStats(&hits, &misses);
+  CHECK(hits == 0 && misses == 0,
+        "mapped reads were counted as block cache lookups");
+
+  // Past the end of the image
+  CHECK(command(hd, 0, CMD_READ, IMAGEBLOCKS) != 0,
+        "a read past the end succeeded");
+  CHECK(command(hd, 0, CMD_WRITE, IMAGEBLOCKS) != 0,
+        "a write past the end succeeded");
+}
+
+static void testMappedWritesReachFile(const char *path)
+{
+  TEST("hd32: a mapped drive's writes are in the file after eject");
+  {
+    HD32Peek hd;
+    hd.insertDisk(0, path);
+    memset(&s_mem[BUFADDR], 0x4B, 512);
+    CHECK(command(hd, 0, CMD_WRITE, 0) == 0, "the first write failed");
+    memset(&s_mem[BUFADDR], 0xD2, 512);
+    CHECK(command(hd, 0, CMD_WRITE, IMAGEBLOCKS - 1) == 0,
+          "the last write failed");
+    // Nothing's due yet, but it mustn't get in the way
+    hd.maintenance();
+    hd.ejectDisk(0);
+  }
+
+  uint8_t image[IMAGEBLOCKS * 512];
+  int fd = open(path, O_RDONLY);
+  bool ok = fd != -1 && read(fd, image, sizeof(image)) == sizeof(image);
+  if (fd != -1) close(fd);
+  CHECK(ok, "couldn't read the image back");
+  int wrong = 0;
+  for (int b = 0; ok && b < IMAGEBLOCKS; b++) {
+    for (int i = 0; i < 512; i++) {
+      uint8_t want = (b == 0) ? 0x4B :
+                     (b == IMAGEBLOCKS - 1) ? 0xD2 : patternByte(b, i);
+      if (image[b * 512 + i] != want) {
+        wrong++;
+        break;
+      }
+    }
+  }
+  CHECK(ok && wrong == 0, "%d blocks in the file are wrong", wrong);
+
+  // ... and a new drive sees them
+  HD32Peek hd;
+  hd.insertDisk(0, path);
+  CHECK(readIs(hd, 0, 0, 0x4B) && readIs(hd, 0, IMAGEBLOCKS - 1, 0xD2),
+        "reinserting the image lost the writes");
+}
+
+int main(int argc, char *argv[])
+{
+  NixFileManager fm;
+  g_filemanager = &fm;
+  const char *path = makeImage();
+
+  testReadAfterWrite(path);
+  unlink(path);
+  path = makeImage();
+  testEvictsLeastRecentlyUsed(path);
+  unlink(path);
+  path = makeImage();
+  testMappedReadAfterWrite(path);
+  unlink(path);
+  path = makeImage();
+  testMappedWritesReachFile(path);
+  unlink(path);
+
+  fprintf(stderr, "\n==== %d passed, %d failed ====\n", g_pass, g_fail);
+  return g_fail == 0 ? 0 : 1;
+}
@@ -0,0 +1,491 @@
+// Tests for saving the machine's state: suspend files, and what's
+// built on them.
+//
+// Like test-diskii, it links just the pieces under test, with the
+// globals they touch stubbed out.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <signal.h>
+
+#include "cpu.h"
+#include "filemanager.h"
+#include "globals.h"
+#include "nix/nix-filemanager.h"
+#include "apple/mockingboard.h"
+#include "snapshot.h"
+#include "nix/rewind.h"
+#include "nix/bg-suspend.h"
+#include "serialize.h"
+
+// ---------------------------------------------------------------------
+// Stubs for the globals these touch (g_cpu->cycles, g_ram...)
+// ---------------------------------------------------------------------
+static Cpu s_cpu;
+
+FileManager *g_filemanager = NULL;
+Cpu *g_cpu = &s_cpu;
+VM *g_vm = NULL;
+PhysicalDisplay *g_display = NULL;
+PhysicalKeyboard *g_keyboard = NULL;
+PhysicalMouse *g_mouse = NULL;
+PhysicalSpeaker *g_speaker = NULL;
+PhysicalPaddles *g_paddles = NULL;
+PhysicalPrinter *g_printer = NULL;
+VMui *g_ui = NULL;
+int8_t g_volume = 0;
+uint8_t g_displayType = 0;
+VMRam g_ram;
+volatile uint8_t g_debugMode = 0;
+volatile bool g_biosInterrupt = false;
+uint32_t g_speed = 1023000;
+bool g_invertPaddleX = false;
+bool g_invertPaddleY = false;
+uint8_t g_luminanceCutoff = 0;
+char debugBuf[255];
+
+// ---------------------------------------------------------------------
+// Test framework (tiny — just counters and an ASSERT macro)
+// ---------------------------------------------------------------------
+static int g_pass = 0, g_fail = 0;
+static const char *g_curTest = "";
+
+#define TEST(name) do { g_curTest = name; fprintf(stderr, "\n[%s]\n", name); } while (0)
+
+#define CHECK(cond, fmt, ...) do { \
+  if (!(cond)) { \
+    fprintf(stderr, "  FAIL %s: " fmt "\n", g_curTest, ##__VA_ARGS__); \
+    g_fail++; \
+  } else { \
+    g_pass++; \
+  } \
+} while (0)
+
+// Suspend files are built in memory and replace the old file in one
+// write and a rename: nothing reaches the file until the commit, an
+// uncommitted one leaves the old file as it was, and reading one back
+// gives the same bytes.
+static void testSnapshotCommitsWhole() {
+  TEST("filemanager: snapshots are written whole and atomically");
+  NixFileManager fm;
+  char path[] = "/tmp/aiie-snapshot-XXXXXX";
+  int tfd = mkstemp(path);
+  if (tfd == -1) { CHECK(false, "mkstemp failed"); return; }
+  CHECK(::write(tfd, "old", 3) == 3, "couldn't seed the old snapshot");
+  close(tfd);
+
+  // About the size of a real suspend file: 128K of RAM plus change
+  static uint8_t ram[131072];
+  for (uint32_t i = 0; i < sizeof(ram); i++) ram[i] = (i * 7) ^ (i >> 8);
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  int8_t fd = fm.openSnapshot(path, true);
+  CHECK(fd != -1, "openSnapshot for writing failed");
+  int writes = 0;
+  bool wroteAll = true;
+  for (int i = 0; i < 2000; i++, writes++) {
+    uint8_t b = i;
+    if (fm.write(fd, &b, 1) != 1) wroteAll = false;
+  }
+  if (fm.write(fd, ram, sizeof(ram)) != (int)sizeof(ram)) wroteAll = false;
+  CHECK(wroteAll, "buffered writes failed");
+
+  struct stat st;
+  CHECK(stat(path, &st) == 0 && st.st_size == 3,
+        "the file changed before the snapshot was committed");
+  CHECK(fm.commitSnapshot(fd), "commitSnapshot failed");
+  fm.closeFile(fd);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+  fprintf(stderr, "  %d small writes and %u bytes of RAM: %.3f ms\n",
+          writes, (unsigned)sizeof(ram), ms);
+  CHECK(stat(path, &st) == 0 && st.st_size == 2000 + (off_t)sizeof(ram),
+        "committed snapshot is %ld bytes", (long)st.st_size);
+
+  // Read it back
+  fd = fm.openSnapshot(path, false);
+  CHECK(fd != -1, "openSnapshot for reading failed");
+  bool same = true;
+  for (int i = 0; i < 2000; i++) {
+    uint8_t b;
+    if (fm.read(fd, &b, 1) != 1 || b != (uint8_t)i) same = false;
+  }
+  static uint8_t back[sizeof(ram)];
+  if (fm.read(fd, back, sizeof(back)) != (int)sizeof(back) ||
+      memcmp(back, ram, sizeof(ram)))
+    same = false;
+  CHECK(same, "snapshot read back differently");
+  uint8_t extra;
+  CHECK(fm.read(fd, &extra, 1) == -1, "read past the end of the snapshot");
+  fm.closeFile(fd);
+
+  // One that's abandoned never touches the file
+  fd = fm.openSnapshot(path, true);
+  fm.write(fd, "new", 3);
+  fm.closeFile(fd);
+  CHECK(stat(path, &st) == 0 && st.st_size == 2000 + (off_t)sizeof(ram),
+        "an uncommitted snapshot replaced the file");
+  unlink(path);
+}
+
+// Suspend files are chunked: a reader skips the chunks it doesn't
+// know, and a device restored from its chunk carries on exactly as
+// the original would have. The Mockingboard has the most state that
+// keeps moving on its own.
+static void mbWriteAY(Mockingboard *mb, uint8_t reg, uint8_t val) {
+  mb->writeSlotRom(0x01, reg);
+  mb->writeSlotRom(0x00, 0x07); // latch address
+  mb->writeSlotRom(0x00, 0x04);
+  mb->writeSlotRom(0x01, val);
+  mb->writeSlotRom(0x00, 0x06); // write
+  mb->writeSlotRom(0x00, 0x04);
+}
+
+static void testSnapshotChunksRoundTrip() {
+  TEST("snapshot: chunks skip and restore");
+  NixFileManager fm;
+  FileManager *saved = g_filemanager;
+  g_filemanager = &fm;
+  char path[] = "/tmp/aiie-chunks-XXXXXX";
+  int tfd = mkstemp(path);
+  if (tfd != -1) close(tfd);
+
+  Mockingboard a, b;
+  s_cpu.cycles = 1000;
+  a.update(s_cpu.cycles);
+  a.writeSlotRom(0x02, 0xFF);  // DDRB
+  a.writeSlotRom(0x03, 0xFF);  // DDRA
+  a.writeSlotRom(0x0B, 0x40);  // T1 free-running
+  a.writeSlotRom(0x0E, 0xC0);  // T1 interrupts on
+  a.writeSlotRom(0x04, 0x34);
+  a.writeSlotRom(0x05, 0x12);
+  uint8_t regs[14] = { 0x40, 0x01, 0x90, 0x00, 0x20, 0x02, 0x0C,
+                       0x30, 0x0F, 0x10, 0x0A, 0x80, 0x01, 0x0E };
+  for (int r = 0; r < 14; r++) mbWriteAY(&a, r, regs[r]);
+  s_cpu.cycles += 5000;
+  a.update(s_cpu.cycles);
+  for (int i = 0; i < 100; i++) a.mixSample();
+
+  uint32_t lengthPos;
+  uint8_t junk[5] = { 1, 2, 3, 4, 5 };
+  int8_t fd = fm.openSnapshot(path, true);
+  bool wrote = fd != -1 &&
+    beginChunk(fd, SNAPTAG('Z','Z','Z','Z'), 7, &lengthPos) &&
+    fm.write(fd, junk, sizeof(junk)) == sizeof(junk) &&
+    endChunk(fd, lengthPos) &&
+    beginChunk(fd, SNAPTAG('M','O','C','K'), 1, &lengthPos) &&
+    a.Serialize(fd) && endChunk(fd, lengthPos) &&
+    beginChunk(fd, SNAP_END, 1, &lengthPos) && endChunk(fd, lengthPos) &&
+    fm.commitSnapshot(fd);
+  fm.closeFile(fd);
+  CHECK(wrote, "couldn't write the chunks");
+
+  uint32_t tag, length, start;
+  uint8_t version;
+  fd = fm.openSnapshot(path, false);
+  CHECK(fd != -1 && readChunkHeader(fd, &tag, &version, &length, &start) &&
+        tag == SNAPTAG('Z','Z','Z','Z') && version == 7 && length == 5 &&
+        skipChunk(fd, length, start), "couldn't skip the unknown chunk");
+  CHECK(readChunkHeader(fd, &tag, &version, &length, &start) &&
+        tag == SNAPTAG('M','O','C','K') && b.Deserialize(fd) &&
+        finishChunk(fd, tag, length, start),
+        "couldn't restore the Mockingboard chunk");
+  CHECK(readChunkHeader(fd, &tag, &version, &length, &start) &&
+        tag == SNAP_END && length == 0, "no end chunk");
+  fm.closeFile(fd);
+  g_filemanager = saved;
+  unlink(path);
+
+  // Both carry on the same: timers, interrupt flags and audio
+  bool same = true;
+  for (int i = 0; i < 2000 && same; i++) {
+    s_cpu.cycles += 37 + (i % 500);
+    if (a.readSlotRom(0x04) != b.readSlotRom(0x04) ||
+        a.readSlotRom(0x0D) != b.readSlotRom(0x0D))
+      same = false;
+    for (int j = 0; j < 8; j++)
+      if (a.mixSample() != b.mixSample()) same = false;
+  }
+  CHECK(same, "restored Mockingboard diverged");
+}
+
+// The rewind buffer keeps only the pages that changed between
+// captures; walking back through them has to land on exactly the RAM
+// (and device state) each capture saw.
+static bool rewindTestSave(int8_t fd) {
+  serialize64(s_cpu.cycles);
+  return g_ram.Serialize(fd);
+ err:
+  return false;
+}
+
+static bool rewindTestLoad(int8_t fd) {
+  deserialize64(s_cpu.cycles);
+  return g_ram.Deserialize(fd);
+ err:
+  return false;
+}
+
+// Stands in for the disks having changed since a capture
+static bool s_rewindRefuse;
+
+static bool rewindTestCheck(int8_t fd) {
+  return !s_rewindRefuse;
+}
+
+#define REWIND_TEST_RAM (VMRAM_PAGES * 256)
+#define REWIND_TEST_CAPTURES 40
+
+static uint32_t rewindScribble(uint32_t seed, int pages) {
+  for (int p = 0; p < pages; p++) {
+    seed = seed * 1103515245 + 12345;
+    uint32_t page = (seed >> 8) % VMRAM_PAGES;
+    if (p & 1) {
+      // Some writers go through memPtr(), like AppleMMU::writeBlock
+      memset(g_ram.memPtr(page << 8), seed >> 24, 256);
+      g_ram.markDirty(page << 8, 256);
+    } else {
+      g_ram.writeByte((page << 8) | ((seed >> 16) & 0xFF), seed >> 20);
+    }
+  }
+  return seed;
+}
+
+static void testRewindRestoresDeltas() {
+  TEST("rewind: dirty-page deltas restore every capture");
+  NixFileManager fm;
+  FileManager *saved = g_filemanager;
+  g_filemanager = &fm;
+
+  static uint8_t copies[REWIND_TEST_CAPTURES][REWIND_TEST_RAM];
+  int64_t cycles[REWIND_TEST_CAPTURES];
+  g_ram.init();
+  uint32_t seed = 99;
+  for (uint32_t i = 0; i < REWIND_TEST_RAM; i += 64) {
+    seed = seed * 1103515245 + 12345;
+    g_ram.writeByte(i, seed >> 16);
+  }
+
+  RewindBuffer rb(64 * 1024 * 1024, rewindTestSave, rewindTestLoad,
+                  rewindTestCheck);
+  s_cpu.cycles = 1000;
+  bool captured = true;
+  for (int i = 0; i < REWIND_TEST_CAPTURES; i++) {
+    seed = rewindScribble(seed, (i % 9) * 3);
+    s_cpu.cycles += 511500;
+    cycles[i] = s_cpu.cycles;
+    memcpy(copies[i], g_ram.memPtr(0), REWIND_TEST_RAM);
+    if (!rb.capture(s_cpu.cycles)) captured = false;
+  }
+  CHECK(captured && rb.count() == REWIND_TEST_CAPTURES,
+        "only %d captures", rb.count());
+  fprintf(stderr, "  %d captures with up to 24 pages changed: %u KB\n",
+          rb.count(), rb.bytesUsed() / 1024);
+  CHECK(rb.bytesUsed() < REWIND_TEST_RAM + 300 * 1024,
+        "the captures take %u bytes", rb.bytesUsed());
+
+  // Back in a few hops, scribbling in between so there are pages
+  // dirtied since the newest capture too
+  int targets[] = { 37, 30, 30, 12, 3 };
+  bool same = true;
+  double worstMs = 0;
+  for (unsigned t = 0; t < sizeof(targets) / sizeof(targets[0]); t++) {
+    int j = targets[t];
+    seed = rewindScribble(seed, 50);
+    s_cpu.cycles += 1234;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int64_t at = rb.restore(cycles[j] + 100);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    if (ms > worstMs) worstMs = ms;
+    if (at != cycles[j] || s_cpu.cycles != cycles[j] ||
+        memcmp(g_ram.memPtr(0), copies[j], REWIND_TEST_RAM)) {
+      CHECK(false, "restoring capture %d came back different", j);
+      same = false;
+    }
+    CHECK(rb.count() == j + 1, "%d captures left after going back to %d",
+          rb.count(), j);
+  }
+  CHECK(same, "rewound RAM doesn't match");
+  fprintf(stderr, "  slowest restore: %.3f ms\n", worstMs);
+
+  // Carry on from there, then go back past the start
+  seed = rewindScribble(seed, 10);
+  s_cpu.cycles += 511500;
+  memcpy(copies[4], g_ram.memPtr(0), REWIND_TEST_RAM);
+  rb.capture(s_cpu.cycles);
+  CHECK(rb.restore(s_cpu.cycles) == s_cpu.cycles &&
+        !memcmp(g_ram.memPtr(0), copies[4], REWIND_TEST_RAM),
+        "couldn't restore a capture taken after rewinding");
+  CHECK(rb.restore(0) == cycles[0] &&
+        !memcmp(g_ram.memPtr(0), copies[0], REWIND_TEST_RAM),
+        "going back past the oldest capture didn't stop at it");
+
+  // A capture that won't load leaves everything as it was
+  seed = rewindScribble(seed, 10);
+  static uint8_t before[REWIND_TEST_RAM];
+  memcpy(before, g_ram.memPtr(0), REWIND_TEST_RAM);
+  int64_t cyclesBefore = s_cpu.cycles;
+  int countBefore = rb.count();
+  s_rewindRefuse = true;
+  int64_t refused = rb.restore(0);
+  s_rewindRefuse = false;
+  CHECK(refused == -1 && s_cpu.cycles == cyclesBefore &&
+        rb.count() == countBefore &&
+        !memcmp(g_ram.memPtr(0), before, REWIND_TEST_RAM),
+        "a refused restore changed something");
+  CHECK(rb.restore(0) == cycles[0] &&
+        !memcmp(g_ram.memPtr(0), copies[0], REWIND_TEST_RAM),
+        "a refused restore broke the next one");
+
+  // An idle minute: two captures a second, a couple of pages each
+  rb.clear();
+  for (int i = 0; i < 120; i++) {
+    seed = rewindScribble(seed, 2);
+    s_cpu.cycles += 511500;
+    rb.capture(s_cpu.cycles);
+  }
+  fprintf(stderr, "  an idle minute (%d captures): %u KB\n",
+          rb.count(), rb.bytesUsed() / 1024);
+  CHECK(rb.count() == 120 && rb.bytesUsed() < 400 * 1024,
+        "an idle minute takes %u bytes in %d captures",
+        rb.bytesUsed(), rb.count());
+
+  // With a tight budget, the oldest ones go and what's left still
+  // restores
+  RewindBuffer tight(REWIND_TEST_RAM + 8 * 48 * 1024, rewindTestSave,
+                     rewindTestLoad, rewindTestCheck);
+  for (int i = 0; i < REWIND_TEST_CAPTURES; i++) {
+    seed = rewindScribble(seed, 180);
+    s_cpu.cycles += 511500;
+    cycles[i] = s_cpu.cycles;
+    memcpy(copies[i], g_ram.memPtr(0), REWIND_TEST_RAM);
+    tight.capture(s_cpu.cycles);
+  }
+  int kept = tight.count();
+  CHECK(kept > 1 && kept < REWIND_TEST_CAPTURES &&
+        tight.bytesUsed() <= REWIND_TEST_RAM + 8 * 48 * 1024,
+        "%d captures in %u bytes", kept, tight.bytesUsed());
+  int oldest = REWIND_TEST_CAPTURES - kept;
+  CHECK(tight.oldestCycle() == cycles[oldest], "the wrong captures were dropped");
+  CHECK(tight.restore(0) == cycles[oldest] &&
+        !memcmp(g_ram.memPtr(0), copies[oldest], REWIND_TEST_RAM),
+        "the oldest capture left doesn't restore");
+
+  g_filemanager = saved;
+}
+
+// A background suspend saves the machine as it was when it forked,
+// while the parent goes on changing it, and says how it went.
+#define BGSUSPEND_TEST_RAM (VMRAM_PAGES * 256)
+
+static int s_bgDelayMs;
+static int s_bgHow; // 0 saves, 1 fails, 2 dies
+
+static bool bgSave(const char *fn) {
+  usleep(s_bgDelayMs * 1000);
+  if (s_bgHow == 2) kill(getpid(), SIGKILL);
+  int8_t fd = g_filemanager->openSnapshot(fn, true);
+  bool ok = fd != -1 && g_ram.Serialize(fd) && s_bgHow == 0 &&
+    g_filemanager->commitSnapshot(fd);
+  g_filemanager->closeFile(fd);
+  return ok;
+}
+
+static double msSince(struct timespec *t0) {
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+static void testBackgroundSuspend() {
+  TEST("suspend: forked background snapshots");
+  NixFileManager fm;
+  FileManager *saved = g_filemanager;
+  g_filemanager = &fm;
+  char path[] = "/tmp/aiie-bgsuspend-XXXXXX";
+  int tfd = mkstemp(path);
+  if (tfd != -1) close(tfd);
+
+  static uint8_t before[BGSUSPEND_TEST_RAM];
+  for (uint32_t i = 0; i < BGSUSPEND_TEST_RAM; i++)
+    g_ram.writeByte(i, (i * 13) ^ (i >> 9));
+  memcpy(before, g_ram.memPtr(0), BGSUSPEND_TEST_RAM);
+
+  // What it costs in the foreground, for comparison
+  struct timespec t0;
+  s_bgDelayMs = 0;
+  s_bgHow = 0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  bgSave(path);
+  double foreground = msSince(&t0);
+
+  BackgroundSuspend bg;
+  s_bgDelayMs = 200;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  bool started = bg.start(path, bgSave);
+  double paused = msSince(&t0);
+  CHECK(started, "couldn't start a background suspend");
+  fprintf(stderr, "  foreground save %.3f ms; the fork held us up %.3f ms\n",
+          foreground, paused);
+
+  // Carry on changing things while the child writes
+  for (uint32_t i = 0; i < BGSUSPEND_TEST_RAM; i += 7)
+    g_ram.writeByte(i, 0xEE);
+  CHECK(bg.busy() && bg.poll() == BGSUSPEND_RUNNING,
+        "the suspend finished before its child could have");
+  CHECK(!bg.start(path, bgSave), "a second suspend overlapped the first");
+  CHECK(bg.poll(true) == BGSUSPEND_DONE, "the background suspend failed");
+  CHECK(!bg.busy() && bg.poll() == BGSUSPEND_IDLE, "it's still busy");
+
+  int8_t fd = fm.openSnapshot(path, false);
+  uint8_t magic, data[8];
+  uint32_t size = 0;
+  bool same = fd != -1 && fm.read(fd, &magic, 1) == 1 &&
+    fm.read(fd, data, 4) == 4;
+  if (same) {
+    size = ((uint32_t)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+    uint8_t *back = (uint8_t *)malloc(BGSUSPEND_TEST_RAM);
+    same = size == BGSUSPEND_TEST_RAM &&
+      fm.read(fd, back, BGSUSPEND_TEST_RAM) == BGSUSPEND_TEST_RAM &&
+      !memcmp(back, before, BGSUSPEND_TEST_RAM);
+    free(back);
+  }
+  fm.closeFile(fd);
+  CHECK(same, "the suspend file isn't the RAM as of the fork");
+
+  // Failing, and dying, are both reported, and leave the file alone
+  struct stat st1, st2;
+  stat(path, &st1);
+  s_bgDelayMs = 0;
+  s_bgHow = 1;
+  CHECK(bg.start(path, bgSave) && bg.poll(true) == BGSUSPEND_FAILED,
+        "a failed suspend wasn't reported");
+  s_bgHow = 2;
+  CHECK(bg.start(path, bgSave) && bg.poll(true) == BGSUSPEND_FAILED,
+        "a child that died wasn't reported");
+  stat(path, &st2);
+  CHECK(st1.st_mtime == st2.st_mtime && st1.st_size == st2.st_size,
+        "a failed suspend touched the file");
+
+  g_filemanager = saved;
+  unlink(path);
+}
+
+int main(int argc, char *argv[]) {
+  testSnapshotCommitsWhole();
+  testSnapshotChunksRoundTrip();
+  testRewindRestoresDeltas();
+  testBackgroundSuspend();
+
+  fprintf(stderr, "\n==== %d passed, %d failed ====\n", g_pass, g_fail);
+  return g_fail == 0 ? 0 : 1;
+}
@@ -0,0 +1,206 @@
+// Checks the WSOLA overlap search. The coarse-to-fine search in
+// wsola-speaker.cpp has to pick the same offset as the exhaustive scan
+// it replaced, or one whose correlation is equivalent. Test signals
+// are rendered through wsola_toggle/wsola_flush so they have the same
+// duty-cycle integrated shape the real speaker path produces.
+//
+// Also reports the host time per search so the speedup is visible;
+// those times aren't checked.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "wsola-speaker.h"
+
+#define OVERLAP 128
+#define SEARCH  64
+#define HOP     128
+#define NSAMPLES 30000
+
+static int g_pass = 0, g_fail = 0;
+static const char *g_curTest = "";
+
+#define TEST(name) do { g_curTest = name; fprintf(stderr, "\n[%s]\n", name); } while (0)
+
+#define CHECK(cond, fmt, ...) do { \
+  if (!(cond)) { \
+    fprintf(stderr, "  FAIL %s: " fmt "\n", g_curTest, ##__VA_ARGS__); \
+    g_fail++; \
+  } else { \
+    g_pass++; \
+  } \
+} while (0)
+
+static int16_t s_signal[NSAMPLES];
+
+// The original scalar correlation, kept here as the reference.
+static int64_t refCorrelate(const int16_t *tail, const int16_t *win)
+{
+  int64_t corr = 0;
+  for (int j = 0; j < OVERLAP; j++)
+    corr += (int32_t)tail[j] * (int32_t)win[j];
+  return corr;
+}
+
+// Render a speaker signal from a list of toggle intervals (in CPU
+// cycles) by replaying them through the real emu-rate path.
+typedef int (*intervalFn)(int i);
+
+static int renderSignal(intervalFn fn)
+{
+  wsola_reset();
+  int64_t cycles = 1000;
+  int i = 0;
+  while (wsola_buffered() < NSAMPLES) {
+    wsola_toggle(cycles, 0x4FFF, -0x4FFF);
+    cycles += fn(i++);
+  }
+  return wsola_peek_emubuf(s_signal, NSAMPLES);
+}
+
+static int toneInterval;
+static int toneFn(int i) { return toneInterval; }
+
+// Fake polyphony: two tones interleaved by PWM, like the music
+// drivers that toggle the speaker at uneven intervals.
+static int pwmFn(int i) { return (i & 1) ? 37 + (i % 23) : 110 - (i % 41); }
+
+// Sweep from a low buzz up into the top of the audible range.
+static int sweepFn(int i) { return 2000 - ((i / 8) % 1950); }
+
+static uint32_t s_lcg = 12345;
+static int noiseFn(int i)
+{
+  s_lcg = s_lcg * 1103515245 + 12345;
+  return 24 + ((s_lcg >> 16) % 400);
+}
+
+// Walk the signal the way wsolaEmitOneSynhop does: the previous
+// frame's tail against a window `ratio` hops ahead, for every hop.
+static void compareSearches(int count, int ratioHops)
+{
+  int16_t tail[OVERLAP];
+  int16_t window[SEARCH + OVERLAP];
+  int same = 0, equivalent = 0, worse = 0;
+  double worstRatio = 1.0;
+
+  for (int p = 0; p + OVERLAP + ratioHops * HOP + SEARCH + OVERLAP < count;
+       p += HOP) {
+    for (int j = 0; j < OVERLAP; j++) tail[j] = s_signal[p + j] >> 2;
+    int w = p + OVERLAP + (ratioHops - 1) * HOP;
+    for (int j = 0; j < SEARCH + OVERLAP; j++) window[j] = s_signal[w + j] >> 2;
+
+    int ex = wsola_best_offset(tail, window, 0, SEARCH, true);
+    int fast = wsola_best_offset(tail, window, 0, SEARCH, false);
+
+    // The exhaustive path must still agree with the scalar reference.
+    int refBest = 0;
+    int64_t refCorr = INT64_MIN;
+    for (int off = 0; off <= SEARCH; off++) {
+      int64_t c = refCorrelate(tail, &window[off]);
+      if (c > refCorr) { refCorr = c; refBest = off; }
+    }
+    if (refBest != ex) {
+      CHECK(false, "exhaustive kernel picked %d, scalar reference %d at %d",
+            ex, refBest, p);
+      continue;
+    }
+
+    if (fast == ex) { same++; continue; }
+    int64_t exCorr = refCorrelate(tail, &window[ex]);
+    int64_t fastCorr = refCorrelate(tail, &window[fast]);
+    // "Equivalent" means within 2% of the best correlation's swing;
+    // anything lower is an audible mis-splice.
+    int64_t slack = (exCorr < 0 ? -exCorr : exCorr) / 50;
+    if (fastCorr >= exCorr - slack) {
+      equivalent++;
+      if (exCorr > 0 && (double)fastCorr / exCorr < worstRatio)
+        worstRatio = (double)fastCorr / exCorr;
+    } else {
+      worse++;
+    }
+  }
+  fprintf(stderr, "  ratio %d: %d same, %d equivalent (worst %.3f), %d worse\n",
+          ratioHops, same, equivalent, worstRatio, worse);
+  CHECK(worse == 0, "%d hops picked a clearly worse offset", worse);
+}
+
+static void testSignal(const char *name, intervalFn fn)
+{
+  TEST(name);
+  int n = renderSignal(fn);
+  CHECK(n == NSAMPLES, "only rendered %d samples", n);
+  for (int r = 2; r <= 5; r++) compareSearches(n, r);
+}
+
+// 0 = the original scalar loop, 1 = exhaustive kernel, 2 = adaptive.
+static int searchWith(int mode, const int16_t *tail, const int16_t *window)
+{
+  if (mode > 0) return wsola_best_offset(tail, window, 0, SEARCH, mode == 1);
+  int best = 0;
+  int64_t bestCorr = INT64_MIN;
+  for (int off = 0; off <= SEARCH; off++) {
+    int64_t c = refCorrelate(tail, &window[off]);
+    if (c > bestCorr) { bestCorr = c; best = off; }
+  }
+  return best;
+}
+
+static double timeSearches(int mode)
+{
+  int16_t tail[OVERLAP];
+  int16_t window[SEARCH + OVERLAP];
+  const int iters = 20000;
+  volatile int sink = 0;
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int i = 0; i < iters; i++) {
+    int p = (i * HOP) % (NSAMPLES - 3 * OVERLAP - SEARCH);
+    for (int j = 0; j < OVERLAP; j++) tail[j] = s_signal[p + j] >> 2;
+    for (int j = 0; j < SEARCH + OVERLAP; j++)
+      window[j] = s_signal[p + OVERLAP + j] >> 2;
+    sink += searchWith(mode, tail, window);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  (void)sink;
+  return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / iters;
+}
+
+static void timeSignal(const char *name, intervalFn fn)
+{
+  renderSignal(fn);
+  double scalar = timeSearches(0);
+  double kernel = timeSearches(1);
+  double adaptive = timeSearches(2);
+  // Report only: wall-clock times aren't something a loaded machine
+  // can be held to
+  fprintf(stderr, "  %-14s scalar %5.0f ns, kernel %5.0f ns, "
+          "coarse-to-fine %5.0f ns (%.2fx the kernel)\n",
+          name, scalar, kernel, adaptive, adaptive / kernel);
+}
+
+int main(int argc, char *argv[])
+{
+  int tones[] = { 4600, 1160, 580, 290, 116, 64, 46 };
+  char name[64];
+  for (unsigned i = 0; i < sizeof(tones) / sizeof(tones[0]); i++) {
+    toneInterval = tones[i];
+    snprintf(name, sizeof(name), "search: square tone, %d Hz",
+             1023000 / (2 * tones[i]));
+    testSignal(name, toneFn);
+  }
+  testSignal("search: PWM fake polyphony", pwmFn);
+  testSignal("search: frequency sweep", sweepFn);
+  testSignal("search: random toggles", noiseFn);
+
+  TEST("search: host cost per hop");
+  toneInterval = 1160;
+  timeSignal("440 Hz tone", toneFn);
+  timeSignal("PWM", pwmFn);
+
+  fprintf(stderr, "\n==== %d passed, %d failed ====\n", g_pass, g_fail);
+  return g_fail == 0 ? 0 : 1;
+}
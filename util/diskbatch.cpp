@@ -0,0 +1,411 @@
+// Converts, verifies and dumps disk images in bulk, outside the
+// emulator. Give it images and directories (which are searched
+// recursively); each image goes to one of a pool of worker threads,
+// and every worker reuses its own Woz for image after image.
+//
+//   diskbatch [-j threads] [-t type [-o dir]] [-V] [-i] [-q] path...
+//
+// With no -t or -i it verifies. Per-image times and the overall
+// throughput are reported at the end.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "woz.h"
+#include "crc32.h"
+#include "image-map.h"
+#include "compressed-image.h"
+
+#define MAXJOBPATH 4096
+
+typedef struct _job {
+  char *path;
+  uint64_t bytes;
+} job;
+
+// Options
+static int s_threads = 0;
+static uint8_t s_convertTo = T_AUTO; // T_AUTO: don't convert
+static const char *s_outDir = NULL;
+static bool s_verify = false;
+static bool s_dump = false;
+static bool s_quiet = false;
+
+static job *s_jobs = NULL;
+static uint32_t s_jobCount = 0, s_jobSpace = 0;
+
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t s_nextJob = 0;
+static uint32_t s_failed = 0;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *typeExtension(uint8_t type)
+{
+  switch (type) {
+  case T_WOZ: return ".woz";
+  case T_DSK: return ".dsk";
+  case T_PO:  return ".po";
+  case T_NIB: return ".nib";
+  case T_HDV: return ".hdv";
+  }
+  return "";
+}
+
+// Anything Woz::readFile() can load, going by its name
+static bool isImageName(const char *name)
+{
+  static const char *exts[] = { ".dsk", ".do", ".po", ".nib", ".woz",
+                                ".hdv", ".2mg", ".img", ".gz", ".zip" };
+  const char *p = strrchr(name, '.');
+  if (!p)
+    return false;
+  for (unsigned i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+    if (!strcasecmp(p, exts[i]))
+      return true;
+  }
+  return false;
+}
+
+static void addJob(const char *path, uint64_t bytes)
+{
+  if (s_jobCount == s_jobSpace) {
+    s_jobSpace = s_jobSpace ? s_jobSpace * 2 : 256;
+    s_jobs = (job *)realloc(s_jobs, s_jobSpace * sizeof(job));
+    if (!s_jobs) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+  }
+  s_jobs[s_jobCount].path = strdup(path);
+  s_jobs[s_jobCount].bytes = bytes;
+  s_jobCount++;
+}
+
+static void addPath(const char *path, bool named)
+{
+  struct stat st;
+  if (stat(path, &st) == -1) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return;
+  }
+  if (S_ISREG(st.st_mode)) {
+    // Files named on the command line are always tried
+    if (named || isImageName(path))
+      addJob(path, st.st_size);
+    return;
+  }
+  if (!S_ISDIR(st.st_mode))
+    return;
+
+  DIR *d = opendir(path);
+  if (!d) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return;
+  }
+  struct dirent *de;
+  char child[MAXJOBPATH];
+  while ((de = readdir(d)) != NULL) {
+    if (de->d_name[0] == '.')
+      continue;
+    snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+    addPath(child, false);
+  }
+  closedir(d);
+}
+
+// A WOZ image's CRC covers everything after its 12-byte header. Images
+// that aren't WOZ, or leave the CRC at 0, pass.
+static bool checkWozCRC(const char *path, char *msg, size_t msgLen)
+{
+  uint32_t size = 0;
+  const uint8_t *data;
+  uint8_t *decoded = NULL;
+  char name[256];
+  if (isCompressedImage(path)) {
+    decoded = readCompressedImage(path, &size, name, sizeof(name));
+    data = decoded;
+  } else {
+    data = mapImageFile(path, &size);
+  }
+  if (!data) {
+    snprintf(msg, msgLen, "can't read the image back for its CRC");
+    return false;
+  }
+
+  bool ok = true;
+  if (size >= 12 && (!memcmp(data, "WOZ1", 4) || !memcmp(data, "WOZ2", 4))) {
+    uint32_t want = data[8] | (data[9] << 8) | (data[10] << 16) | ((uint32_t)data[11] << 24);
+    uint32_t got = compute_crc_32((unsigned char *)data + 12, size - 12);
+    if (want && want != got) {
+      snprintf(msg, msgLen, "CRC is 0x%08X, header says 0x%08X",
+               (unsigned)got, (unsigned)want);
+      ok = false;
+    }
+  }
+
+  if (decoded)
+    free(decoded);
+  else
+    unmapImageFile(data, size);
+  return ok;
+}
+
+// Decode every standard track. Returns how many didn't decode, and
+// fills sectors (if it's set) with what did.
+static int decodeTracks(Woz *w, uint8_t *sectors)
+{
+  uint8_t scratch[256*16];
+  int bad = 0;
+  bool thirteen = w->isThirteenSectorDisk();
+  for (int t = 0; t < 35; t++) {
+    uint8_t *out = sectors ? &sectors[t * 256*16] : NULL;
+    if (w->dataTrackNumberForQuarterTrack(t*4) == 0xFF) {
+      if (out)
+        memset(out, 0, 256*16);
+      continue;
+    }
+    bool ok;
+    if (thirteen)
+      ok = w->decodeWozTrack13ToDsk(t, out ? out : scratch);
+    else
+      ok = w->decodeWozTrackToDsk(t, T_DSK, out ? out : scratch);
+    if (!ok) {
+      bad++;
+      if (out)
+        memset(out, 0, 256*16);
+    }
+  }
+  return bad;
+}
+
+static void outputPath(const char *path, char *out, size_t len)
+{
+  // Strip the compression suffix and the image's own extension
+  char base[MAXJOBPATH - 8];
+  const char *slash = strrchr(path, '/');
+  if (s_outDir)
+    snprintf(base, sizeof(base), "%s/%s", s_outDir, slash ? slash + 1 : path);
+  else
+    snprintf(base, sizeof(base), "%s", path);
+  for (int i = 0; i < 2; i++) {
+    char *dot = strrchr(base, '.');
+    char *sep = strrchr(base, '/');
+    if (!dot || (sep && dot < sep))
+      break;
+    bool compressed = !strcasecmp(dot, ".gz") || !strcasecmp(dot, ".zip");
+    *dot = '\0';
+    if (!compressed)
+      break;
+  }
+  snprintf(out, len, "%s%s", base, typeExtension(s_convertTo));
+}
+
+// Returns false (with a reason in msg) if the image failed
+static bool processImage(Woz *w, const char *path, char *msg, size_t msgLen)
+{
+  static __thread uint8_t before[35*256*16];
+  msg[0] = '\0';
+
+  if (!w->readFile(path, true, T_AUTO)) {
+    snprintf(msg, msgLen, "can't be read");
+    return false;
+  }
+
+  bool floppy = !w->isHdv();
+  uint8_t sourceType = w->imageFormat();
+  int badTracks = 0;
+  if (s_verify) {
+    if (!checkWozCRC(path, msg, msgLen))
+      return false;
+    if (floppy) {
+      badTracks = decodeTracks(w, s_convertTo != T_AUTO ? before : NULL);
+      if (badTracks)
+        snprintf(msg, msgLen, "%d nonstandard tracks", badTracks);
+    }
+  }
+
+  if (s_dump) {
+    pthread_mutex_lock(&s_mutex);
+    printf("==== %s\n", path);
+    w->dumpInfo();
+    fflush(stdout);
+    pthread_mutex_unlock(&s_mutex);
+  }
+
+  if (s_convertTo != T_AUTO) {
+    char out[MAXJOBPATH];
+    outputPath(path, out, sizeof(out));
+    if (!strcmp(out, path)) {
+      snprintf(msg, msgLen, "is already in that format");
+      return true;
+    }
+    if (!w->writeFile(out, s_convertTo)) {
+      snprintf(msg, msgLen, "can't be written to %s", out);
+      return false;
+    }
+    // The converted image has to decode to the same sectors (except
+    // for tracks that didn't decode to begin with)
+    if (s_verify && floppy && s_convertTo != T_HDV) {
+      static __thread uint8_t after[35*256*16];
+      if (!w->readFile(out, true, T_AUTO)) {
+        snprintf(msg, msgLen, "converted image %s can't be read", out);
+        return false;
+      }
+      int newBad = decodeTracks(w, after);
+      if (newBad > badTracks || memcmp(before, after, sizeof(after))) {
+        snprintf(msg, msgLen, "converted image %s doesn't match", out);
+        return false;
+      }
+    }
+    if (!msg[0])
+      snprintf(msg, msgLen, "-> %s", out);
+  }
+
+  // Only WOZ images can hold nonstandard (copy protected) tracks. In
+  // anything else, a track that doesn't decode means it's damaged.
+  return !(badTracks && sourceType != T_WOZ);
+}
+
+static void *worker(void *arg)
+{
+  Woz *w = new Woz(false, 0);
+  char msg[MAXJOBPATH + 64];
+
+  while (1) {
+    pthread_mutex_lock(&s_mutex);
+    uint32_t j = s_nextJob++;
+    pthread_mutex_unlock(&s_mutex);
+    if (j >= s_jobCount)
+      break;
+
+    double start = now();
+    bool ok = processImage(w, s_jobs[j].path, msg, sizeof(msg));
+    double ms = (now() - start) * 1000.0;
+
+    pthread_mutex_lock(&s_mutex);
+    if (!ok)
+      s_failed++;
+    if (!ok || !s_quiet) {
+      printf("%-4s %8.2f ms  %s%s%s\n", ok ? "ok" : "FAIL", ms,
+             s_jobs[j].path, msg[0] ? "  " : "", msg);
+      fflush(stdout);
+    }
+    pthread_mutex_unlock(&s_mutex);
+  }
+
+  delete w;
+  return NULL;
+}
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr,
+          "Usage: %s [options] <image or directory>...\n"
+          "  -j N     worker threads (default: one per CPU)\n"
+          "  -t TYPE  convert to woz, dsk, po, nib or hdv\n"
+          "  -o DIR   put converted images in DIR (default: next to the originals)\n"
+          "  -V       verify: WOZ CRCs, that tracks decode, and that conversions\n"
+          "           decode to the same sectors\n"
+          "  -i       dump each image's info\n"
+          "  -q       only report failures and the summary\n"
+          "With no -t or -i, images are verified.\n",
+          argv0);
+  exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+  int c;
+  while ((c = getopt(argc, argv, "j:t:o:Viq")) != -1) {
+    switch (c) {
+    case 'j':
+      s_threads = atoi(optarg);
+      break;
+    case 't':
+      if (!strcasecmp(optarg, "woz")) s_convertTo = T_WOZ;
+      else if (!strcasecmp(optarg, "dsk") || !strcasecmp(optarg, "do")) s_convertTo = T_DSK;
+      else if (!strcasecmp(optarg, "po")) s_convertTo = T_PO;
+      else if (!strcasecmp(optarg, "nib")) s_convertTo = T_NIB;
+      else if (!strcasecmp(optarg, "hdv")) s_convertTo = T_HDV;
+      else usage(argv[0]);
+      break;
+    case 'o':
+      s_outDir = optarg;
+      break;
+    case 'V':
+      s_verify = true;
+      break;
+    case 'i':
+      s_dump = true;
+      break;
+    case 'q':
+      s_quiet = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind >= argc)
+    usage(argv[0]);
+  if (s_convertTo == T_AUTO && !s_dump)
+    s_verify = true;
+  if (s_outDir && mkdir(s_outDir, 0755) == -1 && errno != EEXIST) {
+    fprintf(stderr, "Unable to create %s: %s\n", s_outDir, strerror(errno));
+    return 1;
+  }
+
+  for (int i = optind; i < argc; i++)
+    addPath(argv[i], true);
+  if (!s_jobCount) {
+    fprintf(stderr, "No disk images found\n");
+    return 1;
+  }
+
+  if (s_threads <= 0)
+    s_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (s_threads <= 0)
+    s_threads = 1;
+  if ((uint32_t)s_threads > s_jobCount)
+    s_threads = s_jobCount;
+
+  double start = now();
+  pthread_t *threads = (pthread_t *)malloc(s_threads * sizeof(pthread_t));
+  int started = 0;
+  for (int i = 0; i < s_threads; i++) {
+    if (pthread_create(&threads[i], NULL, worker, NULL) == 0)
+      started++;
+  }
+  if (!started)
+    worker(NULL);
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  double secs = now() - start;
+
+  uint64_t bytes = 0;
+  for (uint32_t i = 0; i < s_jobCount; i++)
+    bytes += s_jobs[i].bytes;
+  printf("%u images (%u failed) in %.2f s with %d threads: "
+         "%.1f images/s, %.1f MB/s\n",
+         s_jobCount, s_failed, secs, started ? started : 1,
+         s_jobCount / secs, bytes / secs / (1024.0 * 1024.0));
+
+  for (uint32_t i = 0; i < s_jobCount; i++)
+    free(s_jobs[i].path);
+  free(s_jobs);
+  free(threads);
+  return s_failed ? 1 : 0;
+}
@@ -25,7 +25,14 @@ uint8_t preallocatedRam[599*256];
 // Serializing token for RAM data
 #define RAMMAGIC 'R'
 
-VMRam::VMRam() {memset(preallocatedRam, 0, sizeof(preallocatedRam)); }
+VMRam::VMRam()
+{
+  memset(preallocatedRam, 0, sizeof(preallocatedRam));
+#ifndef TEENSYDUINO
+  memset(dirtyPages, 0xFF, sizeof(dirtyPages));
+#endif
+  serializeContents = true;
+}
 
 VMRam::~VMRam() { }
 
@@ -34,6 +41,9 @@ void VMRam::init()
   for (uint32_t i=0; i<sizeof(preallocatedRam); i++) {
     preallocatedRam[i] = 0;
   }
+#ifndef TEENSYDUINO
+  memset(dirtyPages, 0xFF, sizeof(dirtyPages));
+#endif
 }
 
 uint8_t VMRam::readByte(uint32_t addr) 
@@ -44,6 +54,9 @@ uint8_t VMRam::readByte(uint32_t addr)
 void VMRam::writeByte(uint32_t addr, uint8_t value)
 { 
   preallocatedRam[addr] = value;
+#ifndef TEENSYDUINO
+  dirtyPages[addr >> 13] |= 1 << ((addr >> 8) & 31);
+#endif
 }
 
 uint8_t *VMRam::memPtr(uint32_t addr)
@@ -53,13 +66,31 @@ uint8_t *VMRam::memPtr(uint32_t addr)
   return &preallocatedRam[addr];
 }
 
+#ifndef TEENSYDUINO
+void VMRam::markDirty(uint32_t addr, uint32_t len)
+{
+  if (!len)
+    return;
+  for (uint32_t page = addr >> 8; page <= (addr + len - 1) >> 8; page++) {
+    dirtyPages[page >> 5] |= 1 << (page & 31);
+  }
+}
+
+void VMRam::takeDirtyPages(uint32_t bits[VMRAM_DIRTYWORDS])
+{
+  memcpy(bits, dirtyPages, sizeof(dirtyPages));
+  memset(dirtyPages, 0, sizeof(dirtyPages));
+}
+#endif
+
 bool VMRam::Serialize(int8_t fd)
 {
-  uint32_t size = sizeof(preallocatedRam);
+  uint32_t size = serializeContents ? sizeof(preallocatedRam) : 0;
   serializeMagic(RAMMAGIC);
   serialize32(size);
 
-  if (g_filemanager->write(fd, preallocatedRam, sizeof(preallocatedRam)) != sizeof(preallocatedRam))
+  if (size &&
+      g_filemanager->write(fd, preallocatedRam, size) != (int)size)
     goto err;
 
   serializeMagic(RAMMAGIC);
@@ -75,10 +106,18 @@ bool VMRam::Deserialize(int8_t fd)
   deserializeMagic(RAMMAGIC);
   uint32_t size;
   deserialize32(size);
-
-  if ((uint32_t)g_filemanager->read(fd, preallocatedRam, size) != size)
+  if (size > sizeof(preallocatedRam))
     goto err;
 
+  // A size of 0 means the contents were left out
+  if (size) {
+    if ((uint32_t)g_filemanager->read(fd, preallocatedRam, size) != size)
+      goto err;
+#ifndef TEENSYDUINO
+    markDirty(0, size);
+#endif
+  }
+
   deserializeMagic(RAMMAGIC);
 
   return true;
@@ -5,6 +5,10 @@
 
 /* Preallocated RAM class. */
 
+// We need 599 pages of 256 bytes for the //e.
+#define VMRAM_PAGES 599
+#define VMRAM_DIRTYWORDS ((VMRAM_PAGES + 31) / 32)
+
 class VMRam {
  public: 
   VMRam();
@@ -17,14 +21,27 @@ class VMRam {
 
   uint8_t *memPtr(uint32_t addr);
 
+#ifndef TEENSYDUINO
+  // Dirty page tracking, for rewinding (which the Teensy doesn't do,
+  // so it doesn't pay for it in writeByte either).
+
+  // For anyone who writes through memPtr()
+  void markDirty(uint32_t addr, uint32_t len);
+
+  // Every page written since the last call, one bit per page; the
+  // bits are cleared as they're handed over.
+  void takeDirtyPages(uint32_t bits[VMRAM_DIRTYWORDS]);
+#endif
+
   bool Serialize(int8_t fd);
   bool Deserialize(int8_t fd);
+  // With this off, Serialize leaves the RAM out (for callers that
+  // keep their own copy of it) and Deserialize leaves it untouched.
+  void setSerializeContents(bool enable) { serializeContents = enable; }
 
   bool Test();
 
  private:
-  // We need 599 pages of 256 bytes for the //e.
-  //
   // This previously used a split memory model where some of this was
   // in internal ram and some was external - and while that's not true
   // right now, it may be true again in the future.
@@ -41,6 +58,10 @@ class VMRam {
   // Has to be static if we're using the EXTMEM sectioning, so it's now in vmram.cpp :/
   //EXTMEM uint8_t preallocatedRam[599*256];
 
+#ifndef TEENSYDUINO
+  uint32_t dirtyPages[VMRAM_DIRTYWORDS];
+#endif
+  bool serializeContents;
 
 };
 
@@ -41,8 +41,10 @@
 #define PENDING_BUF_SAMPLES 512
 
 // Target lag: how much emu audio we aim to keep buffered after each
-// callback.
+// callback. This is the default; platforms that size their device
+// buffer at runtime adjust it with wsola_set_target_lag().
 #define TARGET_LAG          2048
+#define MIN_TARGET_LAG      WSOLA_FRAME
 
 // Only engage WSOLA when the buffer is sustainedly beyond this ratio.
 // Below it we do bit-exact passthrough — essential for PWM-based
@@ -65,8 +67,11 @@ static int64_t           lastFilledTime = 0;
 
 static int16_t prevTail[WSOLA_OVERLAP];
 static bool    prevTailValid = false;
+static int     exhaustiveHops = 0;
 static int     silenceChunks = 0;
 static int     wsolaEngageCount = 0;
+static int     targetLag = TARGET_LAG;
+static volatile uint32_t underrunChunks = 0;
 
 static int16_t pendingBuf[PENDING_BUF_SAMPLES];
 static int     pendingFill = 0;
@@ -94,6 +99,7 @@ void wsola_reset()
   emuReadIdx  = 0;
   lastFilledTime = 0;
   prevTailValid = false;
+  exhaustiveHops = 0;
   silenceChunks = 0;
   wsolaEngageCount = 0;
   pendingFill = 0;
@@ -185,6 +191,18 @@ void wsola_flush(int64_t cycles)
   emitSamplesUpTo(cycles);
 }
 
+int wsola_drain(int16_t *output, int count)
+{
+  uint64_t avail = emuWriteIdx - emuReadIdx;
+  int n = (int)((avail < (uint64_t)count) ? avail : (uint64_t)count);
+  for (int i = 0; i < n; i++) {
+    output[i] = emuBuf[(emuReadIdx + i) & EMU_BUF_MASK];
+  }
+  emuReadIdx += n;
+  if (n > 0) lastOutputSample = output[n - 1];
+  return n;
+}
+
 bool wsola_has_primed_fill(int minSamples)
 {
   return (int64_t)(emuWriteIdx - emuReadIdx) >= (int64_t)minSamples;
@@ -205,8 +223,166 @@ int64_t wsola_buffered()
   return (int64_t)(emuWriteIdx - emuReadIdx);
 }
 
+void wsola_set_target_lag(int samples)
+{
+  if (samples < MIN_TARGET_LAG) samples = MIN_TARGET_LAG;
+  if (samples > EMU_BUF_SAMPLES / 2) samples = EMU_BUF_SAMPLES / 2;
+  targetLag = samples;
+}
+
+int wsola_target_lag()
+{
+  return targetLag;
+}
+
+uint32_t wsola_underruns()
+{
+  return underrunChunks;
+}
+
 // --- WSOLA core (only used when ratio >= RATIO_WSOLA_ON) ---
 //
+// Correlation kernel. `a` and `b` are WSOLA_OVERLAP samples that have
+// already been shifted right by 2 (the same pre-scale the original
+// scalar loop used), so every product fits in 27 bits and a block of
+// 16 products can't overflow an int32. Accumulating in 32-bit blocks
+// lets the compiler turn the inner loop into packed multiply-adds
+// (pmaddwd on x86, SMLAD on the Teensy's Cortex-M7) while the result
+// stays bit-identical to the old 64-bit scalar sum.
+#define WSOLA_CORR_BLOCK 16
+
+#if defined(TEENSYDUINO) && defined(__ARM_FEATURE_DSP)
+// Dual 16x16 multiply, add both products to acc.
+static inline uint32_t wsolaSmlad(uint32_t a, uint32_t b, uint32_t acc)
+{
+  uint32_t r;
+  asm ("smlad %0, %1, %2, %3" : "=r" (r) : "r" (a), "r" (b), "r" (acc));
+  return r;
+}
+#endif
+
+static int64_t wsolaCorrelate(const int16_t *a, const int16_t *b)
+{
+  int64_t corr = 0;
+  for (int blk = 0; blk < WSOLA_OVERLAP; blk += WSOLA_CORR_BLOCK) {
+#if defined(TEENSYDUINO) && defined(__ARM_FEATURE_DSP)
+    uint32_t acc = 0;
+    for (int j = 0; j < WSOLA_CORR_BLOCK; j += 2) {
+      uint32_t pa, pb;
+      memcpy(&pa, &a[blk + j], sizeof(pa));
+      memcpy(&pb, &b[blk + j], sizeof(pb));
+      acc = wsolaSmlad(pa, pb, acc);
+    }
+    corr += (int32_t)acc;
+#else
+    int32_t acc = 0;
+    for (int j = 0; j < WSOLA_CORR_BLOCK; j++) {
+      acc += (int32_t)a[blk + j] * (int32_t)b[blk + j];
+    }
+    corr += acc;
+#endif
+  }
+  return corr;
+}
+
+// Coarse-to-fine search: correlate every `step`th offset, then refine
+// +/- (step-1) around the best coarse hit. That only finds the same
+// peak an exhaustive scan would if the correlation peak is wider than
+// the step, and the peak is about as wide as the shortest flat run in
+// the signal. So the step comes from the tail itself: a third of the
+// shortest run between crossings of its mean, capped at
+// WSOLA_COARSE_STEP. Ordinary tones get the full coarse step; PWM
+// "DAC" music and tones near Nyquist fall back to the exhaustive scan.
+//
+// For those, the analysis costs more than the coarse scan could save,
+// and the music that needs it goes on for a while. So once it comes out
+// at 1, the next WSOLA_RECHECK_HOPS searches go straight to the
+// exhaustive scan without it. That can only cost speed, never the
+// result: the exhaustive scan is the reference.
+#define WSOLA_COARSE_STEP 4
+#define WSOLA_RECHECK_HOPS 8
+
+static int wsolaCoarseStep(const int16_t *tail)
+{
+  int32_t sum = 0;
+  for (int j = 0; j < WSOLA_OVERLAP; j++) sum += tail[j];
+
+  // crossed[j] is set when the signal crosses its mean between samples
+  // j-1 and j. A run shorter than d samples is a pair of crossings
+  // less than d apart. The first run is cut off by the start of the
+  // tail and has only one crossing, so it's ignored automatically.
+  // Everything here is flat byte arrays so it vectorizes like the
+  // correlation kernel does; a bit-at-a-time scan costs as much as
+  // the correlations it's meant to save.
+  uint8_t above[WSOLA_OVERLAP];
+  uint8_t crossed[WSOLA_OVERLAP + 3 * WSOLA_COARSE_STEP];
+  uint8_t reach[WSOLA_OVERLAP];
+  for (int j = 0; j < WSOLA_OVERLAP; j++)
+    above[j] = (int32_t)tail[j] * WSOLA_OVERLAP >= sum;
+  crossed[0] = 0;
+  for (int j = 1; j < WSOLA_OVERLAP; j++) crossed[j] = above[j] ^ above[j-1];
+  memset(&crossed[WSOLA_OVERLAP], 0, 3 * WSOLA_COARSE_STEP);
+  memset(reach, 0, sizeof(reach));
+
+  // A step of s needs every run to be at least 3*s samples long (the
+  // peak is about half a run wide on either side). Widen `reach` three
+  // distances at a time and stop at the first step that's too big.
+  for (int s = 1; s <= WSOLA_COARSE_STEP; s++) {
+    for (int d = (s > 1) ? 3 * (s - 1) : 1; d < 3 * s; d++) {
+      for (int j = 0; j < WSOLA_OVERLAP; j++) reach[j] |= crossed[j + d];
+    }
+    uint8_t hit = 0;
+    for (int j = 0; j < WSOLA_OVERLAP; j++) hit |= crossed[j] & reach[j];
+    if (hit) return (s > 1) ? s - 1 : 1;
+  }
+  return WSOLA_COARSE_STEP;
+}
+
+int wsola_best_offset(const int16_t *tail, const int16_t *window,
+                      int searchMin, int searchMax, bool exhaustive)
+{
+  int bestOffset = searchMin;
+  int64_t bestCorr = INT64_MIN;
+
+  int step = 1;
+  if (exhaustive) {
+    // The reference scan leaves the search state alone
+  } else if (exhaustiveHops > 0) {
+    exhaustiveHops--;
+  } else {
+    step = wsolaCoarseStep(tail);
+    if (step == 1) exhaustiveHops = WSOLA_RECHECK_HOPS;
+  }
+  if (step == 1) {
+    for (int off = searchMin; off <= searchMax; off++) {
+      int64_t corr = wsolaCorrelate(tail, &window[off - searchMin]);
+      if (corr > bestCorr) { bestCorr = corr; bestOffset = off; }
+    }
+    return bestOffset;
+  }
+
+  for (int off = searchMin; off <= searchMax; off += step) {
+    int64_t corr = wsolaCorrelate(tail, &window[off - searchMin]);
+    if (corr > bestCorr) { bestCorr = corr; bestOffset = off; }
+  }
+
+  int fineMin = bestOffset - (step - 1);
+  int fineMax = bestOffset + (step - 1);
+  if (fineMin < searchMin) fineMin = searchMin;
+  if (fineMax > searchMax) fineMax = searchMax;
+  int coarseBest = bestOffset;
+  for (int off = fineMin; off <= fineMax; off++) {
+    if (off == coarseBest) continue;
+    int64_t corr = wsolaCorrelate(tail, &window[off - searchMin]);
+    // Prefer the lower offset on ties, matching the exhaustive scan.
+    if (corr > bestCorr || (corr == bestCorr && off < bestOffset)) {
+      bestCorr = corr;
+      bestOffset = off;
+    }
+  }
+  return bestOffset;
+}
+
 // Produces one SYN_HOP chunk of output into dst[0..SYN_HOP). Reads
 // from emuBuf starting at readIdxBase. Returns logical input samples
 // consumed (ratio × SYN_HOP), or -1 on underrun.
@@ -225,16 +401,18 @@ static int wsolaEmitOneSynhop(int16_t *dst, double ratio,
       int64_t m = (int64_t)available - (int64_t)WSOLA_OVERLAP - baseIdx;
       if (m < searchMax) searchMax = (int)m;
     }
-    int64_t bestCorr = INT64_MIN;
-    for (int off = searchMin; off <= searchMax; off++) {
-      int64_t idxBase = baseIdx + off;
-      int64_t corr = 0;
-      for (int j = 0; j < WSOLA_OVERLAP; j++) {
-        uint64_t ring = (readIdxBase + idxBase + j) & EMU_BUF_MASK;
-        corr += (int32_t)(prevTail[j] >> 2) * (int32_t)(emuBuf[ring] >> 2);
-      }
-      if (corr > bestCorr) { bestCorr = corr; bestOffset = off; }
+
+    // Unwrap the pre-scaled tail and search window out of the ring
+    // once, so the kernel sees contiguous memory for every offset.
+    int16_t tail[WSOLA_OVERLAP];
+    int16_t window[2 * WSOLA_SEARCH + WSOLA_OVERLAP];
+    for (int j = 0; j < WSOLA_OVERLAP; j++) tail[j] = prevTail[j] >> 2;
+    int windowLen = searchMax - searchMin + WSOLA_OVERLAP;
+    for (int j = 0; j < windowLen; j++) {
+      uint64_t ring = (readIdxBase + baseIdx + searchMin + j) & EMU_BUF_MASK;
+      window[j] = emuBuf[ring] >> 2;
     }
+    bestOffset = wsola_best_offset(tail, window, searchMin, searchMax, false);
   }
 
   int64_t frameStart = baseIdx + bestOffset;
@@ -284,7 +462,7 @@ static void appendOneChunk()
   }
 
   // Compute target ratio based on buffer state.
-  int64_t desired = (int64_t)available - (int64_t)TARGET_LAG;
+  int64_t desired = (int64_t)available - (int64_t)targetLag;
   if (desired < WSOLA_SYNHOP) desired = WSOLA_SYNHOP;    // ratio ≥ 1
   if (desired > (int64_t)MAX_RATIO * WSOLA_SYNHOP) desired = MAX_RATIO * WSOLA_SYNHOP;
   if ((uint64_t)desired > available) desired = (int64_t)available;
@@ -299,6 +477,9 @@ static void appendOneChunk()
   if (ratio < RATIO_WSOLA_ON || wsolaEngageCount < WSOLA_ENGAGE_CHUNKS) {
     int n = WSOLA_SYNHOP;
     if ((uint64_t)n > available) n = (int)available;
+    // Only count starvation once the speaker is live; before its first
+    // toggle (or after a reset) there's nothing to play anyway.
+    if (n < WSOLA_SYNHOP && lastFilledTime != 0) underrunChunks++;
     if (n == WSOLA_SYNHOP) {
       for (int j = 0; j < n; j++) {
         pendingBuf[pendingFill + j] = emuBuf[(readIdx + j) & EMU_BUF_MASK];
@@ -340,6 +521,7 @@ static void appendOneChunk()
     // with linear interpolation stretching when underrunning.
     int n = (int)available;
     if (n > WSOLA_SYNHOP) n = WSOLA_SYNHOP;
+    if (n < WSOLA_SYNHOP && lastFilledTime != 0) underrunChunks++;
     if (n >= 2 && n < WSOLA_SYNHOP) {
       for (int j = 0; j < WSOLA_SYNHOP; j++) {
         int32_t srcPos = j * (n - 1);
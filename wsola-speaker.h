@@ -39,6 +39,12 @@ void wsola_flush(int64_t cycles);
 // samples yet (underrun), holds the last level (silence) to pad.
 void wsola_produce(int16_t *output, int count);
 
+// Drain up to `count` emu-rate samples into `output[]` without any
+// time-scaling, for consumers that are clocked by emulated time
+// rather than a wall-clock device (e.g. recording to a file).
+// Returns the number of samples copied; never pads.
+int wsola_drain(int16_t *output, int count);
+
 // Gate for initial buffer fill. Returns true once we've accumulated
 // at least `minSamples` worth of emu-rate audio — useful to let the
 // platform speaker write silence during startup rather than running
@@ -54,4 +60,27 @@ int wsola_peek_emubuf(int16_t *out, int count);
 // Diagnostic: current count of samples buffered (emuWriteIdx - emuReadIdx).
 int64_t wsola_buffered();
 
+// How much emu-rate audio produce() tries to leave buffered after
+// each call (default 2048 samples). Together with the device buffer
+// this is the audio latency; platforms that resize their device
+// buffer should move this with it.
+void wsola_set_target_lag(int samples);
+int wsola_target_lag();
+
+// Diagnostic: number of SYN_HOP chunks that had to be padded or
+// stretched because the emulator hadn't produced enough audio yet.
+// Never reset; callers look at the difference between two readings.
+uint32_t wsola_underruns();
+
+// Diagnostic: the overlap-offset search used by the WSOLA path.
+// `tail` is WSOLA's 128-sample overlap and `window` holds the
+// candidate input starting at `searchMin`, both pre-shifted right by
+// 2. Returns the offset in [searchMin, searchMax] with the highest
+// correlation. `exhaustive` tries every offset (the reference the
+// coarse-to-fine search is checked against in tests/test-wsola.cpp).
+// Otherwise the search remembers, for a few calls, when the signal
+// needed the exhaustive scan; wsola_reset() forgets it.
+int wsola_best_offset(const int16_t *tail, const int16_t *window,
+                      int searchMin, int searchMax, bool exhaustive);
+
 #endif